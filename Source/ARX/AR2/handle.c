@@ -110,12 +110,18 @@ static AR2HandleT *ar2CreateHandleSub( int pixFormat, int xsize, int ysize, int
     }
     ar2Handle->threadNum = threadNum;
     ARLOGi("Tracking thread = %d\n", threadNum);
+    ar2Handle->taskQueue = threadTaskQueueInit(AR2_SEARCH_FEATURE_MAX*AR2_TRACKING_PAGE_MAX);
+    if( ar2Handle->taskQueue == NULL ) {
+        ARLOGe("Out of memory!!\n");
+        exit(1);
+    }
     for( i = 0; i < ar2Handle->threadNum; i++ ) {
-        arMalloc( ar2Handle->arg[i].mfImage, ARUint8, xsize*ysize );
+        ar2Handle->arg[i].ar2Handle = ar2Handle;
         ar2Handle->arg[i].templ = NULL;
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
         ar2Handle->arg[i].templ2 = NULL;
 #endif
+        ar2Handle->arg[i].work = NULL;
         ar2Handle->threadHandle[i] = threadInit(i, &(ar2Handle->arg[i]), ar2Tracking2d);
     }
 
@@ -131,12 +137,13 @@ int ar2DeleteHandle( AR2HandleT **ar2Handle )
     for( i = 0; i < (*ar2Handle)->threadNum; i++ ) {
         threadWaitQuit( (*ar2Handle)->threadHandle[i] );
         threadFree( &((*ar2Handle)->threadHandle[i]) );
-        if( (*ar2Handle)->arg[i].mfImage   != NULL )  free( (*ar2Handle)->arg[i].mfImage );
         if( (*ar2Handle)->arg[i].templ  != NULL ) ar2FreeTemplate( (*ar2Handle)->arg[i].templ );
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
         if( (*ar2Handle)->arg[i].templ2 != NULL ) ar2FreeTemplate ( (*ar2Handle)->arg[i].templ2 );
 #endif
+        if( (*ar2Handle)->arg[i].work   != NULL ) ar2FreeMatchingWork( (*ar2Handle)->arg[i].work );
     }
+    threadTaskQueueFree( &((*ar2Handle)->taskQueue) );
 
     if( (*ar2Handle)->icpHandle != NULL ) icpDeleteHandle( &((*ar2Handle)->icpHandle) );
     //if( (*ar2Handle)->cparamLT  != NULL ) arParamLTFree( (*ar2Handle)->cparamLT );
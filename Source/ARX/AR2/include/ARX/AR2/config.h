@@ -108,6 +108,12 @@ extern "C" {
 
 #define AR2_THREAD_MAX                              8
 
+// Use the NEON versions of the tracking kernels on ARM. These have not yet been built and
+// checked against the scalar code on ARM hardware, so are off unless defined to 1 when building.
+#ifndef AR2_ENABLE_NEON
+#  define AR2_ENABLE_NEON                           0
+#endif
+
 #define AR2_DEFAULT_SEARCH_SIZE	                    25          // Default radius of feature search window.
 
 #define AR2_DEFAULT_SEARCH_FEATURE_NUM	            10          // May not be higher than AR2_SEARCH_FEATURE_MAX.
@@ -124,6 +130,7 @@ extern "C" {
 /* tracking.c */
 #define    AR2_TRACKING_SURFACE_MAX                 10          // Maximum number of surfaces per surface set (i.e. maximum number of discrete surfaces with fixed relationship to each other able to be combined into a surface set.)
 #define    AR2_TRACKING_CANDIDATE_MAX               200         // Maximum number of candidate feature points.
+#define    AR2_TRACKING_PAGE_MAX                    8           // Maximum number of surface sets tracked at once by ar2TrackingMulti().
 
 /* tracking2d.c */
 #define AR2_DEFAULT_TRACKING_SD_THRESH              5.0F
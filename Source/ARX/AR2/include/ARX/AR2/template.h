@@ -61,6 +61,16 @@ typedef struct {
     int          validNum;
 } AR2TemplateT;
 
+/* Working memory for ar2GetBestMatching(). Each thread matching templates needs its own. */
+typedef struct {
+    int          xsize, ysize;      /* template size          */
+    int          tstride;           /* row length of tval and tmask, padded to a multiple of 8 */
+    ARInt16     *tval;              /* template, with null pixels as 0 */
+    ARInt16     *tmask;             /* -1 for valid template pixels, 0 for null and padding */
+    ARUint32    *subImage1;         /* integral image of pixel values around a candidate */
+    ARUint32    *subImage2;         /* integral image of squared pixel values around a candidate */
+} AR2MatchingWorkT;
+
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
 typedef struct {
     int          xsize, ysize;      /* template size         */
@@ -106,12 +116,15 @@ AR_EXTERN int ar2SetTemplateSub ( const ARParamLT *cparamLT, const float  trans[
 #endif
 
 
-AR_EXTERN int ar2GetBestMatching ( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR_PIXEL_FORMAT pixFormat,
-                         AR2TemplateT *mtemp, int rx, int ry,
+AR_EXTERN AR2MatchingWorkT *ar2GenMatchingWork ( int ts1, int ts2 );
+AR_EXTERN int               ar2FreeMatchingWork( AR2MatchingWorkT *work );
+
+AR_EXTERN int ar2GetBestMatching ( ARUint8 *img, int xsize, int ysize, AR_PIXEL_FORMAT pixFormat,
+                         AR2TemplateT *mtemp, AR2MatchingWorkT *work, int rx, int ry,
                          int search[3][2], int *bx, int *by, float *val);
 
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
-AR_EXTERN int ar2GetBestMatching2( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR_PIXEL_FORMAT pixFormat,
+AR_EXTERN int ar2GetBestMatching2( ARUint8 *img, int xsize, int ysize, AR_PIXEL_FORMAT pixFormat,
                          AR2Template2T *mtemp, int rx, int ry,
                          int search[3][2], int *bx, int *by, float *val, int *blurLevel);
 #else
@@ -97,19 +97,47 @@ typedef struct _AR2HandleT           AR2HandleT;
 typedef struct _AR2Tracking2DParamT  AR2Tracking2DParamT;
 
 // Structure to pass parameters to threads spawned to run ar2Tracking2d().
+// The templates to match are taken from ar2Handle->taskQueue, with one AR2Tracking2DTaskT per template.
 struct _AR2Tracking2DParamT {
     struct _AR2HandleT      *ar2Handle;  // Reference to parent AR2HandleT.
-    AR2SurfaceSetT          *surfaceSet;
-    AR2TemplateCandidateT   *candidate;
     ARUint8                 *dataPtr;    // Input image.
-    ARUint8                 *mfImage;    // (Internally allocated buffer same size as input image).
     AR2TemplateT            *templ;
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
     AR2Template2T           *templ2;
 #endif
+    AR2MatchingWorkT        *work;       // Working memory for ar2GetBestMatching().
+};
+
+// Per-frame state for tracking one surface set. ar2TrackingMulti() uses one per surface set
+// tracked concurrently.
+typedef struct {
+    AR2SurfaceSetT           *surfaceSet;
+    float                     wtrans1[AR2_TRACKING_SURFACE_MAX][3][4];
+    float                     wtrans2[AR2_TRACKING_SURFACE_MAX][3][4];
+    float                     wtrans3[AR2_TRACKING_SURFACE_MAX][3][4];
+    float                     pos[AR2_SEARCH_FEATURE_MAX+AR2_THREAD_MAX][2];
+    float                     pos2d[AR2_SEARCH_FEATURE_MAX][2];
+    float                     pos3d[AR2_SEARCH_FEATURE_MAX][3];
+    AR2TemplateCandidateT     candidate[AR2_TRACKING_CANDIDATE_MAX+1];
+    AR2TemplateCandidateT     candidate2[AR2_TRACKING_CANDIDATE_MAX+1];
+    AR2TemplateCandidateT     usedFeature[AR2_SEARCH_FEATURE_MAX];
+    AR2TemplateCandidateT    *candidatePtr;                 // candidate or candidate2, whichever templates are being selected from.
+    int                       task[AR2_SEARCH_FEATURE_MAX]; // Numbers of the tasks selected for this surface set, in order.
+    int                       selected;                     // Number of templates selected.
+    int                       collected;                    // Number of results collected.
+    int                       num;                          // Number of templates matched.
+#if AR2_CAPABLE_ADAPTIVE_TEMPLATE
+    float                     aveBlur;
+#endif
+} AR2TrackingPageT;
+
+// A single template to be matched by one of the ar2Tracking2d() threads.
+typedef struct {
+    AR2TrackingPageT        *page;
+    AR2TemplateCandidateT   *candidate;
     AR2Tracking2DResultT     result;
     int                      ret;
-};
+} AR2Tracking2DTaskT;
 
 struct _AR2HandleT {
     int               trackingMode;
@@ -129,18 +157,12 @@ struct _AR2HandleT {
     float             simThresh;
     float             trackingThresh;
     /*--------------------------------*/
-    float                     wtrans1[AR2_TRACKING_SURFACE_MAX][3][4];
-    float                     wtrans2[AR2_TRACKING_SURFACE_MAX][3][4];
-    float                     wtrans3[AR2_TRACKING_SURFACE_MAX][3][4];
-    float                     pos[AR2_SEARCH_FEATURE_MAX+AR2_THREAD_MAX][2];
-    float                     pos2d[AR2_SEARCH_FEATURE_MAX][2];
-    float                     pos3d[AR2_SEARCH_FEATURE_MAX][3];
-    AR2TemplateCandidateT     candidate[AR2_TRACKING_CANDIDATE_MAX+1];
-    AR2TemplateCandidateT     candidate2[AR2_TRACKING_CANDIDATE_MAX+1];
-    AR2TemplateCandidateT     usedFeature[AR2_SEARCH_FEATURE_MAX];
+    AR2TrackingPageT          page[AR2_TRACKING_PAGE_MAX];
     int                       threadNum;
     struct _AR2Tracking2DParamT       arg[AR2_THREAD_MAX];
     THREAD_HANDLE_T          *threadHandle[AR2_THREAD_MAX];
+    AR2Tracking2DTaskT        task[AR2_SEARCH_FEATURE_MAX*AR2_TRACKING_PAGE_MAX];
+    THREAD_TASK_QUEUE_T      *taskQueue;
 };
 
 
@@ -169,6 +191,27 @@ struct _AR2HandleT {
  */
 int             ar2Tracking              ( AR2HandleT *ar2Handle, AR2SurfaceSetT *surfaceSet,
                                            ARUint8 *dataPtr, float  trans[3][4], float  *err );
+
+/*!
+    Perform NFT texture tracking of several surface sets on the same image frame.
+        Equivalent to calling ar2Tracking() for each surface set in turn, except that the
+        templates of all the surface sets are matched by the tracking threads together, so
+        the frame takes about as long as its slowest surface set rather than the sum of all.
+        Up to AR2_TRACKING_PAGE_MAX surface sets are tracked at once; any more are tracked
+        in further batches.
+    @param ar2Handle Tracking settings structure, as returned via ar2CreateHandle.
+    @param surfaceSet Array of num tracking surface sets. Each may appear only once.
+    @param num Number of surface sets in surfaceSet.
+    @param dataPtr Pointer to image data on which tracking will be performed.
+    @param trans Array of num float[3][4] arrays, which will be filled out with the pose of each surface set.
+    @param err Array of num floats. Each one that is tracked will be filled out with the pose error value.
+    @param ret Array of num ints, which will be filled out with the result of tracking each surface set,
+        as would be returned by ar2Tracking().
+    @result 0 if tracking was attempted, or -1 in case of a bad parameter.
+    @see ar2Tracking ar2Tracking
+ */
+int             ar2TrackingMulti         ( AR2HandleT *ar2Handle, AR2SurfaceSetT *surfaceSet[], int num,
+                                           ARUint8 *dataPtr, float  trans[][3][4], float  err[], int ret[] );
 void           *ar2Tracking2d            ( THREAD_HANDLE_T *threadHandle );
 /*
 int             ar2Tracking2d            ( AR2HandleT *ar2Handle, AR2SurfaceSetT *surfaceSet,
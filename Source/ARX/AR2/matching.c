@@ -51,24 +51,79 @@
 #define  SKIP_INTERVAL  3
 #define  KEEP_NUM       3
 
+// The vector kernels take the template's samples from every second byte of a 16-byte load.
+// The NEON kernels are only built with AR2_ENABLE_NEON (see config.h).
+#if AR2_TEMP_SCALE == 2
+#  if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define AR2_MATCHING_SSE2 1
+#    include <emmintrin.h>
+#  elif AR2_ENABLE_NEON && (defined(__ARM_NEON__) || defined(__ARM_NEON))
+#    define AR2_MATCHING_NEON 1
+#    include <arm_neon.h>
+#  endif
+#endif
+#if AR2_MATCHING_SSE2 || AR2_MATCHING_NEON
+#  define AR2_MATCHING_SIMD 1
+#endif
+
+#define  TEMPLATE_LANES 8
+
 
 static int ar2GetBestMatchingSubFine   ( ARUint8 *img, int xsize, int ysize, AR_PIXEL_FORMAT pixFormat,
-                                         AR2TemplateT *mtemp, int sx, int sy, int *val);
+                                         AR2TemplateT *mtemp, AR2MatchingWorkT *work, int sx, int sy, int *val);
 static void updateCandidate            ( int x, int y, int wval,
                                          int *keep_num, int cx[KEEP_NUM], int cy[KEEP_NUM], int cval[KEEP_NUM] );
+static int  inSearchWindow             ( int x, int y, int wnum, int wx[3], int wy[3], int rx, int ry );
 #if 1
-static int ar2GetBestMatchingSubFineOpt( ARUint8 *img, int xsize, int ysize, int sx1, int sy1, AR2TemplateT *mtemp,
-                                         ARUint32 *subImage1, ARUint32 *subImage2, int sx2, int sy2, int *val);
+static int ar2GetBestMatchingSubFineOpt( AR2TemplateT *mtemp, ARUint32 *subImage1, ARUint32 *subImage2,
+                                         int sx2, int sy2, int sum3, int *val);
+static int ar2GetTemplateDot           ( ARUint8 *img, int xsize, AR2TemplateT *mtemp );
 #endif
+static void ar2SetMatchingWork         ( AR2MatchingWorkT *work, AR2TemplateT *mtemp );
+#if AR2_MATCHING_SIMD
+static int  ar2MatchingReadFits        ( int xsize, int ysize, AR2MatchingWorkT *work, int sx1, int sy1, int nx, int ny );
+static void ar2GetTemplateSums         ( ARUint8 *img, int xsize, AR2MatchingWorkT *work, int *sum1, int *sum2, int *sum3 );
+static void ar2GetTemplateDot2         ( ARUint8 *img, int xsize, AR2MatchingWorkT *work, int dot[2] );
+#endif
+
+AR2MatchingWorkT *ar2GenMatchingWork( int ts1, int ts2 )
+{
+    AR2MatchingWorkT  *work;
+    int                xsize, ysize;
+
+    arMalloc( work, AR2MatchingWorkT, 1 );
+    work->xsize = xsize = ts1 + ts2 + 1;
+    work->ysize = ysize = ts1 + ts2 + 1;
+    work->tstride = (xsize + TEMPLATE_LANES - 1) / TEMPLATE_LANES * TEMPLATE_LANES;
+    arMalloc( work->tval,  ARInt16, work->tstride*ysize );
+    arMalloc( work->tmask, ARInt16, work->tstride*ysize );
+    arMalloc( work->subImage1, ARUint32, ( (xsize + 1)*AR2_TEMP_SCALE + (SKIP_INTERVAL*2)) * ((ysize + 1)*AR2_TEMP_SCALE + (SKIP_INTERVAL*2) ) );
+    arMalloc( work->subImage2, ARUint32, ( (xsize + 1)*AR2_TEMP_SCALE + (SKIP_INTERVAL*2)) * ((ysize + 1)*AR2_TEMP_SCALE + (SKIP_INTERVAL*2) ) );
+
+    return work;
+}
+
+int ar2FreeMatchingWork( AR2MatchingWorkT *work )
+{
+    if( work == NULL ) return -1;
+
+    free( work->tval );
+    free( work->tmask );
+    free( work->subImage1 );
+    free( work->subImage2 );
+    free( work );
+
+    return 0;
+}
 
 /*!
     @brief Get best match for a candidate feature template.
     @param img Incoming image to match against.
-    @param mfImage Buffer same size as img, to provide working memory for status of matched features.
-    @param xsize Horizontal size of img and mfImage.
-    @param ysize Vertical size of img and mfImage.
+    @param xsize Horizontal size of img.
+    @param ysize Vertical size of img.
     @param pixFormat Pixel format of img.
     @param mtemp Template undergoing matching.
+    @param work Working memory from ar2GenMatchingWork() for the size of mtemp, or NULL to allocate it for this call only.
     @param rx search radius in x dimension.
     @param ry search radius in y dimension.
     @param search screen coordinates (second dimension is x and y) for up to three previous positions of this feature.
@@ -78,12 +133,13 @@ static int ar2GetBestMatchingSubFineOpt( ARUint8 *img, int xsize, int ysize, int
     @result -1 in case of error or no match, or 0 otherwise.
  */
  
-int ar2GetBestMatching( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR_PIXEL_FORMAT pixFormat,
-                        AR2TemplateT *mtemp, int rx, int ry,
+int ar2GetBestMatching( ARUint8 *img, int xsize, int ysize, AR_PIXEL_FORMAT pixFormat,
+                        AR2TemplateT *mtemp, AR2MatchingWorkT *work, int rx, int ry,
                          int search[3][2], int *bx, int *by, float *val)
 {
     int              search_flag[] = {USE_SEARCH1, USE_SEARCH2, USE_SEARCH3};
-    int              px, py, sx, sy, ex, ey;
+    int              px, py;
+    int              wx[3], wy[3], wnum;
     int              yts1, yts2;
     int              keep_num;
     int              cx[KEEP_NUM], cy[KEEP_NUM];
@@ -92,7 +148,7 @@ int ar2GetBestMatching( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR
     int              i, j, l;
     int              ii;
     int              ret;
-    ARUint8         *pmf;
+    AR2MatchingWorkT *localWork = NULL;
 #if 0
 #else
     ARUint32   *subImage1, *p11, *p12, w1;
@@ -100,48 +156,31 @@ int ar2GetBestMatching( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR
     ARUint32    subImage11[AR2_TEMP_SCALE];
     ARUint32    subImage21[AR2_TEMP_SCALE];
     ARUint8    *p3, *p4;
+    int         dot[SKIP_INTERVAL*2 + 2];
 #endif
 
-    // First pass: initialise.
-    yts1 = mtemp->yts1;
-    yts2 = mtemp->yts2;
-    for( ii = 0; ii < 3; ii++ ) {
-        if( search_flag[ii] == 0 ) continue;
-        if( search[ii][0] < 0 ) break;
-
-        // "Snap" position to centre of grid square.
-        px = (search[ii][0]/(SKIP_INTERVAL + 1))*(SKIP_INTERVAL + 1) + (SKIP_INTERVAL + 1)/2;
-        py = (search[ii][1]/(SKIP_INTERVAL + 1))*(SKIP_INTERVAL + 1) + (SKIP_INTERVAL + 1)/2;
-
-        sx = px - rx; // Start position in x.
-        if( sx < 0 ) sx = 0;
-        ex = px + rx; // End position in x.
-        if( ex >= xsize ) ex = xsize - 1;
-
-        sy = py - ry; // Start position in y.
-        if( sy < 0 ) sy = 0;
-        ey = py + ry; // End position in y.
-        if( ey >= ysize ) ey = ysize - 1;
-
-        // Initialise mfImage by writing 0s into the potential search space.
-        for( j = sy; j <= ey; j++ ) {
-            pmf = &mfImage[j*xsize + sx];
-            for( i = sx; i <= ex; i++ ) {
-                *(pmf++) = 0;
-            }
-        }
+    if( work == NULL || work->xsize != mtemp->xsize || work->ysize != mtemp->ysize ) {
+        work = localWork = ar2GenMatchingWork( mtemp->xts1, mtemp->xts2 );
     }
+    ar2SetMatchingWork( work, mtemp );
 
-    // Second pass: get candidates.
+    // First pass: get candidates.
+    yts1 = mtemp->yts1;
+    yts2 = mtemp->yts2;
     keep_num = 0;
+    wnum = 0;
     ret = 1;
     for( ii = 0; ii < 3; ii++ ) {      
         if( search_flag[ii] == 0 ) continue;
         if( search[ii][0] < 0 ) {
-            if( ret ) return -1; // If we haven't got at least one starting point for a search, bail out.
+            if( ret ) { // If we haven't got at least one starting point for a search, bail out.
+                if( localWork ) ar2FreeMatchingWork( localWork );
+                return -1;
+            }
             else    break;
         }
 
+        // "Snap" position to centre of grid square.
         px = (search[ii][0]/(SKIP_INTERVAL + 1))*(SKIP_INTERVAL + 1) + (SKIP_INTERVAL + 1)/2;
         py = (search[ii][1]/(SKIP_INTERVAL + 1))*(SKIP_INTERVAL + 1) + (SKIP_INTERVAL + 1)/2;
 
@@ -151,18 +190,20 @@ int ar2GetBestMatching( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR
             for( i = px - rx; i <= px + rx; i += SKIP_INTERVAL + 1 ) {
                 if( i - mtemp->xts1*AR2_TEMP_SCALE <  0     ) continue;
                 if( i + mtemp->xts2*AR2_TEMP_SCALE >= xsize ) break;
-                if( mfImage[j*xsize + i] ) continue; // Skip pixels already matched.
-                mfImage[j*xsize + i] = 1; // Mark this pixel as matched.
-                if( ar2GetBestMatchingSubFine(img, xsize, ysize, pixFormat, mtemp, i, j, &wval) < 0 ) {
+                if( inSearchWindow(i, j, wnum, wx, wy, rx, ry) ) continue; // Skip positions already matched.
+                if( ar2GetBestMatchingSubFine(img, xsize, ysize, pixFormat, mtemp, work, i, j, &wval) < 0 ) {
                     continue;
                 }
                 ret = 0;
                 updateCandidate(i, j, wval, &keep_num, cx, cy, cval);
             }
         }
+        wx[wnum] = px;
+        wy[wnum] = py;
+        wnum++;
     }
 
-    // Third pass. Determine best candidate.
+    // Second pass. Determine best candidate.
     wval2 = 0;
     ret = -1;
 #if 0
@@ -173,7 +214,7 @@ int ar2GetBestMatching( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR
             for( i = cx[l] - SKIP_INTERVAL; i <= cx[l] + SKIP_INTERVAL; i++ ) {
                 if( i - mtemp->xts1*AR2_TEMP_SCALE <  0     ) continue;
                 if( i + mtemp->xts2*AR2_TEMP_SCALE >= xsize ) break;
-                if( ar2GetBestMatchingSubFine(img, xsize, ysize, pixFormat, mtemp, i, j, &wval) < 0 ) {
+                if( ar2GetBestMatchingSubFine(img, xsize, ysize, pixFormat, mtemp, work, i, j, &wval) < 0 ) {
                     continue;
                 }
                 if( wval > wval2 ) {
@@ -187,8 +228,8 @@ int ar2GetBestMatching( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR
         }
     }
 #else
-    arMalloc( subImage1, ARUint32, ( (mtemp->xsize + 1)*AR2_TEMP_SCALE + (SKIP_INTERVAL*2)) * ((mtemp->ysize + 1)*AR2_TEMP_SCALE + (SKIP_INTERVAL*2) ) );
-    arMalloc( subImage2, ARUint32, ( (mtemp->xsize + 1)*AR2_TEMP_SCALE + (SKIP_INTERVAL*2)) * ((mtemp->ysize + 1)*AR2_TEMP_SCALE + (SKIP_INTERVAL*2) ) );
+    subImage1 = work->subImage1;
+    subImage2 = work->subImage2;
 
     for(l = 0; l < keep_num; l++) {
         if( mtemp->validNum != mtemp->xsize*mtemp->ysize
@@ -203,7 +244,7 @@ int ar2GetBestMatching( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR
                 for( i = cx[l] - SKIP_INTERVAL; i <= cx[l] + SKIP_INTERVAL; i++ ) {
                     if( i - mtemp->xts1*AR2_TEMP_SCALE <  0     ) continue;
                     if( i + mtemp->xts2*AR2_TEMP_SCALE >= xsize ) break;
-                    if( ar2GetBestMatchingSubFine(img, xsize, ysize, pixFormat, mtemp, i, j, &wval) < 0 ) {
+                    if( ar2GetBestMatchingSubFine(img, xsize, ysize, pixFormat, mtemp, work, i, j, &wval) < 0 ) {
                         continue;
                     }
                     if( wval > wval2 ) {
@@ -223,6 +264,10 @@ int ar2GetBestMatching( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR
             int px2 = cx[l] - SKIP_INTERVAL - mtemp->xts1*AR2_TEMP_SCALE;
             int py2 = cy[l] - SKIP_INTERVAL - mtemp->yts1*AR2_TEMP_SCALE;
             int px3 = px1 - AR2_TEMP_SCALE;
+#if AR2_MATCHING_SIMD
+            // Each vector pass scores two horizontally adjacent positions.
+            int simd = ar2MatchingReadFits( xsize, ysize, work, px2, py2, SKIP_INTERVAL*2 + 2, SKIP_INTERVAL*2 + 1 );
+#endif
             p11 = p12 = subImage1;
             p21 = p22 = subImage2;
             for( j = 0; j < AR2_TEMP_SCALE*px1; j++ ) {
@@ -249,9 +294,21 @@ int ar2GetBestMatching( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR
                 p3 = p4 += xsize;
             }
             for( j = 0; j < SKIP_INTERVAL*2 + 1; j++ ) {
+#if AR2_MATCHING_SIMD
+                 if( simd ) {
+                     for( i = 0; i < SKIP_INTERVAL*2 + 1; i += 2 ) {
+                         ar2GetTemplateDot2( &img[(py2 + j)*xsize + px2 + i], xsize, work, &dot[i] );
+                     }
+                 }
+                 else
+#endif
+                 {
+                     for( i = 0; i < SKIP_INTERVAL*2 + 1; i++ ) {
+                         dot[i] = ar2GetTemplateDot( &img[(py2 + j)*xsize + px2 + i], xsize, mtemp );
+                     }
+                 }
                  for( i = 0; i < SKIP_INTERVAL*2 + 1; i++) {
-                     if( ar2GetBestMatchingSubFineOpt(img, xsize, ysize, px2 + i, py2 + j,
-                         mtemp, subImage1, subImage2, i + AR2_TEMP_SCALE, j + AR2_TEMP_SCALE, &wval) < 0 ) {
+                     if( ar2GetBestMatchingSubFineOpt(mtemp, subImage1, subImage2, i + AR2_TEMP_SCALE, j + AR2_TEMP_SCALE, dot[i], &wval) < 0 ) {
                          continue;
                      }
                      if( wval > wval2 ) {
@@ -265,15 +322,43 @@ int ar2GetBestMatching( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR
             }
         }
     }
-    free(subImage1);
-    free(subImage2);
 #endif
+    if( localWork ) ar2FreeMatchingWork( localWork );
 
     return ret;
 }
 
+// Copy the template into the layout used by the vector kernels.
+static void ar2SetMatchingWork( AR2MatchingWorkT *work, AR2TemplateT *mtemp )
+{
+    ARUint16   *p1;
+    ARInt16    *tv, *tm;
+    int         i, j;
+
+    p1 = mtemp->img1;
+    for( j = 0; j < mtemp->ysize; j++ ) {
+        tv = &(work->tval[j*work->tstride]);
+        tm = &(work->tmask[j*work->tstride]);
+        for( i = 0; i < mtemp->xsize; i++ ) {
+            if( *p1 != AR2_TEMPLATE_NULL_PIXEL ) {
+                tv[i] = (ARInt16)*p1;
+                tm[i] = -1;
+            }
+            else {
+                tv[i] = 0;
+                tm[i] = 0;
+            }
+            p1++;
+        }
+        for( ; i < work->tstride; i++ ) {
+            tv[i] = 0;
+            tm[i] = 0;
+        }
+    }
+}
+
 static int ar2GetBestMatchingSubFine( ARUint8 *img, int xsize, int ysize, AR_PIXEL_FORMAT pixFormat,
-                                      AR2TemplateT *mtemp, int sx, int sy, int *val)
+                                      AR2TemplateT *mtemp, AR2MatchingWorkT *work, int sx, int sy, int *val)
 {
     ARUint16            *p1;
     ARUint8             *p2;
@@ -305,18 +390,26 @@ static int ar2GetBestMatchingSubFine( ARUint8 *img, int xsize, int ysize, AR_PIX
         eex =   mtemp->xts2;
         ssy = -(mtemp->yts1);
         eey =   mtemp->yts2;
-        p2 = p3 = &img[((sy + ssy*AR2_TEMP_SCALE)*xsize + sx + ssx*AR2_TEMP_SCALE)];
-        for( j = ssy; j <= eey; j++ ) {
-            for( i = ssx; i <= eex; i++ ) {
-                if( *p1 != AR2_TEMPLATE_NULL_PIXEL ) {
-                    sum1 += (*p2);
-                    sum2 += (*p2) * (*p2);
-                    sum3 += (*p2) * (*p1);
+#if AR2_MATCHING_SIMD
+        if( ar2MatchingReadFits( xsize, ysize, work, sx + ssx*AR2_TEMP_SCALE, sy + ssy*AR2_TEMP_SCALE, 1, 1 ) ) {
+            ar2GetTemplateSums( &img[((sy + ssy*AR2_TEMP_SCALE)*xsize + sx + ssx*AR2_TEMP_SCALE)], xsize, work, &sum1, &sum2, &sum3 );
+        }
+        else
+#endif
+        {
+            p2 = p3 = &img[((sy + ssy*AR2_TEMP_SCALE)*xsize + sx + ssx*AR2_TEMP_SCALE)];
+            for( j = ssy; j <= eey; j++ ) {
+                for( i = ssx; i <= eex; i++ ) {
+                    if( *p1 != AR2_TEMPLATE_NULL_PIXEL ) {
+                        sum1 += (*p2);
+                        sum2 += (*p2) * (*p2);
+                        sum3 += (*p2) * (*p1);
+                    }
+                    p2 += AR2_TEMP_SCALE;
+                    p1++;
                 }
-                p2 += AR2_TEMP_SCALE;
-                p1++;
+                p2 = p3 += AR2_TEMP_SCALE*xsize; // i.e. p3 += AR2_TEMP_SCALE*xsize; p2 = p3;
             }
-            p2 = p3 += AR2_TEMP_SCALE*xsize; // i.e. p3 += AR2_TEMP_SCALE*xsize; p2 = p3;
         }
 #endif
     }
@@ -405,19 +498,16 @@ static int ar2GetBestMatchingSubFine( ARUint8 *img, int xsize, int ysize, AR_PIX
 }
 
 #if 1
-static int ar2GetBestMatchingSubFineOpt( ARUint8 *img, int xsize, int ysize, int sx1, int sy1, AR2TemplateT *mtemp,
-                                         ARUint32 *subImage1, ARUint32 *subImage2, int sx2, int sy2, int *val)
+static int ar2GetTemplateDot( ARUint8 *img, int xsize, AR2TemplateT *mtemp )
 {
     ARUint16            *p1;
     ARUint8             *p2, *p3;
-    int                  sum1, sum2, sum3;
-    int                  vlen;
-    int                  subImageXsize, px1, px2, py1, py2;
+    int                  sum3;
     int                  i, j;
-    
+
     p1 = mtemp->img1;
     sum3 = 0;
-    p2 = p3 = &img[sy1*xsize + sx1];
+    p2 = p3 = img;
     for( j = 0; j < mtemp->ysize; j++ ) {
         for( i = 0; i < mtemp->xsize; i++ ) {
             sum3 += (*p2) * *(p1++);
@@ -426,6 +516,16 @@ static int ar2GetBestMatchingSubFineOpt( ARUint8 *img, int xsize, int ysize, int
         p2 = p3 += AR2_TEMP_SCALE*xsize;
     }
 
+    return sum3;
+}
+
+static int ar2GetBestMatchingSubFineOpt( AR2TemplateT *mtemp, ARUint32 *subImage1, ARUint32 *subImage2,
+                                         int sx2, int sy2, int sum3, int *val)
+{
+    int                  sum1, sum2;
+    int                  vlen;
+    int                  subImageXsize, px1, px2, py1, py2;
+
     subImageXsize = (mtemp->xsize + 1)*AR2_TEMP_SCALE + (SKIP_INTERVAL*2);
     px1 =  sx2 + (mtemp->xsize - 1)*AR2_TEMP_SCALE;
     px2 =  sx2                    - AR2_TEMP_SCALE;
@@ -450,6 +550,158 @@ static int ar2GetBestMatchingSubFineOpt( ARUint8 *img, int xsize, int ysize, int
 }
 #endif
 
+#if AR2_MATCHING_SIMD
+// Whether the vector kernels may be used for nx by ny template positions starting with the
+// template's top-left pixel at (sx1, sy1). Each row of the template is read in full vectors,
+// so the last row may be read up to 2*tstride bytes past its start (plus one for the odd
+// position of a pair), which must still be inside the image.
+static int ar2MatchingReadFits( int xsize, int ysize, AR2MatchingWorkT *work, int sx1, int sy1, int nx, int ny )
+{
+    int   lastRow;
+
+    lastRow = sy1 + ny - 1 + (work->ysize - 1)*AR2_TEMP_SCALE;
+    return( lastRow*xsize + sx1 + ((nx - 1) & ~1) + work->tstride*AR2_TEMP_SCALE <= xsize*ysize );
+}
+
+#if AR2_MATCHING_SSE2
+static inline int ar2HorizontalSumSSE2( __m128i v )
+{
+    v = _mm_add_epi32( v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)) );
+    v = _mm_add_epi32( v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)) );
+    return _mm_cvtsi128_si32( v );
+}
+#elif AR2_MATCHING_NEON
+static inline int ar2HorizontalSumNEON( uint32x4_t v )
+{
+    uint64x2_t w = vpaddlq_u32( v );
+    return (int)(vgetq_lane_u64(w, 0) + vgetq_lane_u64(w, 1));
+}
+#endif
+
+// Sums of the image pixels (sum1), their squares (sum2) and their products with the template
+// (sum3) over the valid template pixels, with the template's top-left pixel at img.
+static void ar2GetTemplateSums( ARUint8 *img, int xsize, AR2MatchingWorkT *work, int *sum1, int *sum2, int *sum3 )
+{
+    ARUint8   *p;
+    ARInt16   *tv, *tm;
+    int        i, j;
+#if AR2_MATCHING_SSE2
+    const __m128i lo  = _mm_set1_epi16( 0x00FF );
+    const __m128i one = _mm_set1_epi16( 1 );
+    __m128i    s1 = _mm_setzero_si128();
+    __m128i    s2 = _mm_setzero_si128();
+    __m128i    s3 = _mm_setzero_si128();
+    __m128i    v;
+
+    for( j = 0; j < work->ysize; j++ ) {
+        p  = &img[j*AR2_TEMP_SCALE*xsize];
+        tv = &(work->tval[j*work->tstride]);
+        tm = &(work->tmask[j*work->tstride]);
+        for( i = 0; i < work->tstride; i += TEMPLATE_LANES ) {
+            v  = _mm_and_si128( _mm_loadu_si128((const __m128i *)&p[i*AR2_TEMP_SCALE]), lo );
+            v  = _mm_and_si128( v, _mm_loadu_si128((const __m128i *)&tm[i]) );
+            s1 = _mm_add_epi32( s1, _mm_madd_epi16(v, one) );
+            s2 = _mm_add_epi32( s2, _mm_madd_epi16(v, v) );
+            s3 = _mm_add_epi32( s3, _mm_madd_epi16(v, _mm_loadu_si128((const __m128i *)&tv[i])) );
+        }
+    }
+    *sum1 = ar2HorizontalSumSSE2( s1 );
+    *sum2 = ar2HorizontalSumSSE2( s2 );
+    *sum3 = ar2HorizontalSumSSE2( s3 );
+#else
+    uint32x4_t s1 = vdupq_n_u32( 0 );
+    uint32x4_t s2 = vdupq_n_u32( 0 );
+    uint32x4_t s3 = vdupq_n_u32( 0 );
+    uint16x8_t v, t;
+
+    for( j = 0; j < work->ysize; j++ ) {
+        p  = &img[j*AR2_TEMP_SCALE*xsize];
+        tv = &(work->tval[j*work->tstride]);
+        tm = &(work->tmask[j*work->tstride]);
+        for( i = 0; i < work->tstride; i += TEMPLATE_LANES ) {
+            v  = vmovl_u8( vld2_u8(&p[i*AR2_TEMP_SCALE]).val[0] );
+            v  = vandq_u16( v, vreinterpretq_u16_s16(vld1q_s16(&tm[i])) );
+            t  = vreinterpretq_u16_s16( vld1q_s16(&tv[i]) );
+            s1 = vpadalq_u16( s1, v );
+            s2 = vmlal_u16( s2, vget_low_u16(v),  vget_low_u16(v)  );
+            s2 = vmlal_u16( s2, vget_high_u16(v), vget_high_u16(v) );
+            s3 = vmlal_u16( s3, vget_low_u16(v),  vget_low_u16(t)  );
+            s3 = vmlal_u16( s3, vget_high_u16(v), vget_high_u16(t) );
+        }
+    }
+    *sum1 = ar2HorizontalSumNEON( s1 );
+    *sum2 = ar2HorizontalSumNEON( s2 );
+    *sum3 = ar2HorizontalSumNEON( s3 );
+#endif
+}
+
+// Dot products of the template with the image, with the template's top-left pixel at img
+// (dot[0]) and at img + 1 (dot[1]). Both positions come from the same loads: the even bytes
+// of each load are the samples for the first and the odd bytes those for the second.
+// Null template pixels count as 0.
+static void ar2GetTemplateDot2( ARUint8 *img, int xsize, AR2MatchingWorkT *work, int dot[2] )
+{
+    ARUint8   *p;
+    ARInt16   *tv;
+    int        i, j;
+#if AR2_MATCHING_SSE2
+    const __m128i lo = _mm_set1_epi16( 0x00FF );
+    __m128i    s0 = _mm_setzero_si128();
+    __m128i    s1 = _mm_setzero_si128();
+    __m128i    v, t;
+
+    for( j = 0; j < work->ysize; j++ ) {
+        p  = &img[j*AR2_TEMP_SCALE*xsize];
+        tv = &(work->tval[j*work->tstride]);
+        for( i = 0; i < work->tstride; i += TEMPLATE_LANES ) {
+            v  = _mm_loadu_si128( (const __m128i *)&p[i*AR2_TEMP_SCALE] );
+            t  = _mm_loadu_si128( (const __m128i *)&tv[i] );
+            s0 = _mm_add_epi32( s0, _mm_madd_epi16(_mm_and_si128(v, lo), t) );
+            s1 = _mm_add_epi32( s1, _mm_madd_epi16(_mm_srli_epi16(v, 8), t) );
+        }
+    }
+    dot[0] = ar2HorizontalSumSSE2( s0 );
+    dot[1] = ar2HorizontalSumSSE2( s1 );
+#else
+    uint32x4_t s0 = vdupq_n_u32( 0 );
+    uint32x4_t s1 = vdupq_n_u32( 0 );
+    uint8x8x2_t v;
+    uint16x8_t e, o, t;
+
+    for( j = 0; j < work->ysize; j++ ) {
+        p  = &img[j*AR2_TEMP_SCALE*xsize];
+        tv = &(work->tval[j*work->tstride]);
+        for( i = 0; i < work->tstride; i += TEMPLATE_LANES ) {
+            v  = vld2_u8( &p[i*AR2_TEMP_SCALE] );
+            e  = vmovl_u8( v.val[0] );
+            o  = vmovl_u8( v.val[1] );
+            t  = vreinterpretq_u16_s16( vld1q_s16(&tv[i]) );
+            s0 = vmlal_u16( s0, vget_low_u16(e),  vget_low_u16(t)  );
+            s0 = vmlal_u16( s0, vget_high_u16(e), vget_high_u16(t) );
+            s1 = vmlal_u16( s1, vget_low_u16(o),  vget_low_u16(t)  );
+            s1 = vmlal_u16( s1, vget_high_u16(o), vget_high_u16(t) );
+        }
+    }
+    dot[0] = ar2HorizontalSumNEON( s0 );
+    dot[1] = ar2HorizontalSumNEON( s1 );
+#endif
+}
+#endif // AR2_MATCHING_SIMD
+
+// Whether (x, y) lies in one of the first wnum search windows, centred on (wx[], wy[]).
+// The windows all lie on the same grid of SKIP_INTERVAL + 1 pixels, so a grid position in
+// an earlier window has already been tried from it.
+static int inSearchWindow( int x, int y, int wnum, int wx[3], int wy[3], int rx, int ry )
+{
+    int     i;
+
+    for( i = 0; i < wnum; i++ ) {
+        if( x >= wx[i] - rx && x <= wx[i] + rx
+         && y >= wy[i] - ry && y <= wy[i] + ry ) return 1;
+    }
+    return 0;
+}
+
 static void updateCandidate( int x, int y, int wval,
                              int *keep_num, int cx[KEEP_NUM], int cy[KEEP_NUM], int cval[KEEP_NUM] )
 {
@@ -59,16 +59,18 @@ static int ar2GetBestMatchingSubFine2  ( ARUint8 *img, int xsize, int ysize, AR_
                                          AR2Template2T *mtemp, int sx, int sy, int *val, int *blurLevel);
 static void updateCandidate            ( int x, int y, int wval,
                                          int *keep_num, int cx[KEEP_NUM], int cy[KEEP_NUM], int cval[KEEP_NUM] );
+static int  inSearchWindow             ( int x, int y, int wnum, int wx[3], int wy[3], int rx, int ry );
 #endif
 
 
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
-int ar2GetBestMatching2( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, AR_PIXEL_FORMAT pixFormat,
+int ar2GetBestMatching2( ARUint8 *img, int xsize, int ysize, AR_PIXEL_FORMAT pixFormat,
                          AR2Template2T *mtemp, int rx, int ry,
                          int search[3][2], int *bx, int *by, float *val, int *blurLevel)
 {
     int              search_flag[] = {USE_SEARCH1, USE_SEARCH2, USE_SEARCH3};
-    int              px, py, sx, sy, ex, ey;
+    int              px, py;
+    int              wx[3], wy[3], wnum;
     int              yts1, yts2;
     int              keep_num;
     int              cx[KEEP_NUM], cy[KEEP_NUM];
@@ -78,38 +80,13 @@ int ar2GetBestMatching2( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, A
     int              i, j, l;
     int              ii;
     int              ret;
-    ARUint8         *pmf;
 
     keep_num = 0;
 
     yts1 = mtemp->yts1;
     yts2 = mtemp->yts2;
 
-    for( ii = 0; ii < 3; ii++ ) {
-        if( search_flag[ii] == 0 ) continue;
-        if( search[ii][0] < 0 ) break;
-
-        px = (search[ii][0]/(SKIP_INTERVAL+1))*(SKIP_INTERVAL+1) + (SKIP_INTERVAL+1)/2;
-        py = (search[ii][1]/(SKIP_INTERVAL+1))*(SKIP_INTERVAL+1) + (SKIP_INTERVAL+1)/2;
-
-        sx = px - rx;
-        if( sx < 0 ) sx = 0;
-        ex = px + rx;
-        if( ex >= xsize ) ex = xsize-1;
-
-        sy = py - ry;
-        if( sy < 0 ) sy = 0;
-        ey = py + ry;
-        if( ey >= ysize ) ey = ysize-1;
-
-        for( j = sy; j <= ey; j++ ) {
-            pmf = &mfImage[j*xsize+sx];
-            for( i = sx; i <= ex; i++ ) {
-                *(pmf++) = 0;
-            }
-        }
-    }
-
+    wnum = 0;
     ret = 1;
     for( ii = 0; ii < 3; ii++ ) {      
         if( search_flag[ii] == 0 ) continue;
@@ -127,8 +104,7 @@ int ar2GetBestMatching2( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, A
             for( i = px - rx; i <= px + rx; i += SKIP_INTERVAL+1 ) {
                 if( i - mtemp->xts1*AR2_TEMP_SCALE <  0     ) continue;
                 if( i + mtemp->xts2*AR2_TEMP_SCALE >= xsize ) break;
-                if( mfImage[j*xsize+i] ) continue;
-                mfImage[j*xsize+i] = 1;
+                if( inSearchWindow(i, j, wnum, wx, wy, rx, ry) ) continue;
                 if( ar2GetBestMatchingSubFine(img,xsize,ysize,pixFormat,mtemp,i,j,&wval) < 0 ) {
                     continue;
                 }
@@ -136,6 +112,9 @@ int ar2GetBestMatching2( ARUint8 *img, ARUint8 *mfImage, int xsize, int ysize, A
                 updateCandidate(i, j, wval, &keep_num, cx, cy, cval);
             }
         }
+        wx[wnum] = px;
+        wy[wnum] = py;
+        wnum++;
     }
 
     wval2 = 0;
@@ -451,6 +430,20 @@ static int ar2GetBestMatchingSubFine2( ARUint8 *img, int xsize, int ysize, AR_PI
     return 0;
 }
 
+// Whether (x, y) lies in one of the first wnum search windows, centred on (wx[], wy[]).
+// The windows all lie on the same grid of SKIP_INTERVAL + 1 pixels, so a grid position in
+// an earlier window has already been tried from it.
+static int inSearchWindow( int x, int y, int wnum, int wx[3], int wy[3], int rx, int ry )
+{
+    int     i;
+
+    for( i = 0; i < wnum; i++ ) {
+        if( x >= wx[i] - rx && x <= wx[i] + rx
+         && y >= wy[i] - ry && y <= wy[i] + ry ) return 1;
+    }
+    return 0;
+}
+
 static void updateCandidate( int x, int y, int wval,
                              int *keep_num, int cx[KEEP_NUM], int cy[KEEP_NUM], int cval[KEEP_NUM] )
 {
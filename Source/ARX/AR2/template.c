@@ -46,6 +46,28 @@
 #include <ARX/AR2/template.h>
 #include <ARX/AR2/tracking.h>
 
+// The row path solves for marker coordinates four pixels at a time. NEON is only used on
+// AArch64, as 32-bit NEON has no exact float division, and only with AR2_ENABLE_NEON
+// (see config.h).
+#if !AR2_CAPABLE_ADAPTIVE_TEMPLATE
+#  if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define AR2_TEMPLATE_SSE2 1
+#    include <emmintrin.h>
+#  elif AR2_ENABLE_NEON && (defined(__ARM_NEON__) || defined(__ARM_NEON)) && (defined(__aarch64__) || defined(_M_ARM64))
+#    define AR2_TEMPLATE_NEON 1
+#    include <arm_neon.h>
+#  endif
+#endif
+
+#if !AR2_CAPABLE_ADAPTIVE_TEMPLATE
+#define  TEMPLATE_ROW_CHUNK 32
+
+static void ar2SetTemplateRow( const ARParamLTf *paramLTf, const float trans[3][4], const AR2ImageT *image,
+                               int sx, int sy, int n, ARUint16 *img1, int *sum, int *sum2, int *k );
+static void ar2GetImageCoordRow( const float trans[3][4], const AR2ImageT *image,
+                                 const float *sx, const float *sy, int n, int *ix, int *iy );
+#endif
+
 
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
 AR2TemplateT *ar2GenTemplate( int ts1, int ts2 )
@@ -123,11 +145,15 @@ int ar2SetTemplateSub( const ARParamLT *cparamLT, const float  trans[3][4], AR2I
     ARUint16 *img1;
     int      sum, sum2;
     int      vlen;
-    ARUint8  pixel;
     int      ix, iy;
-    int      ix2, iy2;
+    int      iy2;
+#if AR2_CAPABLE_ADAPTIVE_TEMPLATE
+    ARUint8  pixel;
+    int      ix2;
     int      ret;
-    int      i, j, k;
+    int      i;
+#endif
+    int      j, k;
 
     if( cparamLT != NULL ) {
 #ifdef ARDOUBLE_IS_FLOAT
@@ -147,6 +173,13 @@ int ar2SetTemplateSub( const ARParamLT *cparamLT, const float  trans[3][4], AR2I
         sum = sum2 = 0;
         k = 0;
         iy2 = iy - (templ->yts1)*AR2_TEMP_SCALE;
+#if !AR2_CAPABLE_ADAPTIVE_TEMPLATE
+        for( j = -(templ->yts1); j <= templ->yts2; j++, iy2+=AR2_TEMP_SCALE ) {
+            ar2SetTemplateRow( &cparamLT->paramLTf, (const float (*)[4])wtrans, imageSet->scale[featurePoints->scale],
+                               ix - (templ->xts1)*AR2_TEMP_SCALE, iy2, templ->xsize, img1, &sum, &sum2, &k );
+            img1 += templ->xsize;
+        }
+#else
         for( j = -(templ->yts1); j <= templ->yts2; j++, iy2+=AR2_TEMP_SCALE ) {
             ix2 = ix - (templ->xts1)*AR2_TEMP_SCALE;
             for( i = -(templ->xts1); i <= templ->xts2; i++, ix2+=AR2_TEMP_SCALE ) {
@@ -173,6 +206,7 @@ int ar2SetTemplateSub( const ARParamLT *cparamLT, const float  trans[3][4], AR2I
                 }
             }
         }
+#endif
     }
     else {
         mx = featurePoints->coord[num].mx;
@@ -185,6 +219,13 @@ int ar2SetTemplateSub( const ARParamLT *cparamLT, const float  trans[3][4], AR2I
         sum = sum2 = 0;
         k = 0;
         iy2 = iy - (templ->yts1)*AR2_TEMP_SCALE;
+#if !AR2_CAPABLE_ADAPTIVE_TEMPLATE
+        for( j = -(templ->yts1); j <= templ->yts2; j++, iy2+=AR2_TEMP_SCALE ) {
+            ar2SetTemplateRow( NULL, trans, imageSet->scale[featurePoints->scale],
+                               ix - (templ->xts1)*AR2_TEMP_SCALE, iy2, templ->xsize, img1, &sum, &sum2, &k );
+            img1 += templ->xsize;
+        }
+#else
         for( j = -(templ->yts1); j <= templ->yts2; j++, iy2+=AR2_TEMP_SCALE ) {
             ix2 = ix - (templ->xts1)*AR2_TEMP_SCALE;
             for( i = -(templ->xts1); i <= templ->xts2; i++, ix2+=AR2_TEMP_SCALE ) {
@@ -206,6 +247,7 @@ int ar2SetTemplateSub( const ARParamLT *cparamLT, const float  trans[3][4], AR2I
                 }
             }
         }
+#endif
     }
     if( k == 0 ) return -1;
 
@@ -217,6 +259,163 @@ int ar2SetTemplateSub( const ARParamLT *cparamLT, const float  trans[3][4], AR2I
     return 0;
 }
 
+#if !AR2_CAPABLE_ADAPTIVE_TEMPLATE
+// Sample one row of n template pixels, AR2_TEMP_SCALE apart, starting at screen position (sx, sy).
+// If paramLTf is non-NULL, the screen position is an observed one and is undistorted through the
+// lookup table first. Gives the same pixels as ar2GetImageValue() does for each position on x86,
+// where this has been checked. Where the compiler may fuse multiplies and adds (e.g. GCC on
+// AArch64 without -ffp-contract=off), positions on a pixel boundary may round differently.
+static void ar2SetTemplateRow( const ARParamLTf *paramLTf, const float trans[3][4], const AR2ImageT *image,
+                               int sx, int sy, int n, ARUint16 *img1, int *sum, int *sum2, int *k )
+{
+    float    isx[TEMPLATE_ROW_CHUNK], isy[TEMPLATE_ROW_CHUNK];
+    int      ix[TEMPLATE_ROW_CHUNK], iy[TEMPLATE_ROW_CHUNK];
+    ARUint8  valid[TEMPLATE_ROW_CHUNK];
+    ARUint8  pixel;
+    float   *lt = NULL;
+    int      px, py;
+    int      i, i0, m;
+
+    if( paramLTf != NULL ) {
+        // As arParamObserv2IdealLTf(), with the row of the table looked up once.
+        py = (int)((float)sy + 0.5F) + paramLTf->yOff;
+        if( py >= 0 && py < paramLTf->ysize ) lt = paramLTf->o2i + py*paramLTf->xsize*2;
+    }
+
+    for( i0 = 0; i0 < n; i0 += TEMPLATE_ROW_CHUNK, sx += TEMPLATE_ROW_CHUNK*AR2_TEMP_SCALE ) {
+        m = (n - i0 < TEMPLATE_ROW_CHUNK)? n - i0: TEMPLATE_ROW_CHUNK;
+        for( i = 0; i < m; i++ ) {
+            if( paramLTf == NULL ) {
+                isx[i] = (float)(sx + i*AR2_TEMP_SCALE);
+                isy[i] = (float)sy;
+                valid[i] = 1;
+                continue;
+            }
+            px = (int)((float)(sx + i*AR2_TEMP_SCALE) + 0.5F) + paramLTf->xOff;
+            if( lt == NULL || px < 0 || px >= paramLTf->xsize ) {
+                isx[i] = isy[i] = 0.0F;
+                valid[i] = 0;
+                continue;
+            }
+            isx[i] = lt[px*2];
+            isy[i] = lt[px*2 + 1];
+            valid[i] = 1;
+        }
+
+        ar2GetImageCoordRow( trans, image, isx, isy, m, ix, iy );
+
+        for( i = 0; i < m; i++ ) {
+            if( !valid[i] || ix[i] < 0 ) {
+                *(img1++) = AR2_TEMPLATE_NULL_PIXEL;
+            }
+            else {
+                pixel = image->imgBW[iy[i]*image->xsize + ix[i]];
+                *(img1++) = pixel;
+                *sum  += pixel;
+                *sum2 += pixel*pixel;
+                (*k)++;
+            }
+        }
+    }
+}
+
+// Image coordinates of the pixels at n ideal screen positions, computed as ar2ScreenCoord2MarkerCoord()
+// and ar2GetImageValue() do. ix[i] is set to -1 if the position has no pixel in the image.
+static void ar2GetImageCoordRow( const float trans[3][4], const AR2ImageT *image,
+                                 const float *sx, const float *sy, int n, int *ix, int *iy )
+{
+    float   c11, c12, c21, c22, b1, b2;
+    float   m, mx, my;
+    int     i = 0;
+
+#if AR2_TEMPLATE_SSE2
+    const __m128i xsize = _mm_set1_epi32( image->xsize );
+    const __m128i ysize = _mm_set1_epi32( image->ysize );
+    const __m128i none  = _mm_set1_epi32( -1 );
+    const __m128  fysize = _mm_set1_ps( (float)image->ysize );
+    const __m128  dpi   = _mm_set1_ps( image->dpi );
+    const __m128  inch  = _mm_set1_ps( 25.4F );
+    const __m128  half  = _mm_set1_ps( 0.5F );
+    __m128        vsx, vsy, vc11, vc12, vc21, vc22, vb1, vb2, vm, vmx, vmy;
+    __m128i       vix, viy, ok;
+
+    for( ; i + 4 <= n; i += 4 ) {
+        vsx  = _mm_loadu_ps( &sx[i] );
+        vsy  = _mm_loadu_ps( &sy[i] );
+        vc11 = _mm_sub_ps( _mm_mul_ps(_mm_set1_ps(trans[2][0]), vsx), _mm_set1_ps(trans[0][0]) );
+        vc12 = _mm_sub_ps( _mm_mul_ps(_mm_set1_ps(trans[2][1]), vsx), _mm_set1_ps(trans[0][1]) );
+        vc21 = _mm_sub_ps( _mm_mul_ps(_mm_set1_ps(trans[2][0]), vsy), _mm_set1_ps(trans[1][0]) );
+        vc22 = _mm_sub_ps( _mm_mul_ps(_mm_set1_ps(trans[2][1]), vsy), _mm_set1_ps(trans[1][1]) );
+        vb1  = _mm_sub_ps( _mm_set1_ps(trans[0][3]), _mm_mul_ps(_mm_set1_ps(trans[2][3]), vsx) );
+        vb2  = _mm_sub_ps( _mm_set1_ps(trans[1][3]), _mm_mul_ps(_mm_set1_ps(trans[2][3]), vsy) );
+        vm   = _mm_sub_ps( _mm_mul_ps(vc11, vc22), _mm_mul_ps(vc12, vc21) );
+        vmx  = _mm_div_ps( _mm_sub_ps(_mm_mul_ps(vc22, vb1), _mm_mul_ps(vc12, vb2)), vm );
+        vmy  = _mm_div_ps( _mm_sub_ps(_mm_mul_ps(vc11, vb2), _mm_mul_ps(vc21, vb1)), vm );
+        vix  = _mm_cvttps_epi32( _mm_add_ps(_mm_div_ps(_mm_mul_ps(vmx, dpi), inch), half) );
+        viy  = _mm_cvttps_epi32( _mm_add_ps(_mm_sub_ps(fysize, _mm_div_ps(_mm_mul_ps(vmy, dpi), inch)), half) );
+        ok   = _mm_castps_si128( _mm_cmpneq_ps(vm, _mm_setzero_ps()) );
+        ok   = _mm_and_si128( ok, _mm_and_si128(_mm_cmpgt_epi32(vix, none), _mm_cmplt_epi32(vix, xsize)) );
+        ok   = _mm_and_si128( ok, _mm_and_si128(_mm_cmpgt_epi32(viy, none), _mm_cmplt_epi32(viy, ysize)) );
+        _mm_storeu_si128( (__m128i *)&ix[i], _mm_or_si128(_mm_and_si128(ok, vix), _mm_andnot_si128(ok, none)) );
+        _mm_storeu_si128( (__m128i *)&iy[i], viy );
+    }
+#elif AR2_TEMPLATE_NEON
+    const int32x4_t   xsize = vdupq_n_s32( image->xsize );
+    const int32x4_t   ysize = vdupq_n_s32( image->ysize );
+    const int32x4_t   none  = vdupq_n_s32( -1 );
+    const float32x4_t fysize = vdupq_n_f32( (float)image->ysize );
+    const float32x4_t dpi   = vdupq_n_f32( image->dpi );
+    const float32x4_t inch  = vdupq_n_f32( 25.4F );
+    const float32x4_t half  = vdupq_n_f32( 0.5F );
+    float32x4_t       vsx, vsy, vc11, vc12, vc21, vc22, vb1, vb2, vm, vmx, vmy;
+    int32x4_t         vix, viy;
+    uint32x4_t        ok;
+
+    // Separate multiplies and adds (no vmla/vfma), as the scalar code is written. Not yet checked
+    // against the scalar code on hardware, which the compiler may contract to fused multiply-adds.
+    for( ; i + 4 <= n; i += 4 ) {
+        vsx  = vld1q_f32( &sx[i] );
+        vsy  = vld1q_f32( &sy[i] );
+        vc11 = vsubq_f32( vmulq_n_f32(vsx, trans[2][0]), vdupq_n_f32(trans[0][0]) );
+        vc12 = vsubq_f32( vmulq_n_f32(vsx, trans[2][1]), vdupq_n_f32(trans[0][1]) );
+        vc21 = vsubq_f32( vmulq_n_f32(vsy, trans[2][0]), vdupq_n_f32(trans[1][0]) );
+        vc22 = vsubq_f32( vmulq_n_f32(vsy, trans[2][1]), vdupq_n_f32(trans[1][1]) );
+        vb1  = vsubq_f32( vdupq_n_f32(trans[0][3]), vmulq_n_f32(vsx, trans[2][3]) );
+        vb2  = vsubq_f32( vdupq_n_f32(trans[1][3]), vmulq_n_f32(vsy, trans[2][3]) );
+        vm   = vsubq_f32( vmulq_f32(vc11, vc22), vmulq_f32(vc12, vc21) );
+        vmx  = vdivq_f32( vsubq_f32(vmulq_f32(vc22, vb1), vmulq_f32(vc12, vb2)), vm );
+        vmy  = vdivq_f32( vsubq_f32(vmulq_f32(vc11, vb2), vmulq_f32(vc21, vb1)), vm );
+        vix  = vcvtq_s32_f32( vaddq_f32(vdivq_f32(vmulq_f32(vmx, dpi), inch), half) );
+        viy  = vcvtq_s32_f32( vaddq_f32(vsubq_f32(fysize, vdivq_f32(vmulq_f32(vmy, dpi), inch)), half) );
+        ok   = vmvnq_u32( vceqq_f32(vm, vdupq_n_f32(0.0F)) );
+        ok   = vandq_u32( ok, vandq_u32(vcgtq_s32(vix, none), vcltq_s32(vix, xsize)) );
+        ok   = vandq_u32( ok, vandq_u32(vcgtq_s32(viy, none), vcltq_s32(viy, ysize)) );
+        vst1q_s32( &ix[i], vbslq_s32(ok, vix, none) );
+        vst1q_s32( &iy[i], viy );
+    }
+#endif
+
+    for( ; i < n; i++ ) {
+        c11 = trans[2][0] * sx[i] - trans[0][0];
+        c12 = trans[2][1] * sx[i] - trans[0][1];
+        c21 = trans[2][0] * sy[i] - trans[1][0];
+        c22 = trans[2][1] * sy[i] - trans[1][1];
+        b1  = trans[0][3] - trans[2][3] * sx[i];
+        b2  = trans[1][3] - trans[2][3] * sy[i];
+        m = c11 * c22 - c12 * c21;
+        ix[i] = -1;
+        if( m == 0.0F ) continue;
+        mx = (c22 * b1 - c12 * b2) / m;
+        my = (c11 * b2 - c21 * b1) / m;
+
+        iy[i] = (int)(image->ysize - my * image->dpi / 25.4F + 0.5F);
+        if( iy[i] < 0 || iy[i] >= image->ysize ) continue;
+        ix[i] = (int)(mx * image->dpi / 25.4F + 0.5F);
+        if( ix[i] < 0 || ix[i] >= image->xsize ) ix[i] = -1;
+    }
+}
+#endif
+
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
 int ar2SetTemplate2Sub( const ARParamLT *cparamLT, const float  trans[3][4], AR2ImageSetT *imageSet,
                         AR2FeaturePointsT *featurePoints, int num, int blurLevel,
@@ -63,143 +63,245 @@ static int    extractVisibleFeaturesHomography( int xsize, int ysize, float  tra
                                           AR2TemplateCandidateT candidate[],
                                           AR2TemplateCandidateT candidate2[] );
 static int    getDeltaS( float  H[8], float  dU[], float  J_U_H[][8], int n );
+static void   ar2TrackingPages          ( AR2HandleT *ar2Handle, AR2SurfaceSetT *surfaceSet[], int num,
+                                          ARUint8 *dataPtr, float  trans[][3][4], float  err[], int ret[] );
+static void   ar2TrackingPageInit       ( AR2HandleT *ar2Handle, AR2TrackingPageT *page, AR2SurfaceSetT *surfaceSet );
+static int    ar2TrackingSelect         ( AR2HandleT *ar2Handle, AR2TrackingPageT *page, int *pushed );
+static void   ar2TrackingCollect        ( AR2HandleT *ar2Handle, AR2TrackingPageT *page, AR2Tracking2DTaskT *task );
+static int    ar2TrackingPose           ( AR2HandleT *ar2Handle, AR2TrackingPageT *page, float  trans[3][4], float  *err );
 
 
 int ar2Tracking( AR2HandleT *ar2Handle, AR2SurfaceSetT *surfaceSet, ARUint8 *dataPtr, float  trans[3][4], float  *err )
 {
-    AR2TemplateCandidateT  *candidatePtr;
-    AR2TemplateCandidateT  *cp[AR2_THREAD_MAX];
-#if AR2_CAPABLE_ADAPTIVE_TEMPLATE
-    float                   aveBlur;
-#endif
-    int                     num, num2;
-    int                     i, j, k;
+    int     ret;
 
     if (!ar2Handle || !surfaceSet || !dataPtr || !trans || !err) return (-1);
 
-    if( surfaceSet->contNum <= 0  ) {
-        ARLOGd("ar2Tracking() error: ar2SetInitTrans() must be called first.\n");
-        return -2;
+    if( ar2TrackingMulti( ar2Handle, &surfaceSet, 1, dataPtr, (float (*)[3][4])trans, err, &ret ) < 0 ) return (-1);
+
+    return ret;
+}
+
+int ar2TrackingMulti( AR2HandleT *ar2Handle, AR2SurfaceSetT *surfaceSet[], int num,
+                      ARUint8 *dataPtr, float  trans[][3][4], float  err[], int ret[] )
+{
+    int     i;
+
+    if (!ar2Handle || !surfaceSet || num < 0 || !dataPtr || !trans || !err || !ret) return (-1);
+
+    for( i = 0; i < num; i += AR2_TRACKING_PAGE_MAX ) {
+        ar2TrackingPages( ar2Handle, &surfaceSet[i], (num - i < AR2_TRACKING_PAGE_MAX)? num - i: AR2_TRACKING_PAGE_MAX,
+                          dataPtr, &trans[i], &err[i], &ret[i] );
+    }
+
+    return 0;
+}
+
+// Track up to AR2_TRACKING_PAGE_MAX surface sets at once.
+static void ar2TrackingPages( AR2HandleT *ar2Handle, AR2SurfaceSetT *surfaceSet[], int num,
+                              ARUint8 *dataPtr, float  trans[][3][4], float  err[], int ret[] )
+{
+    AR2TrackingPageT       *page;
+    int                     active;
+    int                     pushed; // Counts templates queued.
+    int                     k;      // Counts results collected.
+    int                     i, j;
+
+    active = 0;
+    for( i = 0; i < num; i++ ) {
+        page = &(ar2Handle->page[i]);
+        page->surfaceSet = NULL;
+        if( surfaceSet[i] == NULL ) {
+            ret[i] = -1;
+            continue;
+        }
+        if( surfaceSet[i]->contNum <= 0  ) {
+            ARLOGd("ar2Tracking() error: ar2SetInitTrans() must be called first.\n");
+            ret[i] = -2;
+            continue;
+        }
+        err[i] = 0.0F;
+        ar2TrackingPageInit( ar2Handle, page, surfaceSet[i] );
+        active++;
+    }
+    if( active == 0 ) return;
+
+    // Templates are matched by the tracking threads as soon as they are selected here, so selection
+    // overlaps with matching. Selection for a surface set depends on the positions of its templates
+    // already matched, so no more than threadNum templates per surface set are in flight at once, and
+    // its results are collected in the order its templates were selected. All the surface sets share
+    // the one queue, and the pose of each is computed as soon as its last result is in, while the
+    // threads carry on with the others.
+    threadTaskQueueReset( ar2Handle->taskQueue );
+    for( j = 0; j < ar2Handle->threadNum; j++ ) {
+        ar2Handle->arg[j].dataPtr = dataPtr;
+        threadStartSignal( ar2Handle->threadHandle[j] );
+    }
+    pushed = 0;
+    for( i = 0; i < num; i++ ) {
+        page = &(ar2Handle->page[i]);
+        if( page->surfaceSet == NULL ) continue;
+        while( ar2TrackingSelect( ar2Handle, page, &pushed ) == 0 );
+        if( page->selected == 0 ) ret[i] = ar2TrackingPose( ar2Handle, page, trans[i], &err[i] );
+    }
+    for( k = 0; k < pushed; k++ ) {
+        threadTaskQueueWaitDone( ar2Handle->taskQueue, k );
+        page = ar2Handle->task[k].page;
+        ar2TrackingCollect( ar2Handle, page, &(ar2Handle->task[k]) );
+
+        // Selection may succeed now that another result is in.
+        while( ar2TrackingSelect( ar2Handle, page, &pushed ) == 0 );
+        if( page->collected == page->selected ) {
+            i = (int)(page - ar2Handle->page);
+            ret[i] = ar2TrackingPose( ar2Handle, page, trans[i], &err[i] );
+        }
     }
+    threadTaskQueueClose( ar2Handle->taskQueue );
+    for( j = 0; j < ar2Handle->threadNum; j++ ) {
+        threadEndWait( ar2Handle->threadHandle[j] );
+    }
+}
 
-    *err = 0.0F;
+static void ar2TrackingPageInit( AR2HandleT *ar2Handle, AR2TrackingPageT *page, AR2SurfaceSetT *surfaceSet )
+{
+    int     i;
 
+    page->surfaceSet = surfaceSet;
     for( i = 0; i < surfaceSet->num; i++ ) {
-        arUtilMatMulf( (const float (*)[4])surfaceSet->trans1, (const float (*)[4])surfaceSet->surface[i].trans, ar2Handle->wtrans1[i] );
-        if( surfaceSet->contNum > 1 ) arUtilMatMulf( (const float (*)[4])surfaceSet->trans2, (const float (*)[4])surfaceSet->surface[i].trans, ar2Handle->wtrans2[i] );
-        if( surfaceSet->contNum > 2 ) arUtilMatMulf( (const float (*)[4])surfaceSet->trans3, (const float (*)[4])surfaceSet->surface[i].trans, ar2Handle->wtrans3[i] );
+        arUtilMatMulf( (const float (*)[4])surfaceSet->trans1, (const float (*)[4])surfaceSet->surface[i].trans, page->wtrans1[i] );
+        if( surfaceSet->contNum > 1 ) arUtilMatMulf( (const float (*)[4])surfaceSet->trans2, (const float (*)[4])surfaceSet->surface[i].trans, page->wtrans2[i] );
+        if( surfaceSet->contNum > 2 ) arUtilMatMulf( (const float (*)[4])surfaceSet->trans3, (const float (*)[4])surfaceSet->surface[i].trans, page->wtrans3[i] );
     }
 
     if( ar2Handle->trackingMode == AR2_TRACKING_6DOF ) {
-        extractVisibleFeatures(ar2Handle->cparamLT, ar2Handle->wtrans1, surfaceSet, ar2Handle->candidate, ar2Handle->candidate2);
+        extractVisibleFeatures(ar2Handle->cparamLT, page->wtrans1, surfaceSet, page->candidate, page->candidate2);
     }
     else {
-        extractVisibleFeaturesHomography(ar2Handle->xsize, ar2Handle->ysize, ar2Handle->wtrans1, surfaceSet, ar2Handle->candidate, ar2Handle->candidate2);
+        extractVisibleFeaturesHomography(ar2Handle->xsize, ar2Handle->ysize, page->wtrans1, surfaceSet, page->candidate, page->candidate2);
     }
 
-    candidatePtr = ar2Handle->candidate;
+    page->candidatePtr = page->candidate;
+    page->selected  = 0;
+    page->collected = 0;
+    page->num       = 0;
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
-    aveBlur = 0.0F;
+    page->aveBlur   = 0.0F;
 #endif
-    i = 0; // Counts up to searchFeatureNum.
-    num = 0;
-    while( i < ar2Handle->searchFeatureNum ) {
-        num2 = num;
-        for( j = 0; j < ar2Handle->threadNum; j++ ) {
-            if( i == ar2Handle->searchFeatureNum ) break;
-
-            k = ar2SelectTemplate( candidatePtr, surfaceSet->prevFeature, num2, ar2Handle->pos, ar2Handle->xsize, ar2Handle->ysize );
-            if( k < 0 ) {
-                if( candidatePtr == ar2Handle->candidate ) {
-                    candidatePtr = ar2Handle->candidate2;
-                    k = ar2SelectTemplate( candidatePtr, surfaceSet->prevFeature, num2, ar2Handle->pos, ar2Handle->xsize, ar2Handle->ysize );
-                    if( k < 0 ) break; // PRL 2012-05-15: Give up if we can't select template from alternate candidate either.
-                }
-                else break;
-            }
+}
 
-            cp[j] = &(candidatePtr[k]);
-            ar2Handle->pos[num2][0] = candidatePtr[k].sx;
-            ar2Handle->pos[num2][1] = candidatePtr[k].sy;
-            ar2Handle->arg[j].ar2Handle  = ar2Handle;
-            ar2Handle->arg[j].surfaceSet = surfaceSet;
-            ar2Handle->arg[j].candidate  = &(candidatePtr[k]);
-            ar2Handle->arg[j].dataPtr    = dataPtr;
-
-            threadStartSignal( ar2Handle->threadHandle[j] );
-            num2++;
-            if( num2 == 5 ) num2 = num;
-            i++;
-        }
-        k = j;
-        if( k == 0 ) break;
+// Select the next template of a surface set and queue it for the tracking threads. Returns 0 if
+// one was queued, or -1 if none can be until another result for this surface set is in.
+static int ar2TrackingSelect( AR2HandleT *ar2Handle, AR2TrackingPageT *page, int *pushed )
+{
+    AR2Tracking2DTaskT     *task;
+    int                     num2;
+    int                     i, j;
+
+    if( page->selected >= ar2Handle->searchFeatureNum || page->selected - page->collected >= ar2Handle->threadNum ) return -1;
+
+    // Templates still being matched count as selected.
+    num2 = page->num;
+    for( i = page->collected; i < page->selected; i++ ) {
+        page->pos[num2][0] = ar2Handle->task[page->task[i]].candidate->sx;
+        page->pos[num2][1] = ar2Handle->task[page->task[i]].candidate->sy;
+        num2++;
+    }
+    j = ar2SelectTemplate( page->candidatePtr, page->surfaceSet->prevFeature, num2, page->pos, ar2Handle->xsize, ar2Handle->ysize );
+    if( j < 0 && page->candidatePtr == page->candidate ) {
+        page->candidatePtr = page->candidate2;
+        j = ar2SelectTemplate( page->candidatePtr, page->surfaceSet->prevFeature, num2, page->pos, ar2Handle->xsize, ar2Handle->ysize );
+    }
+    if( j < 0 ) return -1;
+
+    // Fill in the task before queuing it, as a tracking thread may take it straight away.
+    task = &(ar2Handle->task[*pushed]);
+    task->page      = page;
+    task->candidate = &(page->candidatePtr[j]);
+    page->task[page->selected++] = *pushed;
+    threadTaskQueuePush( ar2Handle->taskQueue );
+    (*pushed)++;
+
+    return 0;
+}
 
-        for( j = 0; j < k; j++ ) {
-            threadEndWait( ar2Handle->threadHandle[j] );
+// Collect the result of the next template selected for a surface set.
+static void ar2TrackingCollect( AR2HandleT *ar2Handle, AR2TrackingPageT *page, AR2Tracking2DTaskT *task )
+{
+    page->collected++;
 
-            if( ar2Handle->arg[j].ret == 0 && ar2Handle->arg[j].result.sim > ar2Handle->simThresh ) {
-                if( ar2Handle->trackingMode == AR2_TRACKING_6DOF ) {
+    if( task->ret == 0 && task->result.sim > ar2Handle->simThresh ) {
+        if( ar2Handle->trackingMode == AR2_TRACKING_6DOF ) {
 #ifdef ARDOUBLE_IS_FLOAT
-                    arParamObserv2Ideal(ar2Handle->cparamLT->param.dist_factor,
-                                        ar2Handle->arg[j].result.pos2d[0], ar2Handle->arg[j].result.pos2d[1],
-                                        &ar2Handle->pos2d[num][0], &ar2Handle->pos2d[num][1], ar2Handle->cparamLT->param.dist_function_version);
+            arParamObserv2Ideal(ar2Handle->cparamLT->param.dist_factor,
+                                task->result.pos2d[0], task->result.pos2d[1],
+                                &page->pos2d[page->num][0], &page->pos2d[page->num][1], ar2Handle->cparamLT->param.dist_function_version);
 #else
-                    ARdouble pos2d0, pos2d1;
-                    arParamObserv2Ideal(ar2Handle->cparamLT->param.dist_factor,                    
-                                        (ARdouble)(ar2Handle->arg[j].result.pos2d[0]), (ARdouble)(ar2Handle->arg[j].result.pos2d[1]),
-                                        &pos2d0, &pos2d1, ar2Handle->cparamLT->param.dist_function_version);
-                    ar2Handle->pos2d[num][0] = (float)pos2d0;
-                    ar2Handle->pos2d[num][1] = (float)pos2d1;
+            ARdouble pos2d0, pos2d1;
+            arParamObserv2Ideal(ar2Handle->cparamLT->param.dist_factor,                    
+                                (ARdouble)(task->result.pos2d[0]), (ARdouble)(task->result.pos2d[1]),
+                                &pos2d0, &pos2d1, ar2Handle->cparamLT->param.dist_function_version);
+            page->pos2d[page->num][0] = (float)pos2d0;
+            page->pos2d[page->num][1] = (float)pos2d1;
 #endif
-                }
-                else {
-                    ar2Handle->pos2d[num][0] = ar2Handle->arg[j].result.pos2d[0];
-                    ar2Handle->pos2d[num][1] = ar2Handle->arg[j].result.pos2d[1];
-                }
-                ar2Handle->pos3d[num][0] = ar2Handle->arg[j].result.pos3d[0];
-                ar2Handle->pos3d[num][1] = ar2Handle->arg[j].result.pos3d[1];
-                ar2Handle->pos3d[num][2] = ar2Handle->arg[j].result.pos3d[2];
-                ar2Handle->pos[num][0] = cp[j]->sx;
-                ar2Handle->pos[num][1] = cp[j]->sy;
-                ar2Handle->usedFeature[num].snum  = cp[j]->snum;
-                ar2Handle->usedFeature[num].level = cp[j]->level;
-                ar2Handle->usedFeature[num].num   = cp[j]->num;
-                ar2Handle->usedFeature[num].flag  = 0;
+        }
+        else {
+            page->pos2d[page->num][0] = task->result.pos2d[0];
+            page->pos2d[page->num][1] = task->result.pos2d[1];
+        }
+        page->pos3d[page->num][0] = task->result.pos3d[0];
+        page->pos3d[page->num][1] = task->result.pos3d[1];
+        page->pos3d[page->num][2] = task->result.pos3d[2];
+        page->pos[page->num][0] = task->candidate->sx;
+        page->pos[page->num][1] = task->candidate->sy;
+        page->usedFeature[page->num].snum  = task->candidate->snum;
+        page->usedFeature[page->num].level = task->candidate->level;
+        page->usedFeature[page->num].num   = task->candidate->num;
+        page->usedFeature[page->num].flag  = 0;
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
-                aveBlur += ar2Handle->arg[j].result.blurLevel;
+        page->aveBlur += task->result.blurLevel;
 #endif
-                num++;
-            }
-        }
+        page->num++;
     }
-    for( i = 0; i < num; i++ ) {
-        surfaceSet->prevFeature[i] = ar2Handle->usedFeature[i];
+}
+
+// Compute the pose of a surface set once all its results are in.
+static int ar2TrackingPose( AR2HandleT *ar2Handle, AR2TrackingPageT *page, float  trans[3][4], float  *err )
+{
+    AR2SurfaceSetT         *surfaceSet;
+#if AR2_CAPABLE_ADAPTIVE_TEMPLATE
+    float                   aveBlur;
+#endif
+    int                     i, j;
+
+    surfaceSet = page->surfaceSet;
+    for( i = 0; i < page->num; i++ ) {
+        surfaceSet->prevFeature[i] = page->usedFeature[i];
     }
-    surfaceSet->prevFeature[num].flag = -1;
-    //ARLOGd("------\nNum = %d\n", num);
+    surfaceSet->prevFeature[page->num].flag = -1;
+    //ARLOGd("------\nNum = %d\n", page->num);
 
     if( ar2Handle->trackingMode == AR2_TRACKING_6DOF ) {
-        if( num < 3 ) {
+        if( page->num < 3 ) {
             surfaceSet->contNum = 0;
             return -3;
         }
-        *err = ar2GetTransMat( ar2Handle->icpHandle, surfaceSet->trans1, ar2Handle->pos2d, ar2Handle->pos3d, num, trans, 0 );
+        *err = ar2GetTransMat( ar2Handle->icpHandle, surfaceSet->trans1, page->pos2d, page->pos3d, page->num, trans, 0 );
         //ARLOGd("outlier  0%%: err = %f, num = %d\n", *err, num);
         if( *err > ar2Handle->trackingThresh ) {
             icpSetInlierProbability( ar2Handle->icpHandle, 0.8F );
-            *err = ar2GetTransMat( ar2Handle->icpHandle, trans, ar2Handle->pos2d, ar2Handle->pos3d, num, trans, 1 );
+            *err = ar2GetTransMat( ar2Handle->icpHandle, trans, page->pos2d, page->pos3d, page->num, trans, 1 );
             //ARLOGd("outlier 20%%: err = %f, num = %d\n", *err, num);
             if( *err > ar2Handle->trackingThresh ) {
                 icpSetInlierProbability( ar2Handle->icpHandle, 0.6F );
-                *err = ar2GetTransMat( ar2Handle->icpHandle, trans, ar2Handle->pos2d, ar2Handle->pos3d, num, trans, 1 );
+                *err = ar2GetTransMat( ar2Handle->icpHandle, trans, page->pos2d, page->pos3d, page->num, trans, 1 );
                 //ARLOGd("outlier 60%%: err = %f, num = %d\n", *err, num);
                 if( *err > ar2Handle->trackingThresh ) {
                     icpSetInlierProbability( ar2Handle->icpHandle, 0.4F );
-                    *err = ar2GetTransMat( ar2Handle->icpHandle, trans, ar2Handle->pos2d, ar2Handle->pos3d, num, trans, 1 );
+                    *err = ar2GetTransMat( ar2Handle->icpHandle, trans, page->pos2d, page->pos3d, page->num, trans, 1 );
                     //ARLOGd("outlier 60%%: err = %f, num = %d\n", *err, num);
                     if( *err > ar2Handle->trackingThresh ) {
                         icpSetInlierProbability( ar2Handle->icpHandle, 0.0F );
-                        *err = ar2GetTransMat( ar2Handle->icpHandle, trans, ar2Handle->pos2d, ar2Handle->pos3d, num, trans, 1 );
+                        *err = ar2GetTransMat( ar2Handle->icpHandle, trans, page->pos2d, page->pos3d, page->num, trans, 1 );
                         //ARLOGd("outlier Max: err = %f, num = %d\n", *err, num);
                         if( *err > ar2Handle->trackingThresh ) {
                             surfaceSet->contNum = 0;
@@ -214,23 +316,23 @@ int ar2Tracking( AR2HandleT *ar2Handle, AR2SurfaceSetT *surfaceSet, ARUint8 *dat
         }
     }
     else {
-        if( num < 3 ) {
+        if( page->num < 3 ) {
             surfaceSet->contNum = 0;
             return -3;
         }
-        *err = ar2GetTransMatHomography( surfaceSet->trans1, ar2Handle->pos2d, ar2Handle->pos3d, num, trans, 0, 1.0F );
+        *err = ar2GetTransMatHomography( surfaceSet->trans1, page->pos2d, page->pos3d, page->num, trans, 0, 1.0F );
         //ARLOGd("outlier  0%%: err = %f, num = %d\n", *err, num);
         if( *err > ar2Handle->trackingThresh ) {
-            *err = ar2GetTransMatHomography( trans, ar2Handle->pos2d, ar2Handle->pos3d, num, trans, 1, 0.8F );
+            *err = ar2GetTransMatHomography( trans, page->pos2d, page->pos3d, page->num, trans, 1, 0.8F );
             //ARLOGd("outlier 20%%: err = %f, num = %d\n", *err, num);
             if( *err > ar2Handle->trackingThresh ) {
-                *err = ar2GetTransMatHomography( trans, ar2Handle->pos2d, ar2Handle->pos3d, num, trans, 1, 0.6F );
+                *err = ar2GetTransMatHomography( trans, page->pos2d, page->pos3d, page->num, trans, 1, 0.6F );
                 //ARLOGd("outlier 40%%: err = %f, num = %d\n", *err, num);
                 if( *err > ar2Handle->trackingThresh ) {
-                    *err = ar2GetTransMatHomography( trans, ar2Handle->pos2d, ar2Handle->pos3d, num, trans, 1, 0.4F );
+                    *err = ar2GetTransMatHomography( trans, page->pos2d, page->pos3d, page->num, trans, 1, 0.4F );
                     //ARLOGd("outlier 60%%: err = %f, num = %d\n", *err, num);
                     if( *err > ar2Handle->trackingThresh ) {
-                        *err = ar2GetTransMatHomography( trans, ar2Handle->pos2d, ar2Handle->pos3d, num, trans, 1, 0.0F );
+                        *err = ar2GetTransMatHomography( trans, page->pos2d, page->pos3d, page->num, trans, 1, 0.0F );
                         //ARLOGd("outlier Max: err = %f, num = %d\n", *err, num);
                         if( *err > ar2Handle->trackingThresh ) {
                             surfaceSet->contNum = 0;
@@ -247,7 +349,7 @@ int ar2Tracking( AR2HandleT *ar2Handle, AR2SurfaceSetT *surfaceSet, ARUint8 *dat
 
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
     if( ar2Handle->blurMethod == AR2_ADAPTIVE_BLUR ) {
-        aveBlur = aveBlur/num + 0.5F;
+        aveBlur = page->aveBlur/page->num + 0.5F;
         ar2Handle->blurLevel += (int)aveBlur - 1;
         if( ar2Handle->blurLevel < 1 ) ar2Handle->blurLevel = 1;
         if( ar2Handle->blurLevel >= AR2_BLUR_IMAGE_MAX-1 ) ar2Handle->blurLevel = AR2_BLUR_IMAGE_MAX-2;
@@ -268,6 +370,7 @@ int ar2Tracking( AR2HandleT *ar2Handle, AR2SurfaceSetT *surfaceSet, ARUint8 *dat
     return 0;
 }
 
+
 static int extractVisibleFeatures(const ARParamLT *cparamLT, const float  trans1[][3][4], AR2SurfaceSetT *surfaceSet,
                                   AR2TemplateCandidateT candidate[],  // candidates inside DPI range of [mindpi, maxdpi].
                                   AR2TemplateCandidateT candidate2[]) // candidates inside DPI range of [mindpi/2, maxdpi*2].
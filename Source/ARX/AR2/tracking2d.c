@@ -47,19 +47,21 @@
 #include <ARX/AR2/tracking.h>
 
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
-static int ar2Tracking2dSub ( AR2HandleT *handle, AR2SurfaceSetT *surfaceSet, AR2TemplateCandidateT *candidate,
-                              ARUint8 *dataPtr, ARUint8 *mfImage, AR2TemplateT **templ,
+static int ar2Tracking2dSub ( AR2HandleT *handle, AR2TrackingPageT *page, AR2TemplateCandidateT *candidate,
+                              ARUint8 *dataPtr, AR2MatchingWorkT **work, AR2TemplateT **templ,
                               AR2Template2T **templ2, AR2Tracking2DResultT *result );
 #else
-static int ar2Tracking2dSub ( AR2HandleT *handle, AR2SurfaceSetT *surfaceSet, AR2TemplateCandidateT *candidate,
-                              ARUint8 *dataPtr, ARUint8 *mfImage, AR2TemplateT **templ,
+static int ar2Tracking2dSub ( AR2HandleT *handle, AR2TrackingPageT *page, AR2TemplateCandidateT *candidate,
+                              ARUint8 *dataPtr, AR2MatchingWorkT **work, AR2TemplateT **templ,
                               AR2Tracking2DResultT *result );
 #endif
 
 void *ar2Tracking2d( THREAD_HANDLE_T *threadHandle )
 {
     AR2Tracking2DParamT  *arg;
+    AR2Tracking2DTaskT   *task;
     int                   ID;
+    int                   i;
 
     arg          = (AR2Tracking2DParamT *)threadGetArg(threadHandle);
     ID           = threadGetID(threadHandle);
@@ -68,13 +70,18 @@ void *ar2Tracking2d( THREAD_HANDLE_T *threadHandle )
     for(;;) {
         if( threadStartWait(threadHandle) < 0 ) break;
 
+        // Take templates until ar2Tracking() has selected all it needs for this frame.
+        while( (i = threadTaskQueuePop(arg->ar2Handle->taskQueue)) >= 0 ) {
+            task = &(arg->ar2Handle->task[i]);
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
-        arg->ret = ar2Tracking2dSub( arg->ar2Handle, arg->surfaceSet, arg->candidate,
-                                     arg->dataPtr, arg->mfImage, &(arg->templ), &(arg->templ2), &(arg->result) );
+            task->ret = ar2Tracking2dSub( arg->ar2Handle, task->page, task->candidate,
+                                          arg->dataPtr, &(arg->work), &(arg->templ), &(arg->templ2), &(task->result) );
 #else
-        arg->ret = ar2Tracking2dSub( arg->ar2Handle, arg->surfaceSet, arg->candidate,
-                                     arg->dataPtr, arg->mfImage, &(arg->templ), &(arg->result) );
+            task->ret = ar2Tracking2dSub( arg->ar2Handle, task->page, task->candidate,
+                                          arg->dataPtr, &(arg->work), &(arg->templ), &(task->result) );
 #endif
+            threadTaskQueueDone(arg->ar2Handle->taskQueue, i);
+        }
         threadEndSignal(threadHandle);
     }
     ARLOGi("End tracking_thread #%d.\n", ID);
@@ -84,27 +91,30 @@ void *ar2Tracking2d( THREAD_HANDLE_T *threadHandle )
 
 
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
-static int ar2Tracking2dSub ( AR2HandleT *handle, AR2SurfaceSetT *surfaceSet, AR2TemplateCandidateT *candidate,
-                              ARUint8 *dataPtr, ARUint8 *mfImage, AR2TemplateT **templ,
+static int ar2Tracking2dSub ( AR2HandleT *handle, AR2TrackingPageT *page, AR2TemplateCandidateT *candidate,
+                              ARUint8 *dataPtr, AR2MatchingWorkT **work, AR2TemplateT **templ,
                               AR2Template2T **templ2, AR2Tracking2DResultT *result )
 #else
-static int ar2Tracking2dSub ( AR2HandleT *handle, AR2SurfaceSetT *surfaceSet, AR2TemplateCandidateT *candidate,
-                              ARUint8 *dataPtr, ARUint8 *mfImage, AR2TemplateT **templ,
+static int ar2Tracking2dSub ( AR2HandleT *handle, AR2TrackingPageT *page, AR2TemplateCandidateT *candidate,
+                              ARUint8 *dataPtr, AR2MatchingWorkT **work, AR2TemplateT **templ,
                               AR2Tracking2DResultT *result )
 #endif
 {
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
     AR2Template2T        *templ2;
 #endif
+    AR2SurfaceSetT       *surfaceSet;
     int                   snum, level, fnum;
     int                   search[3][2];
     int                   bx, by;
 
+    surfaceSet = page->surfaceSet;
     snum  = candidate->snum;
     level = candidate->level;
     fnum  = candidate->num;
 
     if( *templ == NULL )  *templ = ar2GenTemplate( handle->templateSize1, handle->templateSize2 );
+    if( *work == NULL )   *work  = ar2GenMatchingWork( handle->templateSize1, handle->templateSize2 );
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
     if( *templ2 == NULL ) *templ2 = ar2GenTemplate2( handle->templateSize1, handle->templateSize2 );
 #endif
@@ -112,7 +122,7 @@ static int ar2Tracking2dSub ( AR2HandleT *handle, AR2SurfaceSetT *surfaceSet, AR
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
     if( handle->blurMethod == AR2_CONSTANT_BLUR ) {
         if( ar2SetTemplateSub( handle->cparamLT,
-                               (const float (*)[4])handle->wtrans1[snum],
+                               (const float (*)[4])page->wtrans1[snum],
                                surfaceSet->surface[snum].imageSet,
                              &(surfaceSet->surface[snum].featureSet->list[level]),
                                fnum,
@@ -127,7 +137,7 @@ static int ar2Tracking2dSub ( AR2HandleT *handle, AR2SurfaceSetT *surfaceSet, AR
     }
     else {
         if( ar2SetTemplate2Sub( handle->cparamLT,
-                                (const float (*)[4])handle->wtrans1[snum],
+                                (const float (*)[4])page->wtrans1[snum],
                                 surfaceSet->surface[snum].imageSet,
                               &(surfaceSet->surface[snum].featureSet->list[level]),
                                 fnum,
@@ -142,7 +152,7 @@ static int ar2Tracking2dSub ( AR2HandleT *handle, AR2SurfaceSetT *surfaceSet, AR
     }
 #else
     if( ar2SetTemplateSub( handle->cparamLT,
-                           (const float (*)[4])handle->wtrans1[snum],
+                           (const float (*)[4])page->wtrans1[snum],
                            surfaceSet->surface[snum].imageSet,
                          &(surfaceSet->surface[snum].featureSet->list[level]),
                            fnum,
@@ -158,22 +168,22 @@ static int ar2Tracking2dSub ( AR2HandleT *handle, AR2SurfaceSetT *surfaceSet, AR
     // Get the screen coordinates for up to three previous positions of this feature into search[][].
     if( surfaceSet->contNum == 1 ) {
         ar2GetSearchPoint( handle->cparamLT,
-                           (const float (*)[4])handle->wtrans1[snum], NULL, NULL,
+                           (const float (*)[4])page->wtrans1[snum], NULL, NULL,
                          &(surfaceSet->surface[snum].featureSet->list[level].coord[fnum]),
                            search );
     }
     else if( surfaceSet->contNum == 2 ) {
         ar2GetSearchPoint( handle->cparamLT,
-                           (const float (*)[4])handle->wtrans1[snum],
-                           (const float (*)[4])handle->wtrans2[snum], NULL,
+                           (const float (*)[4])page->wtrans1[snum],
+                           (const float (*)[4])page->wtrans2[snum], NULL,
                          &(surfaceSet->surface[snum].featureSet->list[level].coord[fnum]),
                            search );
     }
     else {
         ar2GetSearchPoint( handle->cparamLT,
-                           (const float (*)[4])handle->wtrans1[snum],
-                           (const float (*)[4])handle->wtrans2[snum],
-                           (const float (*)[4])handle->wtrans3[snum],
+                           (const float (*)[4])page->wtrans1[snum],
+                           (const float (*)[4])page->wtrans2[snum],
+                           (const float (*)[4])page->wtrans3[snum],
                          &(surfaceSet->surface[snum].featureSet->list[level].coord[fnum]),
                            search );
     }
@@ -181,11 +191,11 @@ static int ar2Tracking2dSub ( AR2HandleT *handle, AR2SurfaceSetT *surfaceSet, AR
 #if AR2_CAPABLE_ADAPTIVE_TEMPLATE
     if( handle->blurMethod == AR2_CONSTANT_BLUR ) {
         if( ar2GetBestMatching( dataPtr,
-                                mfImage,
                                 handle->xsize,
                                 handle->ysize,
                                 handle->pixFormat,
                                *templ,
+                               *work,
                                 handle->searchSize,
                                 handle->searchSize,
                                 search,
@@ -197,7 +207,6 @@ static int ar2Tracking2dSub ( AR2HandleT *handle, AR2SurfaceSetT *surfaceSet, AR
     }
     else {
         if( ar2GetBestMatching2( dataPtr,
-                                 mfImage,
                                  handle->xsize,
                                  handle->ysize,
                                  handle->pixFormat,
@@ -213,11 +222,11 @@ static int ar2Tracking2dSub ( AR2HandleT *handle, AR2SurfaceSetT *surfaceSet, AR
     }
 #else
     if( ar2GetBestMatching( dataPtr,
-                            mfImage,
                             handle->xsize,
                             handle->ysize,
                             handle->pixFormat,
                            *templ,
+                           *work,
                             handle->searchSize,
                             handle->searchSize,
                             search,
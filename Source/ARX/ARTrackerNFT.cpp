@@ -43,18 +43,23 @@
 #if HAVE_NFT
 #include <ARX/ARTrackableNFT.h>
 #include "trackingSub.h"
+#include <ARX/AR2/coord.h>
 #include <algorithm>
 
+// Number of recently lost pages KPM looks for before the others.
+#define NFT_KPM_PRIOR_PAGE_MAX 3
+
 ARTrackerNFT::ARTrackerNFT() :
     m_trackables(),
     m_videoSourceIsStereo(false),
     m_nftMultiMode(false),
     m_kpmRequired(true),
-    m_kpmBusy(false),
+    m_kpmWorkerCount(1),
+    m_kpmEarlyExitMargin(-1),
     trackingThreadHandle(NULL),
     m_ar2Handle(NULL),
     m_kpmHandle(NULL),
-    m_surfaceSet{NULL},
+    m_surfaceSet(),
     m_pageCount(0)
 {
 }
@@ -79,6 +84,27 @@ bool ARTrackerNFT::NFTMultiMode() const
     return m_nftMultiMode;
 }
 
+void ARTrackerNFT::setNFTDetectionWorkerCount(int count)
+{
+    if (count < 1) return;
+    m_kpmWorkerCount = count;
+}
+
+int ARTrackerNFT::NFTDetectionWorkerCount() const
+{
+    return m_kpmWorkerCount;
+}
+
+void ARTrackerNFT::setNFTDetectionEarlyExitMargin(int margin)
+{
+    m_kpmEarlyExitMargin = (margin < 0 ? -1 : margin);
+}
+
+int ARTrackerNFT::NFTDetectionEarlyExitMargin() const
+{
+    return m_kpmEarlyExitMargin;
+}
+
 bool ARTrackerNFT::start(ARParamLT *paramLT, AR_PIXEL_FORMAT pixelFormat)
 {
     if (!paramLT || pixelFormat == AR_PIXEL_FORMAT_INVALID) return false;
@@ -132,23 +158,106 @@ bool ARTrackerNFT::start(ARParamLT *paramLT0, AR_PIXEL_FORMAT pixelFormat0, ARPa
 
 bool ARTrackerNFT::unloadNFTData(void)
 {
-    int i;
-    
     if (trackingThreadHandle) {
-        ARLOGi("Stopping NFT tracking thread.\n");
+        ARLOGi("Stopping NFT tracking threads.\n");
         trackingInitQuit(&trackingThreadHandle);
-        m_kpmBusy = false;
     }
-    for (i = 0; i < PAGES_MAX; i++) m_surfaceSet[i] = NULL; // Discard weak-references.
+    m_surfaceSet.clear(); // Discard weak-references.
     m_kpmRequired = true;
     m_pageCount = 0;
+    for (std::vector<PageToAdd>::iterator it = m_pagesToAdd.begin(); it != m_pagesToAdd.end(); ++it) {
+        kpmDeleteHandle(&it->kpmHandle);
+    }
+    m_pagesToAdd.clear();
+    m_pagesToRemove.clear();
+    m_lostPages.clear();
     
     return true;
 }
 
+int ARTrackerNFT::freePageNo() const
+{
+    int i;
+    for (i = 0; i < (int)m_surfaceSet.size(); i++) {
+        if (m_surfaceSet[i]) continue;
+        if (std::find(m_pagesToRemove.begin(), m_pagesToRemove.end(), i) != m_pagesToRemove.end()) continue;
+        if (std::find_if(m_pagesToAdd.begin(), m_pagesToAdd.end(), [&](const PageToAdd& p) { return p.pageNo == i; }) != m_pagesToAdd.end()) continue;
+        break;
+    }
+    return i;
+}
+
+// Tell the KPM workers which pages are being tracked, and the area of the frame each covers
+// at its last tracked pose, so that detection looks only at the rest of the frame and for the
+// other pages.
+void ARTrackerNFT::updateKPMSkipPages()
+{
+    m_kpmSkipPages.clear();
+    m_kpmSkipRegions.clear();
+    for (int page = 0; page < (int)m_surfaceSet.size(); page++) {
+        AR2SurfaceSetT *surfaceSet = m_surfaceSet[page];
+        if (!surfaceSet || surfaceSet->contNum < 1) continue;
+        m_kpmSkipPages.push_back(page);
+        
+        for (int i = 0; i < surfaceSet->num; i++) {
+            const AR2ImageT *image = surfaceSet->surface[i].imageSet->scale[0];
+            const float w = image->xsize * 25.4f / image->dpi;
+            const float h = image->ysize * 25.4f / image->dpi;
+            const float mx[4] = {0.0f, w, w, 0.0f};
+            const float my[4] = {0.0f, 0.0f, h, h};
+            float trans[3][4];
+            KpmSkipRect region;
+            int j;
+            arUtilMatMulf((const float (*)[4])surfaceSet->trans1, (const float (*)[4])surfaceSet->surface[i].trans, trans);
+            for (j = 0; j < 4; j++) {
+                if (ar2MarkerCoord2ScreenCoord(m_ar2Handle->cparamLT, (const float (*)[4])trans, mx[j], my[j], &region.vertex[j].x, &region.vertex[j].y) < 0) break;
+            }
+            if (j == 4) m_kpmSkipRegions.push_back(region);
+        }
+    }
+    trackingInitSetSkipPages(trackingThreadHandle, m_kpmSkipPages.data(), (int)m_kpmSkipPages.size(), m_kpmSkipRegions.data(), (int)m_kpmSkipRegions.size());
+}
+
+// Apply the pages added and removed since the data was loaded, leaving the other pages and
+// their tracking state untouched. Must only be called while the KPM workers are idle.
+// The features of added pages were indexed by newTrackable(), so nothing is built here.
+// The workers other than the first are not updated here; see trackingInitUpdateRefDataSet().
+bool ARTrackerNFT::updateNFTData()
+{
+    bool ok = true;
+    
+    for (std::vector<int>::iterator it = m_pagesToRemove.begin(); it != m_pagesToRemove.end(); ++it) {
+        ARLOGi("Removing NFT page %d.\n", *it);
+        if (kpmRemoveRefDataSetPage(m_kpmHandle, *it) < 0) {
+            ARLOGe("kpmRemoveRefDataSetPage\n");
+            ok = false;
+        }
+    }
+    m_pagesToRemove.clear();
+    
+    for (std::vector<PageToAdd>::iterator it = m_pagesToAdd.begin(); it != m_pagesToAdd.end(); ++it) {
+        std::shared_ptr<ARTrackableNFT> t = it->trackable;
+        if (kpmMoveRefDataSetPages(m_kpmHandle, it->kpmHandle) < 0) {
+            ARLOGe("Error adding KPM data from '%s.fset3'.\n", t->datasetPathname);
+            kpmDeleteHandle(&it->kpmHandle);
+            ok = false;
+            continue;
+        }
+        kpmDeleteHandle(&it->kpmHandle);
+        t->pageNo = it->pageNo;
+        ARLOGi("Added '%s' as page no. %d.\n", t->datasetPathname, t->pageNo);
+        if (t->pageNo >= (int)m_surfaceSet.size()) m_surfaceSet.resize(t->pageNo + 1, NULL);
+        m_surfaceSet[t->pageNo] = t->surfaceSet;
+        m_pageCount++;
+    }
+    m_pagesToAdd.clear();
+    
+    return ok;
+}
+
 bool ARTrackerNFT::loadNFTData()
 {
-    // If data was already loaded, stop KPM tracking thread and unload previously loaded data.
+    // If data was already loaded, stop KPM tracking threads and unload previously loaded data.
     if (trackingThreadHandle) {
         ARLOGi("Reloading NFT data.\n");
         unloadNFTData();
@@ -156,7 +265,10 @@ bool ARTrackerNFT::loadNFTData()
         ARLOGi("Loading NFT data.\n");
     }
     
-    KpmRefDataSet *refDataSet = NULL;
+    // With early exit, detection stops at the first page found, starting with those lost most recently.
+    kpmSetEarlyExitMargin(m_kpmHandle, m_kpmEarlyExitMargin);
+    
+    std::vector<KpmRefDataSet *> refDataSets;
     
     for (std::vector<std::shared_ptr<ARTrackable>>::iterator it = m_trackables.begin(); it != m_trackables.end(); ++it) {
         std::shared_ptr<ARTrackableNFT> t = std::static_pointer_cast<ARTrackableNFT>(*it);
@@ -170,34 +282,52 @@ bool ARTrackerNFT::loadNFTData()
         }
         t->pageNo = m_pageCount;
         ARLOGi("  Assigned page no. %d.\n", t->pageNo);
+        kpmLoadIndexFile(m_kpmHandle, t->datasetPathname, KpmIndexFileExt);
         if (kpmChangePageNoOfRefDataSet(refDataSet2, KpmChangePageNoAllPages, t->pageNo) < 0) {
             ARLOGe("kpmChangePageNoOfRefDataSet\n");
             exit(-1);
         }
-        if (kpmMergeRefDataSet(&refDataSet, &refDataSet2) < 0) {
-            ARLOGe("kpmMergeRefDataSet\n");
-            exit(-1);
-        }
+        refDataSets.push_back(refDataSet2);
         ARLOGi("Done.\n");
 
         // For convenience, create a weak reference to the AR2 data.
-        m_surfaceSet[t->pageNo] = t->surfaceSet;
+        m_surfaceSet.push_back(t->surfaceSet);
 
         m_pageCount++;
-        if (m_pageCount == PAGES_MAX) {
-            ARLOGe("Maximum number of NFT pages (%d) loaded.\n", PAGES_MAX);
-            break;
+    }
+    
+    // Merge neighbouring pairs of datasets until one is left. Each point is then copied
+    // once per round rather than once per page, which matters for large numbers of pages.
+    while (refDataSets.size() > 1) {
+        size_t j = 0;
+        for (size_t i = 0; i < refDataSets.size(); i += 2, j++) {
+            if (i + 1 < refDataSets.size() && kpmMergeRefDataSet(&refDataSets[i], &refDataSets[i + 1]) < 0) {
+                ARLOGe("kpmMergeRefDataSet\n");
+                exit(-1);
+            }
+            refDataSets[j] = refDataSets[i];
         }
+        refDataSets.resize(j);
     }
+    KpmRefDataSet *refDataSet = (refDataSets.empty() ? NULL : refDataSets[0]);
     if (kpmSetRefDataSet(m_kpmHandle, refDataSet) < 0) {
         ARLOGe("kpmSetRefDataSet\n");
         exit(-1);
     }
     kpmDeleteRefDataSet(&refDataSet);
     
-    // Start the KPM tracking thread.
-    ARLOGi("Starting NFT tracking thread.\n");
-    trackingThreadHandle = trackingInitInit(m_kpmHandle);
+    // Cache any feature indices that had to be built, so the next load can skip building them.
+    for (std::vector<std::shared_ptr<ARTrackable>>::iterator it = m_trackables.begin(); it != m_trackables.end(); ++it) {
+        std::shared_ptr<ARTrackableNFT> t = std::static_pointer_cast<ARTrackableNFT>(*it);
+        if (t->pageNo < 0) continue;
+        if (kpmSaveIndexFile(m_kpmHandle, t->datasetPathname, KpmIndexFileExt, t->pageNo, 1) < 0) {
+            ARLOGw("Unable to write KPM index file for '%s'.\n", t->datasetPathname);
+        }
+    }
+    
+    // Start the KPM tracking threads.
+    ARLOGi("Starting NFT tracking threads.\n");
+    trackingThreadHandle = trackingInitInit(m_kpmHandle, m_kpmWorkerCount);
     if (!trackingThreadHandle) {
         ARLOGe("trackingInitInit()\n");
         return false;
@@ -234,59 +364,94 @@ bool ARTrackerNFT::update(AR2VideoBufferT *buff)
     if (trackingThreadHandle) {
         
         // Do KPM tracking.
-        float err;
         float trackingTrans[3][4];
         
-        if (m_kpmRequired) {
-            if (!m_kpmBusy) {
-                trackingInitStart(trackingThreadHandle, buff->buffLuma);
-                m_kpmBusy = true;
-            } else {
-                int ret;
-                int pageNo;
-                ret = trackingInitGetResult(trackingThreadHandle, trackingTrans, &pageNo);
-                if (ret != 0) {
-                    m_kpmBusy = false;
-                    if (ret == 1) {
-                        if (pageNo >= 0 && pageNo < PAGES_MAX) {
-                            if (m_surfaceSet[pageNo]->contNum < 1) {
-                                ARLOGd("Detected page %d.\n", pageNo);
-                                ar2SetInitTrans(m_surfaceSet[pageNo], trackingTrans); // Sets surfaceSet[page]->contNum = 1.
-                            }
-                        } else {
-                            ARLOGe("Detected page with bad page number %d.\n", pageNo);
-                        }
-                    } else /*if (ret < 0)*/ {
-                        ARLOGd("No page detected.\n");
-                    }
+        // Collect the newest detection, if any of the KPM workers have finished.
+        int ret;
+        int pageNo;
+        ret = trackingInitGetResult(trackingThreadHandle, trackingTrans, &pageNo, NULL);
+        if (ret == 1) {
+            if (pageNo >= 0 && pageNo < (int)m_surfaceSet.size() && m_surfaceSet[pageNo]) {
+                if (m_surfaceSet[pageNo]->contNum < 1) {
+                    ARLOGd("Detected page %d.\n", pageNo);
+                    ar2SetInitTrans(m_surfaceSet[pageNo], trackingTrans); // Sets surfaceSet[page]->contNum = 1.
+                    m_lostPages.erase(std::remove(m_lostPages.begin(), m_lostPages.end(), pageNo), m_lostPages.end());
                 }
+            } else {
+                ARLOGe("Detected page with bad page number %d.\n", pageNo);
+            }
+        } else if (ret < 0) {
+            ARLOGd("No page detected.\n");
+        }
+        
+        if (!m_pagesToAdd.empty() || !m_pagesToRemove.empty()) {
+            // Pages can only be added or removed while all KPM workers are idle, so don't start
+            // any more until then. The pages already being tracked are unaffected.
+            if (!trackingInitIsBusy(trackingThreadHandle)) {
+                updateNFTData();
+                trackingInitUpdateRefDataSet(trackingThreadHandle);
             }
+        } else if (m_kpmRequired) {
+            // Start an idle worker, if any, on this frame.
+            updateKPMSkipPages();
+            trackingInitSetPriorPages(trackingThreadHandle, m_lostPages.data(), (int)m_lostPages.size());
+            trackingInitStart(trackingThreadHandle, buff->buffLuma, &buff->time);
         }
         
         // Do AR2 tracking and update NFT markers.
-        int page = 0;
         int pagesTracked = 0;
         bool success = true;
         ARdouble *transL2R = (m_videoSourceIsStereo ? (ARdouble *)m_transL2R : NULL);
         
+        // Track all the pages which are being tracked with a single call, so that the templates of
+        // all pages share the AR2 tracking threads.
+        std::vector<std::shared_ptr<ARTrackableNFT>> trackedTrackables;
+        std::vector<int> trackedSlots; // Index of each trackable's page in trackedSurfaceSets.
+        std::vector<AR2SurfaceSetT *> trackedSurfaceSets;
         for (std::vector<std::shared_ptr<ARTrackable>>::iterator it = m_trackables.begin(); it != m_trackables.end(); ++it) {
             std::shared_ptr<ARTrackableNFT> t = std::static_pointer_cast<ARTrackableNFT>(*it);
+            int page = t->pageNo;
+            if (page < 0 || !m_surfaceSet[page]) continue; // Not loaded (yet).
 
             if (m_surfaceSet[page]->contNum > 0) {
-                if (ar2Tracking(m_ar2Handle, m_surfaceSet[page], buff->buffLuma, trackingTrans, &err) < 0) {
+                // A page may only be tracked once per frame.
+                std::vector<AR2SurfaceSetT *>::iterator s = std::find(trackedSurfaceSets.begin(), trackedSurfaceSets.end(), m_surfaceSet[page]);
+                trackedSlots.push_back((int)(s - trackedSurfaceSets.begin()));
+                if (s == trackedSurfaceSets.end()) trackedSurfaceSets.push_back(m_surfaceSet[page]);
+                trackedTrackables.push_back(t);
+            }
+        }
+
+        if (!trackedSurfaceSets.empty()) {
+            int trackedCount = (int)trackedSurfaceSets.size();
+            std::unique_ptr<float[][3][4]> trackedTrans(new float[trackedCount][3][4]);
+            std::vector<float> trackedErr(trackedCount);
+            std::vector<int> trackedRet(trackedCount);
+            if (ar2TrackingMulti(m_ar2Handle, trackedSurfaceSets.data(), trackedCount, buff->buffLuma, trackedTrans.get(), trackedErr.data(), trackedRet.data()) < 0) {
+                ARLOGe("Error tracking pages.\n");
+                std::fill(trackedRet.begin(), trackedRet.end(), -1);
+            }
+
+            for (size_t i = 0; i < trackedTrackables.size(); i++) {
+                std::shared_ptr<ARTrackableNFT> t = trackedTrackables[i];
+                int page = t->pageNo;
+                int slot = trackedSlots[i];
+                if (trackedRet[slot] < 0) {
                     ARLOGd("Tracking lost on page %d.\n", page);
+                    // Most recently lost first.
+                    m_lostPages.erase(std::remove(m_lostPages.begin(), m_lostPages.end(), page), m_lostPages.end());
+                    m_lostPages.insert(m_lostPages.begin(), page);
+                    if (m_lostPages.size() > NFT_KPM_PRIOR_PAGE_MAX) m_lostPages.pop_back();
                     success &= t->updateWithNFTResults(-1, NULL, NULL);
                 } else {
-                    ARLOGd("Tracked page %d (pos = {% 4f, % 4f, % 4f}).\n", page, trackingTrans[0][3], trackingTrans[1][3], trackingTrans[2][3]);
-                    success &= t->updateWithNFTResults(page, trackingTrans, (ARdouble (*)[4])transL2R);
+                    ARLOGd("Tracked page %d (pos = {% 4f, % 4f, % 4f}).\n", page, trackedTrans[slot][0][3], trackedTrans[slot][1][3], trackedTrans[slot][2][3]);
+                    success &= t->updateWithNFTResults(page, trackedTrans[slot], (ARdouble (*)[4])transL2R);
                     pagesTracked++;
                 }
             }
-
-            page++;
         }
         
-        m_kpmRequired = (pagesTracked < (m_nftMultiMode ? page : 1));
+        m_kpmRequired = (pagesTracked < (m_nftMultiMode ? m_pageCount : 1));
         
     } // trackingThreadHandle
 
@@ -363,9 +528,39 @@ int ARTrackerNFT::newTrackable(std::vector<std::string> config)
         return ARTrackable::NO_ID;
     }
 
-    m_trackables.push_back(std::shared_ptr<ARTrackable>(ret));
-    // Trigger reload on next tracker update.
-    unloadNFTData();
+    std::shared_ptr<ARTrackableNFT> t(ret);
+    m_trackables.push_back(t);
+    
+    // If NFT data is already loaded, load just this trackable's KPM data, and index its features
+    // here rather than on the tracking thread. It is added to the tracker on a later update,
+    // without reloading the other pages.
+    if (trackingThreadHandle) {
+        KpmRefDataSet *refDataSet = NULL;
+        ARLOGi("Reading '%s.fset3'.\n", t->datasetPathname);
+        if (kpmLoadRefDataSet(t->datasetPathname, "fset3", &refDataSet) < 0) {
+            ARLOGe("Error reading KPM data from '%s.fset3'.\n", t->datasetPathname);
+        } else {
+            PageToAdd page;
+            page.trackable = t;
+            page.pageNo = freePageNo();
+            page.kpmHandle = kpmCreateHandle(m_ar2Handle->cparamLT);
+            if (!page.kpmHandle) {
+                ARLOGe("kpmCreateHandle\n");
+            } else {
+                kpmLoadIndexFile(page.kpmHandle, t->datasetPathname, KpmIndexFileExt);
+                if (kpmChangePageNoOfRefDataSet(refDataSet, KpmChangePageNoAllPages, page.pageNo) < 0 || kpmSetRefDataSet(page.kpmHandle, refDataSet) < 0) {
+                    ARLOGe("Error adding KPM data from '%s.fset3'.\n", t->datasetPathname);
+                    kpmDeleteHandle(&page.kpmHandle);
+                } else {
+                    if (kpmSaveIndexFile(page.kpmHandle, t->datasetPathname, KpmIndexFileExt, page.pageNo, 1) < 0) {
+                        ARLOGw("Unable to write KPM index file for '%s'.\n", t->datasetPathname);
+                    }
+                    m_pagesToAdd.push_back(page);
+                }
+            }
+            kpmDeleteRefDataSet(&refDataSet);
+        }
+    }
 
     return ret->UID;
 }
@@ -395,8 +590,26 @@ bool ARTrackerNFT::deleteTrackable(int UID)
     if (ti == m_trackables.end()) {
         return false;
     }
+    std::shared_ptr<ARTrackableNFT> t = std::static_pointer_cast<ARTrackableNFT>(*ti);
     m_trackables.erase(ti);
-    unloadNFTData();
+    
+    // Remove just this trackable's page. The KPM data is removed on the next update.
+    if (trackingThreadHandle) {
+        if (t->pageNo >= 0 && t->pageNo < (int)m_surfaceSet.size() && m_surfaceSet[t->pageNo] == t->surfaceSet) {
+            m_surfaceSet[t->pageNo] = NULL;
+            m_pagesToRemove.push_back(t->pageNo);
+            m_lostPages.erase(std::remove(m_lostPages.begin(), m_lostPages.end(), t->pageNo), m_lostPages.end());
+            m_pageCount--;
+        }
+        for (std::vector<PageToAdd>::iterator it = m_pagesToAdd.begin(); it != m_pagesToAdd.end(); ++it) {
+            if (it->trackable == t) {
+                kpmDeleteHandle(&it->kpmHandle);
+                m_pagesToAdd.erase(it);
+                break;
+            }
+        }
+    }
+    t->pageNo = -1;
     return true;
 }
 
@@ -128,6 +128,56 @@ ARUTIL_EXTERN void *threadGetArg( THREAD_HANDLE_T *flag );
 /// Returns the number of online CPUs in the system.
 ARUTIL_EXTERN int threadGetCPU(void);
 
+//
+// Task queue.
+//
+
+/// \brief A queue of numbered tasks shared by a set of persistent worker threads.
+///
+/// Tasks are numbered 0, 1, 2... in the order they are pushed, and the client owns
+/// whatever per-task data the number refers to. Workers pull tasks as soon as they are
+/// free, so the client can keep pushing while earlier tasks are still being processed.
+///
+/// Example client structure, with workers already started via threadStartSignal():
+/// \code
+///    threadTaskQueueReset(queue);
+///    for (i = 0; i < n; i++) {
+///        // Fill in data for task i.
+///        threadTaskQueuePush(queue);
+///    }
+///    threadTaskQueueClose(queue);
+///    for (i = 0; i < n; i++) {
+///        threadTaskQueueWaitDone(queue, i);
+///        // Use the result of task i.
+///    }
+/// \endcode
+///
+/// Example worker structure:
+/// \code
+///    while ((i = threadTaskQueuePop(queue)) >= 0) {
+///        // Process task i.
+///        threadTaskQueueDone(queue, i);
+///    }
+/// \endcode
+typedef struct _THREAD_TASK_QUEUE_T THREAD_TASK_QUEUE_T;
+
+/// Client-side, set up. Create a queue which can hold up to taskMax tasks between resets. Returns NULL in case of failure.
+ARUTIL_EXTERN THREAD_TASK_QUEUE_T *threadTaskQueueInit( int taskMax );
+/// Client-side, set up. Frees the queue pointed to by the location pointed to by queue. No worker may be using the queue. Location pointed to by queue is set to NULL.
+ARUTIL_EXTERN int threadTaskQueueFree( THREAD_TASK_QUEUE_T **queue );
+/// Client-side. Empty the queue and open it for a new round of tasks. No worker may be processing a task from the previous round.
+ARUTIL_EXTERN int threadTaskQueueReset( THREAD_TASK_QUEUE_T *queue );
+/// Client-side. Make the next task available to workers. Returns the task number, or -1 if the queue is full or closed.
+ARUTIL_EXTERN int threadTaskQueuePush( THREAD_TASK_QUEUE_T *queue );
+/// Client-side. Signal that no more tasks will be pushed this round. Workers waiting for a task return -1.
+ARUTIL_EXTERN int threadTaskQueueClose( THREAD_TASK_QUEUE_T *queue );
+/// Client-side. Wait until the task with the given number has been done.
+ARUTIL_EXTERN int threadTaskQueueWaitDone( THREAD_TASK_QUEUE_T *queue, int task );
+/// Worker-side. Wait for the next task. Returns the task number, or -1 once the queue has been closed and all its tasks handed out.
+ARUTIL_EXTERN int threadTaskQueuePop( THREAD_TASK_QUEUE_T *queue );
+/// Worker-side. Notify the client that the task with the given number has been done.
+ARUTIL_EXTERN int threadTaskQueueDone( THREAD_TASK_QUEUE_T *queue, int task );
+
 
 #ifdef __cplusplus
 }
@@ -51,6 +51,7 @@
 #endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ARX/ARUtil/thread_sub.h>
 //#define ARUTIL_DISABLE_PTHREADS // Uncomment to disable pthreads support.
 
@@ -255,6 +256,127 @@ int threadWaitQuit( THREAD_HANDLE_T *flag )
     return 0;
 }
 
+//
+// Task queue.
+//
+
+struct _THREAD_TASK_QUEUE_T {
+    int             taskMax;
+    int             pushed;  // Number of tasks pushed this round.
+    int             popped;  // Number of tasks handed out to workers this round.
+    int             closed;  // 1 = no more tasks this round.
+    char           *doneF;   // Per task, 1 = done.
+    pthread_mutex_t mut;
+    pthread_cond_t  cond1;   // Signals to workers that a task was pushed or the queue closed.
+    pthread_cond_t  cond2;   // Signals to client that a task is done.
+};
+
+THREAD_TASK_QUEUE_T *threadTaskQueueInit( int taskMax )
+{
+    THREAD_TASK_QUEUE_T *queue;
+
+    if (taskMax < 1) return NULL;
+    if ((queue = malloc(sizeof(THREAD_TASK_QUEUE_T))) == NULL) return NULL;
+    if ((queue->doneF = calloc(taskMax, sizeof(char))) == NULL) {
+        free(queue);
+        return NULL;
+    }
+    queue->taskMax = taskMax;
+    queue->pushed  = 0;
+    queue->popped  = 0;
+    queue->closed  = 0;
+    pthread_mutex_init( &(queue->mut), NULL );
+    pthread_cond_init( &(queue->cond1), NULL );
+    pthread_cond_init( &(queue->cond2), NULL );
+
+    return queue;
+}
+
+int threadTaskQueueFree( THREAD_TASK_QUEUE_T **queue )
+{
+    if (!queue || !*queue) return -1;
+
+    pthread_mutex_destroy(&((*queue)->mut));
+    pthread_cond_destroy(&((*queue)->cond1));
+    pthread_cond_destroy(&((*queue)->cond2));
+    free( (*queue)->doneF );
+    free( *queue );
+    *queue = NULL;
+    return 0;
+}
+
+int threadTaskQueueReset( THREAD_TASK_QUEUE_T *queue )
+{
+    pthread_mutex_lock(&(queue->mut));
+    memset(queue->doneF, 0, queue->pushed);
+    queue->pushed = 0;
+    queue->popped = 0;
+    queue->closed = 0;
+    pthread_mutex_unlock(&(queue->mut));
+    return 0;
+}
+
+int threadTaskQueuePush( THREAD_TASK_QUEUE_T *queue )
+{
+    int task;
+
+    pthread_mutex_lock(&(queue->mut));
+    if (queue->closed || queue->pushed == queue->taskMax) {
+        pthread_mutex_unlock(&(queue->mut));
+        return -1;
+    }
+    task = queue->pushed++;
+    pthread_cond_signal(&(queue->cond1));
+    pthread_mutex_unlock(&(queue->mut));
+    return task;
+}
+
+int threadTaskQueueClose( THREAD_TASK_QUEUE_T *queue )
+{
+    pthread_mutex_lock(&(queue->mut));
+    queue->closed = 1;
+    pthread_cond_broadcast(&(queue->cond1));
+    pthread_mutex_unlock(&(queue->mut));
+    return 0;
+}
+
+int threadTaskQueueWaitDone( THREAD_TASK_QUEUE_T *queue, int task )
+{
+    if (task < 0 || task >= queue->taskMax) return -1;
+
+    pthread_mutex_lock(&(queue->mut));
+    while (!queue->doneF[task]) {
+        pthread_cond_wait(&(queue->cond2), &(queue->mut));
+    }
+    pthread_mutex_unlock(&(queue->mut));
+    return 0;
+}
+
+int threadTaskQueuePop( THREAD_TASK_QUEUE_T *queue )
+{
+    int task;
+
+    pthread_mutex_lock(&(queue->mut));
+    while (queue->popped == queue->pushed && !queue->closed) {
+        pthread_cond_wait(&(queue->cond1), &(queue->mut));
+    }
+    if (queue->popped == queue->pushed) task = -1;
+    else                                task = queue->popped++;
+    pthread_mutex_unlock(&(queue->mut));
+    return task;
+}
+
+int threadTaskQueueDone( THREAD_TASK_QUEUE_T *queue, int task )
+{
+    if (task < 0 || task >= queue->taskMax) return -1;
+
+    pthread_mutex_lock(&(queue->mut));
+    queue->doneF[task] = 1;
+    pthread_cond_signal(&(queue->cond2));
+    pthread_mutex_unlock(&(queue->mut));
+    return 0;
+}
+
 int threadGetCPU(void)
 {
 #ifdef _WIN32
@@ -447,6 +447,14 @@ void arwSetTrackerOptionInt(int option, int value)
     } else if (option == ARW_TRACKER_OPTION_2D_MAXIMUM_MARKERS_TO_TRACK) {
 #if HAVE_2D
         gARTK->get2dTracker()->setMaxMarkersToTrack(value);
+#endif
+    } else if (option == ARW_TRACKER_OPTION_NFT_DETECTION_WORKER_COUNT) {
+#if HAVE_NFT
+        gARTK->getNFTTracker()->setNFTDetectionWorkerCount(value);
+#endif
+    } else if (option == ARW_TRACKER_OPTION_NFT_DETECTION_EARLY_EXIT_MARGIN) {
+#if HAVE_NFT
+        gARTK->getNFTTracker()->setNFTDetectionEarlyExitMargin(value);
 #endif
     }
 }
@@ -519,6 +527,14 @@ int arwGetTrackerOptionInt(int option)
     } else if (option == ARW_TRACKER_OPTION_2D_MAXIMUM_MARKERS_TO_TRACK) {
 #if HAVE_2D
         return gARTK->get2dTracker()->getMaxMarkersToTrack();
+#endif
+    } else if (option == ARW_TRACKER_OPTION_NFT_DETECTION_WORKER_COUNT) {
+#if HAVE_NFT
+        return gARTK->getNFTTracker()->NFTDetectionWorkerCount();
+#endif
+    } else if (option == ARW_TRACKER_OPTION_NFT_DETECTION_EARLY_EXIT_MARGIN) {
+#if HAVE_NFT
+        return gARTK->getNFTTracker()->NFTDetectionEarlyExitMargin();
 #endif
     }
     return (INT_MAX);
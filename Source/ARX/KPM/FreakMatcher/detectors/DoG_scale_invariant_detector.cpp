@@ -36,17 +36,327 @@
 #include "DoG_scale_invariant_detector.h"
 #include <framework/error.h>
 #include <framework/timers.h>
+#include <framework/thread_pool.h>
 #include <math/math_utils.h>
 #include <math/linear_algebra.h>
+#include <math/geometry.h>
 #include <algorithm>
 #include <functional>
 #include "interpolate.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define DOG_SSE2 1
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#  define DOG_NEON 1
+#  include <arm_neon.h>
+#endif
+
 using namespace vision;
 
+namespace {
+    
+    // Minimum number of rows given to a thread
+    const size_t kMinRowsPerBand = 16;
+    
+    /**
+     * Append the bands of the rows [ROW_BEGIN, ROW_END) of a level to BANDS. The
+     * level is only split when there is a pool to share the bands with.
+     */
+    void append_row_bands(std::vector<PyramidRowBand>& bands,
+                          ThreadPool* pool,
+                          size_t level,
+                          size_t row_begin,
+                          size_t row_end) {
+        if(row_end <= row_begin) {
+            return;
+        }
+        
+        size_t rows = row_end-row_begin;
+        size_t num_bands = 1;
+        if(pool != NULL) {
+            num_bands = std::max<size_t>(1, std::min<size_t>(pool->concurrency(), rows/kMinRowsPerBand));
+        }
+        
+        for(size_t i = 0; i < num_bands; i++) {
+            PyramidRowBand band;
+            band.level = level;
+            band.row_begin = row_begin+rows*i/num_bands;
+            band.row_end = row_begin+rows*(i+1)/num_bands;
+            bands.push_back(band);
+        }
+    }
+    
+    /**
+     * Call FUNC(index) for every index in [0, count), on POOL if there is one.
+     */
+    template<typename FUNC>
+    void for_each_index(ThreadPool* pool, size_t count, const FUNC& func) {
+        if(pool == NULL || pool->numThreads() == 0 || count <= 1) {
+            for(size_t i = 0; i < count; i++) {
+                func(i);
+            }
+            return;
+        }
+        pool->parallelFor((int)count, [&](int index, int) {
+            func((size_t)index);
+        });
+    }
+    
+    // Result of comparing a pixel with its neighbours
+    enum {
+        kNotExtremum = 0,
+        kMaxima = 1,
+        kMinima = 2
+    };
+    
+    /**
+     * Rows above, at and below the current row of a Laplacian level.
+     */
+    struct Neighbourhood {
+        const float* ym1;
+        const float* y;
+        const float* yp1;
+        
+        Neighbourhood()
+        : ym1(NULL), y(NULL), yp1(NULL) {}
+        
+        Neighbourhood(const Image& im, size_t row)
+        : ym1(im.get<float>(row-1)), y(im.get<float>(row)), yp1(im.get<float>(row+1)) {}
+    }; // Neighbourhood
+    
+    /**
+     * Compare the pixel at COL of the center row of LAP with its 8 neighbours in
+     * LAP and its 9 neighbours in each of A and B, when they are set. B may be
+     * empty if only two levels have the same size.
+     *
+     * @return kMaxima/kMinima if the pixel passes the Laplacian threshold and is
+     * strictly greater/less than all the neighbours, otherwise kNotExtremum.
+     */
+    inline int classify_pixel(const Neighbourhood& lap,
+                              const Neighbourhood& a,
+                              const Neighbourhood& b,
+                              size_t col,
+                              float laplacianSqrThreshold) {
+        const float value = lap.y[col];
+        
+        // Check laplacian score
+        if(sqr(value) < laplacianSqrThreshold) {
+            return kNotExtremum;
+        }
+        
+        float max_value = std::max(std::max(lap.ym1[col-1], lap.ym1[col]), lap.ym1[col+1]);
+        float min_value = std::min(std::min(lap.ym1[col-1], lap.ym1[col]), lap.ym1[col+1]);
+        max_value = std::max(max_value, std::max(lap.y[col-1], lap.y[col+1]));
+        min_value = std::min(min_value, std::min(lap.y[col-1], lap.y[col+1]));
+        max_value = std::max(max_value, std::max(std::max(lap.yp1[col-1], lap.yp1[col]), lap.yp1[col+1]));
+        min_value = std::min(min_value, std::min(std::min(lap.yp1[col-1], lap.yp1[col]), lap.yp1[col+1]));
+        
+        const Neighbourhood* others[2] = {&a, &b};
+        for(int i = 0; i < 2; i++) {
+            const Neighbourhood& n = *others[i];
+            if(n.y == NULL) {
+                continue;
+            }
+            for(int j = -1; j <= 1; j++) {
+                max_value = std::max(max_value, std::max(std::max(n.ym1[col+j], n.y[col+j]), n.yp1[col+j]));
+                min_value = std::min(min_value, std::min(std::min(n.ym1[col+j], n.y[col+j]), n.yp1[col+j]));
+            }
+        }
+        
+        if(value > max_value) {
+            return kMaxima;
+        } else if(value < min_value) {
+            return kMinima;
+        }
+        return kNotExtremum;
+    }
+    
+#if DOG_SSE2
+    
+    inline void max_min_3x3(__m128& max_value, __m128& min_value, const float* const rows[], int num_rows, size_t col) {
+        for(int i = 0; i < num_rows; i++) {
+            __m128 l = _mm_loadu_ps(rows[i]+col-1);
+            __m128 c = _mm_loadu_ps(rows[i]+col);
+            __m128 r = _mm_loadu_ps(rows[i]+col+1);
+            max_value = _mm_max_ps(max_value, _mm_max_ps(_mm_max_ps(l, c), r));
+            min_value = _mm_min_ps(min_value, _mm_min_ps(_mm_min_ps(l, c), r));
+        }
+    }
+    
+    /**
+     * Vector version of CLASSIFY_PIXEL for the 4 pixels starting at COL. Bit I of
+     * MAXIMA/MINIMA is set if pixel COL+I is a maxima/minima.
+     */
+    inline void classify_pixels(int& maxima,
+                                int& minima,
+                                const Neighbourhood& lap,
+                                const Neighbourhood& a,
+                                const Neighbourhood& b,
+                                size_t col,
+                                __m128 laplacianSqrThreshold) {
+        __m128 value = _mm_loadu_ps(lap.y+col);
+        
+        // Check laplacian score. Written as !(v^2 < t) to match the scalar test.
+        int pass = _mm_movemask_ps(_mm_cmpnlt_ps(_mm_mul_ps(value, value), laplacianSqrThreshold));
+        if(pass == 0) {
+            maxima = minima = 0;
+            return;
+        }
+        
+        // 8 neighbours on the same level
+        __m128 l = _mm_loadu_ps(lap.y+col-1);
+        __m128 r = _mm_loadu_ps(lap.y+col+1);
+        __m128 max_value = _mm_max_ps(l, r);
+        __m128 min_value = _mm_min_ps(l, r);
+        const float* lap_rows[2] = {lap.ym1, lap.yp1};
+        max_min_3x3(max_value, min_value, lap_rows, 2, col);
+        
+        // 9 neighbours on each of the other levels
+        if(a.y != NULL) {
+            const float* rows[3] = {a.ym1, a.y, a.yp1};
+            max_min_3x3(max_value, min_value, rows, 3, col);
+        }
+        if(b.y != NULL) {
+            const float* rows[3] = {b.ym1, b.y, b.yp1};
+            max_min_3x3(max_value, min_value, rows, 3, col);
+        }
+        
+        maxima = pass & _mm_movemask_ps(_mm_cmpgt_ps(value, max_value));
+        minima = pass & _mm_movemask_ps(_mm_cmplt_ps(value, min_value));
+    }
+    
+#elif DOG_NEON
+    
+    inline int movemask(uint32x4_t mask) {
+        return (vgetq_lane_u32(mask, 0)&1) |
+               (vgetq_lane_u32(mask, 1)&2) |
+               (vgetq_lane_u32(mask, 2)&4) |
+               (vgetq_lane_u32(mask, 3)&8);
+    }
+    
+    inline void max_min_3x3(float32x4_t& max_value, float32x4_t& min_value, const float* const rows[], int num_rows, size_t col) {
+        for(int i = 0; i < num_rows; i++) {
+            float32x4_t l = vld1q_f32(rows[i]+col-1);
+            float32x4_t c = vld1q_f32(rows[i]+col);
+            float32x4_t r = vld1q_f32(rows[i]+col+1);
+            max_value = vmaxq_f32(max_value, vmaxq_f32(vmaxq_f32(l, c), r));
+            min_value = vminq_f32(min_value, vminq_f32(vminq_f32(l, c), r));
+        }
+    }
+    
+    /**
+     * Vector version of CLASSIFY_PIXEL for the 4 pixels starting at COL. Bit I of
+     * MAXIMA/MINIMA is set if pixel COL+I is a maxima/minima.
+     */
+    inline void classify_pixels(int& maxima,
+                                int& minima,
+                                const Neighbourhood& lap,
+                                const Neighbourhood& a,
+                                const Neighbourhood& b,
+                                size_t col,
+                                float32x4_t laplacianSqrThreshold) {
+        float32x4_t value = vld1q_f32(lap.y+col);
+        
+        // Check laplacian score. Written as !(v^2 < t) to match the scalar test.
+        int pass = movemask(vmvnq_u32(vcltq_f32(vmulq_f32(value, value), laplacianSqrThreshold)));
+        if(pass == 0) {
+            maxima = minima = 0;
+            return;
+        }
+        
+        // 8 neighbours on the same level
+        float32x4_t l = vld1q_f32(lap.y+col-1);
+        float32x4_t r = vld1q_f32(lap.y+col+1);
+        float32x4_t max_value = vmaxq_f32(l, r);
+        float32x4_t min_value = vminq_f32(l, r);
+        const float* lap_rows[2] = {lap.ym1, lap.yp1};
+        max_min_3x3(max_value, min_value, lap_rows, 2, col);
+        
+        // 9 neighbours on each of the other levels
+        if(a.y != NULL) {
+            const float* rows[3] = {a.ym1, a.y, a.yp1};
+            max_min_3x3(max_value, min_value, rows, 3, col);
+        }
+        if(b.y != NULL) {
+            const float* rows[3] = {b.ym1, b.y, b.yp1};
+            max_min_3x3(max_value, min_value, rows, 3, col);
+        }
+        
+        maxima = pass & movemask(vcgtq_f32(value, max_value));
+        minima = pass & movemask(vcltq_f32(value, min_value));
+    }
+    
+#endif
+    
+    /**
+     * Classify the pixels in [COL_BEGIN, COL_END) of the center row of LAP and call
+     * FUNC(col, maxima) for each pixel that is an extrema with respect to the
+     * neighbours in LAP, A and B.
+     */
+    template<typename FUNC>
+    void find_row_extrema(const Neighbourhood& lap,
+                          const Neighbourhood& a,
+                          const Neighbourhood& b,
+                          size_t col_begin,
+                          size_t col_end,
+                          float laplacianSqrThreshold,
+                          const FUNC& func) {
+        size_t col = col_begin;
+#if DOG_SSE2 || DOG_NEON
+#  if DOG_SSE2
+        const __m128 threshold = _mm_set1_ps(laplacianSqrThreshold);
+#  else
+        const float32x4_t threshold = vdupq_n_f32(laplacianSqrThreshold);
+#  endif
+        for(; col+4 <= col_end; col += 4) {
+            int maxima, minima;
+            classify_pixels(maxima, minima, lap, a, b, col, threshold);
+            int extrema = maxima|minima;
+            for(int i = 0; extrema != 0; i++, extrema >>= 1) {
+                if(extrema&1) {
+                    func(col+i, ((maxima>>i)&1) != 0);
+                }
+            }
+        }
+#endif
+        for(; col < col_end; col++) {
+            int result = classify_pixel(lap, a, b, col, laplacianSqrThreshold);
+            if(result != kNotExtremum) {
+                func(col, result == kMaxima);
+            }
+        }
+    }
+    
+    /**
+     * Compare VALUE with the 3x3 samples around (X,Y) spaced STEP pixels apart on
+     * a level of a different size.
+     *
+     * @return True if VALUE is strictly greater (MAXIMA) or less than all samples
+     */
+    inline bool check_interpolated_neighbours(const Image& im,
+                                              float x,
+                                              float y,
+                                              float step,
+                                              float value,
+                                              bool maxima) {
+        for(int i = -1; i <= 1; i++) {
+            for(int j = -1; j <= 1; j++) {
+                float sample = bilinear_interpolation<float>(im, x+j*step, y+i*step);
+                if(maxima ? !(value > sample) : !(value < sample)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    
+} // anonymous namespace
+
 DoGPyramid::DoGPyramid()
 : mNumOctaves(0)
 , mNumScalesPerOctave(0)
+, mThreadPool(NULL)
 {}
 
 void DoGPyramid::alloc(const GaussianScaleSpacePyramid* pyramid) {
@@ -73,16 +383,25 @@ void DoGPyramid::compute(const GaussianScaleSpacePyramid* pyramid) {
     ASSERT(pyramid->numOctaves() > 0, "Pyramid does not contain any levels");
     ASSERT(dynamic_cast<const BinomialPyramid32f*>(pyramid), "Only binomial pyramid is supported");
     
-    for(size_t i = 0; i < mNumOctaves; i++) {
-        for(size_t j = 0; j < mNumScalesPerOctave; j++) {
-            difference_image_binomial(get(i, j),
-                                      pyramid->get(i, j),
-                                      pyramid->get(i, j+1));
-        }
+    // Split every level into bands so the small octaves can run next to the large ones
+    mBands.clear();
+    for(size_t i = 0; i < mImages.size(); i++) {
+        append_row_bands(mBands, mThreadPool, i, 0, mImages[i].height());
     }
+    
+    for_each_index(mThreadPool, mBands.size(), [&](size_t index) {
+        const PyramidRowBand& band = mBands[index];
+        size_t octave = band.level/mNumScalesPerOctave;
+        size_t scale = band.level%mNumScalesPerOctave;
+        difference_image_binomial(get(octave, scale),
+                                  pyramid->get(octave, scale),
+                                  pyramid->get(octave, scale+1),
+                                  band.row_begin,
+                                  band.row_end);
+    });
 }
 
-void DoGPyramid::difference_image_binomial(Image& d, const Image& im1, const Image& im2) {
+void DoGPyramid::difference_image_binomial(Image& d, const Image& im1, const Image& im2, size_t row_begin, size_t row_end) {
     ASSERT(d.type() == IMAGE_F32, "Only F32 images supported");
     ASSERT(im1.type() == IMAGE_F32, "Only F32 images supported");
     ASSERT(im2.type() == IMAGE_F32, "Only F32 images supported");
@@ -93,13 +412,24 @@ void DoGPyramid::difference_image_binomial(Image& d, const Image& im1, const Ima
     ASSERT(d.height() == im2.height(), "Images must have the same height");
     ASSERT(im1.width() == im2.width(), "Images must have the same width");
     ASSERT(im1.height() == im2.height(), "Images must have the same height");
+    ASSERT(row_end <= im1.height(), "Row is out of range");
     
     // Compute diff
-    for(size_t i = 0; i < im1.height(); i++) {
+    for(size_t i = row_begin; i < row_end; i++) {
         float* p0 = d.get<float>(i);
         const float* p1 = im1.get<float>(i);
         const float* p2 = im2.get<float>(i);
-        for(size_t j = 0; j < im1.width(); j++) {
+        size_t j = 0;
+#if DOG_SSE2
+        for(; j+4 <= im1.width(); j += 4) {
+            _mm_storeu_ps(p0+j, _mm_sub_ps(_mm_loadu_ps(p1+j), _mm_loadu_ps(p2+j)));
+        }
+#elif DOG_NEON
+        for(; j+4 <= im1.width(); j += 4) {
+            vst1q_f32(p0+j, vsubq_f32(vld1q_f32(p1+j), vld1q_f32(p2+j)));
+        }
+#endif
+        for(; j < im1.width(); j++) {
             p0[j] = p1[j]-p2[j];
         }
     }
@@ -113,6 +443,7 @@ DoGScaleInvariantDetector::DoGScaleInvariantDetector()
 , mFindOrientation(true)
 , mLaplacianThreshold(0)
 , mEdgeThreshold(10)
+, mThreadPool(NULL)
 , mMaxSubpixelDistanceSqr(3*3) {
     setMaxNumFeaturePoints(kMaxNumFeaturePoints);
     mOrientations.resize(kMaxNumOrientations);
@@ -120,6 +451,15 @@ DoGScaleInvariantDetector::DoGScaleInvariantDetector()
 
 DoGScaleInvariantDetector::~DoGScaleInvariantDetector() {}
 
+void DoGScaleInvariantDetector::setThreadPool(ThreadPool* pool) {
+    mThreadPool = pool;
+    mLaplacianPyramid.setThreadPool(pool);
+}
+
+void DoGScaleInvariantDetector::setSkipRegions(const SkipRegion* regions, size_t num) {
+    mSkipRegions.assign(regions, regions+num);
+}
+
 void DoGScaleInvariantDetector::alloc(const GaussianScaleSpacePyramid* pyramid) {
     mLaplacianPyramid.alloc(pyramid);
     
@@ -156,6 +496,13 @@ void DoGScaleInvariantDetector::detect(const GaussianScaleSpacePyramid* pyramid)
         extractFeatures(pyramid, &mLaplacianPyramid);
     }
     
+    // Drop the candidates in the skip regions
+    if(!mSkipRegions.empty()) {
+        TIMED("Skip regions") {
+            removeSkippedFeatures();
+        }
+    }
+    
     // Sub-pixel refinement
     TIMED("Subpixel") {
         findSubpixelLocations(pyramid);
@@ -178,270 +525,155 @@ void DoGScaleInvariantDetector::extractFeatures(const GaussianScaleSpacePyramid*
     // Clear old features
     mFeaturePoints.clear();
     
-    float laplacianSqrThreshold = sqr(mLaplacianThreshold);
+    if(laplacian->size() < 3) {
+        return;
+    }
     
-    for(size_t i = 1; i < mLaplacianPyramid.size()-1; i++) {
+    // Split the interior levels into bands of rows. Each band only reads the
+    // Laplacian images, so the bands can be searched in any order.
+    mExtractionBands.clear();
+    for(size_t i = 1; i < laplacian->size()-1; i++) {
         const Image& im0 = laplacian->get(i-1);
         const Image& im1 = laplacian->get(i);
         const Image& im2 = laplacian->get(i+1);
         
-        int octave = laplacian->octaveFromIndex((int)i);
-        int scale = laplacian->scaleFromIndex((int)i);
-        
-        if(im0.width() == im1.width() && im0.width() == im2.width()) { // All images are the same size
-            ASSERT(im0.height() == im1.height(), "Height is inconsistent");
-            ASSERT(im0.height() == im2.height(), "Height is inconsistent");
-            
-            size_t width_minus_1 = im1.width() - 1;
-            size_t heigh_minus_1 = im1.height() - 1;
-            
-            for(size_t row = 1; row < heigh_minus_1; row++) {
-                const float* im0_ym1 = im0.get<float>(row-1);
-                const float* im0_y   = im0.get<float>(row);
-                const float* im0_yp1 = im0.get<float>(row+1);
-                
-                const float* im1_ym1 = im1.get<float>(row-1);
-                const float* im1_y   = im1.get<float>(row);
-                const float* im1_yp1 = im1.get<float>(row+1);
-                
-                const float* im2_ym1 = im2.get<float>(row-1);
-                const float* im2_y   = im2.get<float>(row);
-                const float* im2_yp1 = im2.get<float>(row+1);
-                
-                for(size_t col = 1; col < width_minus_1; col++) {
-                    const float& value = im1_y[col];
-                    FeaturePoint fp;
-                    
-                    // Check laplacian score
-                    if(sqr(value) < laplacianSqrThreshold) {
-                        continue;
-                    }
-                    
-#define NONMAX_CHECK(OPERATOR, VALUE)                  \
-                    /* im0 - 9 evaluations */          \
-                    VALUE OPERATOR im0_ym1[col-1]   && \
-                    VALUE OPERATOR im0_ym1[col]     && \
-                    VALUE OPERATOR im0_ym1[col+1]   && \
-                    VALUE OPERATOR im0_y[col-1]     && \
-                    VALUE OPERATOR im0_y[col]       && \
-                    VALUE OPERATOR im0_y[col+1]     && \
-                    VALUE OPERATOR im0_yp1[col-1]   && \
-                    VALUE OPERATOR im0_yp1[col]     && \
-                    VALUE OPERATOR im0_yp1[col+1]   && \
-                    /* im1 - 8 evaluations */          \
-                    VALUE OPERATOR im1_ym1[col-1]   && \
-                    VALUE OPERATOR im1_ym1[col]     && \
-                    VALUE OPERATOR im1_ym1[col+1]   && \
-                    VALUE OPERATOR im1_y[col-1]     && \
-                    VALUE OPERATOR im1_y[col+1]     && \
-                    VALUE OPERATOR im1_yp1[col-1]   && \
-                    VALUE OPERATOR im1_yp1[col]     && \
-                    VALUE OPERATOR im1_yp1[col+1]   && \
-                    /* im2 - 9 evaluations */          \
-                    VALUE OPERATOR im2_ym1[col-1]   && \
-                    VALUE OPERATOR im2_ym1[col]     && \
-                    VALUE OPERATOR im2_ym1[col+1]   && \
-                    VALUE OPERATOR im2_y[col-1]     && \
-                    VALUE OPERATOR im2_y[col]       && \
-                    VALUE OPERATOR im2_y[col+1]     && \
-                    VALUE OPERATOR im2_yp1[col-1]   && \
-                    VALUE OPERATOR im2_yp1[col]     && \
-                    VALUE OPERATOR im2_yp1[col+1]
-                    
-                    bool extrema = false;
-                    if(NONMAX_CHECK(>, value)) { // strictly greater than
-                        extrema = true;
-                    } else if(NONMAX_CHECK(<, value)) { // strictly less than
-                        extrema = true;
-                    }
-                    
-                    if(extrema) {
-                        fp.octave = octave;
-                        fp.scale  = scale;
-                        fp.score  = value;
-                        fp.sigma  = pyramid->effectiveSigma(octave, scale);
-                        
-                        bilinear_upsample_point(fp.x,
-                                                fp.y,
-                                                col,
-                                                row,
-                                                octave);
-                        
-                        mFeaturePoints.push_back(fp);
-                    }
-                    
-#undef NONMAX_CHECK
-                }
-            }
-        } else if(im0.width() == im1.width() && (im1.width()>>1) == im2.width()) { // 0,1 are the same size, 2 is half size
-            ASSERT(im0.height() == im1.height(), "Height is inconsistent");
-            ASSERT((im1.height()>>1) == im2.height(), "Height is inconsistent");
-    
-            size_t end_x = std::floor(((im2.width()-1)-0.5f)*2.f+0.5f);
+        if(im0.width() == im1.width() && (im1.width()>>1) == im2.width()) {
             size_t end_y = std::floor(((im2.height()-1)-0.5f)*2.f+0.5f);
+            append_row_bands(mExtractionBands, mThreadPool, i, 2, end_y);
+        } else {
+            append_row_bands(mExtractionBands, mThreadPool, i, 1, im1.height()-1);
+        }
+    }
+    
+    if(mBandFeaturePoints.size() < mExtractionBands.size()) {
+        mBandFeaturePoints.resize(mExtractionBands.size());
+    }
+    
+    for_each_index(mThreadPool, mExtractionBands.size(), [&](size_t index) {
+        mBandFeaturePoints[index].clear();
+        extractFeatures(mBandFeaturePoints[index], pyramid, laplacian, mExtractionBands[index]);
+    });
+    
+    // Merge in band order, so the points are in the same order as a single pass
+    for(size_t i = 0; i < mExtractionBands.size(); i++) {
+        mFeaturePoints.insert(mFeaturePoints.end(), mBandFeaturePoints[i].begin(), mBandFeaturePoints[i].end());
+    }
+}
 
-            for(size_t row = 2; row < end_y; row++) {
-                const float* im0_ym1 = im0.get<float>(row-1);
-                const float* im0_y   = im0.get<float>(row);
-                const float* im0_yp1 = im0.get<float>(row+1);
-                
-                const float* im1_ym1 = im1.get<float>(row-1);
-                const float* im1_y   = im1.get<float>(row);
-                const float* im1_yp1 = im1.get<float>(row+1);
-
-                for(size_t col = 2; col < end_x; col++) {
-                    const float& value = im1_y[col];
-                    FeaturePoint fp;
-                    
-                    // Check laplacian score
-                    if(sqr(value) < laplacianSqrThreshold) {
-                        continue;
-                    }
-                    
-                    // Compute downsampled point location
-                    float ds_x = col*0.5f-0.25f;
-                    float ds_y = row*0.5f-0.25f;
-                                        
-#define NONMAX_CHECK(OPERATOR, VALUE)                  \
-                    /* im0 - 9 evaluations */          \
-                    VALUE OPERATOR im0_ym1[col-1]   && \
-                    VALUE OPERATOR im0_ym1[col]     && \
-                    VALUE OPERATOR im0_ym1[col+1]   && \
-                    VALUE OPERATOR im0_y[col-1]     && \
-                    VALUE OPERATOR im0_y[col]       && \
-                    VALUE OPERATOR im0_y[col+1]     && \
-                    VALUE OPERATOR im0_yp1[col-1]   && \
-                    VALUE OPERATOR im0_yp1[col]     && \
-                    VALUE OPERATOR im0_yp1[col+1]   && \
-                    /* im1 - 8 evaluations */          \
-                    VALUE OPERATOR im1_ym1[col-1]   && \
-                    VALUE OPERATOR im1_ym1[col]     && \
-                    VALUE OPERATOR im1_ym1[col+1]   && \
-                    VALUE OPERATOR im1_y[col-1]     && \
-                    VALUE OPERATOR im1_y[col+1]     && \
-                    VALUE OPERATOR im1_yp1[col-1]   && \
-                    VALUE OPERATOR im1_yp1[col]     && \
-                    VALUE OPERATOR im1_yp1[col+1]   && \
-                    /* im2 - 9 evaluations */          \
-                    VALUE OPERATOR bilinear_interpolation<float>(im2, ds_x-0.5f, ds_y-0.5f)   && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im2, ds_x,      ds_y-0.5f)   && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im2, ds_x+0.5f, ds_y-0.5f)   && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im2, ds_x-0.5f, ds_y)        && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im2, ds_x,      ds_y)        && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im2, ds_x+0.5f, ds_y)        && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im2, ds_x-0.5f, ds_y+0.5f)   && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im2, ds_x,      ds_y+0.5f)   && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im2, ds_x+0.5f, ds_y+0.5f)
-
-                    bool extrema = false;
-                    if(NONMAX_CHECK(>, value)) { // strictly greater than
-                        extrema = true;
-                    } else if(NONMAX_CHECK(<, value)) { // strictly less than
-                        extrema = true;
-                    }
-                    
-                    if(extrema) {
-                        fp.octave = octave;
-                        fp.scale  = scale;
-                        fp.score  = value;
-                        fp.sigma  = pyramid->effectiveSigma(octave, scale);
-                        
-                        bilinear_upsample_point(fp.x,
-                                                fp.y,
-                                                col,
-                                                row,
-                                                octave);
-                        
-                        mFeaturePoints.push_back(fp);
-                    }
-                    
-#undef NONMAX_CHECK
-                }
-            }
-        } else if((im0.width()>>1) == im1.width() && (im0.width()>>1) == im2.width()) { // 0 is twice the size of 1 and 2
-            ASSERT((im0.height()>>1) == im1.height(), "Height is inconsistent");
-            ASSERT((im0.height()>>1) == im2.height(), "Height is inconsistent");
+void DoGScaleInvariantDetector::extractFeatures(std::vector<FeaturePoint>& points,
+                                                const GaussianScaleSpacePyramid* pyramid,
+                                                const DoGPyramid* laplacian,
+                                                const PyramidRowBand& band) const {
+    
+    float laplacianSqrThreshold = sqr(mLaplacianThreshold);
+    
+    const size_t i = band.level;
+    const Image& im0 = laplacian->get(i-1);
+    const Image& im1 = laplacian->get(i);
+    const Image& im2 = laplacian->get(i+1);
+    
+    int octave = laplacian->octaveFromIndex((int)i);
+    int scale = laplacian->scaleFromIndex((int)i);
+    float sigma = pyramid->effectiveSigma(octave, scale);
+    
+    FeaturePoint fp;
+    fp.octave = octave;
+    fp.scale  = scale;
+    fp.sigma  = sigma;
+    
+    if(im0.width() == im1.width() && im0.width() == im2.width()) { // All images are the same size
+        ASSERT(im0.height() == im1.height(), "Height is inconsistent");
+        ASSERT(im0.height() == im2.height(), "Height is inconsistent");
+        
+        size_t width_minus_1 = im1.width() - 1;
+        
+        for(size_t row = band.row_begin; row < band.row_end; row++) {
+            Neighbourhood lap(im1, row);
+            find_row_extrema(lap,
+                             Neighbourhood(im0, row),
+                             Neighbourhood(im2, row),
+                             1,
+                             width_minus_1,
+                             laplacianSqrThreshold,
+                             [&](size_t col, bool) {
+                                 fp.score = lap.y[col];
+                                 bilinear_upsample_point(fp.x,
+                                                         fp.y,
+                                                         col,
+                                                         row,
+                                                         octave);
+                                 points.push_back(fp);
+                             });
+        }
+    } else if(im0.width() == im1.width() && (im1.width()>>1) == im2.width()) { // 0,1 are the same size, 2 is half size
+        ASSERT(im0.height() == im1.height(), "Height is inconsistent");
+        ASSERT((im1.height()>>1) == im2.height(), "Height is inconsistent");
+        
+        size_t end_x = std::floor(((im2.width()-1)-0.5f)*2.f+0.5f);
+        
+        for(size_t row = band.row_begin; row < band.row_end; row++) {
+            Neighbourhood lap(im1, row);
             
-            size_t width_minus_1 = im1.width() - 1;
-            size_t height_minus_1 = im1.height() - 1;
+            // The same size level rejects most pixels before any interpolation
+            find_row_extrema(lap,
+                             Neighbourhood(im0, row),
+                             Neighbourhood(),
+                             2,
+                             end_x,
+                             laplacianSqrThreshold,
+                             [&](size_t col, bool maxima) {
+                                 const float value = lap.y[col];
+                                 
+                                 // Compute downsampled point location
+                                 float ds_x = col*0.5f-0.25f;
+                                 float ds_y = row*0.5f-0.25f;
+                                 
+                                 if(!check_interpolated_neighbours(im2, ds_x, ds_y, 0.5f, value, maxima)) {
+                                     return;
+                                 }
+                                 
+                                 fp.score = value;
+                                 bilinear_upsample_point(fp.x,
+                                                         fp.y,
+                                                         col,
+                                                         row,
+                                                         octave);
+                                 points.push_back(fp);
+                             });
+        }
+    } else if((im0.width()>>1) == im1.width() && (im0.width()>>1) == im2.width()) { // 0 is twice the size of 1 and 2
+        ASSERT((im0.height()>>1) == im1.height(), "Height is inconsistent");
+        ASSERT((im0.height()>>1) == im2.height(), "Height is inconsistent");
+        
+        size_t width_minus_1 = im1.width() - 1;
+        
+        for(size_t row = band.row_begin; row < band.row_end; row++) {
+            Neighbourhood lap(im1, row);
             
-            for(size_t row = 1; row < height_minus_1; row++) {
-                const float* im1_ym1 = im1.get<float>(row-1);
-                const float* im1_y   = im1.get<float>(row);
-                const float* im1_yp1 = im1.get<float>(row+1);
-                
-                const float* im2_ym1 = im2.get<float>(row-1);
-                const float* im2_y   = im2.get<float>(row);
-                const float* im2_yp1 = im2.get<float>(row+1);
-                
-                for(size_t col = 1; col < width_minus_1; col++) {
-                    const float& value = im1_y[col];
-                    FeaturePoint fp;
-                    
-                    // Check laplacian score
-                    if(sqr(value) < laplacianSqrThreshold) {
-                        continue;
-                    }
-                    
-                    float us_x = (col<<1)+0.5f;
-                    float us_y = (row<<1)+0.5f;
-                    
-#define NONMAX_CHECK(OPERATOR, VALUE)                  \
-                    /* im1 - 8 evaluations */          \
-                    VALUE OPERATOR im1_ym1[col-1]   && \
-                    VALUE OPERATOR im1_ym1[col]     && \
-                    VALUE OPERATOR im1_ym1[col+1]   && \
-                    VALUE OPERATOR im1_y[col-1]     && \
-                    VALUE OPERATOR im1_y[col+1]     && \
-                    VALUE OPERATOR im1_yp1[col-1]   && \
-                    VALUE OPERATOR im1_yp1[col]     && \
-                    VALUE OPERATOR im1_yp1[col+1]   && \
-                    /* im2 - 9 evaluations */          \
-                    VALUE OPERATOR im2_ym1[col-1]   && \
-                    VALUE OPERATOR im2_ym1[col]     && \
-                    VALUE OPERATOR im2_ym1[col+1]   && \
-                    VALUE OPERATOR im2_y[col-1]     && \
-                    VALUE OPERATOR im2_y[col]       && \
-                    VALUE OPERATOR im2_y[col+1]     && \
-                    VALUE OPERATOR im2_yp1[col-1]   && \
-                    VALUE OPERATOR im2_yp1[col]     && \
-                    VALUE OPERATOR im2_yp1[col+1]   && \
-                    /* im2 - 9 evaluations */          \
-                    VALUE OPERATOR bilinear_interpolation<float>(im0, us_x-2.f, us_y-2.f)   && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im0, us_x,     us_y-2.f)   && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im0, us_x+2.f, us_y-2.f)   && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im0, us_x-2.f, us_y)       && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im0, us_x,     us_y)       && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im0, us_x+2.f, us_y)       && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im0, us_x-2.f, us_y+2.f)   && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im0, us_x,     us_y+2.f)   && \
-                    VALUE OPERATOR bilinear_interpolation<float>(im0, us_x+2.f, us_y+2.f)
-                    
-                    bool extrema = false;
-                    if(NONMAX_CHECK(>, value)) { // strictly greater than
-                        extrema = true;
-                    } else if(NONMAX_CHECK(<, value)) { // strictly less than
-                        extrema = true;
-                    }
-                    
-                    if(extrema) {
-                        fp.octave = octave;
-                        fp.scale  = scale;
-                        fp.score  = value;
-                        fp.sigma  = pyramid->effectiveSigma(octave, scale);
-                        
-                        bilinear_upsample_point(fp.x,
-                                                fp.y,
-                                                col,
-                                                row,
-                                                octave);
-                        
-                        mFeaturePoints.push_back(fp);
-                    }
-                    
-#undef NONMAX_CHECK
-                }
-            }
+            find_row_extrema(lap,
+                             Neighbourhood(im2, row),
+                             Neighbourhood(),
+                             1,
+                             width_minus_1,
+                             laplacianSqrThreshold,
+                             [&](size_t col, bool maxima) {
+                                 const float value = lap.y[col];
+                                 
+                                 float us_x = (col<<1)+0.5f;
+                                 float us_y = (row<<1)+0.5f;
+                                 
+                                 if(!check_interpolated_neighbours(im0, us_x, us_y, 2.f, value, maxima)) {
+                                     return;
+                                 }
+                                 
+                                 fp.score = value;
+                                 bilinear_upsample_point(fp.x,
+                                                         fp.y,
+                                                         col,
+                                                         row,
+                                                         octave);
+                                 points.push_back(fp);
+                             });
         }
     }
 }
@@ -454,9 +686,8 @@ void DoGScaleInvariantDetector::pruneFeatures() {
     ASSERT(mBuckets.size() == mNumBucketsX, "Buckets are not allocated");
     ASSERT(mBuckets[0].size() == mNumBucketsY, "Buckets are not allocated");
     
-    std::vector<FeaturePoint> points;
     PruneDoGFeatures(mBuckets,
-                     points,
+                     mTmpPrunedFeaturePoints,
                      mFeaturePoints,
                      (int)mNumBucketsX,
                      (int)mNumBucketsY,
@@ -464,11 +695,31 @@ void DoGScaleInvariantDetector::pruneFeatures() {
                      (int)mHeight,
                      (int)mMaxNumFeaturePoints);
     
-    mFeaturePoints.swap(points);
+    mFeaturePoints.swap(mTmpPrunedFeaturePoints);
     
     ASSERT(mFeaturePoints.size() <= mMaxNumFeaturePoints, "Too many feature points");
 }
 
+void DoGScaleInvariantDetector::removeSkippedFeatures() {
+    size_t num_points = 0;
+    for(size_t i = 0; i < mFeaturePoints.size(); i++) {
+        const float p[2] = {mFeaturePoints[i].x, mFeaturePoints[i].y};
+        
+        size_t j;
+        for(j = 0; j < mSkipRegions.size(); j++) {
+            const SkipRegion& r = mSkipRegions[j];
+            if(QuadrilateralContainsPoint(r.vertex[0], r.vertex[1], r.vertex[2], r.vertex[3], p)) {
+                break;
+            }
+        }
+        if(j == mSkipRegions.size()) {
+            mFeaturePoints[num_points++] = mFeaturePoints[i];
+        }
+    }
+    
+    mFeaturePoints.resize(num_points);
+}
+
 void DoGScaleInvariantDetector::findSubpixelLocations(const GaussianScaleSpacePyramid* pyramid) {
     float A[9];
     float b[3];
@@ -44,6 +44,28 @@
 
 namespace vision {
     
+    class ThreadPool;
+    
+    /**
+     * A band of rows of one level in a pyramid. Used to split the work on a
+     * pyramid into independent jobs.
+     */
+    struct PyramidRowBand {
+        size_t level;
+        size_t row_begin;
+        size_t row_end;
+    }; // PyramidRowBand
+    
+    /**
+     * A convex quadrilateral of an image in which no feature points are
+     * detected, e.g. the area covered by a target that is already tracked.
+     * The corners are in order around the edge, in the coordinates of the
+     * first level of the pyramid.
+     */
+    struct SkipRegion {
+        float vertex[4][2];
+    }; // SkipRegion
+    
     /**
      * Computes a Difference-of-Gaussian Pyramid from a Gaussian Pyramid.
      */
@@ -100,6 +122,11 @@ namespace vision {
          */
         inline int scaleFromIndex(int index) const { return index%mNumScalesPerOctave; }
         
+        /**
+         * Set the thread pool used to compute the levels. May be NULL.
+         */
+        inline void setThreadPool(ThreadPool* pool) { mThreadPool = pool; }
+        
     private:
         
         // DoG images
@@ -109,12 +136,18 @@ namespace vision {
         int mNumOctaves;
         int mNumScalesPerOctave;
         
+        // Thread pool used to compute the levels
+        ThreadPool* mThreadPool;
+        
+        // Row bands of all levels, computed in parallel
+        std::vector<PyramidRowBand> mBands;
+        
         /**
          * Compute the difference image.
          *
          * d = im1 - im2
          */
-        void difference_image_binomial(Image& d, const Image& im1, const Image& im2);
+        void difference_image_binomial(Image& d, const Image& im1, const Image& im2, size_t row_begin, size_t row_end);
     };
     
     class DoGScaleInvariantDetector {
@@ -204,6 +237,21 @@ namespace vision {
          */
         inline const DoGPyramid& dogPyramid() const { return mLaplacianPyramid; }
         
+        /**
+         * Set the thread pool used to compute the DoG pyramid and to find the
+         * extrema. May be NULL.
+         */
+        void setThreadPool(ThreadPool* pool);
+        
+        /**
+         * Set the regions in which no feature points are detected. Candidates
+         * inside a region are dropped before sub-pixel refinement and pruning, so
+         * the maximum number of feature points goes to the rest of the image. The
+         * regions apply to every detection until they are set again.
+         */
+        void setSkipRegions(const SkipRegion* regions, size_t num);
+        inline const std::vector<SkipRegion>& skipRegions() const { return mSkipRegions; }
+        
     private:
         
         // Width/Height of configured image
@@ -232,9 +280,22 @@ namespace vision {
         // Vector of extracted feature points
         std::vector<FeaturePoint> mFeaturePoints;
         
+        // Thread pool used for detection
+        ThreadPool* mThreadPool;
+        
+        // Row bands of the interior Laplacian levels, and the extrema found in each
+        std::vector<PyramidRowBand> mExtractionBands;
+        std::vector<std::vector<FeaturePoint> > mBandFeaturePoints;
+        
         // Tmp vector of extracted feature points that have orientation values
         std::vector<FeaturePoint> mTmpOrientatedFeaturePoints;
         
+        // Tmp vector of feature points that survive pruning
+        std::vector<FeaturePoint> mTmpPrunedFeaturePoints;
+        
+        // Regions in which no feature points are detected
+        std::vector<SkipRegion> mSkipRegions;
+        
         // Maximum number of feature points
         size_t mMaxNumFeaturePoints;
         
@@ -254,6 +315,19 @@ namespace vision {
         void extractFeatures(const GaussianScaleSpacePyramid* pyramid,
                              const DoGPyramid* laplacian);
         
+        /**
+         * Extract the minima/maxima in a band of rows of a Laplacian level.
+         */
+        void extractFeatures(std::vector<FeaturePoint>& points,
+                             const GaussianScaleSpacePyramid* pyramid,
+                             const DoGPyramid* laplacian,
+                             const PyramidRowBand& band) const;
+        
+        /**
+         * Drop the feature points inside the skip regions.
+         */
+        void removeSkippedFeatures();
+        
         /**
          * Sub-pixel refinement.
          */
@@ -35,248 +35,573 @@
 
 #include "gaussian_scale_space_pyramid.h"
 #include <framework/error.h>
+#include <framework/thread_pool.h>
+#include <algorithm>
+#include <cstring>
 //#include <framework/logger.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define PYRAMID_SSE2 1
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#  define PYRAMID_NEON 1
+#  include <arm_neon.h>
+#endif
+
 using namespace vision;
 
 namespace vision {
-
-    void binomial_4th_order(float* dst,
-                            unsigned short* tmp,
-                            const unsigned char* src,
-                            size_t width,
-                            size_t height) {
-        unsigned short* tmp_ptr;
-        float* dst_ptr;
+    
+    namespace {
         
-        size_t width_minus_1, width_minus_2;
-        size_t height_minus_2;
+        // Minimum number of rows given to a thread
+        const size_t kMinRowsPerBand = 16;
         
-        ASSERT(width >= 5, "Image is too small");
-        ASSERT(height >= 5, "Image is too small");
+        /**
+         * @return Number of bands ROWS are split into on POOL.
+         */
+        inline int num_row_bands(ThreadPool* pool, size_t rows) {
+            if(pool == NULL) {
+                return 1;
+            }
+            return std::max<int>(1, (int)std::min<size_t>(pool->concurrency(), rows/kMinRowsPerBand));
+        }
         
-        width_minus_1 = width-1;
-        width_minus_2 = width-2;
-        height_minus_2 = height-2;
+        /**
+         * Split ROWS into bands and call FUNC(band, row_begin, row_end) for each band,
+         * on POOL if there is one.
+         */
+        template<typename FUNC>
+        void for_each_indexed_row_band(ThreadPool* pool, size_t rows, const FUNC& func) {
+            int num_bands = num_row_bands(pool, rows);
+            if(num_bands <= 1) {
+                func(0, 0, rows);
+                return;
+            }
+            pool->parallelFor(num_bands, [&](int band, int) {
+                func(band, rows*band/num_bands, rows*(band+1)/num_bands);
+            });
+        }
         
-        tmp_ptr = tmp;
+        /**
+         * Split ROWS into bands and call FUNC(row_begin, row_end) for each band, on
+         * POOL if there is one.
+         */
+        template<typename FUNC>
+        void for_each_row_band(ThreadPool* pool, size_t rows, const FUNC& func) {
+            for_each_indexed_row_band(pool, rows, [&](int, size_t row_begin, size_t row_end) {
+                func(row_begin, row_end);
+            });
+        }
         
-        // Apply horizontal filter
-        for(size_t row = 0; row < height; row++) {
-            const unsigned char* src_ptr = &src[row*width];
+        /**
+         * Apply the horizontal 1-4-6-4-1 filter to a row. The border is extended by
+         * repeating the first and last pixels.
+         */
+        inline void binomial_horizontal_row(unsigned short* dst, const unsigned char* src, size_t width) {
+            const size_t width_minus_1 = width-1;
+            const size_t width_minus_2 = width-2;
             
             // Left border is computed by extending the border pixel beyond the image
-            *(tmp_ptr++) = ((src_ptr[0]<<1)+(src_ptr[0]<<2)) + ((src_ptr[0]+src_ptr[1])<<2) + (src_ptr[0]+src_ptr[2]);
-            *(tmp_ptr++) = ((src_ptr[1]<<1)+(src_ptr[1]<<2)) + ((src_ptr[0]+src_ptr[2])<<2) + (src_ptr[0]+src_ptr[3]);
+            dst[0] = ((src[0]<<1)+(src[0]<<2)) + ((src[0]+src[1])<<2) + (src[0]+src[2]);
+            dst[1] = ((src[1]<<1)+(src[1]<<2)) + ((src[0]+src[2])<<2) + (src[0]+src[3]);
             
-            // Compute non-border pixels
-            for(size_t col = 2; col < width_minus_2; col++, tmp_ptr++) {
-                *tmp_ptr = ((src_ptr[col]<<1)+(src_ptr[col]<<2)) + ((src_ptr[col-1]+src_ptr[col+1])<<2) + (src_ptr[col-2]+src_ptr[col+2]);
+            // Compute non-border pixels. The sums fit in 16 bits.
+            size_t col = 2;
+#if PYRAMID_SSE2
+            const __m128i zero = _mm_setzero_si128();
+            for(; col+8 <= width_minus_2; col += 8) {
+                __m128i m2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+col-2)), zero);
+                __m128i m1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+col-1)), zero);
+                __m128i c  = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+col)), zero);
+                __m128i p1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+col+1)), zero);
+                __m128i p2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+col+2)), zero);
+                __m128i r = _mm_add_epi16(_mm_slli_epi16(c, 1), _mm_slli_epi16(c, 2));
+                r = _mm_add_epi16(r, _mm_slli_epi16(_mm_add_epi16(m1, p1), 2));
+                r = _mm_add_epi16(r, _mm_add_epi16(m2, p2));
+                _mm_storeu_si128((__m128i*)(dst+col), r);
+            }
+#elif PYRAMID_NEON
+            for(; col+8 <= width_minus_2; col += 8) {
+                uint16x8_t m2 = vmovl_u8(vld1_u8(src+col-2));
+                uint16x8_t m1 = vmovl_u8(vld1_u8(src+col-1));
+                uint16x8_t c  = vmovl_u8(vld1_u8(src+col));
+                uint16x8_t p1 = vmovl_u8(vld1_u8(src+col+1));
+                uint16x8_t p2 = vmovl_u8(vld1_u8(src+col+2));
+                uint16x8_t r = vaddq_u16(vshlq_n_u16(c, 1), vshlq_n_u16(c, 2));
+                r = vaddq_u16(r, vshlq_n_u16(vaddq_u16(m1, p1), 2));
+                r = vaddq_u16(r, vaddq_u16(m2, p2));
+                vst1q_u16(dst+col, r);
+            }
+#endif
+            for(; col < width_minus_2; col++) {
+                dst[col] = ((src[col]<<1)+(src[col]<<2)) + ((src[col-1]+src[col+1])<<2) + (src[col-2]+src[col+2]);
             }
             
             // Right border. Computed similarily as the left border.
-            *(tmp_ptr++) = ((src_ptr[width_minus_2]<<1)+(src_ptr[width_minus_2]<<2)) + ((src_ptr[width_minus_2-1]+src_ptr[width_minus_2+1])<<2) + (src_ptr[width_minus_2-2]+src_ptr[width_minus_2+1]);
-            *(tmp_ptr++) = ((src_ptr[width_minus_1]<<1)+(src_ptr[width_minus_1]<<2)) + ((src_ptr[width_minus_1-1]+src_ptr[width_minus_1])<<2)   + (src_ptr[width_minus_1-2]+src_ptr[width_minus_1]);
+            dst[width_minus_2] = ((src[width_minus_2]<<1)+(src[width_minus_2]<<2)) + ((src[width_minus_2-1]+src[width_minus_2+1])<<2) + (src[width_minus_2-2]+src[width_minus_2+1]);
+            dst[width_minus_1] = ((src[width_minus_1]<<1)+(src[width_minus_1]<<2)) + ((src[width_minus_1-1]+src[width_minus_1])<<2)   + (src[width_minus_1-2]+src[width_minus_1]);
         }
         
-        const unsigned short* pm2;
-        const unsigned short* pm1;
-        const unsigned short* p;
-        const unsigned short* pp1;
-        const unsigned short* pp2;
+        inline void binomial_horizontal_row(float* dst, const float* src, size_t width) {
+            const size_t width_minus_1 = width-1;
+            const size_t width_minus_2 = width-2;
+            
+            // Left border is computed by extending the border pixel beyond the image
+            dst[0] = 6.f*src[0] + 4.f*(src[0]+src[1]) + src[0] + src[2];
+            dst[1] = 6.f*src[1] + 4.f*(src[0]+src[2]) + src[0] + src[3];
+            
+            // Compute non-border pixels. The vector code adds in the same order as
+            // the scalar code, so the results are identical.
+            size_t col = 2;
+#if PYRAMID_SSE2
+            const __m128 six = _mm_set1_ps(6.f);
+            const __m128 four = _mm_set1_ps(4.f);
+            for(; col+4 <= width_minus_2; col += 4) {
+                __m128 r = _mm_mul_ps(six, _mm_loadu_ps(src+col));
+                r = _mm_add_ps(r, _mm_mul_ps(four, _mm_add_ps(_mm_loadu_ps(src+col-1), _mm_loadu_ps(src+col+1))));
+                r = _mm_add_ps(r, _mm_loadu_ps(src+col-2));
+                r = _mm_add_ps(r, _mm_loadu_ps(src+col+2));
+                _mm_storeu_ps(dst+col, r);
+            }
+#elif PYRAMID_NEON
+            for(; col+4 <= width_minus_2; col += 4) {
+                float32x4_t r = vmulq_n_f32(vld1q_f32(src+col), 6.f);
+                r = vaddq_f32(r, vmulq_n_f32(vaddq_f32(vld1q_f32(src+col-1), vld1q_f32(src+col+1)), 4.f));
+                r = vaddq_f32(r, vld1q_f32(src+col-2));
+                r = vaddq_f32(r, vld1q_f32(src+col+2));
+                vst1q_f32(dst+col, r);
+            }
+#endif
+            for(; col < width_minus_2; col++) {
+                dst[col] = (6.f*src[col] + 4.f*(src[col-1]+src[col+1]) + src[col-2] + src[col+2]);
+            }
+            
+            // Right border. Computed similarily as the left border.
+            dst[width_minus_2] = 6.f*src[width_minus_2] + 4.f*(src[width_minus_2-1]+src[width_minus_2+1]) + src[width_minus_2-2] + src[width_minus_2+1];
+            dst[width_minus_1] = 6.f*src[width_minus_1] + 4.f*(src[width_minus_1-1]+src[width_minus_1])   + src[width_minus_1-2] + src[width_minus_1];
+        }
         
-        // Apply vertical filter along top border. This is applied twice as there are two
-        // border pixels.
-        pm2     = tmp;
-        pm1     = tmp;
-        p       = tmp;
-        pp1     = p+width;
-        pp2     = pp1+width;
-        dst_ptr = dst;
+        /**
+         * Apply the vertical 1-4-6-4-1 filter to the rows PM2..PP2 and normalize.
+         */
+        inline void binomial_vertical_row(float* dst,
+                                          const unsigned short* pm2,
+                                          const unsigned short* pm1,
+                                          const unsigned short* p,
+                                          const unsigned short* pp1,
+                                          const unsigned short* pp2,
+                                          size_t width) {
+            size_t col = 0;
+#if PYRAMID_SSE2
+            // The sums are at most 16*16*255 so they fit in 16 bits
+            const __m128i zero = _mm_setzero_si128();
+            const __m128 scale = _mm_set1_ps(1.f/256.f);
+            for(; col+8 <= width; col += 8) {
+                __m128i c = _mm_loadu_si128((const __m128i*)(p+col));
+                __m128i r = _mm_add_epi16(_mm_slli_epi16(c, 1), _mm_slli_epi16(c, 2));
+                r = _mm_add_epi16(r, _mm_slli_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i*)(pm1+col)),
+                                                                  _mm_loadu_si128((const __m128i*)(pp1+col))), 2));
+                r = _mm_add_epi16(r, _mm_add_epi16(_mm_loadu_si128((const __m128i*)(pm2+col)),
+                                                   _mm_loadu_si128((const __m128i*)(pp2+col))));
+                _mm_storeu_ps(dst+col,   _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(r, zero)), scale));
+                _mm_storeu_ps(dst+col+4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(r, zero)), scale));
+            }
+#elif PYRAMID_NEON
+            for(; col+8 <= width; col += 8) {
+                uint16x8_t c = vld1q_u16(p+col);
+                uint16x8_t r = vaddq_u16(vshlq_n_u16(c, 1), vshlq_n_u16(c, 2));
+                r = vaddq_u16(r, vshlq_n_u16(vaddq_u16(vld1q_u16(pm1+col), vld1q_u16(pp1+col)), 2));
+                r = vaddq_u16(r, vaddq_u16(vld1q_u16(pm2+col), vld1q_u16(pp2+col)));
+                vst1q_f32(dst+col,   vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(r))), 1.f/256.f));
+                vst1q_f32(dst+col+4, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(r))), 1.f/256.f));
+            }
+#endif
+            for(; col < width; col++) {
+                dst[col] = (((p[col]<<1)+(p[col]<<2)) + ((pm1[col]+pp1[col])<<2) + (pm2[col]+pp2[col]))*(1.f/256.f);
+            }
+        }
         
-        for(size_t col = 0; col < width; col++, dst_ptr++, pm2++, pm1++, p++, pp1++, pp2++) {
-            *dst_ptr = (((*p<<1)+(*p<<2)) + ((*pm1+*pp1)<<2) + (*pm2+*pp2))*(1.f/256.f);
+        inline void binomial_vertical_row(float* dst,
+                                          const float* pm2,
+                                          const float* pm1,
+                                          const float* p,
+                                          const float* pp1,
+                                          const float* pp2,
+                                          size_t width) {
+            size_t col = 0;
+#if PYRAMID_SSE2
+            const __m128 six = _mm_set1_ps(6.f);
+            const __m128 four = _mm_set1_ps(4.f);
+            const __m128 scale = _mm_set1_ps(1.f/256.f);
+            for(; col+4 <= width; col += 4) {
+                __m128 r = _mm_mul_ps(six, _mm_loadu_ps(p+col));
+                r = _mm_add_ps(r, _mm_mul_ps(four, _mm_add_ps(_mm_loadu_ps(pm1+col), _mm_loadu_ps(pp1+col))));
+                r = _mm_add_ps(r, _mm_loadu_ps(pm2+col));
+                r = _mm_add_ps(r, _mm_loadu_ps(pp2+col));
+                _mm_storeu_ps(dst+col, _mm_mul_ps(r, scale));
+            }
+#elif PYRAMID_NEON
+            for(; col+4 <= width; col += 4) {
+                float32x4_t r = vmulq_n_f32(vld1q_f32(p+col), 6.f);
+                r = vaddq_f32(r, vmulq_n_f32(vaddq_f32(vld1q_f32(pm1+col), vld1q_f32(pp1+col)), 4.f));
+                r = vaddq_f32(r, vld1q_f32(pm2+col));
+                r = vaddq_f32(r, vld1q_f32(pp2+col));
+                vst1q_f32(dst+col, vmulq_n_f32(r, 1.f/256.f));
+            }
+#endif
+            for(; col < width; col++) {
+                dst[col] = (6.f*p[col] + 4.f*(pm1[col]+pp1[col]) + pm2[col] + pp2[col])*(1.f/256.f);
+            }
         }
         
-        pm2     = tmp;
-        pm1     = tmp;
-        p       = tmp+width;
-        pp1     = p+width;
-        pp2     = pp1+width;
-        dst_ptr = dst+width;
+        /**
+         * Apply the horizontal filter to rows [ROW_BEGIN, ROW_END).
+         */
+        template<typename SRC, typename TMP>
+        void binomial_horizontal(TMP* tmp, const SRC* src, size_t width, size_t row_begin, size_t row_end) {
+            for(size_t row = row_begin; row < row_end; row++) {
+                binomial_horizontal_row(&tmp[row*width], &src[row*width], width);
+            }
+        }
         
-        for(size_t col = 0; col < width; col++, dst_ptr++, pm2++, pm1++, p++, pp1++, pp2++) {
-            *dst_ptr = (((*p<<1)+(*p<<2)) + ((*pm1+*pp1)<<2) + (*pm2+*pp2))*(1.f/256.f);
+        /**
+         * Apply the vertical filter to rows [ROW_BEGIN, ROW_END). Rows beyond the
+         * top and bottom borders are replaced by the border rows.
+         */
+        template<typename TMP>
+        void binomial_vertical(float* dst, const TMP* tmp, size_t width, size_t height, size_t row_begin, size_t row_end) {
+            for(size_t row = row_begin; row < row_end; row++) {
+                binomial_vertical_row(&dst[row*width],
+                                      &tmp[(row >= 2 ? row-2 : 0)*width],
+                                      &tmp[(row >= 1 ? row-1 : 0)*width],
+                                      &tmp[row*width],
+                                      &tmp[std::min(row+1, height-1)*width],
+                                      &tmp[std::min(row+2, height-1)*width],
+                                      width);
+            }
         }
         
-        // Apply vertical filter for non-border pixels.
-        pm2 = tmp;
-        pm1 = pm2+width;
-        p   = pm1+width;
-        pp1 = p+width;
-        pp2 = pp1+width;
+        /**
+         * Downsample two source rows into one destination row.
+         */
+        inline void downsample_bilinear_row(float* dst, const float* src_ptr1, const float* src_ptr2, size_t dst_width) {
+            size_t col = 0;
+#if PYRAMID_SSE2
+            const __m128 quarter = _mm_set1_ps(0.25f);
+            for(; col+4 <= dst_width; col += 4) {
+                __m128 a0 = _mm_loadu_ps(src_ptr1+2*col);
+                __m128 a1 = _mm_loadu_ps(src_ptr1+2*col+4);
+                __m128 b0 = _mm_loadu_ps(src_ptr2+2*col);
+                __m128 b1 = _mm_loadu_ps(src_ptr2+2*col+4);
+                __m128 r = _mm_add_ps(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2, 0, 2, 0)),
+                                      _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(3, 1, 3, 1)));
+                r = _mm_add_ps(r, _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2, 0, 2, 0)));
+                r = _mm_add_ps(r, _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3, 1, 3, 1)));
+                _mm_storeu_ps(dst+col, _mm_mul_ps(r, quarter));
+            }
+#elif PYRAMID_NEON
+            for(; col+4 <= dst_width; col += 4) {
+                float32x4x2_t a = vld2q_f32(src_ptr1+2*col);
+                float32x4x2_t b = vld2q_f32(src_ptr2+2*col);
+                float32x4_t r = vaddq_f32(a.val[0], a.val[1]);
+                r = vaddq_f32(r, b.val[0]);
+                r = vaddq_f32(r, b.val[1]);
+                vst1q_f32(dst+col, vmulq_n_f32(r, 0.25f));
+            }
+#endif
+            for(; col < dst_width; col++) {
+                dst[col] = (src_ptr1[2*col]+src_ptr1[2*col+1]+src_ptr2[2*col]+src_ptr2[2*col+1])*0.25f;
+            }
+        }
         
-        for(size_t row = 2; row < height_minus_2; row++) {
-            pm2 = &tmp[(row-2)*width];
-            pm1 = pm2+width;
-            p   = pm1+width;
-            pp1 = p+width;
-            pp2 = pp1+width;
-            
-            dst_ptr = &dst[row*width];
-            
-            for(size_t col = 0; col < width; col++, dst_ptr++, pm2++, pm1++, p++, pp1++, pp2++) {
-                *dst_ptr = (((*p<<1)+(*p<<2)) + ((*pm1+*pp1)<<2) + (*pm2+*pp2))*(1.f/256.f);
+        /**
+         * Mean of each 2x2 block of two source rows.
+         */
+        inline void downscale_half_row(unsigned char* dst, const unsigned char* p1, const unsigned char* p2, size_t dst_width) {
+            size_t col = 0;
+#if PYRAMID_SSE2
+            const __m128i mask = _mm_set1_epi16(0x00ff);
+            for(; col+8 <= dst_width; col += 8) {
+                __m128i a = _mm_loadu_si128((const __m128i*)(p1+2*col));
+                __m128i b = _mm_loadu_si128((const __m128i*)(p2+2*col));
+                __m128i r = _mm_add_epi16(_mm_and_si128(a, mask), _mm_srli_epi16(a, 8));
+                r = _mm_add_epi16(r, _mm_add_epi16(_mm_and_si128(b, mask), _mm_srli_epi16(b, 8)));
+                r = _mm_srli_epi16(r, 2);
+                _mm_storel_epi64((__m128i*)(dst+col), _mm_packus_epi16(r, r));
+            }
+#elif PYRAMID_NEON
+            for(; col+8 <= dst_width; col += 8) {
+                uint16x8_t r = vpaddlq_u8(vld1q_u8(p1+2*col));
+                r = vpadalq_u8(r, vld1q_u8(p2+2*col));
+                vst1_u8(dst+col, vshrn_n_u16(r, 2));
+            }
+#endif
+            for(; col < dst_width; col++) {
+                dst[col] = ((int)p1[2*col] + (int)p1[2*col+1] + (int)p2[2*col] + (int)p2[2*col+1]) / 4;
             }
         }
         
-        // Apply vertical filter for bottom border. Similar to top border.
-        pm2     = tmp+(height-4)*width;
-        pm1     = pm2+width;
-        p       = pm1+width;
-        pp1     = p+width;
-        pp2     = pp1;
-        dst_ptr = dst+(height-2)*width;
+        /**
+         * Mean of each 4x4 block of four source rows.
+         */
+        inline void downscale_quarter_row(unsigned char* dst,
+                                          const unsigned char* p1,
+                                          const unsigned char* p2,
+                                          const unsigned char* p3,
+                                          const unsigned char* p4,
+                                          size_t dst_width) {
+            size_t col = 0;
+#if PYRAMID_SSE2
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i ones = _mm_set1_epi16(1);
+            for(; col+4 <= dst_width; col += 4) {
+                __m128i a = _mm_loadu_si128((const __m128i*)(p1+4*col));
+                __m128i b = _mm_loadu_si128((const __m128i*)(p2+4*col));
+                __m128i c = _mm_loadu_si128((const __m128i*)(p3+4*col));
+                __m128i d = _mm_loadu_si128((const __m128i*)(p4+4*col));
+                // Column sums over the four rows, at most 4*255
+                __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+                                           _mm_add_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero)));
+                __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)),
+                                           _mm_add_epi16(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero)));
+                // Sum pairs of columns twice to get the sums of four columns
+                __m128i pairs = _mm_packs_epi32(_mm_madd_epi16(lo, ones), _mm_madd_epi16(hi, ones));
+                __m128i r = _mm_srli_epi32(_mm_madd_epi16(pairs, ones), 4);
+                r = _mm_packs_epi32(r, r);
+                r = _mm_packus_epi16(r, r);
+                int v = _mm_cvtsi128_si32(r);
+                memcpy(dst+col, &v, 4);
+            }
+#elif PYRAMID_NEON
+            for(; col+4 <= dst_width; col += 4) {
+                uint16x8_t r = vpaddlq_u8(vld1q_u8(p1+4*col));
+                r = vpadalq_u8(r, vld1q_u8(p2+4*col));
+                r = vpadalq_u8(r, vld1q_u8(p3+4*col));
+                r = vpadalq_u8(r, vld1q_u8(p4+4*col));
+                uint16x4_t r16 = vmovn_u32(vshrq_n_u32(vpaddlq_u16(r), 4));
+                uint8x8_t r8 = vmovn_u16(vcombine_u16(r16, r16));
+                uint32_t v = vget_lane_u32(vreinterpret_u32_u8(r8), 0);
+                memcpy(dst+col, &v, 4);
+            }
+#endif
+            for(; col < dst_width; col++) {
+                const unsigned char* q1 = p1+4*col;
+                const unsigned char* q2 = p2+4*col;
+                const unsigned char* q3 = p3+4*col;
+                const unsigned char* q4 = p4+4*col;
+                dst[col] = ( (int)q1[0] + (int)q1[1] + (int)q1[2] + (int)q1[3]
+                           + (int)q2[0] + (int)q2[1] + (int)q2[2] + (int)q2[3]
+                           + (int)q3[0] + (int)q3[1] + (int)q3[2] + (int)q3[3]
+                           + (int)q4[0] + (int)q4[1] + (int)q4[2] + (int)q4[3] ) / 16;
+            }
+        }
         
-        for(size_t col = 0; col < width; col++, dst_ptr++, pm2++, pm1++, p++, pp1++, pp2++) {
-            *dst_ptr = (((*p<<1)+(*p<<2)) + ((*pm1+*pp1)<<2) + (*pm2+*pp2))*(1.f/256.f);
+        /**
+         * Mean of each 3x3 block of three source rows.
+         */
+        inline void downscale_one_third_row(unsigned char* dst,
+                                            const unsigned char* p1,
+                                            const unsigned char* p2,
+                                            const unsigned char* p3,
+                                            size_t dst_width) {
+            for(size_t col = 0; col < dst_width; col++) {
+                const unsigned char* q1 = p1+3*col;
+                const unsigned char* q2 = p2+3*col;
+                const unsigned char* q3 = p3+3*col;
+                dst[col] = ( (int)q1[0] + (int)q1[1] + (int)q1[2]
+                           + (int)q2[0] + (int)q2[1] + (int)q2[2]
+                           + (int)q3[0] + (int)q3[1] + (int)q3[2] ) / 9;
+            }
+        }
+        
+        /**
+         * One row of a 3x3 to 2x2 downscale. OUTER is the outer source row nearest
+         * to the destination row, and MID is the middle row of the 3x3 blocks.
+         */
+        inline void downscale_two_thirds_row(unsigned char* dst, const unsigned char* outer, const unsigned char* mid, size_t dst_width) {
+            for(size_t i = 0; i < dst_width/2; i++) {
+                dst[0] = ( (int)outer[0]   + (int)outer[1]/2
+                         + (int)mid[0]/2   + (int)mid[1]/4 ) *4/9;
+                dst[1] = ( (int)outer[1]/2 + (int)outer[2]
+                         + (int)mid[1]/4   + (int)mid[2]/2 ) *4/9;
+                dst += 2;
+                outer += 3;
+                mid += 3;
+            }
         }
         
-        pm2     = tmp+(height-3)*width;
-        pm1     = pm2+width;
-        p       = pm1+width;
-        pp1     = p;
-        pp2     = p;
-        dst_ptr = dst+(height-1)*width;
+        /**
+         * Produce row ROW of SRC downscaled by MODE. For DOWNSCALE_NONE the source
+         * row is returned without a copy, otherwise BUFFER is filled and returned.
+         */
+        inline const unsigned char* downscale_row(unsigned char* buffer,
+                                                  const unsigned char* src,
+                                                  size_t src_width,
+                                                  size_t dst_width,
+                                                  size_t row,
+                                                  DownscaleMode mode) {
+            switch(mode) {
+                case DOWNSCALE_NONE:
+                    return &src[row*src_width];
+                case DOWNSCALE_TWO_THIRDS: {
+                    // Rows 2j and 2j+1 come from source rows 3j..3j+2, sharing the middle one
+                    size_t j = row>>1;
+                    downscale_two_thirds_row(buffer,
+                                             &src[(3*j+((row&1) ? 2 : 0))*src_width],
+                                             &src[(3*j+1)*src_width],
+                                             dst_width);
+                    break;
+                }
+                case DOWNSCALE_HALF:
+                    downscale_half_row(buffer,
+                                       &src[(2*row)*src_width],
+                                       &src[(2*row+1)*src_width],
+                                       dst_width);
+                    break;
+                case DOWNSCALE_ONE_THIRD:
+                    downscale_one_third_row(buffer,
+                                            &src[(3*row)*src_width],
+                                            &src[(3*row+1)*src_width],
+                                            &src[(3*row+2)*src_width],
+                                            dst_width);
+                    break;
+                case DOWNSCALE_QUARTER:
+                    downscale_quarter_row(buffer,
+                                          &src[(4*row)*src_width],
+                                          &src[(4*row+1)*src_width],
+                                          &src[(4*row+2)*src_width],
+                                          &src[(4*row+3)*src_width],
+                                          dst_width);
+                    break;
+            }
+            return buffer;
+        }
         
-        for(size_t col = 0; col < width; col++, dst_ptr++, pm2++, pm1++, p++, pp1++, pp2++) {
-            *dst_ptr = (((*p<<1)+(*p<<2)) + ((*pm1+*pp1)<<2) + (*pm2+*pp2))*(1.f/256.f);
+        /**
+         * Downscale SRC by MODE and apply the 2D binomial filter to rows
+         * [ROW_BEGIN, ROW_END) of the result, in a single pass. The horizontally
+         * filtered rows are kept in RING, which holds 5 rows, so each row band
+         * only touches a few rows of the source at a time.
+         */
+        void binomial_4th_order_downscaled(float* dst,
+                                           unsigned short* ring,
+                                           unsigned char* buffer,
+                                           const unsigned char* src,
+                                           size_t src_width,
+                                           size_t width,
+                                           size_t height,
+                                           DownscaleMode mode,
+                                           size_t row_begin,
+                                           size_t row_end) {
+            // Rows beyond the top and bottom borders are replaced by the border rows
+            size_t next = row_begin >= 2 ? row_begin-2 : 0;
+            for(size_t row = row_begin; row < row_end; row++) {
+                size_t last = std::min(row+2, height-1);
+                for(; next <= last; next++) {
+                    binomial_horizontal_row(&ring[(next%5)*width],
+                                            downscale_row(buffer, src, src_width, width, next, mode),
+                                            width);
+                }
+                binomial_vertical_row(&dst[row*width],
+                                      &ring[((row >= 2 ? row-2 : 0)%5)*width],
+                                      &ring[((row >= 1 ? row-1 : 0)%5)*width],
+                                      &ring[(row%5)*width],
+                                      &ring[(std::min(row+1, height-1)%5)*width],
+                                      &ring[(std::min(row+2, height-1)%5)*width],
+                                      width);
+            }
         }
+        
+    } // anonymous
+
+    void binomial_4th_order(float* dst,
+                            unsigned short* tmp,
+                            const unsigned char* src,
+                            size_t width,
+                            size_t height,
+                            ThreadPool* pool) {
+        ASSERT(width >= 5, "Image is too small");
+        ASSERT(height >= 5, "Image is too small");
+        
+        // The vertical filter needs the neighbouring rows, so the horizontal pass
+        // is finished over the whole image first
+        for_each_row_band(pool, height, [&](size_t row_begin, size_t row_end) {
+            binomial_horizontal(tmp, src, width, row_begin, row_end);
+        });
+        for_each_row_band(pool, height, [&](size_t row_begin, size_t row_end) {
+            binomial_vertical(dst, tmp, width, height, row_begin, row_end);
+        });
     }
     
     void binomial_4th_order(float* dst,
                             float* tmp,
                             const float* src,
                             size_t width,
-                            size_t height) {
-        float* tmp_ptr;
-        float* dst_ptr;
-        
-        size_t width_minus_1, width_minus_2;
-        size_t height_minus_2;
-        
+                            size_t height,
+                            ThreadPool* pool) {
         ASSERT(width >= 5, "Image is too small");
         ASSERT(height >= 5, "Image is too small");
         
-        width_minus_1 = width-1;
-        width_minus_2 = width-2;
-        height_minus_2 = height-2;
-        
-        tmp_ptr = tmp;
-        
-        // Apply horizontal filter
-        for(size_t row = 0; row < height; row++) {
-            const float* src_ptr = &src[row*width];
-            
-            // Left border is computed by extending the border pixel beyond the image
-            *(tmp_ptr++) = 6.f*src_ptr[0] + 4.f*(src_ptr[0]+src_ptr[1]) + src_ptr[0] + src_ptr[2];
-            *(tmp_ptr++) = 6.f*src_ptr[1] + 4.f*(src_ptr[0]+src_ptr[2]) + src_ptr[0] + src_ptr[3];
-            
-            // Compute non-border pixels
-            for(size_t col = 2; col < width_minus_2; col++, tmp_ptr++) {
-                *tmp_ptr = (6.f*src_ptr[col] + 4.f*(src_ptr[col-1]+src_ptr[col+1]) + src_ptr[col-2] + src_ptr[col+2]);
-            }
-            
-            // Right border. Computed similarily as the left border.
-            *(tmp_ptr++) = 6.f*src_ptr[width_minus_2] + 4.f*(src_ptr[width_minus_2-1]+src_ptr[width_minus_2+1]) + src_ptr[width_minus_2-2] + src_ptr[width_minus_2+1];
-            *(tmp_ptr++) = 6.f*src_ptr[width_minus_1] + 4.f*(src_ptr[width_minus_1-1]+src_ptr[width_minus_1])   + src_ptr[width_minus_1-2] + src_ptr[width_minus_1];
-        }
-        
-        const float* pm2;
-        const float* pm1;
-        const float* p;
-        const float* pp1;
-        const float* pp2;
-        
-        // Apply vertical filter along top border. This is applied twice as there are two
-        // border pixels.
-        pm2     = tmp;
-        pm1     = tmp;
-        p       = tmp;
-        pp1     = p+width;
-        pp2     = pp1+width;
-        dst_ptr = dst;
-        
-        for(size_t col = 0; col < width; col++, dst_ptr++, pm2++, pm1++, p++, pp1++, pp2++) {
-            *dst_ptr = (6.f*(*p) + 4.f*(*pm1+*pp1) + (*pm2) + (*pp2))*(1.f/256.f);;
+        for_each_row_band(pool, height, [&](size_t row_begin, size_t row_end) {
+            binomial_horizontal(tmp, src, width, row_begin, row_end);
+        });
+        for_each_row_band(pool, height, [&](size_t row_begin, size_t row_end) {
+            binomial_vertical(dst, tmp, width, height, row_begin, row_end);
+        });
+    }
+    
+    void downscaled_size(size_t& dst_width, size_t& dst_height, size_t src_width, size_t src_height, DownscaleMode mode) {
+        switch(mode) {
+            case DOWNSCALE_NONE:
+                dst_width = src_width;
+                dst_height = src_height;
+                break;
+            case DOWNSCALE_TWO_THIRDS:
+                dst_width = src_width/3*2;
+                dst_height = src_height/3*2;
+                break;
+            case DOWNSCALE_HALF:
+                dst_width = src_width/2;
+                dst_height = src_height/2;
+                break;
+            case DOWNSCALE_ONE_THIRD:
+                dst_width = src_width/3;
+                dst_height = src_height/3;
+                break;
+            case DOWNSCALE_QUARTER:
+                dst_width = src_width/4;
+                dst_height = src_height/4;
+                break;
         }
+    }
+    
+    void downscale(unsigned char* dst, const unsigned char* src, size_t src_width, size_t src_height, DownscaleMode mode, ThreadPool* pool) {
+        size_t dst_width, dst_height;
+        downscaled_size(dst_width, dst_height, src_width, src_height, mode);
         
-        pm2     = tmp;
-        pm1     = tmp;
-        p       = tmp+width;
-        pp1     = p+width;
-        pp2     = pp1+width;
-        dst_ptr = dst+width;
-        
-        for(size_t col = 0; col < width; col++, dst_ptr++, pm2++, pm1++, p++, pp1++, pp2++) {
-            *dst_ptr = (6.f*(*p) + 4.f*(*pm1+*pp1) + (*pm2) + (*pp2))*(1.f/256.f);;
+        if(mode == DOWNSCALE_NONE) {
+            memcpy(dst, src, src_width*src_height);
+            return;
         }
-        
-        // Apply vertical filter for non-border pixels.
-        for(size_t row = 2; row < height_minus_2; row++) {
-            pm2 = &tmp[(row-2)*width];
-            pm1 = pm2+width;
-            p   = pm1+width;
-            pp1 = p+width;
-            pp2 = pp1+width;
-            
-            dst_ptr = &dst[row*width];
-            
-            for(size_t col = 0; col < width; col++, dst_ptr++, pm2++, pm1++, p++, pp1++, pp2++) {
-                *dst_ptr = (6.f*(*p) + 4.f*(*pm1+*pp1) + (*pm2) + (*pp2))*(1.f/256.f);;
+        for_each_row_band(pool, dst_height, [&](size_t row_begin, size_t row_end) {
+            for(size_t row = row_begin; row < row_end; row++) {
+                downscale_row(&dst[row*dst_width], src, src_width, dst_width, row, mode);
             }
-        }
-        
-        // Apply vertical filter for bottom border. Similar to top border.
-        pm2     = tmp+(height-4)*width;
-        pm1     = pm2+width;
-        p       = pm1+width;
-        pp1     = p+width;
-        pp2     = pp1;
-        dst_ptr = dst+(height-2)*width;
-        
-        for(size_t col = 0; col < width; col++, dst_ptr++, pm2++, pm1++, p++, pp1++, pp2++) {
-            *dst_ptr = (6.f*(*p) + 4.f*(*pm1+*pp1) + (*pm2) + (*pp2))*(1.f/256.f);;
-        }
-        
-        pm2     = tmp+(height-3)*width;
-        pm1     = pm2+width;
-        p       = pm1+width;
-        pp1     = p;
-        pp2     = p;
-        dst_ptr = dst+(height-1)*width;
-        
-        for(size_t col = 0; col < width; col++, dst_ptr++, pm2++, pm1++, p++, pp1++, pp2++) {
-            *dst_ptr = (6.f*(*p) + 4.f*(*pm1+*pp1) + (*pm2) + (*pp2))*(1.f/256.f);;
-        }
+        });
     }
     
-    void downsample_bilinear(float* dst, const float* src, size_t src_width, size_t src_height) {
-        size_t dst_width;
-        size_t dst_height;
-        const float* src_ptr1;
-        const float* src_ptr2;
-        
-        dst_width = src_width>>1;
-        dst_height = src_height>>1;
-        
-        for(size_t row = 0; row < dst_height; row++) {
-            src_ptr1 = &src[(row<<1)*src_width];
-            src_ptr2 = src_ptr1 + src_width;
-            for(size_t col = 0; col < dst_width; col++, src_ptr1+=2, src_ptr2+=2) {
-                *(dst++) = (src_ptr1[0]+src_ptr1[1]+src_ptr2[0]+src_ptr2[1])*0.25f;
+    void downsample_bilinear(float* dst, const float* src, size_t src_width, size_t src_height, ThreadPool* pool) {
+        size_t dst_width = src_width>>1;
+        size_t dst_height = src_height>>1;
+        
+        for_each_row_band(pool, dst_height, [&](size_t row_begin, size_t row_end) {
+            for(size_t row = row_begin; row < row_end; row++) {
+                const float* src_ptr1 = &src[(row<<1)*src_width];
+                const float* src_ptr2 = src_ptr1 + src_width;
+                downsample_bilinear_row(&dst[row*dst_width], src_ptr1, src_ptr2, dst_width);
             }
-        }
+        });
     }
     
 }
@@ -295,7 +620,8 @@ void GaussianScaleSpacePyramid::configure(int num_octaves, int num_scales_per_oc
     mOneOverLogK = 1.f/std::log(mK);
 }
 
-BinomialPyramid32f::BinomialPyramid32f() {
+BinomialPyramid32f::BinomialPyramid32f()
+: mThreadPool(NULL) {
 }
 
 BinomialPyramid32f::~BinomialPyramid32f()
@@ -316,7 +642,6 @@ void BinomialPyramid32f::alloc(size_t width,
         }
     }
     
-    mTemp_us16.resize(width*height);
     mTemp_f32_1.resize(width*height);
     mTemp_f32_2.resize(width*height);
     
@@ -327,15 +652,21 @@ void BinomialPyramid32f::release() {
 }
 
 void BinomialPyramid32f::build(const Image& image) {
+    build(image, DOWNSCALE_NONE);
+}
+
+void BinomialPyramid32f::build(const Image& image, DownscaleMode mode) {
     ASSERT(image.type() == IMAGE_UINT8, "Image must be grayscale");
     ASSERT(image.channels() == 1, "Image must have 1 channel");
     
+    size_t width, height;
+    downscaled_size(width, height, image.width(), image.height(), mode);
     ASSERT(mPyramid.size() == mNumOctaves*mNumScalesPerOctave, "Pyramid has not been allocated yet");
-    ASSERT(image.width() == mPyramid[0].width(), "Image of wrong size for pyramid");
-    ASSERT(image.height() == mPyramid[0].height(), "Image of wrong size for pyramid");
+    ASSERT(width == mPyramid[0].width(), "Image of wrong size for pyramid");
+    ASSERT(height == mPyramid[0].height(), "Image of wrong size for pyramid");
     
     // First octave
-    apply_filter(mPyramid[0], image);
+    apply_first_filter(mPyramid[0], image, mode);
     apply_filter(mPyramid[1], mPyramid[0]);
     apply_filter_twice(mPyramid[2], mPyramid[1]);
     
@@ -345,7 +676,8 @@ void BinomialPyramid32f::build(const Image& image) {
         downsample_bilinear((float*)mPyramid[i*mNumScalesPerOctave].get(),
                             (const float*)mPyramid[i*mNumScalesPerOctave-1].get(),
                             mPyramid[i*mNumScalesPerOctave-1].width(),
-                            mPyramid[i*mNumScalesPerOctave-1].height());
+                            mPyramid[i*mNumScalesPerOctave-1].height(),
+                            mThreadPool);
         
         // Apply binomial filters
         apply_filter(mPyramid[i*mNumScalesPerOctave+1], mPyramid[i*mNumScalesPerOctave]);
@@ -353,23 +685,45 @@ void BinomialPyramid32f::build(const Image& image) {
     }
 }
 
+void BinomialPyramid32f::apply_first_filter(Image& dst, const Image& src, DownscaleMode mode) {
+    ASSERT(dst.type() == IMAGE_F32, "Destination image should be a float");
+    ASSERT(src.step() == src.width(), "Source rows must be contiguous");
+    ASSERT(dst.width() >= 5, "Image is too small");
+    ASSERT(dst.height() >= 5, "Image is too small");
+    
+    const size_t width = dst.width();
+    const size_t height = dst.height();
+    const int num_bands = num_row_bands(mThreadPool, height);
+    if(mRowRing.size() < num_bands*5*width) {
+        mRowRing.resize(num_bands*5*width);
+        mRowBuffer.resize(num_bands*width);
+    }
+    
+    for_each_indexed_row_band(mThreadPool, height, [&](int band, size_t row_begin, size_t row_end) {
+        binomial_4th_order_downscaled((float*)dst.get(),
+                                      &mRowRing[band*5*width],
+                                      &mRowBuffer[band*width],
+                                      (const unsigned char*)src.get(),
+                                      src.width(),
+                                      width,
+                                      height,
+                                      mode,
+                                      row_begin,
+                                      row_end);
+    });
+}
+
 void BinomialPyramid32f::apply_filter(Image& dst, const Image& src) {
     ASSERT(dst.type() == IMAGE_F32, "Destination image should be a float");
     
     switch(src.type()) {
-        case IMAGE_UINT8:
-            binomial_4th_order((float*)dst.get(),
-                               &mTemp_us16[0],
-                               (const unsigned char*)src.get(),
-                               src.width(),
-                               src.height());
-            break;
         case IMAGE_F32:
             binomial_4th_order((float*)dst.get(),
                                &mTemp_f32_1[0],
                                (const float*)src.get(),
                                src.width(),
-                               src.height());
+                               src.height(),
+                               mThreadPool);
             break;
         case IMAGE_UNKNOWN:
             throw EXCEPTION("Unknown image type");
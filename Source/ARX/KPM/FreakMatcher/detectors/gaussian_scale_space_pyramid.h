@@ -42,6 +42,8 @@
 
 namespace vision {
     
+    class ThreadPool;
+    
     /**
      * Use this function to upsample a point that has been found from a
      * bilinear downsample pyramid.
@@ -156,17 +158,20 @@ namespace vision {
      * @param[in] src Source image
      * @param[in] width Width of image
      * @param[in] height Height of image
+     * @param[in] pool Optional thread pool to split the rows over
      */
     void binomial_4th_order(float* dst,
                             unsigned short* tmp,
                             const unsigned char* src,
                             size_t width,
-                            size_t height);
+                            size_t height,
+                            ThreadPool* pool = NULL);
     void binomial_4th_order(float* dst,
                             float* tmp,
                             const float* src,
                             size_t width,
-                            size_t height);
+                            size_t height,
+                            ThreadPool* pool = NULL);
     
     /**
      * The mean of the first pixel quad, and then every other pixel quad afterwards.
@@ -175,8 +180,39 @@ namespace vision {
      * @param[in] src Source image
      * @param[in] src_width Source width
      * @param[in] src_height Source height
+     * @param[in] pool Optional thread pool to split the rows over
+     */
+    void downsample_bilinear(float* dst, const float* src, size_t src_width, size_t src_height, ThreadPool* pool = NULL);
+    
+    /**
+     * Integer downscales of an 8-bit image. Each destination pixel is the
+     * truncated mean of a block of source pixels, except for TWO_THIRDS which
+     * maps each 3x3 block onto a 2x2 block with bilinear weights.
+     */
+    enum DownscaleMode {
+        DOWNSCALE_NONE,
+        DOWNSCALE_TWO_THIRDS,
+        DOWNSCALE_HALF,
+        DOWNSCALE_ONE_THIRD,
+        DOWNSCALE_QUARTER
+    };
+    
+    /**
+     * Get the size of a SRC_WIDTH x SRC_HEIGHT image downscaled by MODE.
      */
-    void downsample_bilinear(float* dst, const float* src, size_t src_width, size_t src_height);
+    void downscaled_size(size_t& dst_width, size_t& dst_height, size_t src_width, size_t src_height, DownscaleMode mode);
+    
+    /**
+     * Downscale an 8-bit image by MODE.
+     *
+     * @param[out] dst Destination image, of the size given by downscaled_size()
+     * @param[in] src Source image
+     * @param[in] src_width Source width
+     * @param[in] src_height Source height
+     * @param[in] mode Downscale to apply
+     * @param[in] pool Optional thread pool to split the rows over
+     */
+    void downscale(unsigned char* dst, const unsigned char* src, size_t src_width, size_t src_height, DownscaleMode mode, ThreadPool* pool = NULL);
     
     class GaussianScaleSpacePyramid {
     public:
@@ -327,13 +363,34 @@ namespace vision {
          */
         void build(const Image& image);
         
+        /**
+         * Build the pyramid from IMAGE downscaled by MODE. The pyramid must have
+         * been allocated at the downscaled size. The downscale is done in the same
+         * pass as the first filter, so the downscaled image is never stored.
+         */
+        void build(const Image& image, DownscaleMode mode);
+        
+        /**
+         * Set a thread pool to split the filtering of each image over. The pool is
+         * not owned and may be NULL to filter on the calling thread.
+         */
+        inline void setThreadPool(ThreadPool* pool) { mThreadPool = pool; }
+        
     private:
         
+        // Thread pool for filtering, or NULL
+        ThreadPool* mThreadPool;
+        
         // Temporary space for binomial filter
-        std::vector<unsigned short> mTemp_us16;
         std::vector<float> mTemp_f32_1;
         std::vector<float> mTemp_f32_2;
         
+        // Ring of horizontally filtered rows, and a downscaled source row, for
+        // each row band of the first filter
+        std::vector<unsigned short> mRowRing;
+        std::vector<unsigned char> mRowBuffer;
+        
+        void apply_first_filter(Image& dst, const Image& src, DownscaleMode mode);
         void apply_filter(Image& dst, const Image& src);
         void apply_filter_twice(Image& dst, const Image& src);
     };
@@ -34,6 +34,7 @@
 //
 
 #include "gradients.h"
+#include <framework/error.h>
 #include <math/math_utils.h>
 #include <cmath>
 
@@ -124,6 +125,39 @@ p_ptr++; pm1_ptr++; pp1_ptr++;              \
 #undef SET_GRADIENT
     }
     
+    void ComputePolarGradientsRegion(float* gradient,
+                                     size_t gradient_step,
+                                     const float* im,
+                                     size_t im_step,
+                                     size_t width,
+                                     size_t height,
+                                     size_t x0,
+                                     size_t y0,
+                                     size_t x1,
+                                     size_t y1) {
+        ASSERT(x0 <= x1 && x1 < width, "Region is out of bounds");
+        ASSERT(y0 <= y1 && y1 < height, "Region is out of bounds");
+        
+        for(size_t row = y0; row <= y1; row++) {
+            // The border rows use the row itself in place of the missing neighbour
+            const float* p_ptr   = (const float*)((const unsigned char*)im+row*im_step);
+            const float* pm1_ptr = row > 0 ? (const float*)((const unsigned char*)p_ptr-im_step) : p_ptr;
+            const float* pp1_ptr = row < height-1 ? (const float*)((const unsigned char*)p_ptr+im_step) : p_ptr;
+            float* g = (float*)((unsigned char*)gradient+row*gradient_step)+2*x0;
+            
+            for(size_t col = x0; col <= x1; col++) {
+                // Same for the border columns
+                size_t left = col > 0 ? col-1 : col;
+                size_t right = col < width-1 ? col+1 : col;
+                
+                float dx = p_ptr[right] - p_ptr[left];
+                float dy = pp1_ptr[col] - pm1_ptr[col];
+                *(g++) = std::atan2(dy, dx)+PI;
+                *(g++) = std::sqrt(dx*dx+dy*dy);
+            }
+        }
+    }
+    
     void ComputeGradients(float* gradient,
                           const float* im,
                           size_t width,
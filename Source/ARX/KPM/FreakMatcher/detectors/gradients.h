@@ -47,6 +47,27 @@ namespace vision {
                                size_t width,
                                size_t height);
     
+    /**
+     * Compute the gradients in polar coordinates of the pixels in the rectangle
+     * [X0,X1]x[Y0,Y1]. The result for each pixel is the same as ComputePolarGradients,
+     * and pixels outside of the rectangle are not written.
+     *
+     * @param[out] gradient Gradient image with 2 floats per pixel
+     * @param[in] gradient_step Row step of the gradient image in bytes
+     * @param[in] im Image
+     * @param[in] im_step Row step of the image in bytes
+     */
+    void ComputePolarGradientsRegion(float* gradient,
+                                     size_t gradient_step,
+                                     const float* im,
+                                     size_t im_step,
+                                     size_t width,
+                                     size_t height,
+                                     size_t x0,
+                                     size_t y0,
+                                     size_t x1,
+                                     size_t y1);
+    
     /**
      * Compute the spatial derivates (dx,dy).
      */
@@ -41,16 +41,27 @@
 #include <math/polynomial.h>
 #include <math/math_utils.h>
 #include <math/math_io.h>
+#include <algorithm>
 
 using namespace vision;
 
+namespace {
+    
+    // Width/Height of the gradient tiles computed in lazy mode
+    const int kGradientTileSize = 16;
+    
+} // anonymous namespace
+
 OrientationAssignment::OrientationAssignment()
 : mNumOctaves(0)
 , mNumScalesPerOctave(0)
 , mGaussianExpansionFactor(0)
 , mSupportRegionExpansionFactor(0)
 , mNumSmoothingIterations(0)
-, mPeakThreshold(0) {
+, mPeakThreshold(0)
+, mLazyGradients(true)
+, mPyramid(NULL)
+, mFrame(0) {
 }
 
 OrientationAssignment::~OrientationAssignment() {}
@@ -85,9 +96,33 @@ void OrientationAssignment::alloc(size_t fine_width,
                                                         2);
         }
     }
+    
+    // Allocate the tile stamps used in lazy mode
+    mTileStamps.resize(mGradients.size());
+    mNumTilesX.resize(mGradients.size());
+    for(size_t i = 0; i < mGradients.size(); i++) {
+        mNumTilesX[i] = (mGradients[i].width()+kGradientTileSize-1)/kGradientTileSize;
+        size_t num_tiles_y = (mGradients[i].height()+kGradientTileSize-1)/kGradientTileSize;
+        mTileStamps[i].assign(mNumTilesX[i]*num_tiles_y, 0);
+    }
+    mFrame = 0;
 }
 
 void OrientationAssignment::computeGradients(const GaussianScaleSpacePyramid* pyramid) {
+    if(mLazyGradients) {
+        ASSERT(pyramid->images().size() == mGradients.size(), "Pyramid and gradient images mismatch");
+        mPyramid = pyramid;
+        
+        // Invalidate all the tiles by starting a new frame
+        if(++mFrame == 0) {
+            for(size_t i = 0; i < mTileStamps.size(); i++) {
+                std::fill(mTileStamps[i].begin(), mTileStamps[i].end(), 0);
+            }
+            mFrame = 1;
+        }
+        return;
+    }
+    
     // Loop over each pyramid image and compute the gradients
     for(size_t i = 0; i < pyramid->images().size(); i++) {
         const Image& im = pyramid->images()[i];
@@ -159,6 +194,11 @@ void OrientationAssignment::compute(float* angles,
     y0 = max2<int>(0, y0);
     y1 = min2<int>(y1, (int)g.height()-1);
     
+    // Compute the gradients in the box if they are not there yet
+    if(mLazyGradients) {
+        updateGradients(level, x0, y0, x1, y1);
+    }
+    
     // Zero out the orientation histogram
     ZeroVector(&mHistogram[0], mHistogram.size());
     
@@ -244,4 +284,38 @@ void OrientationAssignment::compute(float* angles,
             num_angles++;
         }
     }
-}
\ No newline at end of file
+}
+
+void OrientationAssignment::updateGradients(int level, int x0, int y0, int x1, int y1) {
+    ASSERT(mPyramid != NULL, "Gradients have not been started for this frame");
+    
+    const Image& im = mPyramid->images()[level];
+    Image& g = mGradients[level];
+    std::vector<unsigned int>& stamps = mTileStamps[level];
+    const size_t num_tiles_x = mNumTilesX[level];
+    
+    for(int ty = y0/kGradientTileSize; ty <= y1/kGradientTileSize; ty++) {
+        for(int tx = x0/kGradientTileSize; tx <= x1/kGradientTileSize; tx++) {
+            unsigned int& stamp = stamps[ty*num_tiles_x+tx];
+            if(stamp == mFrame) {
+                continue;
+            }
+            
+            size_t tile_x0 = tx*kGradientTileSize;
+            size_t tile_y0 = ty*kGradientTileSize;
+            size_t tile_x1 = std::min<size_t>(tile_x0+kGradientTileSize, im.width())-1;
+            size_t tile_y1 = std::min<size_t>(tile_y0+kGradientTileSize, im.height())-1;
+            ComputePolarGradientsRegion(g.get<float>(),
+                                        g.step(),
+                                        im.get<float>(),
+                                        im.step(),
+                                        im.width(),
+                                        im.height(),
+                                        tile_x0,
+                                        tile_y0,
+                                        tile_x1,
+                                        tile_y1);
+            stamp = mFrame;
+        }
+    }
+}
@@ -66,7 +66,9 @@ namespace vision {
                    float peak_threshold);
         
         /**
-         * Compute the gradients given a pyramid.
+         * Compute the gradients given a pyramid. In lazy mode this only starts a new
+         * frame, and the gradients are computed by COMPUTE for the tiles it reads.
+         * The pyramid must stay valid until the last call to COMPUTE.
          */
         void computeGradients(const GaussianScaleSpacePyramid* pyramid);
         
@@ -82,7 +84,16 @@ namespace vision {
                      float sigma);
         
         /**
-         * @return Vector of images.
+         * Set/Get lazy gradient computation. When enabled, gradients are only
+         * computed for the tiles around the feature points. The orientations are
+         * the same in both modes.
+         */
+        inline void setLazyGradients(bool b) { mLazyGradients = b; }
+        inline bool lazyGradients() const { return mLazyGradients; }
+        
+        /**
+         * @return Vector of images. In lazy mode only the tiles used by COMPUTE
+         * since the last call to COMPUTEGRADIENTS are valid.
          */
         inline const std::vector<Image>& images() const { return mGradients; }
         
@@ -122,6 +133,23 @@ namespace vision {
         // Vector of gradient images
         std::vector<Image> mGradients;
         
+        // True if the gradients are computed on demand
+        bool mLazyGradients;
+        
+        // Pyramid of the current frame, used to compute the gradients on demand
+        const GaussianScaleSpacePyramid* mPyramid;
+        
+        // Frame stamp of each gradient tile. A tile is valid if its stamp equals
+        // the current frame.
+        std::vector<std::vector<unsigned int> > mTileStamps;
+        std::vector<size_t> mNumTilesX;
+        unsigned int mFrame;
+        
+        /**
+         * Make sure the gradients in [X0,X1]x[Y0,Y1] of a level are computed.
+         */
+        void updateGradients(int level, int x0, int y0, int x1, int y1);
+        
     }; // OrientationAssignment
     
     /**
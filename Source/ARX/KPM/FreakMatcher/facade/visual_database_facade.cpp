@@ -39,12 +39,42 @@
 #include <matchers/keyframe.h>
 #include <framework/image.h>
 #include <matchers/visual_database-inline.h>
+#include <utils/checksum.h>
 #include <cmath>
+#include <fstream>
+#include <unordered_set>
 
 namespace vision {
     typedef VisualDatabase<FREAKExtractor, BinaryFeatureStore, BinaryFeatureMatcher<96> > vdb_t;
     typedef std::vector<vision::Point3d<float> > Point3dVector;
     typedef std::unordered_map<int, Point3dVector> point3d_map_t;
+    typedef std::unordered_map<uint64_t, std::vector<unsigned char> > index_cache_t;
+    
+    namespace {
+        
+        // Index file layout: the header, then NUM_ENTRIES entries of a uint64_t
+        // descriptor checksum, a uint64_t size and SIZE bytes of index. CHECKSUM
+        // covers everything after the header.
+        const char kIndexFileMagic[8] = {'A','R','X','K','P','M','I','X'};
+        const uint32_t kIndexFileVersion = 1;
+        const uint32_t kIndexFileByteOrder = 0x01020304;
+        
+        struct IndexFileHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t byteOrder;
+            uint32_t numBytesPerFeature;
+            uint32_t numEntries;
+            uint64_t checksum;
+        };
+        
+        uint64_t DescriptorChecksum(const BinaryFeatureStore& store) {
+            uint64_t counts[2] = {(uint64_t)store.numBytesPerFeature(), (uint64_t)store.size()};
+            uint64_t h = Checksum64(counts, sizeof(counts));
+            return Checksum64(store.features().data(), store.features().size(), h);
+        }
+        
+    } // anonymous namespace
     
     class VisualDatabaseImpl{
     public:
@@ -56,6 +86,29 @@ namespace vision {
         
         std::unique_ptr<vdb_t> mVdb;
         point3d_map_t mPoint3d;
+        
+        // Indices read from index files, by descriptor checksum. Entries are dropped
+        // once keyframes have been added, as each keyframe keeps its own copy.
+        index_cache_t mIndexCache;
+        
+        // Keyframes whose index was built rather than read
+        std::unordered_set<int> mBuiltIndexIds;
+        
+        /**
+         * Give a keyframe's index from the index cache, or build it.
+         * @return True if the index was built
+         */
+        bool setIndex(Keyframe<96>& keyframe) const {
+            index_cache_t::const_iterator it = mIndexCache.end();
+            if(!mIndexCache.empty()) {
+                it = mIndexCache.find(DescriptorChecksum(keyframe.store()));
+            }
+            if(it != mIndexCache.end() && keyframe.loadIndex(it->second.data(), it->second.size())) {
+                return false;
+            }
+            keyframe.buildIndex();
+            return true;
+        }
     };
     
     VisualDatabaseFacade::VisualDatabaseFacade(){
@@ -88,11 +141,45 @@ namespace vision {
         keyframe->store().points() = featurePoints;
         keyframe->store().features().resize(descriptors.size());
         keyframe->store().features() = descriptors;
-        keyframe->buildIndex();
+        if(mVisualDbImpl->setIndex(*keyframe)) {
+            mVisualDbImpl->mBuiltIndexIds.insert(image_id);
+        } else {
+            mVisualDbImpl->mIndexCache.erase(DescriptorChecksum(keyframe->store()));
+        }
         mVisualDbImpl->mVdb->addKeyframe(keyframe, image_id);
         mVisualDbImpl->mPoint3d[image_id] = points3D;
     }
     
+    void VisualDatabaseFacade::addFreakKeyframes(std::vector<FreakKeyframeData>& keyframes){
+        std::vector<std::shared_ptr<Keyframe<96> > > built(keyframes.size());
+        std::vector<unsigned char> index_built(keyframes.size());
+        
+        // Each keyframe's index only depends on its own features, so the result
+        // is the same for any number of threads
+        const VisualDatabaseImpl& impl = *mVisualDbImpl;
+        mVisualDbImpl->mVdb->threadPool().parallelFor((int)keyframes.size(), [&](int i, int) {
+            std::shared_ptr<Keyframe<96> > keyframe(new Keyframe<96>());
+            keyframe->setWidth((int)keyframes[i].width);
+            keyframe->setHeight((int)keyframes[i].height);
+            keyframe->store().setNumBytesPerFeature(96);
+            keyframe->store().points().swap(keyframes[i].featurePoints);
+            keyframe->store().features().swap(keyframes[i].descriptors);
+            index_built[i] = impl.setIndex(*keyframe);
+            built[i] = keyframe;
+        });
+        mVisualDbImpl->mIndexCache.clear();
+        
+        for(size_t i = 0; i < keyframes.size(); i++) {
+            int image_id = keyframes[i].image_id;
+            if(index_built[i]) {
+                mVisualDbImpl->mBuiltIndexIds.insert(image_id);
+            }
+            mVisualDbImpl->mVdb->addKeyframe(built[i], image_id);
+            mVisualDbImpl->mPoint3d[image_id].swap(keyframes[i].points3D);
+            keyframes[i].points3D.clear();
+        }
+    }
+    
     void VisualDatabaseFacade::computeFreakFeaturesAndDescriptors(unsigned char* grayImage,
                                                                   size_t width,
                                                                   size_t height,
@@ -112,10 +199,67 @@ namespace vision {
         return mVisualDbImpl->mVdb->query(img);
     }
     
+    bool VisualDatabaseFacade::query(unsigned char* grayImage,
+                                     size_t width,
+                                     size_t height,
+                                     DownscaleMode mode){
+        Image img = Image(grayImage,IMAGE_UINT8,width,height,(int)width,1);
+        return mVisualDbImpl->mVdb->query(img, mode);
+    }
+    
+    void VisualDatabaseFacade::setQuerySkipIds(const int* image_ids, size_t num){
+        mVisualDbImpl->mVdb->setSkipIds(image_ids, num);
+    }
+    
+    void VisualDatabaseFacade::setQuerySkipRegions(const SkipRegion* regions, size_t num){
+        mVisualDbImpl->mVdb->setSkipRegions(regions, num);
+    }
+    
+    void VisualDatabaseFacade::setQueryPriorIds(const int* image_ids, size_t num){
+        mVisualDbImpl->mVdb->setPriorIds(image_ids, num);
+    }
+    
+    void VisualDatabaseFacade::setEarlyExit(bool b){
+        mVisualDbImpl->mVdb->setEarlyExit(b);
+    }
+    
+    bool VisualDatabaseFacade::earlyExit() const{
+        return mVisualDbImpl->mVdb->earlyExit();
+    }
+    
+    void VisualDatabaseFacade::setEarlyExitMargin(size_t margin){
+        mVisualDbImpl->mVdb->setEarlyExitMargin(margin);
+    }
+    
+    size_t VisualDatabaseFacade::earlyExitMargin() const{
+        return mVisualDbImpl->mVdb->earlyExitMargin();
+    }
+    
     bool VisualDatabaseFacade::erase(int image_id){
+        mVisualDbImpl->mBuiltIndexIds.erase(image_id);
         return mVisualDbImpl->mVdb->erase(image_id);
     }
     
+    void VisualDatabaseFacade::shareKeyframes(VisualDatabaseFacade& other){
+        mVisualDbImpl->mVdb->shareKeyframes(*other.mVisualDbImpl->mVdb);
+        mVisualDbImpl->mPoint3d = other.mVisualDbImpl->mPoint3d;
+        mVisualDbImpl->mBuiltIndexIds.clear();
+    }
+    
+    void VisualDatabaseFacade::moveKeyframe(VisualDatabaseFacade& other, int other_id, int image_id){
+        std::shared_ptr<Keyframe<96> > keyframe = other.mVisualDbImpl->mVdb->keyframe(other_id);
+        if(!keyframe) {
+            throw EXCEPTION("ID does not exist");
+        }
+        mVisualDbImpl->mVdb->addKeyframe(keyframe, image_id);
+        mVisualDbImpl->mPoint3d[image_id].swap(other.mVisualDbImpl->mPoint3d[other_id]);
+        if(other.mVisualDbImpl->mBuiltIndexIds.count(other_id)) {
+            mVisualDbImpl->mBuiltIndexIds.insert(image_id);
+        }
+        other.erase(other_id);
+        other.mVisualDbImpl->mPoint3d.erase(other_id);
+    }
+    
     const size_t VisualDatabaseFacade::databaseCount(){
         return mVisualDbImpl->mVdb->databaseCount();
     }
@@ -152,6 +296,107 @@ namespace vision {
         return mVisualDbImpl->mVdb->inliers();
     }
     
+    void VisualDatabaseFacade::setMaxNumCandidateKeyframes(size_t n){
+        mVisualDbImpl->mVdb->setMaxNumCandidateKeyframes(n);
+    }
+    
+    size_t VisualDatabaseFacade::maxNumCandidateKeyframes() const{
+        return mVisualDbImpl->mVdb->maxNumCandidateKeyframes();
+    }
+    
+    void VisualDatabaseFacade::buildGlobalIndex(){
+        mVisualDbImpl->mVdb->buildGlobalIndex();
+    }
+    
+    void VisualDatabaseFacade::setNumThreads(int n){
+        mVisualDbImpl->mVdb->setNumThreads(n);
+    }
+    
+    int VisualDatabaseFacade::numThreads() const{
+        return mVisualDbImpl->mVdb->numThreads();
+    }
+    
+    int VisualDatabaseFacade::loadIndexFile(const std::string& filename){
+        std::ifstream ifs(filename.c_str(), std::ios::binary);
+        if(!ifs.is_open()) {
+            return -1;
+        }
+        std::vector<char> data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        
+        IndexFileHeader header;
+        if(data.size() < sizeof(header)) {
+            return -1;
+        }
+        memcpy(&header, data.data(), sizeof(header));
+        const unsigned char* p = (const unsigned char*)data.data()+sizeof(header);
+        const unsigned char* end = (const unsigned char*)data.data()+data.size();
+        if(memcmp(header.magic, kIndexFileMagic, sizeof(header.magic)) != 0 ||
+           header.version != kIndexFileVersion ||
+           header.byteOrder != kIndexFileByteOrder ||
+           header.numBytesPerFeature != 96 ||
+           header.checksum != Checksum64(p, end-p)) {
+            return -1;
+        }
+        
+        index_cache_t entries;
+        for(uint32_t i = 0; i < header.numEntries; i++) {
+            uint64_t key, size;
+            if((size_t)(end-p) < 2*sizeof(uint64_t)) {
+                return -1;
+            }
+            memcpy(&key, p, sizeof(key));
+            memcpy(&size, p+sizeof(key), sizeof(size));
+            p += 2*sizeof(uint64_t);
+            if((uint64_t)(end-p) < size) {
+                return -1;
+            }
+            entries[key].assign(p, p+size);
+            p += size;
+        }
+        
+        for(index_cache_t::iterator it = entries.begin(); it != entries.end(); it++) {
+            mVisualDbImpl->mIndexCache[it->first].swap(it->second);
+        }
+        return (int)header.numEntries;
+    }
+    
+    bool VisualDatabaseFacade::saveIndexFile(const std::string& filename, const std::vector<int>& image_ids) const{
+        std::vector<unsigned char> payload;
+        for(size_t i = 0; i < image_ids.size(); i++) {
+            const vdb_t::keyframe_ptr_t keyframe = mVisualDbImpl->mVdb->keyframe(image_ids[i]);
+            if(!keyframe.get()) {
+                return false;
+            }
+            uint64_t key = DescriptorChecksum(keyframe->store());
+            size_t offset = payload.size();
+            payload.resize(offset+2*sizeof(uint64_t));
+            keyframe->saveIndex(payload);
+            uint64_t size = payload.size()-offset-2*sizeof(uint64_t);
+            memcpy(&payload[offset], &key, sizeof(key));
+            memcpy(&payload[offset+sizeof(key)], &size, sizeof(size));
+        }
+        
+        IndexFileHeader header;
+        memcpy(header.magic, kIndexFileMagic, sizeof(header.magic));
+        header.version = kIndexFileVersion;
+        header.byteOrder = kIndexFileByteOrder;
+        header.numBytesPerFeature = 96;
+        header.numEntries = (uint32_t)image_ids.size();
+        header.checksum = Checksum64(payload.data(), payload.size());
+        
+        std::ofstream ofs(filename.c_str(), std::ios::binary | std::ios::trunc);
+        if(!ofs.is_open()) {
+            return false;
+        }
+        ofs.write((const char*)&header, sizeof(header));
+        ofs.write((const char*)payload.data(), payload.size());
+        return ofs.good();
+    }
+    
+    bool VisualDatabaseFacade::indexWasBuilt(int image_id) const{
+        return mVisualDbImpl->mBuiltIndexIds.count(image_id) != 0;
+    }
+    
     int VisualDatabaseFacade::getWidth(int image_id) const{
         return mVisualDbImpl->mVdb->keyframe(image_id)->width();
     }
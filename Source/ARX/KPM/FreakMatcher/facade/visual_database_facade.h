@@ -36,15 +36,30 @@
 #pragma once
 
 #include <memory>
+#include <string>
 #include <vector>
 #include <matchers/feature_point.h>
 #include <utils/point.h>
 #include <matchers/matcher_types.h>
+#include <detectors/DoG_scale_invariant_detector.h>
 
 namespace vision {
 
     class VisualDatabaseImpl;
     
+    /**
+     * Features, descriptors and 3D points of one keyframe to add with
+     * VisualDatabaseFacade::addFreakKeyframes.
+     */
+    struct FreakKeyframeData {
+        std::vector<FeaturePoint> featurePoints;
+        std::vector<unsigned char> descriptors;
+        std::vector<vision::Point3d<float> > points3D;
+        size_t width;
+        size_t height;
+        int image_id;
+    };
+    
     class VisualDatabaseFacade {
     public:
         
@@ -60,6 +75,13 @@ namespace vision {
                                             size_t height,
                                             int image_id);
         
+        /**
+         * Add several keyframes at once. The feature indices are built (or read from
+         * the index cache) in parallel on the database's threads. The vectors in
+         * KEYFRAMES are moved into the database and left empty.
+         */
+        void addFreakKeyframes(std::vector<FreakKeyframeData>& keyframes);
+        
         void computeFreakFeaturesAndDescriptors(unsigned char* grayImage,
                                                 size_t width, size_t height,
                                                 std::vector<FeaturePoint>& featurePoints,
@@ -67,9 +89,51 @@ namespace vision {
         
         bool query(unsigned char* grayImage, size_t width, size_t height) ;
         
+        /**
+         * Query with the image downscaled by MODE, without storing the downscaled
+         * image. The query features are in the coordinates of the downscaled image.
+         */
+        bool query(unsigned char* grayImage, size_t width, size_t height, DownscaleMode mode);
+        
+        /**
+         * Set keyframes that queries do not match against, and regions of the query
+         * image in which no features are detected, in the coordinates the query
+         * features are in. Both apply to every query until they are set again.
+         */
+        void setQuerySkipIds(const int* image_ids, size_t num);
+        void setQuerySkipRegions(const SkipRegion* regions, size_t num);
+        
+        /**
+         * Set keyframes that early exit queries verify before all others, most
+         * likely first. They apply to every query until they are set again.
+         */
+        void setQueryPriorIds(const int* image_ids, size_t num);
+        
+        /**
+         * Set/Get early exit, and the number of inliers above the minimum a keyframe
+         * needs to end the query early. See VisualDatabase::setEarlyExit.
+         */
+        void setEarlyExit(bool b);
+        bool earlyExit() const;
+        void setEarlyExitMargin(size_t margin);
+        size_t earlyExitMargin() const;
+        
         
         bool erase(int image_id);
         
+        /**
+         * Use the keyframes of another database, e.g. to query the same keyframes from
+         * several threads with one database each. The keyframes and their indices are
+         * shared rather than copied.
+         */
+        void shareKeyframes(VisualDatabaseFacade& other);
+        
+        /**
+         * Move a keyframe, with its index and 3D points, from another database without
+         * building anything, e.g. one prepared on another thread. It is erased from OTHER.
+         */
+        void moveKeyframe(VisualDatabaseFacade& other, int other_id, int image_id);
+        
         const size_t databaseCount();
         
         int matchedId() ;
@@ -92,6 +156,37 @@ namespace vision {
         
         const matches_t& inliers() const;
         
+        void setMaxNumCandidateKeyframes(size_t n);
+        
+        size_t maxNumCandidateKeyframes() const;
+        
+        void buildGlobalIndex();
+        
+        void setNumThreads(int n);
+        
+        int numThreads() const;
+        
+        /**
+         * Read the keyframe indices in an index file written by saveIndexFile. Keyframes
+         * added afterwards whose descriptors match an entry reuse its index instead of
+         * building one. The indices read are released by the next addFreakKeyframes, and
+         * by addFreakFeaturesAndDescriptors once used.
+         * @return Number of indices read, or -1 if the file is missing or corrupt
+         */
+        int loadIndexFile(const std::string& filename);
+        
+        /**
+         * Write the indices of the given keyframes to an index file, each keyed by a
+         * checksum of the keyframe's descriptors.
+         */
+        bool saveIndexFile(const std::string& filename, const std::vector<int>& image_ids) const;
+        
+        /**
+         * @return True if the index of a keyframe was built when it was added, rather
+         * than read from an index file
+         */
+        bool indexWasBuilt(int image_id) const;
+        
     private:
         std::unique_ptr<VisualDatabaseImpl> mVisualDbImpl;
     }; // VisualDatabaseFacade
@@ -0,0 +1,93 @@
+//
+//  aligned_allocator.h
+//  artoolkitX
+//
+//  This file is part of artoolkitX.
+//
+//  artoolkitX is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  artoolkitX is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with artoolkitX.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders of this library give you
+//  permission to link this library with independent modules to produce an
+//  executable, regardless of the license terms of these independent modules, and to
+//  copy and distribute the resulting executable under terms of your choice,
+//  provided that you also meet, for each linked independent module, the terms and
+//  conditions of the license of that module. An independent module is a module
+//  which is neither derived from nor based on this library. If you modify this
+//  library, you may extend this exception to your version of the library, but you
+//  are not obligated to do so. If you do not wish to do so, delete this exception
+//  statement from your version.
+//
+//  Copyright 2024 artoolkitX Contributors.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace vision {
+    
+    /**
+     * Implements a standard allocator that aligns memory to ALIGNMENT bytes, so
+     * containers such as std::vector can hold data for aligned SIMD loads and
+     * start on a cache line boundary.
+     */
+    template<typename T, size_t ALIGNMENT>
+    class AlignedAllocator {
+    public:
+        
+        typedef T value_type;
+        typedef T* pointer;
+        typedef const T* const_pointer;
+        typedef T& reference;
+        typedef const T& const_reference;
+        typedef size_t size_type;
+        typedef ptrdiff_t difference_type;
+        
+        template<typename U>
+        struct rebind {
+            typedef AlignedAllocator<U, ALIGNMENT> other;
+        };
+        
+        AlignedAllocator() {}
+        template<typename U>
+        AlignedAllocator(const AlignedAllocator<U, ALIGNMENT>&) {}
+        
+        /**
+         * Allocate room for N objects. The block is over-allocated and the
+         * original pointer is stored just before the aligned address.
+         */
+        T* allocate(size_t n) {
+            const size_t size = n*sizeof(T) + ALIGNMENT + sizeof(void*);
+            unsigned char* raw = static_cast<unsigned char*>(::operator new(size));
+            uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1);
+            reinterpret_cast<void**>(aligned)[-1] = raw;
+            return reinterpret_cast<T*>(aligned);
+        }
+        
+        void deallocate(T* p, size_t) {
+            if(p != NULL) {
+                ::operator delete(reinterpret_cast<void**>(p)[-1]);
+            }
+        }
+        
+        template<typename U>
+        bool operator==(const AlignedAllocator<U, ALIGNMENT>&) const { return true; }
+        template<typename U>
+        bool operator!=(const AlignedAllocator<U, ALIGNMENT>&) const { return false; }
+        
+    }; // AlignedAllocator
+    
+} // vision
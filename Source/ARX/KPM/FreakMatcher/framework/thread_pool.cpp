@@ -0,0 +1,167 @@
+//
+//  thread_pool.cpp
+//  artoolkitX
+//
+//  This file is part of artoolkitX.
+//
+//  artoolkitX is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  artoolkitX is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with artoolkitX.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders of this library give you
+//  permission to link this library with independent modules to produce an
+//  executable, regardless of the license terms of these independent modules, and to
+//  copy and distribute the resulting executable under terms of your choice,
+//  provided that you also meet, for each linked independent module, the terms and
+//  conditions of the license of that module. An independent module is a module
+//  which is neither derived from nor based on this library. If you modify this
+//  library, you may extend this exception to your version of the library, but you
+//  are not obligated to do so. If you do not wish to do so, delete this exception
+//  statement from your version.
+//
+//  Copyright 2024 artoolkitX Contributors.
+//
+
+#include "thread_pool.h"
+#include "error.h"
+
+using namespace vision;
+
+ThreadPool::ThreadPool()
+: mTask(NULL)
+, mCount(0)
+, mNextIndex(0)
+, mGeneration(0)
+, mNumBusy(0)
+, mQuit(false) {}
+
+ThreadPool::~ThreadPool() {
+    stop();
+}
+
+void ThreadPool::setNumThreads(int n) {
+    std::lock_guard<std::mutex> run_lock(mRunMutex);
+    
+    if(n < 0) {
+        n = 0;
+    }
+    if(n == numThreads()) {
+        return;
+    }
+    
+    stop();
+    
+    mQuit = false;
+    mThreads.reserve(n);
+    for(int i = 0; i < n; i++) {
+        // Worker 0 is the thread calling PARALLELFOR
+        mThreads.push_back(std::thread(&ThreadPool::run, this, i+1, mGeneration));
+    }
+}
+
+void ThreadPool::parallelFor(int count, const task_t& task) {
+    if(count <= 0) {
+        return;
+    }
+    
+    std::lock_guard<std::mutex> run_lock(mRunMutex);
+    
+    // Not worth waking up the workers for a single task
+    if(mThreads.empty() || count == 1) {
+        for(int i = 0; i < count; i++) {
+            task(i, 0);
+        }
+        return;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mTask = &task;
+        mCount = count;
+        mNextIndex = 0;
+        mNumBusy = (int)mThreads.size();
+        mGeneration++;
+    }
+    mStartCondition.notify_all();
+    
+    work(0);
+    
+    std::unique_lock<std::mutex> lock(mMutex);
+    mDoneCondition.wait(lock, [this] { return mNumBusy == 0; });
+    mTask = NULL;
+    
+    // Rethrow here rather than on the worker, where it would terminate the program
+    if(mException) {
+        std::exception_ptr exception = mException;
+        mException = NULL;
+        lock.unlock();
+        std::rethrow_exception(exception);
+    }
+}
+
+void ThreadPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQuit = true;
+    }
+    mStartCondition.notify_all();
+    for(size_t i = 0; i < mThreads.size(); i++) {
+        mThreads[i].join();
+    }
+    mThreads.clear();
+}
+
+void ThreadPool::run(int worker, unsigned int generation) {
+    for(;;) {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mStartCondition.wait(lock, [this, generation] { return mQuit || mGeneration != generation; });
+            if(mQuit) {
+                return;
+            }
+            generation = mGeneration;
+        }
+        
+        work(worker);
+        
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            ASSERT(mNumBusy > 0, "Worker count underflow");
+            if(--mNumBusy == 0) {
+                mDoneCondition.notify_one();
+            }
+        }
+    }
+}
+
+void ThreadPool::work(int worker) {
+    for(;;) {
+        int index;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if(mNextIndex >= mCount) {
+                return;
+            }
+            index = mNextIndex++;
+        }
+        try {
+            (*mTask)(index, worker);
+        } catch(...) {
+            // Keep the first exception for PARALLELFOR, and start no more tasks
+            std::lock_guard<std::mutex> lock(mMutex);
+            if(!mException) {
+                mException = std::current_exception();
+            }
+            mNextIndex = mCount;
+        }
+    }
+}
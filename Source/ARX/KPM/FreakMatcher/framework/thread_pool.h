@@ -0,0 +1,133 @@
+//
+//  thread_pool.h
+//  artoolkitX
+//
+//  This file is part of artoolkitX.
+//
+//  artoolkitX is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  artoolkitX is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with artoolkitX.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders of this library give you
+//  permission to link this library with independent modules to produce an
+//  executable, regardless of the license terms of these independent modules, and to
+//  copy and distribute the resulting executable under terms of your choice,
+//  provided that you also meet, for each linked independent module, the terms and
+//  conditions of the license of that module. An independent module is a module
+//  which is neither derived from nor based on this library. If you modify this
+//  library, you may extend this exception to your version of the library, but you
+//  are not obligated to do so. If you do not wish to do so, delete this exception
+//  statement from your version.
+//
+//  Copyright 2024 artoolkitX Contributors.
+//
+
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+
+namespace vision {
+
+    /**
+     * Implements a persistent pool of worker threads to run data-parallel loops.
+     *
+     * The thread that calls PARALLELFOR also takes part in the work, so a pool with
+     * N threads runs a loop on up to N+1 cores. With zero threads (the default) the
+     * loop simply runs on the calling thread.
+     */
+    class ThreadPool {
+    public:
+        
+        typedef std::function<void(int index, int worker)> task_t;
+        
+        ThreadPool();
+        ~ThreadPool();
+        
+        /**
+         * Set the number of worker threads. Existing threads are stopped first.
+         */
+        void setNumThreads(int n);
+        
+        /**
+         * @return Number of worker threads.
+         */
+        inline int numThreads() const { return (int)mThreads.size(); }
+        
+        /**
+         * @return Number of threads that may run tasks at the same time, including the
+         * calling thread. Worker indices passed to tasks are in [0, concurrency()).
+         */
+        inline int concurrency() const { return numThreads()+1; }
+        
+        /**
+         * Call TASK(index, worker) for every index in [0, count), and wait until all
+         * calls have returned. WORKER identifies the thread running the task, and can
+         * be used to select per-thread scratch data. Calls on the same pool are
+         * serialized, and TASK must not call PARALLELFOR on the same pool. If a call
+         * throws, no more calls are started, and the first exception is rethrown on
+         * the calling thread once the calls already running have returned.
+         */
+        void parallelFor(int count, const task_t& task);
+        
+    private:
+        
+        // Worker threads
+        std::vector<std::thread> mThreads;
+        
+        // Serializes calls to PARALLELFOR
+        std::mutex mRunMutex;
+        
+        // Protects the job state below
+        std::mutex mMutex;
+        std::condition_variable mStartCondition;
+        std::condition_variable mDoneCondition;
+        
+        // Current job
+        const task_t* mTask;
+        int mCount;
+        int mNextIndex;
+        
+        // Incremented for every job so workers can tell a new job from a spurious wakeup
+        unsigned int mGeneration;
+        
+        // Number of worker threads still busy with the current job
+        int mNumBusy;
+        
+        // First exception thrown by a task of the current job
+        std::exception_ptr mException;
+        
+        // Set to true to ask the worker threads to exit
+        bool mQuit;
+        
+        /**
+         * Stop and join all worker threads.
+         */
+        void stop();
+        
+        /**
+         * Worker thread main loop. GENERATION is the last job the worker has seen.
+         */
+        void run(int worker, unsigned int generation);
+        
+        /**
+         * Run tasks of the current job until none are left.
+         */
+        void work(int worker);
+        
+    }; // ThreadPool
+    
+} // vision
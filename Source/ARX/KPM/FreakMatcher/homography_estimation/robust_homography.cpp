@@ -0,0 +1,359 @@
+//
+//  robust_homography.cpp
+//  artoolkitX
+//
+//  This file is part of artoolkitX.
+//
+//  artoolkitX is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  artoolkitX is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with artoolkitX.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders of this library give you
+//  permission to link this library with independent modules to produce an
+//  executable, regardless of the license terms of these independent modules, and to
+//  copy and distribute the resulting executable under terms of your choice,
+//  provided that you also meet, for each linked independent module, the terms and
+//  conditions of the license of that module. An independent module is a module
+//  which is neither derived from nor based on this library. If you modify this
+//  library, you may extend this exception to your version of the library, but you
+//  are not obligated to do so. If you do not wish to do so, delete this exception
+//  statement from your version.
+//
+//  Copyright 2024 artoolkitX Contributors.
+//
+
+#include "robust_homography.h"
+#include <framework/error.h>
+#include <framework/thread_pool.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define HOMOGRAPHY_SSE2 1
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#  define HOMOGRAPHY_NEON 1
+#  include <arm_neon.h>
+#endif
+
+namespace vision {
+    
+    namespace {
+        
+        // Extra elements at the end of each coordinate array, so vector loads can
+        // read past the last point
+        const int kPointPadding = 4;
+        
+        // Number of hypotheses scored by one task
+        const int kHypothesesPerTask = 32;
+        
+        // Cephes coefficients for log(x) with the mantissa in [sqrt(0.5),sqrt(2))
+        const float kLogSqrtHalf = 0.707106781186547524f;
+        const float kLogP0 = 7.0376836292E-2f;
+        const float kLogP1 = -1.1514610310E-1f;
+        const float kLogP2 = 1.1676998740E-1f;
+        const float kLogP3 = -1.2420140846E-1f;
+        const float kLogP4 = 1.4249322787E-1f;
+        const float kLogP5 = -1.6668057665E-1f;
+        const float kLogP6 = 2.0000714765E-1f;
+        const float kLogP7 = -2.4999993993E-1f;
+        const float kLogP8 = 3.3333331174E-1f;
+        const float kLogQ1 = -2.12194440E-4f;
+        const float kLogQ2 = 0.693359375f;
+        
+#if HOMOGRAPHY_SSE2
+        
+        /**
+         * Natural logarithm of 4 positive floats. The sign bit is ignored, and
+         * infinity or NaN give a value just above log(FLT_MAX).
+         */
+        inline __m128 log_ps(__m128 x) {
+            const __m128 one = _mm_set1_ps(1.f);
+            
+            // Split into exponent and mantissa in [0.5,1)
+            x = _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)));
+            __m128i exponent = _mm_srli_epi32(_mm_castps_si128(x), 23);
+            x = _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(~0x7f800000)));
+            x = _mm_or_ps(x, _mm_set1_ps(0.5f));
+            __m128 e = _mm_add_ps(_mm_cvtepi32_ps(_mm_sub_epi32(exponent, _mm_set1_epi32(0x7f))), one);
+            
+            // Move the mantissa to [sqrt(0.5),sqrt(2)) and subtract 1
+            __m128 mask = _mm_cmplt_ps(x, _mm_set1_ps(kLogSqrtHalf));
+            __m128 tmp = _mm_and_ps(x, mask);
+            x = _mm_sub_ps(x, one);
+            e = _mm_sub_ps(e, _mm_and_ps(one, mask));
+            x = _mm_add_ps(x, tmp);
+            
+            __m128 z = _mm_mul_ps(x, x);
+            __m128 y = _mm_set1_ps(kLogP0);
+            y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP1));
+            y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP2));
+            y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP3));
+            y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP4));
+            y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP5));
+            y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP6));
+            y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP7));
+            y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(kLogP8));
+            y = _mm_mul_ps(_mm_mul_ps(y, x), z);
+            
+            y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(kLogQ1)));
+            y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+            x = _mm_add_ps(x, y);
+            return _mm_add_ps(x, _mm_mul_ps(e, _mm_set1_ps(kLogQ2)));
+        }
+        
+#elif HOMOGRAPHY_NEON
+        
+        /**
+         * Natural logarithm of 4 positive floats. The sign bit is ignored, and
+         * infinity or NaN give a value just above log(FLT_MAX).
+         */
+        inline float32x4_t log_ps(float32x4_t x) {
+            const float32x4_t one = vdupq_n_f32(1.f);
+            
+            // Split into exponent and mantissa in [0.5,1)
+            uint32x4_t bits = vandq_u32(vreinterpretq_u32_f32(x), vdupq_n_u32(0x7fffffff));
+            int32x4_t exponent = vreinterpretq_s32_u32(vshrq_n_u32(bits, 23));
+            bits = vandq_u32(bits, vdupq_n_u32(~0x7f800000u));
+            bits = vorrq_u32(bits, vreinterpretq_u32_f32(vdupq_n_f32(0.5f)));
+            x = vreinterpretq_f32_u32(bits);
+            float32x4_t e = vaddq_f32(vcvtq_f32_s32(vsubq_s32(exponent, vdupq_n_s32(0x7f))), one);
+            
+            // Move the mantissa to [sqrt(0.5),sqrt(2)) and subtract 1
+            uint32x4_t mask = vcltq_f32(x, vdupq_n_f32(kLogSqrtHalf));
+            float32x4_t tmp = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(x), mask));
+            x = vsubq_f32(x, one);
+            e = vsubq_f32(e, vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(one), mask)));
+            x = vaddq_f32(x, tmp);
+            
+            float32x4_t z = vmulq_f32(x, x);
+            float32x4_t y = vdupq_n_f32(kLogP0);
+            y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(kLogP1));
+            y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(kLogP2));
+            y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(kLogP3));
+            y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(kLogP4));
+            y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(kLogP5));
+            y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(kLogP6));
+            y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(kLogP7));
+            y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(kLogP8));
+            y = vmulq_f32(vmulq_f32(y, x), z);
+            
+            y = vaddq_f32(y, vmulq_f32(e, vdupq_n_f32(kLogQ1)));
+            y = vsubq_f32(y, vmulq_f32(z, vdupq_n_f32(0.5f)));
+            x = vaddq_f32(x, y);
+            return vaddq_f32(x, vmulq_f32(e, vdupq_n_f32(kLogQ2)));
+        }
+        
+#endif
+        
+    } // anonymous namespace
+    
+    float CauchyProjectiveReprojectionCostSoA(const float H[9],
+                                              const float* px,
+                                              const float* py,
+                                              const float* qx,
+                                              const float* qy,
+                                              int num_points,
+                                              float one_over_scale2) {
+#if HOMOGRAPHY_SSE2
+        const __m128 h0 = _mm_set1_ps(H[0]), h1 = _mm_set1_ps(H[1]), h2 = _mm_set1_ps(H[2]);
+        const __m128 h3 = _mm_set1_ps(H[3]), h4 = _mm_set1_ps(H[4]), h5 = _mm_set1_ps(H[5]);
+        const __m128 h6 = _mm_set1_ps(H[6]), h7 = _mm_set1_ps(H[7]), h8 = _mm_set1_ps(H[8]);
+        const __m128 one = _mm_set1_ps(1.f);
+        const __m128 s = _mm_set1_ps(one_over_scale2);
+        const __m128i lanes = _mm_set_epi32(3, 2, 1, 0);
+        const __m128i n = _mm_set1_epi32(num_points);
+        
+        __m128 sum = _mm_setzero_ps();
+        for(int i = 0; i < num_points; i += 4) {
+            __m128 x = _mm_loadu_ps(px+i);
+            __m128 y = _mm_loadu_ps(py+i);
+            
+            // Same operations as MultiplyPointHomographyInhomogenous
+            __m128 w = _mm_add_ps(_mm_add_ps(_mm_mul_ps(h6, x), _mm_mul_ps(h7, y)), h8);
+            __m128 xp = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(h0, x), _mm_mul_ps(h1, y)), h2), w);
+            __m128 yp = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(h3, x), _mm_mul_ps(h4, y)), h5), w);
+            
+            __m128 fx = _mm_sub_ps(xp, _mm_loadu_ps(qx+i));
+            __m128 fy = _mm_sub_ps(yp, _mm_loadu_ps(qy+i));
+            __m128 cost = log_ps(_mm_add_ps(one, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(fx, fx), _mm_mul_ps(fy, fy)), s)));
+            
+            // Drop the lanes past the last point
+            __m128i valid = _mm_cmplt_epi32(_mm_add_epi32(_mm_set1_epi32(i), lanes), n);
+            sum = _mm_add_ps(sum, _mm_and_ps(cost, _mm_castsi128_ps(valid)));
+        }
+        
+        float lane_sums[4];
+        _mm_storeu_ps(lane_sums, sum);
+        return (lane_sums[0]+lane_sums[1])+(lane_sums[2]+lane_sums[3]);
+#elif HOMOGRAPHY_NEON
+        const float32x4_t one = vdupq_n_f32(1.f);
+        const float32x4_t s = vdupq_n_f32(one_over_scale2);
+        const int32_t lane_ids[4] = {0, 1, 2, 3};
+        const int32x4_t lanes = vld1q_s32(lane_ids);
+        const int32x4_t n = vdupq_n_s32(num_points);
+        
+        float32x4_t sum = vdupq_n_f32(0);
+        for(int i = 0; i < num_points; i += 4) {
+            float32x4_t x = vld1q_f32(px+i);
+            float32x4_t y = vld1q_f32(py+i);
+            
+            // Same operations as MultiplyPointHomographyInhomogenous
+            float32x4_t w = vaddq_f32(vaddq_f32(vmulq_n_f32(x, H[6]), vmulq_n_f32(y, H[7])), vdupq_n_f32(H[8]));
+            float32x4_t xn = vaddq_f32(vaddq_f32(vmulq_n_f32(x, H[0]), vmulq_n_f32(y, H[1])), vdupq_n_f32(H[2]));
+            float32x4_t yn = vaddq_f32(vaddq_f32(vmulq_n_f32(x, H[3]), vmulq_n_f32(y, H[4])), vdupq_n_f32(H[5]));
+#  if defined(__aarch64__)
+            float32x4_t xp = vdivq_f32(xn, w);
+            float32x4_t yp = vdivq_f32(yn, w);
+#  else
+            // ARMv7 has no vector divide. Refine the reciprocal estimate twice.
+            float32x4_t r = vrecpeq_f32(w);
+            r = vmulq_f32(vrecpsq_f32(w, r), r);
+            r = vmulq_f32(vrecpsq_f32(w, r), r);
+            float32x4_t xp = vmulq_f32(xn, r);
+            float32x4_t yp = vmulq_f32(yn, r);
+#  endif
+            
+            float32x4_t fx = vsubq_f32(xp, vld1q_f32(qx+i));
+            float32x4_t fy = vsubq_f32(yp, vld1q_f32(qy+i));
+            float32x4_t cost = log_ps(vaddq_f32(one, vmulq_f32(vaddq_f32(vmulq_f32(fx, fx), vmulq_f32(fy, fy)), s)));
+            
+            // Drop the lanes past the last point
+            uint32x4_t valid = vcltq_s32(vaddq_s32(vdupq_n_s32(i), lanes), n);
+            sum = vaddq_f32(sum, vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(cost), valid)));
+        }
+        
+        float lane_sums[4];
+        vst1q_f32(lane_sums, sum);
+        return (lane_sums[0]+lane_sums[1])+(lane_sums[2]+lane_sums[3]);
+#else
+        float total_cost = 0;
+        for(int i = 0; i < num_points; i++) {
+            const float p[2] = {px[i], py[i]};
+            const float q[2] = {qx[i], qy[i]};
+            total_cost += CauchyProjectiveReprojectionCost(H, p, q, one_over_scale2);
+        }
+        return total_cost;
+#endif
+    }
+    
+    bool PreemptiveRobustHomography(float H[9],
+                                    const float* p,
+                                    const float* q,
+                                    int num_points,
+                                    const float* test_points,
+                                    int num_test_points,
+                                    std::vector<float> &hyp,
+                                    std::vector<int> &tmp_i,
+                                    std::vector< std::pair<float, int> > &hyp_costs,
+                                    std::vector<float> &tmp_points,
+                                    ThreadPool* pool,
+                                    float scale,
+                                    int max_num_hypotheses,
+                                    int max_trials,
+                                    int chunk_size) {
+        const int sample_size = 4;
+        
+        ASSERT(hyp.size() >= (size_t)(9*max_num_hypotheses), "hyp vector should be of size 9*max_num_hypotheses");
+        ASSERT(tmp_i.size() >= (size_t)num_points, "tmp_i vector should be of size num_points");
+        ASSERT(hyp_costs.size() >= (size_t)max_num_hypotheses, "hyp_costs vector should be of size max_num_hypotheses");
+        
+        // We need at least SAMPLE_SIZE points to sample from
+        if(num_points < sample_size) {
+            return false;
+        }
+        
+        int* hyp_perm = &tmp_i[0];
+        
+        float one_over_scale2 = 1/sqr(scale);
+        chunk_size = min2(chunk_size, num_points);
+        
+        int num_hypotheses = ComputeHomographyHypotheses(&hyp[0],
+                                                         hyp_perm,
+                                                         p,
+                                                         q,
+                                                         num_points,
+                                                         test_points,
+                                                         num_test_points,
+                                                         max_num_hypotheses,
+                                                         max_trials,
+                                                         1234);
+        
+        // We fail if no hypotheses could be computed
+        if(num_hypotheses == 0) {
+            return false;
+        }
+        
+        // Copy the points in the order they are scored, so every chunk is a
+        // contiguous range of each coordinate array
+        const int stride = num_points+kPointPadding;
+        tmp_points.assign(4*stride, 0);
+        float* px = &tmp_points[0];
+        float* py = px+stride;
+        float* qx = py+stride;
+        float* qy = qx+stride;
+        for(int i = 0; i < num_points; i++) {
+            px[i] = p[hyp_perm[i]<<1];
+            py[i] = p[(hyp_perm[i]<<1)+1];
+            qx[i] = q[hyp_perm[i]<<1];
+            qy[i] = q[(hyp_perm[i]<<1)+1];
+        }
+        
+        // Initialize the hypotheses costs
+        for(int i = 0; i < num_hypotheses; i++) {
+            hyp_costs[i].first = 0;
+            hyp_costs[i].second = i;
+        }
+        
+        int num_hypotheses_remaining = num_hypotheses;
+        int cur_chunk_size = chunk_size;
+        
+        for(int i = 0;
+            i < num_points && num_hypotheses_remaining > 2;
+            i+=cur_chunk_size) {
+            
+            // Size of the current chunk
+            cur_chunk_size = min2(chunk_size, num_points-i);
+            
+            // Score each of the remaining hypotheses. Every hypothesis is scored by a
+            // single task, so the costs do not depend on the number of threads.
+            int num_tasks = (num_hypotheses_remaining+kHypothesesPerTask-1)/kHypothesesPerTask;
+            ThreadPool::task_t task = [&](int index, int) {
+                int end = min2((index+1)*kHypothesesPerTask, num_hypotheses_remaining);
+                for(int j = index*kHypothesesPerTask; j < end; j++) {
+                    hyp_costs[j].first += CauchyProjectiveReprojectionCostSoA(&hyp[hyp_costs[j].second*9],
+                                                                              px+i,
+                                                                              py+i,
+                                                                              qx+i,
+                                                                              qy+i,
+                                                                              cur_chunk_size,
+                                                                              one_over_scale2);
+                }
+            };
+            if(pool == NULL || pool->numThreads() == 0 || num_tasks == 1) {
+                for(int t = 0; t < num_tasks; t++) {
+                    task(t, 0);
+                }
+            } else {
+                pool->parallelFor(num_tasks, task);
+            }
+            
+            // Cut out half of the hypotheses
+            FastMedian(&hyp_costs[0], num_hypotheses_remaining);
+            num_hypotheses_remaining = num_hypotheses_remaining>>1;
+        }
+        
+        // Find the best hypothesis
+        SelectBestHypothesis(H, &hyp[0], &hyp_costs[0], num_hypotheses_remaining);
+        
+        return true;
+    }
+    
+} // vision
@@ -91,47 +91,27 @@ namespace vision {
     }
     
     /**
-     * Robustly solve for the homography given a set of correspondences. 
+     * Shuffle the points and compute up to MAX_NUM_HYPOTHESES homographies from
+     * random samples of 4 points. The sequence only depends on the seed.
+     *
+     * @param[out] hyp 9*max_num_hypotheses hypotheses
+     * @param[out] hyp_perm num_points shuffled point indices
+     * @return Number of hypotheses
      */
     template<typename T>
-    bool PreemptiveRobustHomography(T H[9],
+    int ComputeHomographyHypotheses(T* hyp,
+                                    int* hyp_perm,
                                     const T* p,
                                     const T* q,
                                     int num_points,
                                     const T* test_points,
                                     int num_test_points,
-                                    std::vector<T> &hyp /* 9*max_num_hypotheses */,
-                                    std::vector<int> &tmp_i /* num_points */,
-                                    std::vector< std::pair<T, int> > &hyp_costs /* max_num_hypotheses */,
-                                    T scale = HOMOGRAPHY_DEFAULT_CAUCHY_SCALE,
-                                    int max_num_hypotheses = HOMOGRAPHY_DEFAULT_NUM_HYPOTHESES,
-                                    int max_trials = HOMOGRAPHY_DEFAULT_MAX_TRIALS,
-                                    int chunk_size = HOMOGRAPHY_DEFAULT_CHUNK_SIZE) {
-        int* hyp_perm;
-        T one_over_scale2;
-        T min_cost;
-        int num_hypotheses, num_hypotheses_remaining, min_index;
-        int cur_chunk_size, this_chunk_end;
-        int trial;
-        int seed;
+                                    int max_num_hypotheses,
+                                    int max_trials,
+                                    int seed) {
+        int num_hypotheses, trial;
         int sample_size = 4;
         
-        ASSERT(hyp.size() >= 9*max_num_hypotheses, "hyp vector should be of size 9*max_num_hypotheses");
-        ASSERT(tmp_i.size() >= num_points, "tmp_i vector should be of size num_points");
-        ASSERT(hyp_costs.size() >= max_num_hypotheses, "hyp_costs vector should be of size max_num_hypotheses");
-        
-        // We need at least SAMPLE_SIZE points to sample from
-        if(num_points < sample_size) {
-            return false;
-        }
-        
-        seed = 1234;
-        
-        hyp_perm = &tmp_i[0];
-
-        one_over_scale2 = 1/sqr(scale);
-        chunk_size = min2(chunk_size, num_points);
-        
         // Fill arrays from [0)
         SequentialVector(hyp_perm, num_points, 0);
 
@@ -181,6 +161,80 @@ namespace vision {
             num_hypotheses++;
         }
         
+        return num_hypotheses;
+    }
+    
+    /**
+     * Copy the hypothesis with the lowest cost among the first NUM_HYPOTHESES
+     * entries of HYP_COSTS to H.
+     */
+    template<typename T>
+    void SelectBestHypothesis(T H[9],
+                              const T* hyp,
+                              const std::pair<T, int>* hyp_costs,
+                              int num_hypotheses) {
+        int min_index = hyp_costs[0].second;
+        T min_cost = hyp_costs[0].first;
+        for(int i = 1; i < num_hypotheses; i++) {
+            if(hyp_costs[i].first < min_cost ) {
+                min_cost = hyp_costs[i].first;
+                min_index = hyp_costs[i].second;
+            }
+        }
+        
+        // Move the best hypothesis
+        CopyVector9(H, &hyp[min_index*9]);
+        NormalizeHomography(H);
+    }
+    
+    /**
+     * Robustly solve for the homography given a set of correspondences. 
+     */
+    template<typename T>
+    bool PreemptiveRobustHomography(T H[9],
+                                    const T* p,
+                                    const T* q,
+                                    int num_points,
+                                    const T* test_points,
+                                    int num_test_points,
+                                    std::vector<T> &hyp /* 9*max_num_hypotheses */,
+                                    std::vector<int> &tmp_i /* num_points */,
+                                    std::vector< std::pair<T, int> > &hyp_costs /* max_num_hypotheses */,
+                                    T scale = HOMOGRAPHY_DEFAULT_CAUCHY_SCALE,
+                                    int max_num_hypotheses = HOMOGRAPHY_DEFAULT_NUM_HYPOTHESES,
+                                    int max_trials = HOMOGRAPHY_DEFAULT_MAX_TRIALS,
+                                    int chunk_size = HOMOGRAPHY_DEFAULT_CHUNK_SIZE) {
+        int* hyp_perm;
+        T one_over_scale2;
+        int num_hypotheses, num_hypotheses_remaining;
+        int cur_chunk_size, this_chunk_end;
+        int sample_size = 4;
+        
+        ASSERT(hyp.size() >= 9*max_num_hypotheses, "hyp vector should be of size 9*max_num_hypotheses");
+        ASSERT(tmp_i.size() >= num_points, "tmp_i vector should be of size num_points");
+        ASSERT(hyp_costs.size() >= max_num_hypotheses, "hyp_costs vector should be of size max_num_hypotheses");
+        
+        // We need at least SAMPLE_SIZE points to sample from
+        if(num_points < sample_size) {
+            return false;
+        }
+        
+        hyp_perm = &tmp_i[0];
+
+        one_over_scale2 = 1/sqr(scale);
+        chunk_size = min2(chunk_size, num_points);
+        
+        num_hypotheses = ComputeHomographyHypotheses(&hyp[0],
+                                                     hyp_perm,
+                                                     p,
+                                                     q,
+                                                     num_points,
+                                                     test_points,
+                                                     num_test_points,
+                                                     max_num_hypotheses,
+                                                     max_trials,
+                                                     1234);
+        
         // We fail if no hypotheses could be computed
         if(num_hypotheses == 0) {
             return false;
@@ -222,22 +276,86 @@ namespace vision {
         }
         
         // Find the best hypothesis
-        min_index = hyp_costs[0].second;
-        min_cost = hyp_costs[0].first;
-        for(int i = 1; i < num_hypotheses_remaining; i++) {
-            if(hyp_costs[i].first < min_cost ) {
-                min_cost = hyp_costs[i].first;
-                min_index = hyp_costs[i].second;
-            }
-        }
-        
-        // Move the best hypothesis
-        CopyVector9(H, &hyp[min_index*9]);
-        NormalizeHomography(H);
+        SelectBestHypothesis(H, &hyp[0], &hyp_costs[0], num_hypotheses_remaining);
         
         return true;
     }
     
+    class ThreadPool;
+    
+    /**
+     * Compute the sum of the Cauchy reprojection costs for H*p_i-q_i, with the
+     * points stored as separate coordinate arrays. The arrays must be readable up
+     * to 3 elements past NUM_POINTS. The points are scored 4 at a time with SSE2 or
+     * NEON, using a vector logarithm. Non-finite residuals get a large finite cost.
+     */
+    float CauchyProjectiveReprojectionCostSoA(const float H[9],
+                                              const float* px,
+                                              const float* py,
+                                              const float* qx,
+                                              const float* qy,
+                                              int num_points,
+                                              float one_over_scale2);
+    
+    /**
+     * Same as PreemptiveRobustHomography, but each round of the preemption scores
+     * the chunk with CauchyProjectiveReprojectionCostSoA and splits the remaining
+     * hypotheses across POOL, which may be NULL. The cost of each hypothesis is
+     * always summed in the same order, so the result only depends on the seed and
+     * not on the number of threads.
+     *
+     * @param[in] tmp_points Temporary memory for the shuffled points
+     */
+    bool PreemptiveRobustHomography(float H[9],
+                                    const float* p,
+                                    const float* q,
+                                    int num_points,
+                                    const float* test_points,
+                                    int num_test_points,
+                                    std::vector<float> &hyp /* 9*max_num_hypotheses */,
+                                    std::vector<int> &tmp_i /* num_points */,
+                                    std::vector< std::pair<float, int> > &hyp_costs /* max_num_hypotheses */,
+                                    std::vector<float> &tmp_points,
+                                    ThreadPool* pool,
+                                    float scale,
+                                    int max_num_hypotheses,
+                                    int max_trials,
+                                    int chunk_size);
+    
+    /**
+     * Types without a vectorized cost use the serial estimator.
+     */
+    template<typename T>
+    bool PreemptiveRobustHomography(T H[9],
+                                    const T* p,
+                                    const T* q,
+                                    int num_points,
+                                    const T* test_points,
+                                    int num_test_points,
+                                    std::vector<T> &hyp,
+                                    std::vector<int> &tmp_i,
+                                    std::vector< std::pair<T, int> > &hyp_costs,
+                                    std::vector<T> &tmp_points,
+                                    ThreadPool* pool,
+                                    T scale,
+                                    int max_num_hypotheses,
+                                    int max_trials,
+                                    int chunk_size) {
+        return PreemptiveRobustHomography<T>(H,
+                                             p,
+                                             q,
+                                             num_points,
+                                             test_points,
+                                             num_test_points,
+                                             hyp,
+                                             tmp_i,
+                                             hyp_costs,
+                                             scale,
+                                             max_num_hypotheses,
+                                             max_trials,
+                                             chunk_size);
+    }
+    
     /**
      * Compute the Lie Basis Jacobian for the homography.
      *
@@ -593,12 +711,21 @@ namespace vision {
         bool find(float H[9], const T* p, const T* q, int num_points);
         bool find(float H[9], const T* p, const T* q, int num_points, const T* test_points, int num_test_points);
         
+        /**
+         * Set the thread pool used to score the hypotheses. May be NULL.
+         */
+        inline void setThreadPool(ThreadPool* pool) { mThreadPool = pool; }
+        
     private:
         
         // Temporary memory for RANSAC
         std::vector<T> mHyp;
         std::vector<int> mTmpi;
         std::vector< std::pair<T, int> > mHypCosts;
+        std::vector<T> mTmpPoints;
+        
+        // Thread pool used to score the hypotheses
+        ThreadPool* mThreadPool;
         
         // RANSAC params
         T mCauchyScale;
@@ -612,7 +739,8 @@ namespace vision {
     RobustHomography<T>::RobustHomography(T cauchyScale,
                                           int maxNumHypotheses,
                                           int maxTrials,
-                                          int chunkSize) {
+                                          int chunkSize)
+    : mThreadPool(NULL) {
         init(cauchyScale, maxNumHypotheses, maxTrials, chunkSize);
     }
     
@@ -633,19 +761,21 @@ namespace vision {
     template<typename T>
     bool RobustHomography<T>::find(float H[9], const T* p, const T* q, int num_points) {
         mTmpi.resize(num_points);
-        if(!PreemptiveRobustHomography<T>(H,
-                                          p,
-                                          q,
-                                          num_points,
-                                          0,
-                                          0,
-                                          mHyp,
-                                          mTmpi,
-                                          mHypCosts,
-                                          mCauchyScale,
-                                          mMaxNumHypotheses,
-                                          mMaxTrials,
-                                          mChunkSize)) {
+        if(!PreemptiveRobustHomography(H,
+                                       p,
+                                       q,
+                                       num_points,
+                                       0,
+                                       0,
+                                       mHyp,
+                                       mTmpi,
+                                       mHypCosts,
+                                       mTmpPoints,
+                                       mThreadPool,
+                                       mCauchyScale,
+                                       mMaxNumHypotheses,
+                                       mMaxTrials,
+                                       mChunkSize)) {
             return false;
         }
         
@@ -655,19 +785,21 @@ namespace vision {
     template<typename T>
     bool RobustHomography<T>::find(float H[9], const T* p, const T* q, int num_points, const T* test_points, int num_test_points) {
         mTmpi.resize(num_points);
-        return PreemptiveRobustHomography<T>(H,
-                                             p,
-                                             q,
-                                             num_points,
-                                             test_points,
-                                             num_test_points,
-                                             mHyp,
-                                             mTmpi,
-                                             mHypCosts,
-                                             mCauchyScale,
-                                             mMaxNumHypotheses,
-                                             mMaxTrials,
-                                             mChunkSize);
+        return PreemptiveRobustHomography(H,
+                                          p,
+                                          q,
+                                          num_points,
+                                          test_points,
+                                          num_test_points,
+                                          mHyp,
+                                          mTmpi,
+                                          mHypCosts,
+                                          mTmpPoints,
+                                          mThreadPool,
+                                          mCauchyScale,
+                                          mMaxNumHypotheses,
+                                          mMaxTrials,
+                                          mChunkSize);
     }
     
 } // vision
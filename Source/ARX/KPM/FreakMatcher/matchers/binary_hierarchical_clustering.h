@@ -37,6 +37,7 @@
 
 #include "kmedoids.h"
 
+#include <cstring>
 #include <limits>
 #include <unordered_map>
 #include <queue>
@@ -116,6 +117,11 @@ namespace vision {
          */
         inline node_id_t id() const { return mId; }
         
+        /**
+         * @return Feature center
+         */
+        inline const unsigned char* center() const { return mCenter; }
+        
         /**
          * Set/Get leaf flag
          */
@@ -136,15 +142,19 @@ namespace vision {
         
         /**
          * Get a queue of all the children nodes sorted by distance from node center.
+         * The nearest children are appended to NODES. DISTANCES is used to hold the
+         * distance to each child.
          */
         inline void nearest(std::vector<const node_t*>& nodes,
                             queue_t& queue,
+                            std::vector<queue_item_t>& distances,
                             const unsigned char* feature) const {
             unsigned int mind = std::numeric_limits<unsigned int>::max();
             int mini = -1;
             
             // Compute the distance to each cluster center
-            std::vector<queue_item_t> v(mChildren.size());
+            std::vector<queue_item_t>& v = distances;
+            v.resize(mChildren.size());
             for(size_t i = 0; i < v.size(); i++) {
                 unsigned int d = HammingDistance<NUM_BYTES_PER_FEATURE>(mChildren[i]->mCenter, feature);
                 v[i] = queue_item_t(mChildren[i], d);
@@ -204,6 +214,68 @@ namespace vision {
         CopyVector(mCenter, center, NUM_BYTES_PER_FEATURE);
     }
     
+    // Forward declaration
+    template<int NUM_BYTES_PER_FEATURE>
+    class BinaryHierarchicalClustering;
+    
+    /**
+     * Holds the state of a single QUERY on a BinaryHierarchicalClustering tree. The tree
+     * itself is not modified by a query, so one tree can be searched from several threads
+     * at the same time as long as each thread uses its own context.
+     */
+    template<int NUM_BYTES_PER_FEATURE>
+    class BinaryHierarchicalClusteringQueryContext {
+    public:
+        
+        typedef PriorityQueueItem<NUM_BYTES_PER_FEATURE> queue_item_t;
+        typedef std::priority_queue<queue_item_t> queue_t;
+        
+        BinaryHierarchicalClusteringQueryContext()
+        : mNumNodesPopped(0) {}
+        ~BinaryHierarchicalClusteringQueryContext() {}
+        
+        /**
+         * @return Reverse index after a QUERY.
+         */
+        inline const std::vector<int>& reverseIndex() const { return mReverseIndex; }
+        
+        /**
+         * @return Number of nodes popped off the priority queue during the last QUERY.
+         */
+        inline int numNodesPopped() const { return mNumNodesPopped; }
+        
+        /**
+         * Reset the state for a new query. Allocated memory is kept.
+         */
+        inline void clear() {
+            mNumNodesPopped = 0;
+            mReverseIndex.clear();
+            while(!mQueue.empty()) {
+                mQueue.pop();
+            }
+        }
+        
+    private:
+        
+        friend class BinaryHierarchicalClustering<NUM_BYTES_PER_FEATURE>;
+        
+        // Node queue
+        queue_t mQueue;
+        
+        // Stack of the nearest nodes still to be visited at each level
+        std::vector<const Node<NUM_BYTES_PER_FEATURE>*> mNodes;
+        
+        // Distance from the feature to each child of a node
+        std::vector<queue_item_t> mDistances;
+        
+        // Number of nodes popped off the priority queue
+        int mNumNodesPopped;
+        
+        // Reverse index for query
+        std::vector<int> mReverseIndex;
+        
+    }; // BinaryHierarchicalClusteringQueryContext
+    
     /**
      * Implements hierarchical clustering for binary features. This can
      * be used for fast nearest neighbor search.
@@ -219,6 +291,7 @@ namespace vision {
         
         typedef PriorityQueueItem<NUM_BYTES_PER_FEATURE> queue_item_t;
         typedef std::priority_queue<queue_item_t> queue_t;
+        typedef BinaryHierarchicalClusteringQueryContext<NUM_BYTES_PER_FEATURE> query_context_t;
         
         BinaryHierarchicalClustering();
         ~BinaryHierarchicalClustering() {}
@@ -229,14 +302,36 @@ namespace vision {
         void build(const unsigned char* features, int num_features);
         
         /**
-         * Query the tree for a reverse index.
+         * Query the tree for a reverse index. The result is stored in CONTEXT and the
+         * tree is not modified, so this may be called concurrently with separate contexts.
+         * @return Number of indices in the reverse index
+         */
+        int query(query_context_t& context, const unsigned char* feature) const;
+        
+        /**
+         * Query the tree for a reverse index using the tree's own context. This
+         * is not reentrant.
          */
         int query(const unsigned char* feature) const;
         
         /**
-         * @return Reverse index after a QUERY.
+         * @return Reverse index after a QUERY with the tree's own context.
+         */
+        inline const std::vector<int>& reverseIndex() const { return mQueryContext.reverseIndex(); }
+        
+        /**
+         * Append the tree and its parameters to DATA. The features are not
+         * included, so the tree can only be restored over the features it was
+         * built from.
+         */
+        void write(std::vector<unsigned char>& data) const;
+        
+        /**
+         * Restore a tree saved with WRITE over NUM_FEATURES features. The tree must
+         * have been saved with the parameters currently set.
+         * @return False if the data is malformed or the parameters differ
          */
-        inline const std::vector<int>& reverseIndex() const { return mQueryReverseIndex; }
+        bool read(const unsigned char* data, size_t size, int num_features);
 
         /**
          * Set/Get number of hypotheses
@@ -276,14 +371,8 @@ namespace vision {
         // Clustering algorithm
         kmedoids_t mBinarykMedoids;
         
-        // Reverse index for query
-        mutable std::vector<int> mQueryReverseIndex;
-        
-        // Node queue
-        mutable queue_t mQueue;
-        
-        // Number of nodes popped off the priority queue
-        mutable int mNumNodesPopped;
+        // Context for queries without a caller supplied context
+        mutable query_context_t mQueryContext;
         
         // Maximum nodes to pop off the priority queue
         int mMaxNodesToPop;
@@ -311,7 +400,36 @@ namespace vision {
         /**
          * Recursive function query function.
          */
-        void query(queue_t& queue, const node_t* node, const unsigned char* feature) const;
+        void query(query_context_t& context, const node_t* node, const unsigned char* feature) const;
+        
+        /**
+         * Recursive functions to write and read a node and its children.
+         */
+        void write(std::vector<unsigned char>& data, const node_t* node) const;
+        node_t* read(const unsigned char*& p,
+                     const unsigned char* end,
+                     int num_features,
+                     int depth,
+                     int& num_indices,
+                     int& max_id) const;
+        
+        /**
+         * Append/Read a plain value.
+         */
+        template<typename T>
+        static void writeValue(std::vector<unsigned char>& data, const T& value) {
+            const unsigned char* bytes = (const unsigned char*)&value;
+            data.insert(data.end(), bytes, bytes+sizeof(T));
+        }
+        template<typename T>
+        static bool readValue(const unsigned char*& p, const unsigned char* end, T& value) {
+            if((size_t)(end-p) < sizeof(T)) {
+                return false;
+            }
+            memcpy(&value, p, sizeof(T));
+            p += sizeof(T);
+            return true;
+        }
         
     }; // BinaryHierarchicalClustering
 
@@ -320,7 +438,6 @@ namespace vision {
     : mRandSeed(1234)
     , mNextNodeId(0)
     , mBinarykMedoids(mRandSeed)
-    , mNumNodesPopped(0)
     , mMaxNodesToPop(0)
     , mMinFeaturePerNode(16) {
         mBinarykMedoids.setk(8);
@@ -402,46 +519,181 @@ namespace vision {
     }
     
     template<int NUM_BYTES_PER_FEATURE>
-    int BinaryHierarchicalClustering<NUM_BYTES_PER_FEATURE>::query(const unsigned char* feature) const {
+    int BinaryHierarchicalClustering<NUM_BYTES_PER_FEATURE>::query(query_context_t& context,
+                                                                   const unsigned char* feature) const {
         ASSERT(mRoot.get(), "Root cannot be NULL");
         
-        mNumNodesPopped = 0;
-        mQueryReverseIndex.clear();
-        
-        while(!mQueue.empty()) {
-            mQueue.pop();
-        }
+        context.clear();
         
-        query(mQueue, mRoot.get(), feature);
+        query(context, mRoot.get(), feature);
         
-        return (int)mQueryReverseIndex.size();
+        return (int)context.mReverseIndex.size();
+    }
+    
+    template<int NUM_BYTES_PER_FEATURE>
+    int BinaryHierarchicalClustering<NUM_BYTES_PER_FEATURE>::query(const unsigned char* feature) const {
+        return query(mQueryContext, feature);
     }
     
     template<int NUM_BYTES_PER_FEATURE>
-    void BinaryHierarchicalClustering<NUM_BYTES_PER_FEATURE>::query(queue_t& queue,
+    void BinaryHierarchicalClustering<NUM_BYTES_PER_FEATURE>::query(query_context_t& context,
                                                                     const node_t* node,
                                                                     const unsigned char* feature) const {
         if(node->leaf()) {
             // Insert all the leaf indices into the query index
-            mQueryReverseIndex.insert(mQueryReverseIndex.end(),
-                                      node->reverseIndex().begin(),
-                                      node->reverseIndex().end());
+            context.mReverseIndex.insert(context.mReverseIndex.end(),
+                                         node->reverseIndex().begin(),
+                                         node->reverseIndex().end());
             return;
         } else {
-            std::vector<const node_t*> nodes;
-            node->nearest(nodes, queue, feature);
-            for(size_t i = 0; i < nodes.size(); i++) {
-                query(queue, nodes[i], feature);
+            // The nearest nodes are pushed onto the context stack, which the
+            // recursion grows and shrinks above them, so no allocation is needed
+            // once the stack has grown to the depth of the tree.
+            const size_t first = context.mNodes.size();
+            node->nearest(context.mNodes, context.mQueue, context.mDistances, feature);
+            const size_t last = context.mNodes.size();
+            for(size_t i = first; i < last; i++) {
+                query(context, context.mNodes[i], feature);
             }
+            context.mNodes.resize(first);
             
             // Pop a node from the queue
-            if(mNumNodesPopped < mMaxNodesToPop && !queue.empty()) {
-                const node_t* q = queue.top().node();
-                queue.pop();
-                mNumNodesPopped++;
-                query(queue, q, feature);
+            if(context.mNumNodesPopped < mMaxNodesToPop && !context.mQueue.empty()) {
+                const node_t* q = context.mQueue.top().node();
+                context.mQueue.pop();
+                context.mNumNodesPopped++;
+                query(context, q, feature);
+            }
+        }
+    }
+    
+    template<int NUM_BYTES_PER_FEATURE>
+    void BinaryHierarchicalClustering<NUM_BYTES_PER_FEATURE>::write(std::vector<unsigned char>& data) const {
+        ASSERT(mRoot.get(), "Root cannot be NULL");
+        
+        int num_features = 0;
+        std::vector<const node_t*> stack(1, mRoot.get());
+        while(!stack.empty()) {
+            const node_t* node = stack.back();
+            stack.pop_back();
+            num_features += (int)node->reverseIndex().size();
+            stack.insert(stack.end(), node->children().begin(), node->children().end());
+        }
+        
+        writeValue(data, (int32_t)numHypotheses());
+        writeValue(data, (int32_t)numCenters());
+        writeValue(data, (int32_t)mMaxNodesToPop);
+        writeValue(data, (int32_t)mMinFeaturePerNode);
+        writeValue(data, (int32_t)num_features);
+        write(data, mRoot.get());
+    }
+    
+    template<int NUM_BYTES_PER_FEATURE>
+    void BinaryHierarchicalClustering<NUM_BYTES_PER_FEATURE>::write(std::vector<unsigned char>& data, const node_t* node) const {
+        writeValue(data, (int32_t)node->id());
+        writeValue(data, (unsigned char)node->leaf());
+        data.insert(data.end(), node->center(), node->center()+NUM_BYTES_PER_FEATURE);
+        if(node->leaf()) {
+            const std::vector<int>& v = node->reverseIndex();
+            writeValue(data, (int32_t)v.size());
+            for(size_t i = 0; i < v.size(); i++) {
+                writeValue(data, (int32_t)v[i]);
+            }
+        } else {
+            writeValue(data, (int32_t)node->children().size());
+            for(size_t i = 0; i < node->children().size(); i++) {
+                write(data, node->children()[i]);
+            }
+        }
+    }
+    
+    template<int NUM_BYTES_PER_FEATURE>
+    bool BinaryHierarchicalClustering<NUM_BYTES_PER_FEATURE>::read(const unsigned char* data, size_t size, int num_features) {
+        const unsigned char* p = data;
+        const unsigned char* end = data+size;
+        
+        int32_t params[5];
+        for(int i = 0; i < 5; i++) {
+            if(!readValue(p, end, params[i])) {
+                return false;
+            }
+        }
+        if(params[0] != numHypotheses() ||
+           params[1] != numCenters() ||
+           params[2] != mMaxNodesToPop ||
+           params[3] != mMinFeaturePerNode ||
+           params[4] != num_features) {
+            return false;
+        }
+        
+        // Every feature is in exactly one leaf
+        int num_indices = 0;
+        int max_id = -1;
+        node_ptr_t root(read(p, end, num_features, 0, num_indices, max_id));
+        if(!root.get() || p != end || num_indices != num_features) {
+            return false;
+        }
+        
+        mRoot = std::move(root);
+        mNextNodeId = max_id+1;
+        return true;
+    }
+    
+    template<int NUM_BYTES_PER_FEATURE>
+    typename BinaryHierarchicalClustering<NUM_BYTES_PER_FEATURE>::node_t*
+    BinaryHierarchicalClustering<NUM_BYTES_PER_FEATURE>::read(const unsigned char*& p,
+                                                              const unsigned char* end,
+                                                              int num_features,
+                                                              int depth,
+                                                              int& num_indices,
+                                                              int& max_id) const {
+        // Deeper than any tree the build produces in practice
+        const int max_depth = 256;
+        
+        int32_t id, n;
+        unsigned char leaf;
+        if(depth > max_depth ||
+           !readValue(p, end, id) ||
+           !readValue(p, end, leaf) ||
+           (size_t)(end-p) < NUM_BYTES_PER_FEATURE) {
+            return NULL;
+        }
+        node_ptr_t node(new node_t(id, p));
+        p += NUM_BYTES_PER_FEATURE;
+        node->leaf(leaf != 0);
+        max_id = max2<int>(max_id, id);
+        
+        if(!readValue(p, end, n) || n < 0) {
+            return NULL;
+        }
+        if(node->leaf()) {
+            if((size_t)(end-p)/sizeof(int32_t) < (size_t)n) {
+                return NULL;
+            }
+            std::vector<int>& v = node->reverseIndex();
+            v.resize(n);
+            for(int i = 0; i < n; i++) {
+                int32_t index;
+                if(!readValue(p, end, index) || index < 0 || index >= num_features) {
+                    return NULL;
+                }
+                v[i] = index;
+            }
+            num_indices += n;
+        } else {
+            if(n == 0 || n > numCenters()) {
+                return NULL;
+            }
+            node->children().reserve(n);
+            for(int i = 0; i < n; i++) {
+                node_t* child = read(p, end, num_features, depth+1, num_indices, max_id);
+                if(!child) {
+                    return NULL;
+                }
+                node->children().push_back(child);
             }
         }
+        return node.release();
     }
     
 } // vision
\ No newline at end of file
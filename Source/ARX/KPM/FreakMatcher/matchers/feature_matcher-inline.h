@@ -67,28 +67,47 @@ namespace vision {
             return 0;
         }
         
+        ASSERT(FEATURE_SIZE == 96, "Only 96 bytes supported now");
+        
         mMatches.reserve(features1->size());
         for(size_t i = 0; i < features1->size(); i++) {
             unsigned int first_best = std::numeric_limits<unsigned int>::max();
             unsigned int second_best = std::numeric_limits<unsigned int>::max();
             int best_index = std::numeric_limits<int>::max();
             
-            // Search for 1st and 2nd best match
             const unsigned char* f1 = features1->feature(i);
             const FeaturePoint& p1 = features1->point(i);
-            for(size_t j = 0; j < features2->size(); j++) {
-                // Both points should be a MINIMA or MAXIMA
-                if(p1.maxima != features2->point(j).maxima) {
-                    continue;
+            
+            // Both points should be a MINIMA or MAXIMA
+            const int* indices;
+            size_t count;
+            if(features2->hasPartitions()) {
+                // Features of the same sign are stored together, so scan them in one pass
+                const BinaryFeaturePartition& partition = features2->partition(p1.maxima);
+                indices = partition.indices();
+                count = partition.size();
+                mDistances.resize(count);
+                HammingDistance768Batch(mDistances.data(), f1, partition.features(), count);
+            } else {
+                mCandidates.clear();
+                for(size_t j = 0; j < features2->size(); j++) {
+                    if(p1.maxima == features2->point(j).maxima) {
+                        mCandidates.push_back((int)j);
+                    }
                 }
-                
-                ASSERT(FEATURE_SIZE == 96, "Only 96 bytes supported now");
-                unsigned int d = HammingDistance<FEATURE_SIZE>(f1,
-                                                               (unsigned char*)features2->feature(j));
+                indices = mCandidates.data();
+                count = mCandidates.size();
+                mDistances.resize(count);
+                HammingDistance768Indexed(mDistances.data(), f1, features2->features().data(), indices, count);
+            }
+            
+            // Search for 1st and 2nd best match
+            for(size_t j = 0; j < count; j++) {
+                unsigned int d = mDistances[j];
                 if(d < first_best) {
                     second_best = first_best;
                     first_best = d;
-                    best_index = (int)j;
+                    best_index = indices[j];
                 } else if(d < second_best) {
                     second_best = d;
                 }
@@ -132,24 +151,33 @@ namespace vision {
             
             // Perform an indexed nearest neighbor lookup
             const unsigned char* f1 = features1->feature(i);
-            index2.query(f1);
+            index2.query(mIndexContext, f1);
             
             const FeaturePoint& p1 = features1->point(i);
             
-            // Search for 1st and 2nd best match
-            const std::vector<int>& v = index2.reverseIndex();
+            // Both points should be a MINIMA or MAXIMA
+            const std::vector<int>& v = mIndexContext.reverseIndex();
+            mCandidates.clear();
             for(size_t j = 0; j < v.size(); j++) {
-                // Both points should be a MINIMA or MAXIMA
-                if(p1.maxima != features2->point(v[j]).maxima) {
-                    continue;
+                if(p1.maxima == features2->point(v[j]).maxima) {
+                    mCandidates.push_back(v[j]);
                 }
-                
-                ASSERT(FEATURE_SIZE == 96, "Only 96 bytes supported now");
-                unsigned int d = HammingDistance<FEATURE_SIZE>(f1, (unsigned char*)features2->feature(v[j]));
+            }
+            if(mCandidates.empty()) {
+                continue;
+            }
+            
+            ASSERT(FEATURE_SIZE == 96, "Only 96 bytes supported now");
+            mDistances.resize(mCandidates.size());
+            HammingDistance768Indexed(&mDistances[0], f1, &features2->features()[0], &mCandidates[0], mCandidates.size());
+            
+            // Search for 1st and 2nd best match
+            for(size_t j = 0; j < mCandidates.size(); j++) {
+                unsigned int d = mDistances[j];
                 if(d < first_best) {
                     second_best = first_best;
                     first_best = d;
-                    best_index = v[j];
+                    best_index = mCandidates[j];
                 } else if(d < second_best) {
                     second_best = d;
                 }
@@ -210,27 +238,45 @@ namespace vision {
             float xp1, yp1;
             MultiplyPointHomographyInhomogenous(xp1, yp1, Hinv, p1.x, p1.y);
             
-            // Search for 1st and 2nd best match
-            for(size_t j = 0; j < features2->size(); j++) {
-                const FeaturePoint& p2 = features2->point(j);
-                
-                // Both points should be a MINIMA or MAXIMA
-                if(p1.maxima != p2.maxima) {
-                    continue;
+            // Both points should be a MINIMA or MAXIMA, and pass the spatial constraint.
+            // CANDIDATES index into FEATURES, and INDICES maps them back to the store.
+            const unsigned char* features;
+            const int* indices;
+            mCandidates.clear();
+            if(features2->hasPartitions()) {
+                const BinaryFeaturePartition& partition = features2->partition(p1.maxima);
+                const float* x2 = partition.x();
+                const float* y2 = partition.y();
+                for(size_t j = 0; j < partition.size(); j++) {
+                    if(!(sqr(xp1-x2[j]) + sqr(yp1-y2[j]) > tr_sqr)) {
+                        mCandidates.push_back((int)j);
+                    }
                 }
-                
-                // Check spatial constraint
-                if(sqr(xp1-p2.x) + sqr(yp1-p2.y) > tr_sqr) {
-                    continue;
+                features = partition.features();
+                indices = partition.indices();
+            } else {
+                for(size_t j = 0; j < features2->size(); j++) {
+                    const FeaturePoint& p2 = features2->point(j);
+                    if(p1.maxima == p2.maxima &&
+                       !(sqr(xp1-p2.x) + sqr(yp1-p2.y) > tr_sqr)) {
+                        mCandidates.push_back((int)j);
+                    }
                 }
-                
-                ASSERT(FEATURE_SIZE == 96, "Only 96 bytes supported now");
-                unsigned int d = HammingDistance768((unsigned int*)f1,
-                                                    (unsigned int*)features2->feature(j));
+                features = features2->features().data();
+                indices = NULL;
+            }
+            
+            ASSERT(FEATURE_SIZE == 96, "Only 96 bytes supported now");
+            mDistances.resize(mCandidates.size());
+            HammingDistance768Indexed(mDistances.data(), f1, features, mCandidates.data(), mCandidates.size());
+            
+            // Search for 1st and 2nd best match
+            for(size_t j = 0; j < mCandidates.size(); j++) {
+                unsigned int d = mDistances[j];
                 if(d < first_best) {
                     second_best = first_best;
                     first_best = d;
-                    best_index = (int)j;
+                    best_index = indices != NULL ? indices[mCandidates[j]] : mCandidates[j];
                 } else if(d < second_best) {
                     second_best = d;
                 }
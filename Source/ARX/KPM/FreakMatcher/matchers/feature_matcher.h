@@ -51,6 +51,7 @@ namespace vision {
     public:
         
         typedef BinaryHierarchicalClustering<FEATURE_SIZE> index_t;
+        typedef typename index_t::query_context_t index_context_t;
         
         BinaryFeatureMatcher();
         ~BinaryFeatureMatcher();
@@ -77,7 +78,8 @@ namespace vision {
                      const BinaryFeatureStore* features2);
 
         /**
-         * Match two feature stores with an index on features2.
+         * Match two feature stores with an index on features2. The index is only
+         * read, so several matchers may share one index across threads.
          * @return Number of matches
          */
         size_t match(const BinaryFeatureStore* features1,
@@ -108,6 +110,13 @@ namespace vision {
         // Threshold on the 1st and 2nd best matches
         float mThreshold;
         
+        // State for queries on an index
+        index_context_t mIndexContext;
+        
+        // Scratch space for the candidates of a query feature and their distances
+        std::vector<int> mCandidates;
+        std::vector<unsigned int> mDistances;
+        
     }; // BinaryFeatureMatcher
     
     /**
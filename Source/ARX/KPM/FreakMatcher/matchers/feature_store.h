@@ -37,12 +37,98 @@
 
 #include <vector>
 #include "feature_point.h"
+#include <framework/aligned_allocator.h>
 
 //#include <boost/serialization/serialization.hpp>
 //#include <boost/serialization/vector.hpp>
 
 namespace vision {
 
+    /**
+     * Holds the features of a store that share the same MAXIMA flag, laid out for
+     * linear scans. The descriptors are stored back to back in a block aligned to
+     * a cache line, and the point data needed while matching is kept in parallel
+     * arrays. Features keep their relative order from the store.
+     */
+    class BinaryFeaturePartition {
+    public:
+        
+        typedef std::vector<unsigned char, AlignedAllocator<unsigned char, 64> > feature_vector_t;
+        typedef std::vector<float, AlignedAllocator<float, 64> > float_vector_t;
+        
+        BinaryFeaturePartition()
+        : mNumBytesPerFeature(0) {}
+        ~BinaryFeaturePartition() {}
+        
+        /**
+         * Remove all features and reserve room for NUMFEATURES.
+         */
+        inline void reset(int bytesPerFeature, size_t numFeatures) {
+            mNumBytesPerFeature = bytesPerFeature;
+            mFeatures.clear();
+            mIndices.clear();
+            mX.clear();
+            mY.clear();
+            mFeatures.reserve(bytesPerFeature*numFeatures);
+            mIndices.reserve(numFeatures);
+            mX.reserve(numFeatures);
+            mY.reserve(numFeatures);
+        }
+        
+        /**
+         * Append the feature with INDEX in the store.
+         */
+        inline void push_back(int index, const unsigned char* feature, const FeaturePoint& point) {
+            mFeatures.insert(mFeatures.end(), feature, feature+mNumBytesPerFeature);
+            mIndices.push_back(index);
+            mX.push_back(point.x);
+            mY.push_back(point.y);
+        }
+        
+        /**
+         * @return Number of features.
+         */
+        inline size_t size() const { return mIndices.size(); }
+        
+        /**
+         * @return Descriptors of all features, stored contiguously
+         */
+        inline const unsigned char* features() const { return mFeatures.data(); }
+        
+        /**
+         * @return Specific feature with an index
+         */
+        inline const unsigned char* feature(size_t i) const { return &mFeatures[i*mNumBytesPerFeature]; }
+        
+        /**
+         * @return Index in the store of a feature
+         */
+        inline int index(size_t i) const { return mIndices[i]; }
+        inline const int* indices() const { return mIndices.data(); }
+        
+        /**
+         * @return Location of each feature.
+         */
+        inline const float* x() const { return mX.data(); }
+        inline const float* y() const { return mY.data(); }
+        
+    private:
+        
+        // Number of bytes per feature
+        int mNumBytesPerFeature;
+        
+        // Descriptors
+        feature_vector_t mFeatures;
+        
+        // Index in the store of each feature
+        std::vector<int> mIndices;
+        
+        // Location of each feature
+        float_vector_t mX;
+        float_vector_t mY;
+        
+    }; // BinaryFeaturePartition
+    
     /**
      * Represents a container for features and point information.
      */
@@ -61,6 +147,7 @@ namespace vision {
         inline void resize(size_t numFeatures) {
             mFeatures.resize(mNumBytesPerFeature*numFeatures, 0);
             mPoints.resize(numFeatures);
+            clearPartitions();
         }
         
         /**
@@ -103,6 +190,43 @@ namespace vision {
          */
         inline FeaturePoint& point(size_t i) { return mPoints[i]; }
         inline const FeaturePoint& point(size_t i) const { return mPoints[i]; }
+        
+        /**
+         * Split the features into a partition of minima and a partition of maxima,
+         * so matchers can scan only the features with the right sign. Must be called
+         * again after the features or points are modified.
+         */
+        void buildPartitions() {
+            size_t num_maxima = 0;
+            for(size_t i = 0; i < mPoints.size(); i++) {
+                num_maxima += mPoints[i].maxima ? 1 : 0;
+            }
+            mPartitions[0].reset(mNumBytesPerFeature, mPoints.size()-num_maxima);
+            mPartitions[1].reset(mNumBytesPerFeature, num_maxima);
+            for(size_t i = 0; i < mPoints.size(); i++) {
+                mPartitions[mPoints[i].maxima ? 1 : 0].push_back((int)i, feature(i), mPoints[i]);
+            }
+        }
+        
+        /**
+         * Remove the partitions.
+         */
+        inline void clearPartitions() {
+            mPartitions[0].reset(mNumBytesPerFeature, 0);
+            mPartitions[1].reset(mNumBytesPerFeature, 0);
+        }
+        
+        /**
+         * @return True if BUILDPARTITIONS has been called for the current features.
+         */
+        inline bool hasPartitions() const {
+            return !mPoints.empty() && mPartitions[0].size()+mPartitions[1].size() == mPoints.size();
+        }
+        
+        /**
+         * @return Partition of the minima (MAXIMA=false) or maxima (MAXIMA=true)
+         */
+        inline const BinaryFeaturePartition& partition(bool maxima) const { return mPartitions[maxima ? 1 : 0]; }
     
         /**
          * Copy a feature store.
@@ -111,6 +235,8 @@ namespace vision {
             mNumBytesPerFeature = store.mNumBytesPerFeature;
             mFeatures = store.mFeatures;
             mPoints = store.mPoints;
+            mPartitions[0] = store.mPartitions[0];
+            mPartitions[1] = store.mPartitions[1];
         }
         
         //
@@ -134,6 +260,9 @@ namespace vision {
     
         // Vector of feature points
         std::vector<FeaturePoint> mPoints;
+        
+        // Features split by the MAXIMA flag
+        BinaryFeaturePartition mPartitions[2];
     };
 
 } // vision
\ No newline at end of file
@@ -35,10 +35,269 @@
 
 #include "freak.h"
 #include <framework/error.h>
+#include <framework/thread_pool.h>
 #include "freak84-inline.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define FREAK_SSE2 1
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#  define FREAK_NEON 1
+#  include <arm_neon.h>
+#endif
+
 using namespace vision;
 
+namespace {
+    
+    // Number of features sampled together. Each feature uses one SIMD lane.
+    const int kBlockSize = 4;
+    
+    // Number of features extracted by one task
+    const size_t kFeaturesPerTask = 64;
+    
+    // Receptors are sampled in groups that share a sigma: 6 rings and the center
+    const int kNumReceptorGroups = 7;
+    
+    // Samples per feature, padded so the comparisons can load 4 samples past any receptor
+    const int kNumPaddedSamples = 40;
+    
+    /**
+     * Per lane state of a block of features.
+     */
+    struct SampleBlock {
+        // Similarity transform from canonical receptor locations to the image
+        float c[kBlockSize];
+        float s[kBlockSize];
+        float x[kBlockSize];
+        float y[kBlockSize];
+        float transform_scale[kBlockSize];
+        
+        // Pyramid image of the current receptor group
+        const unsigned char* data[kBlockSize];
+        size_t step[kBlockSize];
+        float a[kBlockSize];
+        float b[kBlockSize];
+        float max_x[kBlockSize];
+        float max_y[kBlockSize];
+    }; // SampleBlock
+    
+    /**
+     * Sample receptor R at canonical location (PX,PY) for every lane of BLOCK. The
+     * arithmetic is the same as SamplePyramidFREAK84 and SampleReceptorBilinear.
+     */
+    inline void sample_receptor(float samples[kBlockSize][kNumPaddedSamples],
+                                const SampleBlock& block,
+                                int count,
+                                int r,
+                                float px,
+                                float py) {
+        int xi[kBlockSize];
+        int yi[kBlockSize];
+        float w0[kBlockSize];
+        float w1[kBlockSize];
+        float w2[kBlockSize];
+        float w3[kBlockSize];
+        
+#if FREAK_SSE2
+        const __m128 c = _mm_loadu_ps(block.c);
+        const __m128 s = _mm_loadu_ps(block.s);
+        const __m128 ns = _mm_sub_ps(_mm_setzero_ps(), s);
+        const __m128 vpx = _mm_set1_ps(px);
+        const __m128 vpy = _mm_set1_ps(py);
+        
+        // Map to the image, then downsample to the octave
+        __m128 x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c, vpx), _mm_mul_ps(ns, vpy)), _mm_loadu_ps(block.x));
+        __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s, vpx), _mm_mul_ps(c, vpy)), _mm_loadu_ps(block.y));
+        x = _mm_add_ps(_mm_mul_ps(x, _mm_loadu_ps(block.a)), _mm_loadu_ps(block.b));
+        y = _mm_add_ps(_mm_mul_ps(y, _mm_loadu_ps(block.a)), _mm_loadu_ps(block.b));
+        
+        // Clip so the 2x2 neighbourhood is inside the image
+        x = _mm_min_ps(_mm_max_ps(x, _mm_setzero_ps()), _mm_loadu_ps(block.max_x));
+        y = _mm_min_ps(_mm_max_ps(y, _mm_setzero_ps()), _mm_loadu_ps(block.max_y));
+        
+        // Bilinear weights
+        __m128i ix = _mm_cvttps_epi32(x);
+        __m128i iy = _mm_cvttps_epi32(y);
+        __m128 fx = _mm_cvtepi32_ps(ix);
+        __m128 fy = _mm_cvtepi32_ps(iy);
+        __m128 fx1 = _mm_cvtepi32_ps(_mm_add_epi32(ix, _mm_set1_epi32(1)));
+        __m128 fy1 = _mm_cvtepi32_ps(_mm_add_epi32(iy, _mm_set1_epi32(1)));
+        _mm_storeu_ps(w0, _mm_mul_ps(_mm_sub_ps(fx1, x), _mm_sub_ps(fy1, y)));
+        _mm_storeu_ps(w1, _mm_mul_ps(_mm_sub_ps(x, fx), _mm_sub_ps(fy1, y)));
+        _mm_storeu_ps(w2, _mm_mul_ps(_mm_sub_ps(fx1, x), _mm_sub_ps(y, fy)));
+        _mm_storeu_ps(w3, _mm_mul_ps(_mm_sub_ps(x, fx), _mm_sub_ps(y, fy)));
+        _mm_storeu_si128((__m128i*)xi, ix);
+        _mm_storeu_si128((__m128i*)yi, iy);
+#elif FREAK_NEON
+        const float32x4_t c = vld1q_f32(block.c);
+        const float32x4_t s = vld1q_f32(block.s);
+        const float32x4_t ns = vnegq_f32(s);
+        const float32x4_t vpx = vdupq_n_f32(px);
+        const float32x4_t vpy = vdupq_n_f32(py);
+        
+        // Map to the image, then downsample to the octave
+        float32x4_t x = vaddq_f32(vaddq_f32(vmulq_f32(c, vpx), vmulq_f32(ns, vpy)), vld1q_f32(block.x));
+        float32x4_t y = vaddq_f32(vaddq_f32(vmulq_f32(s, vpx), vmulq_f32(c, vpy)), vld1q_f32(block.y));
+        x = vaddq_f32(vmulq_f32(x, vld1q_f32(block.a)), vld1q_f32(block.b));
+        y = vaddq_f32(vmulq_f32(y, vld1q_f32(block.a)), vld1q_f32(block.b));
+        
+        // Clip so the 2x2 neighbourhood is inside the image
+        x = vminq_f32(vmaxq_f32(x, vdupq_n_f32(0)), vld1q_f32(block.max_x));
+        y = vminq_f32(vmaxq_f32(y, vdupq_n_f32(0)), vld1q_f32(block.max_y));
+        
+        // Bilinear weights
+        int32x4_t ix = vcvtq_s32_f32(x);
+        int32x4_t iy = vcvtq_s32_f32(y);
+        float32x4_t fx = vcvtq_f32_s32(ix);
+        float32x4_t fy = vcvtq_f32_s32(iy);
+        float32x4_t fx1 = vcvtq_f32_s32(vaddq_s32(ix, vdupq_n_s32(1)));
+        float32x4_t fy1 = vcvtq_f32_s32(vaddq_s32(iy, vdupq_n_s32(1)));
+        vst1q_f32(w0, vmulq_f32(vsubq_f32(fx1, x), vsubq_f32(fy1, y)));
+        vst1q_f32(w1, vmulq_f32(vsubq_f32(x, fx), vsubq_f32(fy1, y)));
+        vst1q_f32(w2, vmulq_f32(vsubq_f32(fx1, x), vsubq_f32(y, fy)));
+        vst1q_f32(w3, vmulq_f32(vsubq_f32(x, fx), vsubq_f32(y, fy)));
+        vst1q_s32(xi, ix);
+        vst1q_s32(yi, iy);
+#else
+        for(int l = 0; l < kBlockSize; l++) {
+            float x = block.c[l]*px + (-block.s[l])*py + block.x[l];
+            float y = block.s[l]*px + block.c[l]*py + block.y[l];
+            x = x*block.a[l]+block.b[l];
+            y = y*block.a[l]+block.b[l];
+            x = ClipScalar<float>(x, 0, block.max_x[l]);
+            y = ClipScalar<float>(y, 0, block.max_y[l]);
+            xi[l] = (int)x;
+            yi[l] = (int)y;
+            w0[l] = (xi[l]+1-x)*(yi[l]+1-y);
+            w1[l] = (x-xi[l])*(yi[l]+1-y);
+            w2[l] = (xi[l]+1-x)*(y-yi[l]);
+            w3[l] = (x-xi[l])*(y-yi[l]);
+        }
+#endif
+        
+        // Gather the 2x2 neighbourhoods and blend
+        for(int l = 0; l < count; l++) {
+            const float* p0 = (const float*)(block.data[l]+block.step[l]*yi[l]);
+            const float* p1 = (const float*)((const unsigned char*)p0+block.step[l]);
+            samples[l][r] = w0[l]*p0[xi[l]] + w1[l]*p0[xi[l]+1] + w2[l]*p1[xi[l]] + w3[l]*p1[xi[l]+1];
+        }
+    }
+    
+    /**
+     * Sample all the receptors of COUNT <= kBlockSize points. Same result as calling
+     * SamplePyramidFREAK84 for each point.
+     */
+    void sample_block(float samples[kBlockSize][kNumPaddedSamples],
+                      const GaussianScaleSpacePyramid* pyramid,
+                      const FeaturePoint* points,
+                      int count,
+                      const float receptors[2*37],
+                      const float receptor_sigmas[kNumReceptorGroups],
+                      float expansion_factor) {
+        SampleBlock block;
+        
+        // Unused lanes repeat the last point so every lane holds valid values
+        for(int l = 0; l < kBlockSize; l++) {
+            const FeaturePoint& point = points[std::min(l, count-1)];
+            
+            // Ensure the scale of the similarity transform is at least "1".
+            float transform_scale = point.scale*expansion_factor;
+            if(transform_scale < 1) {
+                transform_scale = 1;
+            }
+            
+            block.c[l] = transform_scale*std::cos(point.angle);
+            block.s[l] = transform_scale*std::sin(point.angle);
+            block.x[l] = point.x;
+            block.y[l] = point.y;
+            block.transform_scale[l] = transform_scale;
+        }
+        
+        for(int g = 0; g < kNumReceptorGroups; g++) {
+            // Locate the pyramid image of the group for each lane
+            for(int l = 0; l < kBlockSize; l++) {
+                int octave, scale;
+                pyramid->locate(octave, scale, receptor_sigmas[g]*block.transform_scale[l]);
+                
+                const Image& image = pyramid->get(octave, scale);
+                block.data[l] = image.get();
+                block.step[l] = image.step();
+                block.a[l] = 1.f/(1<<octave);
+                block.b[l] = 0.5f*block.a[l]-0.5f;
+                block.max_x[l] = image.width()-2;
+                block.max_y[l] = image.height()-2;
+            }
+            
+            int first = g*6;
+            int last = std::min(first+6, 37);
+            for(int r = first; r < last; r++) {
+                sample_receptor(samples, block, count, r, receptors[2*r], receptors[2*r+1]);
+            }
+        }
+    }
+    
+    /**
+     * Append the low N bits of MASK to the bit string in WORDS at POS.
+     */
+    inline void append_bits(unsigned long long* words, int& pos, unsigned int mask, int n) {
+        int word = pos>>6;
+        int shift = pos&63;
+        words[word] |= (unsigned long long)mask << shift;
+        if(shift+n > 64) {
+            words[word+1] |= (unsigned long long)mask >> (64-shift);
+        }
+        pos += n;
+    }
+    
+#if FREAK_NEON
+    inline unsigned int movemask(uint32x4_t mask) {
+        return (vgetq_lane_u32(mask, 0)&1) |
+               (vgetq_lane_u32(mask, 1)&2) |
+               (vgetq_lane_u32(mask, 2)&4) |
+               (vgetq_lane_u32(mask, 3)&8);
+    }
+#endif
+    
+    /**
+     * Vector version of CompareFREAK84. Compares each sample with the following
+     * samples 4 at a time and packs the results with a movemask.
+     */
+    inline void compare_samples(unsigned char desc[84], const float samples[kNumPaddedSamples]) {
+        unsigned long long words[11] = {0};
+        int pos = 0;
+        for(int i = 0; i < 37; i++) {
+            int j = i+1;
+#if FREAK_SSE2 || FREAK_NEON
+#  if FREAK_SSE2
+            const __m128 si = _mm_set1_ps(samples[i]);
+#  else
+            const float32x4_t si = vdupq_n_f32(samples[i]);
+#  endif
+            for(; j < 37; j += 4) {
+#  if FREAK_SSE2
+                unsigned int mask = _mm_movemask_ps(_mm_cmplt_ps(si, _mm_loadu_ps(samples+j)));
+#  else
+                unsigned int mask = movemask(vcltq_f32(si, vld1q_f32(samples+j)));
+#  endif
+                int n = std::min(4, 37-j);
+                append_bits(words, pos, mask&((1u<<n)-1), n);
+            }
+#endif
+            for(; j < 37; j++) {
+                append_bits(words, pos, samples[i] < samples[j], 1);
+            }
+        }
+        ASSERT(pos == 666, "Position is not within range");
+        
+        // Same bit order as bitstring_set_bit()
+        for(int i = 0; i < 84; i++) {
+            desc[i] = (unsigned char)(words[i>>3] >> ((i&7)*8));
+        }
+    }
+    
+} // anonymous namespace
+
 FREAKExtractor::FREAKExtractor() {
     CopyVector(mPointRing0, freak84_points_ring0, 12);
     CopyVector(mPointRing1, freak84_points_ring1, 12);
@@ -57,6 +316,17 @@ FREAKExtractor::FREAKExtractor() {
     
     mExpansionFactor = 7;
     
+    const float* rings[6] = {mPointRing5, mPointRing4, mPointRing3, mPointRing2, mPointRing1, mPointRing0};
+    const float sigmas[7] = {mSigmaRing5, mSigmaRing4, mSigmaRing3, mSigmaRing2, mSigmaRing1, mSigmaRing0, mSigmaCenter};
+    for(int i = 0; i < 6; i++) {
+        CopyVector(mReceptors+12*i, rings[i], 12);
+    }
+    mReceptors[72] = 0;
+    mReceptors[73] = 0;
+    CopyVector(mReceptorSigmas, sigmas, 7);
+    
+    mThreadPool = NULL;
+    
     ASSERT(sizeof(freak84_points_ring0) == 48, "Size should be 48 bytes");
     ASSERT(sizeof(freak84_points_ring1) == 48, "Size should be 48 bytes");
     ASSERT(sizeof(freak84_points_ring2) == 48, "Size should be 48 bytes");
@@ -153,6 +423,8 @@ void FREAKExtractor::extract(BinaryFeatureStore& store,
     
     store.setNumBytesPerFeature(96);
     store.resize(points.size());
+    
+#ifdef FREAK_DEBUG
     ExtractFREAK84(store,
                    pyramid,
                    points,
@@ -188,4 +460,47 @@ void FREAKExtractor::extract(BinaryFeatureStore& store,
                    mMappedSC
 #endif
                    );
-}
\ No newline at end of file
+#else
+    // Features are independent, so tasks write to disjoint parts of the store
+    size_t num_tasks = (points.size()+kFeaturesPerTask-1)/kFeaturesPerTask;
+    if(mThreadPool == NULL || num_tasks <= 1) {
+        extractRange(store, pyramid, points, 0, points.size());
+    } else {
+        mThreadPool->parallelFor((int)num_tasks, [&](int task, int) {
+            size_t begin = task*kFeaturesPerTask;
+            size_t end = std::min(begin+kFeaturesPerTask, points.size());
+            extractRange(store, pyramid, points, begin, end);
+        });
+    }
+#endif
+}
+
+void FREAKExtractor::extractRange(BinaryFeatureStore& store,
+                                  const GaussianScaleSpacePyramid* pyramid,
+                                  const std::vector<FeaturePoint>& points,
+                                  size_t begin,
+                                  size_t end) const {
+    ASSERT(pyramid, "Pyramid is NULL");
+    ASSERT(store.size() == points.size(), "Feature store has not been allocated");
+    ASSERT(end <= points.size(), "Range is out of bounds");
+    
+    float samples[kBlockSize][kNumPaddedSamples];
+    for(int l = 0; l < kBlockSize; l++) {
+        ZeroVector(samples[l], kNumPaddedSamples);
+    }
+    
+    for(size_t i = begin; i < end; i += kBlockSize) {
+        int count = (int)std::min<size_t>(kBlockSize, end-i);
+        sample_block(samples,
+                     pyramid,
+                     &points[i],
+                     count,
+                     mReceptors,
+                     mReceptorSigmas,
+                     mExpansionFactor);
+        for(int l = 0; l < count; l++) {
+            compare_samples(store.feature(i+l), samples[l]);
+            store.point(i+l) = points[i+l];
+        }
+    }
+}
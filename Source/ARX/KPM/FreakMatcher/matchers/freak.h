@@ -50,6 +50,8 @@ namespace vision {
     
 //#define FREAK_DEBUG
     
+    class ThreadPool;
+    
     /**
      * Implements the FREAK extractor.
      */
@@ -78,6 +80,11 @@ namespace vision {
                      const GaussianScaleSpacePyramid* pyramid,
                      const std::vector<FeaturePoint>& points);
         
+        /**
+         * Set the thread pool used to extract the descriptors. May be NULL.
+         */
+        inline void setThreadPool(ThreadPool* pool) { mThreadPool = pool; }
+        
 #ifdef FREAK_DEBUG
         std::vector<Point2d<float> > mMappedPoints0;
         std::vector<Point2d<float> > mMappedPoints1;
@@ -118,6 +125,23 @@ namespace vision {
         // Scale expansion factor
         float mExpansionFactor;
         
+        // Receptor locations and sigmas in the order they are sampled: ring 5
+        // down to ring 0, then the center.
+        float mReceptors[2*37];
+        float mReceptorSigmas[7];
+        
+        // Thread pool used to extract the descriptors
+        ThreadPool* mThreadPool;
+        
+        /**
+         * Extract the descriptors of the points in [BEGIN, END).
+         */
+        void extractRange(BinaryFeatureStore& store,
+                          const GaussianScaleSpacePyramid* pyramid,
+                          const std::vector<FeaturePoint>& points,
+                          size_t begin,
+                          size_t end) const;
+        
     }; // FREAKExtractor
 
     /**
@@ -0,0 +1,250 @@
+//
+//  global_feature_index.h
+//  artoolkitX
+//
+//  This file is part of artoolkitX.
+//
+//  artoolkitX is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  artoolkitX is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with artoolkitX.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders of this library give you
+//  permission to link this library with independent modules to produce an
+//  executable, regardless of the license terms of these independent modules, and to
+//  copy and distribute the resulting executable under terms of your choice,
+//  provided that you also meet, for each linked independent module, the terms and
+//  conditions of the license of that module. An independent module is a module
+//  which is neither derived from nor based on this library. If you modify this
+//  library, you may extend this exception to your version of the library, but you
+//  are not obligated to do so. If you do not wish to do so, delete this exception
+//  statement from your version.
+//
+//  Copyright 2024 artoolkitX Contributors.
+//
+
+#pragma once
+
+#include "keyframe.h"
+#include "feature_store.h"
+#include "binary_hierarchical_clustering.h"
+#include <math/hamming.h>
+#include <framework/error.h>
+
+#include <vector>
+#include <limits>
+
+namespace vision {
+
+    /**
+     * Implements a single index over the features of many keyframes. Each feature
+     * in the index remembers the keyframe it came from, so a single query pass
+     * can be used to vote for the keyframes most likely to match a query.
+     */
+    template<int NUM_BYTES_PER_FEATURE>
+    class GlobalFeatureIndex {
+    public:
+
+        typedef int id_t;
+        typedef Keyframe<NUM_BYTES_PER_FEATURE> keyframe_t;
+        typedef BinaryHierarchicalClustering<NUM_BYTES_PER_FEATURE> index_t;
+        typedef typename index_t::query_context_t index_context_t;
+
+        /**
+         * Scratch space for a vote. A caller that keeps one of these across votes
+         * does not allocate once the buffers have grown to size.
+         */
+        struct VoteContext {
+            // 1st and 2nd best distance per keyframe slot
+            std::vector<unsigned int> firstBest;
+            std::vector<unsigned int> secondBest;
+            // Slots touched by the current query feature
+            std::vector<int> touched;
+            // Context for the index query
+            index_context_t index;
+        };
+        typedef VoteContext vote_context_t;
+
+        GlobalFeatureIndex()
+        : mThreshold(0.7f) {}
+        ~GlobalFeatureIndex() {}
+
+        /**
+         * Build the index over a range of (id, keyframe pointer) pairs, such
+         * as the iterators of a keyframe map.
+         */
+        template<typename ITERATOR>
+        void build(ITERATOR begin, ITERATOR end);
+
+        /**
+         * Remove all keyframes from the index.
+         */
+        void clear();
+
+        /**
+         * Vote for keyframes with the features in QUERY. On return, VOTES holds one
+         * entry per keyframe slot with the number of query features whose best match
+         * in that keyframe passed the ratio test. The index is only read, so this
+         * may be called concurrently with a CONTEXT per caller.
+         * @return Total number of votes cast
+         */
+        size_t vote(std::vector<int>& votes, const BinaryFeatureStore& query, vote_context_t& context) const;
+
+        /**
+         * @return Number of keyframes in the index.
+         */
+        inline size_t numKeyframes() const { return mKeyframeIds.size(); }
+
+        /**
+         * @return Number of features in the index.
+         */
+        inline size_t numFeatures() const { return mFeatureSlot.size(); }
+
+        /**
+         * @return Keyframe id for a keyframe slot.
+         */
+        inline id_t keyframeId(size_t slot) const { return mKeyframeIds[slot]; }
+
+        /**
+         * Set/Get the ratio threshold between the 1st and 2nd best matches.
+         */
+        inline void setThreshold(float tr) { mThreshold = tr; }
+        inline float threshold() const { return mThreshold; }
+
+    private:
+
+        // Descriptors of all keyframes, stored contiguously
+        std::vector<unsigned char> mFeatures;
+
+        // Copy of the maxima flag of each feature
+        std::vector<unsigned char> mMaxima;
+
+        // Keyframe slot of each feature
+        std::vector<int> mFeatureSlot;
+
+        // Keyframe id of each slot
+        std::vector<id_t> mKeyframeIds;
+
+        // Index over all the descriptors
+        index_t mIndex;
+
+        // Threshold on the 1st and 2nd best matches
+        float mThreshold;
+
+    }; // GlobalFeatureIndex
+
+    template<int NUM_BYTES_PER_FEATURE>
+    template<typename ITERATOR>
+    void GlobalFeatureIndex<NUM_BYTES_PER_FEATURE>::build(ITERATOR begin, ITERATOR end) {
+        clear();
+
+        size_t num_features = 0;
+        for(ITERATOR it = begin; it != end; it++) {
+            num_features += it->second->store().size();
+        }
+        if(num_features == 0) {
+            return;
+        }
+
+        mFeatures.reserve(num_features*NUM_BYTES_PER_FEATURE);
+        mMaxima.reserve(num_features);
+        mFeatureSlot.reserve(num_features);
+
+        for(ITERATOR it = begin; it != end; it++) {
+            const BinaryFeatureStore& store = it->second->store();
+            ASSERT(store.size() == 0 || store.numBytesPerFeature() == NUM_BYTES_PER_FEATURE, "Feature size mismatch");
+
+            int slot = (int)mKeyframeIds.size();
+            mKeyframeIds.push_back(it->first);
+
+            mFeatures.insert(mFeatures.end(), store.features().begin(), store.features().end());
+            for(size_t i = 0; i < store.size(); i++) {
+                mMaxima.push_back(store.point(i).maxima);
+                mFeatureSlot.push_back(slot);
+            }
+        }
+
+        mIndex.setNumHypotheses(128);
+        mIndex.setNumCenters(8);
+        mIndex.setMaxNodesToPop(8);
+        mIndex.setMinFeaturesPerNode(16);
+        mIndex.build(&mFeatures[0], (int)mFeatureSlot.size());
+    }
+
+    template<int NUM_BYTES_PER_FEATURE>
+    void GlobalFeatureIndex<NUM_BYTES_PER_FEATURE>::clear() {
+        mFeatures.clear();
+        mMaxima.clear();
+        mFeatureSlot.clear();
+        mKeyframeIds.clear();
+    }
+
+    template<int NUM_BYTES_PER_FEATURE>
+    size_t GlobalFeatureIndex<NUM_BYTES_PER_FEATURE>::vote(std::vector<int>& votes, const BinaryFeatureStore& query, vote_context_t& context) const {
+        votes.assign(mKeyframeIds.size(), 0);
+        if(mFeatureSlot.empty() || query.size() == 0) {
+            return 0;
+        }
+
+        // 1st and 2nd best distance per keyframe slot. Only the slots touched by
+        // the current query feature are reset, so the cost per query feature is
+        // proportional to the number of candidates and not the number of keyframes.
+        std::vector<unsigned int>& first_best = context.firstBest;
+        std::vector<unsigned int>& second_best = context.secondBest;
+        std::vector<int>& touched = context.touched;
+        first_best.assign(mKeyframeIds.size(), std::numeric_limits<unsigned int>::max());
+        second_best.assign(mKeyframeIds.size(), std::numeric_limits<unsigned int>::max());
+
+        size_t num_votes = 0;
+        for(size_t i = 0; i < query.size(); i++) {
+            const unsigned char* f1 = query.feature(i);
+            const unsigned char maxima = query.point(i).maxima;
+
+            mIndex.query(context.index, f1);
+            const std::vector<int>& v = context.index.reverseIndex();
+
+            touched.clear();
+            for(size_t j = 0; j < v.size(); j++) {
+                // Both points should be a MINIMA or MAXIMA
+                if(maxima != mMaxima[v[j]]) {
+                    continue;
+                }
+
+                unsigned int d = HammingDistance<NUM_BYTES_PER_FEATURE>(f1, &mFeatures[v[j]*NUM_BYTES_PER_FEATURE]);
+                int slot = mFeatureSlot[v[j]];
+                if(first_best[slot] == std::numeric_limits<unsigned int>::max()) {
+                    touched.push_back(slot);
+                }
+                if(d < first_best[slot]) {
+                    second_best[slot] = first_best[slot];
+                    first_best[slot] = d;
+                } else if(d < second_best[slot]) {
+                    second_best[slot] = d;
+                }
+            }
+
+            // Same acceptance rule as BinaryFeatureMatcher, applied per keyframe
+            for(size_t j = 0; j < touched.size(); j++) {
+                int slot = touched[j];
+                if(second_best[slot] == std::numeric_limits<unsigned int>::max() ||
+                   (float)first_best[slot] / (float)second_best[slot] < mThreshold) {
+                    votes[slot]++;
+                    num_votes++;
+                }
+                first_best[slot] = std::numeric_limits<unsigned int>::max();
+                second_best[slot] = std::numeric_limits<unsigned int>::max();
+            }
+        }
+
+        return num_votes;
+    }
+
+} // vision
@@ -203,7 +203,8 @@ void HoughSimilarityVoting::getSimilarityFromIndex(float& x, float& y, float& an
 
 void HoughSimilarityVoting::autoAdjustXYNumBins(const float* ins, const float* ref, int size) {
     int max_dim = max2<int>(mRefImageWidth, mRefImageHeight);
-    std::vector<float> projected_dim(size);
+    std::vector<float>& projected_dim = mProjectedDim;
+    projected_dim.resize(size);
     
     ASSERT(size > 0, "size must be positive");
     ASSERT(mRefImageWidth > 0, "width must be positive");
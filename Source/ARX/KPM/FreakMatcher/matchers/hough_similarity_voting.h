@@ -283,6 +283,9 @@ namespace vision {
         std::vector<float> mSubBinLocations;
         std::vector<int> mSubBinLocationIndices;
         
+        // Projected reference dimension of each match, used to size the bins
+        std::vector<float> mProjectedDim;
+        
         /**
          * Cast a vote to an similarity index
          */
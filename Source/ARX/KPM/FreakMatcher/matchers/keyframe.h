@@ -74,10 +74,23 @@ namespace vision {
         inline const index_t& index() const { return mIndex; }
         
         /**
-         * Build an index for the features.
+         * Build an index for the features, and split the store into the maxima
+         * partitions used for linear scans.
          */
         void buildIndex();
         
+        /**
+         * Restore an index saved with SAVEINDEX for the same features, instead of
+         * building it, and split the store into the maxima partitions.
+         * @return False if the data is malformed or was saved with other parameters
+         */
+        bool loadIndex(const unsigned char* data, size_t size);
+        
+        /**
+         * Append the index to DATA.
+         */
+        inline void saveIndex(std::vector<unsigned char>& data) const { mIndex.write(data); }
+        
         /**
          * Copy a keyframe.
          */
@@ -110,15 +123,36 @@ namespace vision {
         // Feature index
         index_t mIndex;
         
+        /**
+         * Set the parameters the index is built with.
+         */
+        void setIndexParameters();
+        
     }; // Keyframe
     
     template<int NUM_BYTES_PER_FEATURE>
     void Keyframe<NUM_BYTES_PER_FEATURE>::buildIndex() {
+        setIndexParameters();
+        mIndex.build(&mStore.features()[0], (int)mStore.size());
+        mStore.buildPartitions();
+    }
+    
+    template<int NUM_BYTES_PER_FEATURE>
+    bool Keyframe<NUM_BYTES_PER_FEATURE>::loadIndex(const unsigned char* data, size_t size) {
+        setIndexParameters();
+        if(!mIndex.read(data, size, (int)mStore.size())) {
+            return false;
+        }
+        mStore.buildPartitions();
+        return true;
+    }
+    
+    template<int NUM_BYTES_PER_FEATURE>
+    void Keyframe<NUM_BYTES_PER_FEATURE>::setIndexParameters() {
         mIndex.setNumHypotheses(128);
         mIndex.setNumCenters(8);
         mIndex.setMaxNodesToPop(8);
         mIndex.setMinFeaturesPerNode(16);
-        mIndex.build(&mStore.features()[0], (int)mStore.size());
     }
     
 } // vision
\ No newline at end of file
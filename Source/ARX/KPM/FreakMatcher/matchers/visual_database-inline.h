@@ -43,6 +43,9 @@
 #include <math/math_io.h>
 #include <matchers/visual_database.h>
 
+#include <algorithm>
+#include <functional>
+
 
 namespace vision {
     
@@ -60,6 +63,11 @@ namespace vision {
     
     static const bool kUseFeatureIndex = true;
     
+    static const size_t kMaxNumCandidateKeyframes = 0;
+    
+    static const bool kEarlyExit = false;
+    static const size_t kEarlyExitMargin = 0;
+    
     template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
     VisualDatabase<FEATURE_EXTRACTOR, STORE, MATCHER>::VisualDatabase() {
         mDetector.setLaplacianThreshold(kLaplacianThreshold);
@@ -70,6 +78,18 @@ namespace vision {
         mMinNumInliers = kMinNumInliers;
         
         mUseFeatureIndex = kUseFeatureIndex;
+        
+        mMaxNumCandidateKeyframes = kMaxNumCandidateKeyframes;
+        invalidateGlobalIndex();
+        
+        mEarlyExit = kEarlyExit;
+        mEarlyExitMargin = kEarlyExitMargin;
+        
+        // The pool runs everything on the calling thread until threads are added
+        mPyramid.setThreadPool(&mThreadPool);
+        mDetector.setThreadPool(&mThreadPool);
+        mFeatureExtractor.setThreadPool(&mThreadPool);
+        mRobustHomography.setThreadPool(&mThreadPool);
     }
     
     template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
@@ -115,7 +135,7 @@ namespace vision {
         keyframe->setWidth((int)pyramid->images()[0].width());
         keyframe->setHeight((int)pyramid->images()[0].height());
         TIMED("Extract Features") {
-            FindFeatures<FEATURE_EXTRACTOR, kBytesPerFeature>(keyframe.get(), pyramid, &mDetector, &mFeatureExtractor);
+            FindFeatures<FEATURE_EXTRACTOR, kBytesPerFeature>(keyframe.get(), pyramid, &mDetector, &mFeatureExtractor, mFeaturePoints);
         }
         LOG_INFO("Found %d features", keyframe->store().size());
         
@@ -126,6 +146,7 @@ namespace vision {
         
         // Store the keyframe
         mKeyframeMap[id] = keyframe;
+        invalidateGlobalIndex();
     }
     
     template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
@@ -136,21 +157,25 @@ namespace vision {
         }
         
         mKeyframeMap[id] = keyframe;
+        invalidateGlobalIndex();
     }
     
     template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
-    bool VisualDatabase<FEATURE_EXTRACTOR, STORE, MATCHER>::query(const vision::Image& image) {
+    bool VisualDatabase<FEATURE_EXTRACTOR, STORE, MATCHER>::query(const vision::Image& image, DownscaleMode mode) {
+        size_t width, height;
+        downscaled_size(width, height, image.width(), image.height(), mode);
+        
         // Allocate pyramid
         if(mPyramid.images().size() == 0 ||
-           mPyramid.images()[0].width() != image.width() ||
-           mPyramid.images()[0].height() != image.height()) {
-            int num_octaves = numOctaves((int)image.width(), (int)image.height(), kMinCoarseSize);
-            mPyramid.alloc(image.width(), image.height(), num_octaves);
+           mPyramid.images()[0].width() != width ||
+           mPyramid.images()[0].height() != height) {
+            int num_octaves = numOctaves((int)width, (int)height, kMinCoarseSize);
+            mPyramid.alloc(width, height, num_octaves);
         }
         
         // Build the pyramid
         TIMED("Build Pyramid") {
-            mPyramid.build(image);
+            mPyramid.build(image, mode);
         }
         
         return query(&mPyramid);
@@ -164,12 +189,15 @@ namespace vision {
             mDetector.alloc(pyramid);
         }
         
-        // Find the features on the image
-        mQueryKeyframe.reset(new keyframe_t());
+        // Find the features on the image. The query keyframe, and so its feature
+        // store, is reused unless it is still held from an earlier query.
+        if(!mQueryKeyframe || mQueryKeyframe.use_count() > 1) {
+            mQueryKeyframe.reset(new keyframe_t());
+        }
         mQueryKeyframe->setWidth((int)pyramid->images()[0].width());
         mQueryKeyframe->setHeight((int)pyramid->images()[0].height());
         TIMED("Extract Features") {
-            FindFeatures<FEATURE_EXTRACTOR, kBytesPerFeature>(mQueryKeyframe.get(), pyramid, &mDetector, &mFeatureExtractor);
+            FindFeatures<FEATURE_EXTRACTOR, kBytesPerFeature>(mQueryKeyframe.get(), pyramid, &mDetector, &mFeatureExtractor, mFeaturePoints);
         }
         LOG_INFO("Found %d features in query", mQueryKeyframe->store().size());
         
@@ -181,157 +209,381 @@ namespace vision {
         mMatchedInliers.clear();
         mMatchedId = -1;
         
-        const std::vector<FeaturePoint>& query_points = query_keyframe->store().points();
+        std::vector<id_t>& candidates = mCandidates;
         
-        // Loop over all the images in the database
-        typename keyframe_map_t::const_iterator it = mKeyframeMap.begin();
-        for(; it != mKeyframeMap.end(); it++) {
-            TIMED("Find Matches (1)") {
-                if(mUseFeatureIndex) {
-                    if(mMatcher.match(&query_keyframe->store(), &it->second->store(), it->second->index()) < mMinNumInliers) {
-                        continue;
-                    }
-                } else {
-                    if(mMatcher.match(&query_keyframe->store(), &it->second->store()) < mMinNumInliers) {
-                        continue;
-                    }
+        // Verify the prior keyframes first. Only if none of them is a good enough
+        // match are the other keyframes voted for and verified.
+        if(mEarlyExit && !mPriorIds.empty()) {
+            candidates.clear();
+            for(size_t i = 0; i < mPriorIds.size(); i++) {
+                if(mKeyframeMap.find(mPriorIds[i]) != mKeyframeMap.end() &&
+                   !isSkipped(mPriorIds[i]) &&
+                   std::find(candidates.begin(), candidates.end(), mPriorIds[i]) == candidates.end()) {
+                    candidates.push_back(mPriorIds[i]);
                 }
             }
-            
-            const std::vector<FeaturePoint>& ref_points = it->second->store().points();
-            //std::cout<<"ref_points-"<<ref_points.size()<<std::endl;
-            //std::cout<<"query_points-"<<query_points.size()<<std::endl;
-            
-            //
-            // Vote for a transformation based on the correspondences
-            //
-            
-            int max_hough_index = -1;
-            TIMED("Hough Voting (1)") {
-                max_hough_index = FindHoughSimilarity(mHoughSimilarityVoting,
-                                                      query_points,
-                                                      ref_points,
-                                                      mMatcher.matches(),
-                                                      query_keyframe->width(),
-                                                      query_keyframe->height(),
-                                                      it->second->width(),
-                                                      it->second->height());
-                if(max_hough_index < 0) {
-                    continue;
+            TIMED("Verify Prior Keyframes") {
+                if(verifyCandidateKeyframes(candidates, query_keyframe)) {
+                    return true;
                 }
             }
-            
-            matches_t hough_matches;
-            TIMED("Find Hough Matches (1)") {
-                FindHoughMatches(hough_matches,
-                                 mHoughSimilarityVoting,
-                                 mMatcher.matches(),
-                                 max_hough_index,
-                                 kHoughBinDelta);
-            }
-            
-            //
-            // Estimate the transformation between the two images
-            //
-            
-            float H[9];
-            TIMED("Estimate Homography (1)") {
-                if(!EstimateHomography(H,
-                                       query_points,
-                                       ref_points,
-                                       hough_matches,
-                                       mRobustHomography,
-                                       it->second->width(),
-                                       it->second->height())) {
+        }
+        
+        TIMED("Find Candidate Keyframes") {
+            findCandidateKeyframes(candidates, query_keyframe);
+        }
+        
+        verifyCandidateKeyframes(candidates, query_keyframe);
+        
+        return mMatchedId >= 0;
+    }
+    
+    template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
+    bool VisualDatabase<FEATURE_EXTRACTOR, STORE, MATCHER>::verifyCandidateKeyframes(const std::vector<id_t>& candidates,
+                                                                                     const keyframe_t* query_keyframe) {
+        const size_t exit_num_inliers = mMinNumInliers + mEarlyExitMargin;
+        
+        if(candidates.empty()) {
+            return false;
+        }
+        
+        if(mThreadPool.numThreads() == 0 || candidates.size() == 1) {
+            // Loop over the candidate images in the database
+            for(size_t i = 0; i < candidates.size(); i++) {
+                float H[9];
+                matches_t& inliers = mInliers;
+                if(!matchAndVerifyKeyframe(H,
+                                           inliers,
+                                           mMatcher,
+                                           mHoughSimilarityVoting,
+                                           mRobustHomography,
+                                           mVerificationBuffers,
+                                           query_keyframe,
+                                           mKeyframeMap[candidates[i]].get())) {
                     continue;
                 }
-            }
-            
-            //
-            // Find the inliers
-            //
-            
-            matches_t inliers;
-            TIMED("Find Inliers (1)") {
-                FindInliers(inliers, H, query_points, ref_points, hough_matches, mHomographyInlierThreshold);
-                if(inliers.size() < mMinNumInliers) {
-                    continue;
+                
+                //std::cout<<"inliers-"<<inliers.size()<<std::endl;
+                if(inliers.size() >= mMinNumInliers && inliers.size() > mMatchedInliers.size()) {
+                    CopyVector9(mMatchedGeometry, H);
+                    mMatchedInliers.swap(inliers);
+                    mMatchedId = candidates[i];
+                    if(mEarlyExit && mMatchedInliers.size() >= exit_num_inliers) {
+                        return true;
+                    }
                 }
             }
+        } else {
+            std::vector<const keyframe_t*>& ref_keyframes = mRefKeyframes;
+            ref_keyframes.resize(candidates.size());
+            for(size_t i = 0; i < candidates.size(); i++) {
+                ref_keyframes[i] = mKeyframeMap[candidates[i]].get();
+            }
             
-            //
-            // Use the estimated homography to find more inliers
-            //
+            // Verify the candidates in parallel, each worker with its own objects.
+            // The results are only grown, so their inliers keep their storage.
+            std::vector<VerificationResult>& results = mVerificationResults;
+            if(results.size() < candidates.size()) {
+                results.resize(candidates.size());
+            }
             
-            TIMED("Find Matches (2)") {
-                if(mMatcher.match(&query_keyframe->store(),
-                                  &it->second->store(),
-                                  H,
-                                  10) < mMinNumInliers) {
-                    continue;
+            // With early exit, verify one candidate per worker at a time, so that no
+            // more than one round is spent after the match is found
+            const size_t batch_size = mEarlyExit ? (size_t)mThreadPool.concurrency() : candidates.size();
+            for(size_t begin = 0; begin < candidates.size(); begin += batch_size) {
+                const size_t end = min2(begin+batch_size, candidates.size());
+                TIMED("Verify Keyframes") {
+                    mThreadPool.parallelFor((int)(end-begin), [&](int j, int worker) {
+                        const size_t i = begin+j;
+                        VerificationContext& context = *mVerificationContexts[worker];
+                        results[i].verified = matchAndVerifyKeyframe(results[i].H,
+                                                                     results[i].inliers,
+                                                                     context.matcher,
+                                                                     context.houghSimilarityVoting,
+                                                                     context.robustHomography,
+                                                                     context.buffers,
+                                                                     query_keyframe,
+                                                                     ref_keyframes[i]);
+                    });
+                }
+                
+                // Reduce in candidate order, so the result is the same as the serial loop
+                for(size_t i = begin; i < end; i++) {
+                    if(results[i].verified &&
+                       results[i].inliers.size() >= mMinNumInliers &&
+                       results[i].inliers.size() > mMatchedInliers.size()) {
+                        CopyVector9(mMatchedGeometry, results[i].H);
+                        mMatchedInliers.swap(results[i].inliers);
+                        mMatchedId = candidates[i];
+                        if(mEarlyExit && mMatchedInliers.size() >= exit_num_inliers) {
+                            return true;
+                        }
+                    }
                 }
             }
-            
-            //
-            // Vote for a similarity with new matches
-            //
-            
-            TIMED("Hough Voting (2)") {
-                max_hough_index = FindHoughSimilarity(mHoughSimilarityVoting,
-                                                      query_points,
-                                                      ref_points,
-                                                      mMatcher.matches(),
-                                                      query_keyframe->width(),
-                                                      query_keyframe->height(),
-                                                      it->second->width(),
-                                                      it->second->height());
-                if(max_hough_index < 0) {
-                    continue;
+        }
+        
+        return false;
+    }
+    
+    template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
+    void VisualDatabase<FEATURE_EXTRACTOR, STORE, MATCHER>::buildGlobalIndex() {
+        globalIndex();
+    }
+    
+    template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
+    const typename VisualDatabase<FEATURE_EXTRACTOR, STORE, MATCHER>::global_index_t* VisualDatabase<FEATURE_EXTRACTOR, STORE, MATCHER>::globalIndex() {
+        // Every database sharing the index has the same keyframes, so whichever gets here
+        // first builds it for all of them while the others wait
+        std::lock_guard<std::mutex> lock(mGlobalIndex->mutex);
+        if(!mGlobalIndex->index) {
+            TIMED("Build Global Index") {
+                std::shared_ptr<global_index_t> index(new global_index_t());
+                index->setThreshold(mMatcher.threshold());
+                index->build(mKeyframeMap.begin(), mKeyframeMap.end());
+                mGlobalIndex->index = index;
+            }
+        }
+        return mGlobalIndex->index.get();
+    }
+    
+    template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
+    void VisualDatabase<FEATURE_EXTRACTOR, STORE, MATCHER>::shareKeyframes(VisualDatabase& other) {
+        mKeyframeMap = other.mKeyframeMap;
+        mMaxNumCandidateKeyframes = other.mMaxNumCandidateKeyframes;
+        mEarlyExit = other.mEarlyExit;
+        mEarlyExitMargin = other.mEarlyExitMargin;
+        mGlobalIndex = other.mGlobalIndex;
+    }
+    
+    template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
+    void VisualDatabase<FEATURE_EXTRACTOR, STORE, MATCHER>::findCandidateKeyframes(std::vector<id_t>& candidates,
+                                                                                   const keyframe_t* query_keyframe) {
+        candidates.clear();
+        
+        // Verify every keyframe if the number of candidates is not limited. With
+        // early exit they are still ranked by votes, so the likely ones go first.
+        if(!usesGlobalIndex()) {
+            candidates.reserve(mKeyframeMap.size());
+            typename keyframe_map_t::const_iterator it = mKeyframeMap.begin();
+            for(; it != mKeyframeMap.end(); it++) {
+                if(!isExcludedCandidate(it->first)) {
+                    candidates.push_back(it->first);
                 }
             }
-            
-            TIMED("Find Hough Matches (2)") {
-                FindHoughMatches(hough_matches,
-                                 mHoughSimilarityVoting,
-                                 mMatcher.matches(),
-                                 max_hough_index,
-                                 kHoughBinDelta);
+            return;
+        }
+        
+        const global_index_t* global_index = globalIndex();
+        
+        //
+        // Vote for keyframes with a single pass over the global index
+        //
+        
+        std::vector<int>& votes = mVotes;
+        global_index->vote(votes, query_keyframe->store(), mVoteContext);
+        
+        const bool limited = isCandidateLimited();
+        std::vector<std::pair<int, int> >& ranked = mRankedVotes;
+        ranked.clear();
+        for(size_t i = 0; i < votes.size(); i++) {
+            if((!limited || votes[i] >= (int)mMinNumInliers) && !isExcludedCandidate(global_index->keyframeId(i))) {
+                ranked.push_back(std::make_pair(votes[i], (int)i));
             }
-            
-            //
-            // Re-estimate the homography
-            //
-            
-            TIMED("Estimate Homography (2)") {
-                if(!EstimateHomography(H,
-                                       query_points,
-                                       ref_points,
-                                       hough_matches,
-                                       mRobustHomography,
-                                       it->second->width(),
-                                       it->second->height())) {
-                    continue;
+        }
+        
+        // Keep the top-k keyframes, most votes first
+        size_t k = limited ? min2(ranked.size(), mMaxNumCandidateKeyframes) : ranked.size();
+        std::partial_sort(ranked.begin(), ranked.begin()+k, ranked.end(), std::greater<std::pair<int, int> >());
+        
+        candidates.reserve(k);
+        for(size_t i = 0; i < k; i++) {
+            candidates.push_back(global_index->keyframeId(ranked[i].second));
+        }
+    }
+    
+    template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
+    void VisualDatabase<FEATURE_EXTRACTOR, STORE, MATCHER>::setNumThreads(int n) {
+        mThreadPool.setNumThreads(n);
+        
+        mVerificationContexts.clear();
+        if(mThreadPool.numThreads() > 0) {
+            for(int i = 0; i < mThreadPool.concurrency(); i++) {
+                mVerificationContexts.push_back(verification_context_ptr_t(new VerificationContext()));
+                mVerificationContexts.back()->matcher.setThreshold(mMatcher.threshold());
+            }
+        }
+    }
+    
+    template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
+    bool VisualDatabase<FEATURE_EXTRACTOR, STORE, MATCHER>::matchAndVerifyKeyframe(float H[9],
+                                                                                   matches_t& inliers,
+                                                                                   MATCHER& matcher,
+                                                                                   HoughSimilarityVoting& hough,
+                                                                                   RobustHomography<float>& estimator,
+                                                                                   VerificationBuffers& buffers,
+                                                                                   const keyframe_t* query_keyframe,
+                                                                                   const keyframe_t* ref_keyframe) const {
+        TIMED("Find Matches (1)") {
+            if(mUseFeatureIndex) {
+                if(matcher.match(&query_keyframe->store(), &ref_keyframe->store(), ref_keyframe->index()) < mMinNumInliers) {
+                    return false;
+                }
+            } else {
+                if(matcher.match(&query_keyframe->store(), &ref_keyframe->store()) < mMinNumInliers) {
+                    return false;
                 }
             }
-            
-            //
-            // Check if this is the best match based on number of inliers
-            //
-            
-            inliers.clear();
-            TIMED("Find Inliers (2)") {
-                FindInliers(inliers, H, query_points, ref_points, hough_matches, mHomographyInlierThreshold);
+        }
+        
+        return verifyKeyframe(H, inliers, matcher, hough, estimator, buffers, query_keyframe, ref_keyframe, matcher.matches());
+    }
+    
+    template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
+    bool VisualDatabase<FEATURE_EXTRACTOR, STORE, MATCHER>::verifyKeyframe(float H[9],
+                                                                           matches_t& inliers,
+                                                                           MATCHER& matcher,
+                                                                           HoughSimilarityVoting& hough,
+                                                                           RobustHomography<float>& estimator,
+                                                                           VerificationBuffers& buffers,
+                                                                           const keyframe_t* query_keyframe,
+                                                                           const keyframe_t* ref_keyframe,
+                                                                           const matches_t& matches) const {
+        const std::vector<FeaturePoint>& query_points = query_keyframe->store().points();
+        const std::vector<FeaturePoint>& ref_points = ref_keyframe->store().points();
+        //std::cout<<"ref_points-"<<ref_points.size()<<std::endl;
+        //std::cout<<"query_points-"<<query_points.size()<<std::endl;
+        
+        //
+        // Vote for a transformation based on the correspondences
+        //
+        
+        int max_hough_index = -1;
+        TIMED("Hough Voting (1)") {
+            max_hough_index = FindHoughSimilarity(hough,
+                                                  query_points,
+                                                  ref_points,
+                                                  matches,
+                                                  query_keyframe->width(),
+                                                  query_keyframe->height(),
+                                                  ref_keyframe->width(),
+                                                  ref_keyframe->height(),
+                                                  buffers.houghQuery,
+                                                  buffers.houghRef);
+            if(max_hough_index < 0) {
+                return false;
             }
-            
-            //std::cout<<"inliers-"<<inliers.size()<<std::endl;
-            if(inliers.size() >= mMinNumInliers && inliers.size() > mMatchedInliers.size()) {
-                CopyVector9(mMatchedGeometry, H);
-                mMatchedInliers.swap(inliers);
-                mMatchedId = it->first;
+        }
+        
+        matches_t& hough_matches = buffers.houghMatches;
+        TIMED("Find Hough Matches (1)") {
+            FindHoughMatches(hough_matches,
+                             hough,
+                             matches,
+                             max_hough_index,
+                             kHoughBinDelta);
+        }
+        
+        //
+        // Estimate the transformation between the two images
+        //
+        
+        TIMED("Estimate Homography (1)") {
+            if(!EstimateHomography(H,
+                                   query_points,
+                                   ref_points,
+                                   hough_matches,
+                                   estimator,
+                                   ref_keyframe->width(),
+                                   ref_keyframe->height(),
+                                   buffers.srcPoints,
+                                   buffers.dstPoints)) {
+                return false;
             }
         }
         
-        return mMatchedId >= 0;
+        //
+        // Find the inliers
+        //
+        
+        inliers.clear();
+        TIMED("Find Inliers (1)") {
+            FindInliers(inliers, H, query_points, ref_points, hough_matches, mHomographyInlierThreshold);
+            if(inliers.size() < mMinNumInliers) {
+                return false;
+            }
+        }
+        
+        //
+        // Use the estimated homography to find more inliers. Note that MATCHES
+        // may refer to the matcher's own result, so it is not used after this.
+        //
+        
+        TIMED("Find Matches (2)") {
+            if(matcher.match(&query_keyframe->store(),
+                             &ref_keyframe->store(),
+                             H,
+                             10) < mMinNumInliers) {
+                return false;
+            }
+        }
+        
+        //
+        // Vote for a similarity with new matches
+        //
+        
+        TIMED("Hough Voting (2)") {
+            max_hough_index = FindHoughSimilarity(hough,
+                                                  query_points,
+                                                  ref_points,
+                                                  matcher.matches(),
+                                                  query_keyframe->width(),
+                                                  query_keyframe->height(),
+                                                  ref_keyframe->width(),
+                                                  ref_keyframe->height(),
+                                                  buffers.houghQuery,
+                                                  buffers.houghRef);
+            if(max_hough_index < 0) {
+                return false;
+            }
+        }
+        
+        TIMED("Find Hough Matches (2)") {
+            FindHoughMatches(hough_matches,
+                             hough,
+                             matcher.matches(),
+                             max_hough_index,
+                             kHoughBinDelta);
+        }
+        
+        //
+        // Re-estimate the homography
+        //
+        
+        TIMED("Estimate Homography (2)") {
+            if(!EstimateHomography(H,
+                                   query_points,
+                                   ref_points,
+                                   hough_matches,
+                                   estimator,
+                                   ref_keyframe->width(),
+                                   ref_keyframe->height(),
+                                   buffers.srcPoints,
+                                   buffers.dstPoints)) {
+                return false;
+            }
+        }
+        
+        //
+        // Find the final inliers
+        //
+        
+        inliers.clear();
+        TIMED("Find Inliers (2)") {
+            FindInliers(inliers, H, query_points, ref_points, hough_matches, mHomographyInlierThreshold);
+        }
+        
+        return true;
     }
     
     template<typename FEATURE_EXTRACTOR, typename STORE, typename MATCHER>
@@ -341,6 +593,7 @@ namespace vision {
             return false;
         }
         mKeyframeMap.erase(it);
+        invalidateGlobalIndex();
         return true;
     }
     
@@ -37,8 +37,10 @@
 
 #include <framework/image.h>
 #include <framework/exception.h>
+#include <framework/thread_pool.h>
 #include <detectors/DoG_scale_invariant_detector.h>
 #include <matchers/keyframe.h>
+#include <matchers/global_feature_index.h>
 #include <matchers/feature_matcher-inline.h>
 #include <matchers/hough_similarity_voting.h>
 #include <homography_estimation/robust_homography.h>
@@ -47,7 +49,9 @@
 #include <math/indexing.h>
 
 #include <vector>
+#include <algorithm>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
 
 #include "feature_point.h"
@@ -58,6 +62,18 @@
 
 namespace vision {
 
+    /**
+     * Buffers used to verify a keyframe. They are kept between keyframes and
+     * queries, so they are not allocated again once they have grown large enough.
+     */
+    struct VerificationBuffers {
+        std::vector<float> houghQuery;
+        std::vector<float> houghRef;
+        std::vector<Point2d<float> > srcPoints;
+        std::vector<Point2d<float> > dstPoints;
+        matches_t houghMatches;
+    }; // VerificationBuffers
+
     /**
      * The visual database provides functionality to insert and query images.
      */
@@ -70,6 +86,7 @@ namespace vision {
         typedef Keyframe<96> keyframe_t;
         typedef std::shared_ptr<keyframe_t> keyframe_ptr_t;
         typedef std::unordered_map<id_t, keyframe_ptr_t> keyframe_map_t;
+        typedef GlobalFeatureIndex<96> global_index_t;
         
         typedef BinomialPyramid32f pyramid_t;
         typedef DoGScaleInvariantDetector detector_t;
@@ -93,9 +110,10 @@ namespace vision {
         void addKeyframe(keyframe_ptr_t keyframe , id_t id);
     
         /**
-         * Query the visual database.
+         * Query the visual database with IMAGE downscaled by MODE. The features
+         * of the query are in the coordinates of the downscaled image.
          */
-        bool query(const Image& image);
+        bool query(const Image& image, DownscaleMode mode = DOWNSCALE_NONE);
         
         /**
          * Query the visual database.
@@ -164,19 +182,149 @@ namespace vision {
         inline void setMinNumInliers(size_t n) { mMinNumInliers = n; }
         inline size_t minNumInliers() const { return mMinNumInliers; }
         
+        /**
+         * Set/Get the maximum number of candidate keyframes to verify per query. When
+         * non-zero, a global index over all keyframes votes for the candidates and only
+         * the best N go through geometric verification. When zero, every keyframe is
+         * verified.
+         */
+        inline void setMaxNumCandidateKeyframes(size_t n) { mMaxNumCandidateKeyframes = n; }
+        inline size_t maxNumCandidateKeyframes() const { return mMaxNumCandidateKeyframes; }
+        
+        /**
+         * Build the global index over all keyframes, if it is out of date. This is
+         * done lazily by QUERY when needed, but can be called after loading to avoid
+         * the cost on the first query.
+         */
+        void buildGlobalIndex();
+        
+        /**
+         * Set keyframes that queries do not match against, e.g. those of targets
+         * that are already tracked, and the regions of the query image those targets
+         * cover, in which no features are detected. Both apply to every query until
+         * they are set again.
+         */
+        inline void setSkipIds(const id_t* ids, size_t num) { mSkipIds.assign(ids, ids+num); }
+        inline void setSkipRegions(const SkipRegion* regions, size_t num) { mDetector.setSkipRegions(regions, num); }
+        
+        /**
+         * Set/Get early exit. By default every candidate keyframe is verified and the
+         * one with the most inliers is matched. With early exit, the candidates are
+         * verified in order of how likely they are to match: first the prior ids, then
+         * the rest by the votes they get from the global index. The query stops at the
+         * first keyframe with at least minNumInliers()+MARGIN inliers.
+         */
+        inline void setEarlyExit(bool b) { mEarlyExit = b; }
+        inline bool earlyExit() const { return mEarlyExit; }
+        inline void setEarlyExitMargin(size_t margin) { mEarlyExitMargin = margin; }
+        inline size_t earlyExitMargin() const { return mEarlyExitMargin; }
+        
+        /**
+         * Set keyframes that an early exit query verifies before all others, most
+         * likely first, e.g. those of targets that were tracked until recently. They
+         * apply to every query until they are set again.
+         */
+        inline void setPriorIds(const id_t* ids, size_t num) { mPriorIds.assign(ids, ids+num); }
+        
+        /**
+         * Set/Get the number of worker threads used by a query. The pyramid images
+         * are filtered in row bands, and candidate keyframes are matched and verified
+         * in parallel. With zero threads (the default) everything runs on the
+         * calling thread.
+         */
+        void setNumThreads(int n);
+        inline int numThreads() const { return mThreadPool.numThreads(); }
+        
+        /**
+         * @return Thread pool used by queries. It may be used for other work, such
+         * as building keyframe indices, while no query is running.
+         */
+        inline ThreadPool& threadPool() { return mThreadPool; }
+        
+        /**
+         * Use the same keyframes, and global index, as another database. The keyframes
+         * are shared rather than copied, and are only read by queries, so both databases
+         * can be queried concurrently. Keyframes added or erased afterwards only affect
+         * one database. Nothing is built here: if the global index is out of date, the
+         * first of the databases to query builds it for all of them.
+         */
+        void shareKeyframes(VisualDatabase& other);
+        
     private:
         
+        /**
+         * Objects used to match and verify one keyframe at a time. Each worker
+         * thread has its own.
+         */
+        struct VerificationContext {
+            MATCHER matcher;
+            HoughSimilarityVoting houghSimilarityVoting;
+            RobustHomography<float> robustHomography;
+            VerificationBuffers buffers;
+        }; // VerificationContext
+        
+        typedef std::unique_ptr<VerificationContext> verification_context_ptr_t;
+        
+        /**
+         * Result of verifying one candidate keyframe.
+         */
+        struct VerificationResult {
+            VerificationResult() : verified(false) {}
+            bool verified;
+            float H[9];
+            matches_t inliers;
+        }; // VerificationResult
+        
         size_t mMinNumInliers;
         float mHomographyInlierThreshold;
         
         // Set to true if the feature index is enabled
         bool mUseFeatureIndex;
         
+        // Maximum number of keyframes to verify per query (0 for all)
+        size_t mMaxNumCandidateKeyframes;
+        
+        /**
+         * Index over the features of all keyframes, built by the first query that needs
+         * it. Databases with the same keyframes share one, so it is built once, by
+         * whichever of them queries first.
+         */
+        struct SharedGlobalIndex {
+            std::mutex mutex;
+            std::shared_ptr<global_index_t> index;
+        }; // SharedGlobalIndex
+        
+        // Replaced by an unbuilt one whenever the keyframe map changes
+        std::shared_ptr<SharedGlobalIndex> mGlobalIndex;
+        
+        // Keyframes that are not matched against
+        std::vector<id_t> mSkipIds;
+        
+        // Stop at the first keyframe with mMinNumInliers+mEarlyExitMargin inliers
+        bool mEarlyExit;
+        size_t mEarlyExitMargin;
+        
+        // Keyframes verified first by an early exit query
+        std::vector<id_t> mPriorIds;
+        
         matches_t mMatchedInliers;
         id_t mMatchedId;
         float mMatchedGeometry[9];
         
+        // Reused by each query, unless a caller still holds the previous one
         keyframe_ptr_t mQueryKeyframe;
+        
+        // Detected points of the last image, before their features are extracted
+        std::vector<FeaturePoint> mFeaturePoints;
+        
+        // Buffers used by each query, kept to avoid allocating them again
+        std::vector<id_t> mCandidates;
+        std::vector<int> mVotes;
+        std::vector<std::pair<int, int> > mRankedVotes;
+        typename global_index_t::vote_context_t mVoteContext;
+        matches_t mInliers;
+        std::vector<const keyframe_t*> mRefKeyframes;
+        std::vector<VerificationResult> mVerificationResults;
     
         // Map of keyframe
         keyframe_map_t mKeyframeMap;
@@ -199,16 +347,110 @@ namespace vision {
         // Robust homography estimation
         RobustHomography<float> mRobustHomography;
         
+        // Buffers used to verify a keyframe without the worker threads
+        VerificationBuffers mVerificationBuffers;
+        
+        // Worker threads shared by the query stages
+        ThreadPool mThreadPool;
+        
+        // Matcher, voting and estimation objects for each verification worker
+        std::vector<verification_context_ptr_t> mVerificationContexts;
+        
+        /**
+         * Select the keyframes to verify for a query.
+         */
+        void findCandidateKeyframes(std::vector<id_t>& candidates, const keyframe_t* query_keyframe);
+        
+        /**
+         * @return Global index over the keyframes, built first if it isn't yet
+         */
+        const global_index_t* globalIndex();
+        
+        /**
+         * Forget the global index, after the keyframe map changed.
+         */
+        inline void invalidateGlobalIndex() { mGlobalIndex.reset(new SharedGlobalIndex()); }
+        
+        /**
+         * @return True if the number of candidates is limited to the best voted
+         */
+        inline bool isCandidateLimited() const {
+            return mMaxNumCandidateKeyframes != 0 && mKeyframeMap.size() > mMaxNumCandidateKeyframes;
+        }
+        
+        /**
+         * @return True if candidates are found by voting with the global index,
+         * either to limit their number or to rank them for early exit
+         */
+        inline bool usesGlobalIndex() const {
+            return isCandidateLimited() || (mEarlyExit && mKeyframeMap.size() > 1);
+        }
+        
+        /**
+         * Verify candidate keyframes in order, keeping the match with the most
+         * inliers. With early exit, stops at the first good enough match.
+         * @return True if the query stopped early
+         */
+        bool verifyCandidateKeyframes(const std::vector<id_t>& candidates, const keyframe_t* query_keyframe);
+        
+        /**
+         * @return True if a keyframe is not matched against
+         */
+        inline bool isSkipped(id_t id) const {
+            return std::find(mSkipIds.begin(), mSkipIds.end(), id) != mSkipIds.end();
+        }
+        
+        /**
+         * @return True if a keyframe is left out of the candidates found by
+         * findCandidateKeyframes, either because it is skipped or because an
+         * early exit query verifies it beforehand
+         */
+        inline bool isExcludedCandidate(id_t id) const {
+            return isSkipped(id) ||
+                   (mEarlyExit && std::find(mPriorIds.begin(), mPriorIds.end(), id) != mPriorIds.end());
+        }
+        
+        /**
+         * Match the query against a reference keyframe, then geometrically verify
+         * the matches. Only the objects passed in are modified, so this can run
+         * concurrently for different keyframes with different objects.
+         * @return True if the keyframe passes verification
+         */
+        bool matchAndVerifyKeyframe(float H[9],
+                                    matches_t& inliers,
+                                    MATCHER& matcher,
+                                    HoughSimilarityVoting& hough,
+                                    RobustHomography<float>& estimator,
+                                    VerificationBuffers& buffers,
+                                    const keyframe_t* query_keyframe,
+                                    const keyframe_t* ref_keyframe) const;
+        
+        /**
+         * Geometrically verify a set of initial matches between the query and a
+         * reference keyframe.
+         * @return True if the keyframe passes verification
+         */
+        bool verifyKeyframe(float H[9],
+                            matches_t& inliers,
+                            MATCHER& matcher,
+                            HoughSimilarityVoting& hough,
+                            RobustHomography<float>& estimator,
+                            VerificationBuffers& buffers,
+                            const keyframe_t* query_keyframe,
+                            const keyframe_t* ref_keyframe,
+                            const matches_t& matches) const;
+        
     }; // VisualDatabase
     
     /**
-     * Find feature points in an image.
+     * Find feature points in an image. POINTS is used to hold the detected points.
      */
     template<typename FEATURE_EXTRACTOR, int NUM_BYTES_PER_FEATURE>
     void FindFeatures(Keyframe<NUM_BYTES_PER_FEATURE>* keyframe,
                       const GaussianScaleSpacePyramid* pyramid,
                       DoGScaleInvariantDetector* detector,
-                      FEATURE_EXTRACTOR* extractor) {
+                      FEATURE_EXTRACTOR* extractor,
+                      std::vector<FeaturePoint>& points) {
         ASSERT(pyramid, "Pyramid is NULL");
         ASSERT(detector, "Detector is NULL");
         ASSERT(pyramid->images().size() > 0, "Pyramid is empty");
@@ -225,7 +467,7 @@ namespace vision {
         // Copy the points
         //
         
-        std::vector<FeaturePoint> points(detector->features().size());
+        points.resize(detector->features().size());
         for(size_t i = 0; i < detector->features().size(); i++) {
             const DoGScaleInvariantDetector::FeaturePoint& p = detector->features()[i];
             points[i] = FeaturePoint(p.x, p.y, p.angle, p.sigma, p.score > 0);
@@ -275,7 +517,8 @@ namespace vision {
     }
     
     /**
-     * Vote for a similarity transformation.
+     * Vote for a similarity transformation. QUERY and REF are used to hold the
+     * feature data.
      */
     inline int FindHoughSimilarity(HoughSimilarityVoting& hough,
                                    const std::vector<FeaturePoint>& p1,
@@ -284,9 +527,11 @@ namespace vision {
                                    int insWidth,
                                    int insHeigth,
                                    int refWidth,
-                                   int refHeight) {
-        std::vector<float> query(4*matches.size());
-        std::vector<float> ref(4*matches.size());
+                                   int refHeight,
+                                   std::vector<float>& query,
+                                   std::vector<float>& ref) {
+        query.resize(4*matches.size());
+        ref.resize(4*matches.size());
         
         // Extract the data from the features
         for(size_t i = 0; i < matches.size(); i++) {
@@ -354,7 +599,8 @@ namespace vision {
     }
     
     /**
-     * Estimate the homography between a set of correspondences.
+     * Estimate the homography between a set of correspondences. SRCPOINTS and
+     * DSTPOINTS are used to hold the correspondences.
      */
     inline bool EstimateHomography(float H[9],
                                    const std::vector<FeaturePoint>& p1,
@@ -362,10 +608,12 @@ namespace vision {
                                    const matches_t& matches,
                                    RobustHomography<float>& estimator,
                                    int refWidth,
-                                   int refHeight) {
+                                   int refHeight,
+                                   std::vector<vision::Point2d<float> >& srcPoints,
+                                   std::vector<vision::Point2d<float> >& dstPoints) {
         
-        std::vector<vision::Point2d<float> > srcPoints(matches.size());
-        std::vector<vision::Point2d<float> > dstPoints(matches.size());
+        srcPoints.resize(matches.size());
+        dstPoints.resize(matches.size());
         
         //
         // Copy correspondences
@@ -95,7 +95,22 @@ namespace vision {
         
         return (std::abs(s) == 4);
     }
-    
+
+    /**
+     * Check if a point lies inside a convex quadrilateral. The corners may be in
+     * either winding order.
+     */
+    template<typename T>
+    inline bool QuadrilateralContainsPoint(const T x1[2], const T x2[2], const T x3[2], const T x4[2], const T p[2]) {
+        T s1 = LinePointSide(x1, x2, p);
+        T s2 = LinePointSide(x2, x3, p);
+        T s3 = LinePointSide(x3, x4, p);
+        T s4 = LinePointSide(x4, x1, p);
+
+        return (s1 >= 0 && s2 >= 0 && s3 >= 0 && s4 >= 0) ||
+               (s1 <= 0 && s2 <= 0 && s3 <= 0 && s4 <= 0);
+    }
+
     /**
      * Compute the area of a triangle.
      */
@@ -0,0 +1,565 @@
+//
+//  hamming.cpp
+//  artoolkitX
+//
+//  This file is part of artoolkitX.
+//
+//  artoolkitX is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  artoolkitX is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with artoolkitX.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders of this library give you
+//  permission to link this library with independent modules to produce an
+//  executable, regardless of the license terms of these independent modules, and to
+//  copy and distribute the resulting executable under terms of your choice,
+//  provided that you also meet, for each linked independent module, the terms and
+//  conditions of the license of that module. An independent module is a module
+//  which is neither derived from nor based on this library. If you modify this
+//  library, you may extend this exception to your version of the library, but you
+//  are not obligated to do so. If you do not wish to do so, delete this exception
+//  statement from your version.
+//
+//  Copyright 2024 artoolkitX Contributors.
+//
+
+#include "hamming.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#  define HAMMING_X86 1
+#  if defined(__x86_64__) || defined(_M_X64)
+#    define HAMMING_X86_64 1
+#  endif
+#  if defined(_MSC_VER)
+#    include <intrin.h>
+#  else
+#    include <cpuid.h>
+#  endif
+#  include <immintrin.h>
+#  if defined(__GNUC__) || defined(__clang__)
+#    define HAMMING_TARGET(X) __attribute__((target(X)))
+#  else
+#    define HAMMING_TARGET(X)
+#  endif
+// VPOPCNTDQ intrinsics need GCC 8, Clang 6, Apple Clang 10 or Visual Studio 2019.
+#  if defined(__clang__)
+#    if (defined(__apple_build_version__) && __clang_major__ >= 10) || (!defined(__apple_build_version__) && __clang_major__ >= 6)
+#      define HAMMING_HAVE_AVX512 1
+#    endif
+#  elif defined(__GNUC__)
+#    if __GNUC__ >= 8
+#      define HAMMING_HAVE_AVX512 1
+#    endif
+#  elif defined(_MSC_VER)
+#    if _MSC_VER >= 1920
+#      define HAMMING_HAVE_AVX512 1
+#    endif
+#  endif
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#  define HAMMING_NEON 1
+#  include <arm_neon.h>
+#endif
+
+namespace vision {
+    
+    /************************************************************************************************************************
+     *
+     * Scalar
+     *
+     ***********************************************************************************************************************/
+    
+    static unsigned int HammingDistance768_Scalar(const unsigned char* a, const unsigned char* b) {
+        return HammingDistance768Scalar((const unsigned int*)a, (const unsigned int*)b);
+    }
+    
+    static void HammingDistance768Batch_Scalar(unsigned int* distances,
+                                               const unsigned char* query,
+                                               const unsigned char* features,
+                                               size_t count) {
+        for(size_t i = 0; i < count; i++) {
+            distances[i] = HammingDistance768_Scalar(query, features+i*96);
+        }
+    }
+    
+    static void HammingDistance768Indexed_Scalar(unsigned int* distances,
+                                                 const unsigned char* query,
+                                                 const unsigned char* features,
+                                                 const int* indices,
+                                                 size_t count) {
+        for(size_t i = 0; i < count; i++) {
+            distances[i] = HammingDistance768_Scalar(query, features+indices[i]*96);
+        }
+    }
+    
+#if HAMMING_X86
+    
+    /************************************************************************************************************************
+     *
+     * POPCNT
+     *
+     ***********************************************************************************************************************/
+    
+#if HAMMING_X86_64
+    typedef unsigned long long popcnt_word_t;
+#   define HAMMING_POPCNT(X) (unsigned int)_mm_popcnt_u64(X)
+#else
+    typedef unsigned int popcnt_word_t;
+#   define HAMMING_POPCNT(X) (unsigned int)_mm_popcnt_u32(X)
+#endif
+    
+    static const int kNumPopcntWords = 96/sizeof(popcnt_word_t);
+    
+    HAMMING_TARGET("popcnt")
+    static inline unsigned int Distance_POPCNT(const popcnt_word_t q[], const unsigned char* b) {
+        unsigned int d = 0;
+        for(int i = 0; i < kNumPopcntWords; i++) {
+            popcnt_word_t w;
+            std::memcpy(&w, b+i*sizeof(popcnt_word_t), sizeof(popcnt_word_t));
+            d += HAMMING_POPCNT(q[i]^w);
+        }
+        return d;
+    }
+    
+    HAMMING_TARGET("popcnt")
+    static unsigned int HammingDistance768_POPCNT(const unsigned char* a, const unsigned char* b) {
+        popcnt_word_t q[kNumPopcntWords];
+        std::memcpy(q, a, 96);
+        return Distance_POPCNT(q, b);
+    }
+    
+    HAMMING_TARGET("popcnt")
+    static void HammingDistance768Batch_POPCNT(unsigned int* distances,
+                                               const unsigned char* query,
+                                               const unsigned char* features,
+                                               size_t count) {
+        popcnt_word_t q[kNumPopcntWords];
+        std::memcpy(q, query, 96);
+        for(size_t i = 0; i < count; i++) {
+            distances[i] = Distance_POPCNT(q, features+i*96);
+        }
+    }
+    
+    HAMMING_TARGET("popcnt")
+    static void HammingDistance768Indexed_POPCNT(unsigned int* distances,
+                                                 const unsigned char* query,
+                                                 const unsigned char* features,
+                                                 const int* indices,
+                                                 size_t count) {
+        popcnt_word_t q[kNumPopcntWords];
+        std::memcpy(q, query, 96);
+        for(size_t i = 0; i < count; i++) {
+            distances[i] = Distance_POPCNT(q, features+indices[i]*96);
+        }
+    }
+    
+#undef HAMMING_POPCNT
+    
+    /************************************************************************************************************************
+     *
+     * AVX2
+     *
+     ***********************************************************************************************************************/
+    
+    /**
+     * Sum the 4 64 bit lanes of X.
+     */
+    HAMMING_TARGET("avx2")
+    static inline unsigned int HorizontalSum_AVX2(__m256i x) {
+        __m128i s = _mm_add_epi64(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+        s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+        return (unsigned int)_mm_cvtsi128_si32(s);
+    }
+    
+    /**
+     * Count the bits set in each byte of X with a nibble lookup table.
+     */
+    HAMMING_TARGET("avx2")
+    static inline __m256i PopcountBytes_AVX2(__m256i x) {
+        const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                             0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low_mask = _mm256_set1_epi8(0x0f);
+        __m256i lo = _mm256_and_si256(x, low_mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask);
+        return _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+    }
+    
+    HAMMING_TARGET("avx2")
+    static inline unsigned int Distance_AVX2(__m256i q0, __m256i q1, __m256i q2, const unsigned char* b) {
+        // At most 24 bits per byte lane, so the byte counts cannot overflow
+        __m256i c = PopcountBytes_AVX2(_mm256_xor_si256(q0, _mm256_loadu_si256((const __m256i*)b)));
+        c = _mm256_add_epi8(c, PopcountBytes_AVX2(_mm256_xor_si256(q1, _mm256_loadu_si256((const __m256i*)(b+32)))));
+        c = _mm256_add_epi8(c, PopcountBytes_AVX2(_mm256_xor_si256(q2, _mm256_loadu_si256((const __m256i*)(b+64)))));
+        return HorizontalSum_AVX2(_mm256_sad_epu8(c, _mm256_setzero_si256()));
+    }
+    
+    HAMMING_TARGET("avx2")
+    static unsigned int HammingDistance768_AVX2(const unsigned char* a, const unsigned char* b) {
+        return Distance_AVX2(_mm256_loadu_si256((const __m256i*)a),
+                             _mm256_loadu_si256((const __m256i*)(a+32)),
+                             _mm256_loadu_si256((const __m256i*)(a+64)),
+                             b);
+    }
+    
+    HAMMING_TARGET("avx2")
+    static void HammingDistance768Batch_AVX2(unsigned int* distances,
+                                             const unsigned char* query,
+                                             const unsigned char* features,
+                                             size_t count) {
+        const __m256i q0 = _mm256_loadu_si256((const __m256i*)query);
+        const __m256i q1 = _mm256_loadu_si256((const __m256i*)(query+32));
+        const __m256i q2 = _mm256_loadu_si256((const __m256i*)(query+64));
+        for(size_t i = 0; i < count; i++) {
+            distances[i] = Distance_AVX2(q0, q1, q2, features+i*96);
+        }
+    }
+    
+    HAMMING_TARGET("avx2")
+    static void HammingDistance768Indexed_AVX2(unsigned int* distances,
+                                               const unsigned char* query,
+                                               const unsigned char* features,
+                                               const int* indices,
+                                               size_t count) {
+        const __m256i q0 = _mm256_loadu_si256((const __m256i*)query);
+        const __m256i q1 = _mm256_loadu_si256((const __m256i*)(query+32));
+        const __m256i q2 = _mm256_loadu_si256((const __m256i*)(query+64));
+        for(size_t i = 0; i < count; i++) {
+            distances[i] = Distance_AVX2(q0, q1, q2, features+indices[i]*96);
+        }
+    }
+    
+#if HAMMING_HAVE_AVX512
+    
+    /************************************************************************************************************************
+     *
+     * AVX-512 VPOPCNTDQ
+     *
+     ***********************************************************************************************************************/
+    
+    /**
+     * The last 32 bytes of a descriptor are loaded with a mask, so nothing is
+     * read past the end of the descriptor.
+     */
+    static const __mmask8 kTailMask = 0x0F;
+    
+    HAMMING_TARGET("avx512f,avx512vpopcntdq")
+    static inline unsigned int Distance_AVX512(__m512i q0, __m512i q1, const unsigned char* b) {
+        __m512i x0 = _mm512_xor_si512(q0, _mm512_loadu_si512((const void*)b));
+        __m512i x1 = _mm512_xor_si512(q1, _mm512_maskz_loadu_epi64(kTailMask, (const void*)(b+64)));
+        __m512i c = _mm512_add_epi64(_mm512_popcnt_epi64(x0), _mm512_popcnt_epi64(x1));
+        
+        // Fold the two 256 bit halves, then the two 128 bit lanes, then sum the last two counts.
+        // The zero-masked extract with a full mask is the plain extract, without the undefined
+        // pass-through operand that GCC's unmasked intrinsics warn about at -Wall.
+        __m256i d = _mm256_add_epi64(_mm512_maskz_extracti64x4_epi64(0x0F, c, 0),
+                                     _mm512_maskz_extracti64x4_epi64(0x0F, c, 1));
+        __m128i s = _mm_add_epi64(_mm256_extracti128_si256(d, 0), _mm256_extracti128_si256(d, 1));
+        s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+        return (unsigned int)_mm_cvtsi128_si32(s);
+    }
+    
+    HAMMING_TARGET("avx512f,avx512vpopcntdq")
+    static unsigned int HammingDistance768_AVX512(const unsigned char* a, const unsigned char* b) {
+        return Distance_AVX512(_mm512_loadu_si512((const void*)a),
+                               _mm512_maskz_loadu_epi64(kTailMask, (const void*)(a+64)),
+                               b);
+    }
+    
+    HAMMING_TARGET("avx512f,avx512vpopcntdq")
+    static void HammingDistance768Batch_AVX512(unsigned int* distances,
+                                               const unsigned char* query,
+                                               const unsigned char* features,
+                                               size_t count) {
+        const __m512i q0 = _mm512_loadu_si512((const void*)query);
+        const __m512i q1 = _mm512_maskz_loadu_epi64(kTailMask, (const void*)(query+64));
+        for(size_t i = 0; i < count; i++) {
+            distances[i] = Distance_AVX512(q0, q1, features+i*96);
+        }
+    }
+    
+    HAMMING_TARGET("avx512f,avx512vpopcntdq")
+    static void HammingDistance768Indexed_AVX512(unsigned int* distances,
+                                                 const unsigned char* query,
+                                                 const unsigned char* features,
+                                                 const int* indices,
+                                                 size_t count) {
+        const __m512i q0 = _mm512_loadu_si512((const void*)query);
+        const __m512i q1 = _mm512_maskz_loadu_epi64(kTailMask, (const void*)(query+64));
+        for(size_t i = 0; i < count; i++) {
+            distances[i] = Distance_AVX512(q0, q1, features+indices[i]*96);
+        }
+    }
+    
+#endif // HAMMING_HAVE_AVX512
+    
+    /************************************************************************************************************************
+     *
+     * CPU feature detection
+     *
+     ***********************************************************************************************************************/
+    
+    static void Cpuid(unsigned int regs[4], unsigned int leaf, unsigned int subleaf) {
+#if defined(_MSC_VER)
+        int r[4];
+        __cpuidex(r, (int)leaf, (int)subleaf);
+        for(int i = 0; i < 4; i++) {
+            regs[i] = (unsigned int)r[i];
+        }
+#else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    }
+    
+    static unsigned long long Xgetbv0() {
+#if defined(_MSC_VER)
+        return _xgetbv(0);
+#else
+        unsigned int eax, edx;
+        __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return ((unsigned long long)edx << 32) | eax;
+#endif
+    }
+    
+    struct CpuFeatures {
+        bool popcnt;
+        bool avx2;
+        bool avx512;
+    }; // CpuFeatures
+    
+    static CpuFeatures DetectCpuFeatures() {
+        CpuFeatures features = {false, false, false};
+        unsigned int regs[4];
+        
+        Cpuid(regs, 0, 0);
+        const unsigned int max_leaf = regs[0];
+        if(max_leaf < 1) {
+            return features;
+        }
+        
+        Cpuid(regs, 1, 0);
+        features.popcnt = (regs[2] & (1u << 23)) != 0;
+        
+        // The OS must save the YMM/ZMM registers before AVX can be used
+        const bool osxsave = (regs[2] & (1u << 27)) != 0;
+        const bool avx = (regs[2] & (1u << 28)) != 0;
+        if(!osxsave || !avx || max_leaf < 7) {
+            return features;
+        }
+        const unsigned long long xcr0 = Xgetbv0();
+        
+        Cpuid(regs, 7, 0);
+        features.avx2 = (xcr0 & 0x06) == 0x06 &&
+                        (regs[1] & (1u << 5)) != 0;
+        features.avx512 = (xcr0 & 0xE6) == 0xE6 &&
+                          (regs[1] & (1u << 16)) != 0 &&    // AVX512F
+                          (regs[2] & (1u << 14)) != 0;      // AVX512_VPOPCNTDQ
+        return features;
+    }
+    
+    static const CpuFeatures& GetCpuFeatures() {
+        static const CpuFeatures features = DetectCpuFeatures();
+        return features;
+    }
+    
+#endif // HAMMING_X86
+    
+#if HAMMING_NEON
+    
+    /************************************************************************************************************************
+     *
+     * NEON
+     *
+     ***********************************************************************************************************************/
+    
+    static inline unsigned int Distance_NEON(const uint8x16_t q[6], const unsigned char* b) {
+        // At most 48 bits per byte lane, so the byte counts cannot overflow
+        uint8x16_t c = vcntq_u8(veorq_u8(q[0], vld1q_u8(b)));
+        c = vaddq_u8(c, vcntq_u8(veorq_u8(q[1], vld1q_u8(b+16))));
+        c = vaddq_u8(c, vcntq_u8(veorq_u8(q[2], vld1q_u8(b+32))));
+        c = vaddq_u8(c, vcntq_u8(veorq_u8(q[3], vld1q_u8(b+48))));
+        c = vaddq_u8(c, vcntq_u8(veorq_u8(q[4], vld1q_u8(b+64))));
+        c = vaddq_u8(c, vcntq_u8(veorq_u8(q[5], vld1q_u8(b+80))));
+        uint64x2_t s = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(c)));
+        return (unsigned int)(vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1));
+    }
+    
+    static inline void LoadQuery_NEON(uint8x16_t q[6], const unsigned char* a) {
+        for(int i = 0; i < 6; i++) {
+            q[i] = vld1q_u8(a+16*i);
+        }
+    }
+    
+    static unsigned int HammingDistance768_NEON(const unsigned char* a, const unsigned char* b) {
+        uint8x16_t q[6];
+        LoadQuery_NEON(q, a);
+        return Distance_NEON(q, b);
+    }
+    
+    static void HammingDistance768Batch_NEON(unsigned int* distances,
+                                             const unsigned char* query,
+                                             const unsigned char* features,
+                                             size_t count) {
+        uint8x16_t q[6];
+        LoadQuery_NEON(q, query);
+        for(size_t i = 0; i < count; i++) {
+            distances[i] = Distance_NEON(q, features+i*96);
+        }
+    }
+    
+    static void HammingDistance768Indexed_NEON(unsigned int* distances,
+                                               const unsigned char* query,
+                                               const unsigned char* features,
+                                               const int* indices,
+                                               size_t count) {
+        uint8x16_t q[6];
+        LoadQuery_NEON(q, query);
+        for(size_t i = 0; i < count; i++) {
+            distances[i] = Distance_NEON(q, features+indices[i]*96);
+        }
+    }
+    
+#endif // HAMMING_NEON
+    
+    /************************************************************************************************************************
+     *
+     * Dispatch
+     *
+     ***********************************************************************************************************************/
+    
+    // Start with the scalar kernel, so matching works even before the library
+    // initializer below has run.
+    detail::HammingKernelTable detail::gHammingKernelTable = {
+        HAMMING_KERNEL_SCALAR,
+        &HammingDistance768_Scalar,
+        &HammingDistance768Batch_Scalar,
+        &HammingDistance768Indexed_Scalar
+    };
+    
+    /**
+     * Fill TABLE with the entry points of KERNEL.
+     * @return False if KERNEL was not compiled in
+     */
+    static bool GetHammingKernelTable(detail::HammingKernelTable& table, HammingKernel kernel) {
+        table.kernel = kernel;
+        switch(kernel) {
+            case HAMMING_KERNEL_SCALAR:
+                table.distance768 = &HammingDistance768_Scalar;
+                table.distance768Batch = &HammingDistance768Batch_Scalar;
+                table.distance768Indexed = &HammingDistance768Indexed_Scalar;
+                return true;
+#if HAMMING_X86
+            case HAMMING_KERNEL_POPCNT:
+                table.distance768 = &HammingDistance768_POPCNT;
+                table.distance768Batch = &HammingDistance768Batch_POPCNT;
+                table.distance768Indexed = &HammingDistance768Indexed_POPCNT;
+                return true;
+            case HAMMING_KERNEL_AVX2:
+                table.distance768 = &HammingDistance768_AVX2;
+                table.distance768Batch = &HammingDistance768Batch_AVX2;
+                table.distance768Indexed = &HammingDistance768Indexed_AVX2;
+                return true;
+#if HAMMING_HAVE_AVX512
+            case HAMMING_KERNEL_AVX512:
+                table.distance768 = &HammingDistance768_AVX512;
+                table.distance768Batch = &HammingDistance768Batch_AVX512;
+                table.distance768Indexed = &HammingDistance768Indexed_AVX512;
+                return true;
+#endif
+#endif
+#if HAMMING_NEON
+            case HAMMING_KERNEL_NEON:
+                table.distance768 = &HammingDistance768_NEON;
+                table.distance768Batch = &HammingDistance768Batch_NEON;
+                table.distance768Indexed = &HammingDistance768Indexed_NEON;
+                return true;
+#endif
+            default:
+                return false;
+        }
+    }
+    
+    bool HammingKernelSupported(HammingKernel kernel) {
+        detail::HammingKernelTable table;
+        if(!GetHammingKernelTable(table, kernel)) {
+            return false;
+        }
+        switch(kernel) {
+#if HAMMING_X86
+            case HAMMING_KERNEL_POPCNT:
+                return GetCpuFeatures().popcnt;
+            case HAMMING_KERNEL_AVX2:
+                return GetCpuFeatures().avx2;
+            case HAMMING_KERNEL_AVX512:
+                return GetCpuFeatures().avx512;
+#endif
+            default:
+                // Scalar always works, and NEON is only compiled in when the
+                // compiler targets a CPU that has it
+                return true;
+        }
+    }
+    
+    HammingKernel HammingKernelBest() {
+        const HammingKernel kernels[] = {
+            HAMMING_KERNEL_AVX512,
+            HAMMING_KERNEL_AVX2,
+            HAMMING_KERNEL_NEON,
+            HAMMING_KERNEL_POPCNT
+        };
+        for(size_t i = 0; i < sizeof(kernels)/sizeof(kernels[0]); i++) {
+            if(HammingKernelSupported(kernels[i])) {
+                return kernels[i];
+            }
+        }
+        return HAMMING_KERNEL_SCALAR;
+    }
+    
+    bool SetHammingKernel(HammingKernel kernel) {
+        detail::HammingKernelTable table;
+        if(!HammingKernelSupported(kernel) || !GetHammingKernelTable(table, kernel)) {
+            return false;
+        }
+        detail::gHammingKernelTable = table;
+        return true;
+    }
+    
+    HammingKernel GetHammingKernel() {
+        return detail::gHammingKernelTable.kernel;
+    }
+    
+    const char* HammingKernelName(HammingKernel kernel) {
+        switch(kernel) {
+            case HAMMING_KERNEL_SCALAR: return "scalar";
+            case HAMMING_KERNEL_POPCNT: return "popcnt";
+            case HAMMING_KERNEL_NEON:   return "neon";
+            case HAMMING_KERNEL_AVX2:   return "avx2";
+            case HAMMING_KERNEL_AVX512: return "avx512";
+        }
+        return "unknown";
+    }
+    
+    namespace {
+        
+        /**
+         * Selects the fastest kernel when the library is loaded.
+         */
+        struct HammingKernelInitializer {
+            HammingKernelInitializer() {
+                SetHammingKernel(HammingKernelBest());
+            }
+        }; // HammingKernelInitializer
+        
+        HammingKernelInitializer gHammingKernelInitializer;
+        
+    } // anonymous
+    
+} // vision
@@ -35,6 +35,7 @@
 
 #pragma once
 
+#include <cstddef>
 #include <limits>
 
 namespace vision {
@@ -59,9 +60,10 @@ namespace vision {
     }
     
     /**
-     * Hamming distance for 768 bits (96 bytes)
+     * Portable Hamming distance for 768 bits (96 bytes). This is the reference
+     * implementation the accelerated kernels must agree with.
      */
-    inline unsigned int HammingDistance768(const unsigned int a[24], const unsigned int b[24]) {
+    inline unsigned int HammingDistance768Scalar(const unsigned int a[24], const unsigned int b[24]) {
         return  HammingDistance32(a[0],  b[0]) +
                 HammingDistance32(a[1],  b[1]) +
                 HammingDistance32(a[2],  b[2]) +
@@ -88,6 +90,106 @@ namespace vision {
                 HammingDistance32(a[23], b[23]);
     }
     
+    /**
+     * Implementations of the 768 bit Hamming distance. All kernels return exactly
+     * the same distances, they only differ in speed.
+     */
+    enum HammingKernel {
+        HAMMING_KERNEL_SCALAR = 0,  // Portable bit twiddling
+        HAMMING_KERNEL_POPCNT,      // x86 POPCNT on 64 bit words
+        HAMMING_KERNEL_NEON,        // ARM NEON VCNT
+        HAMMING_KERNEL_AVX2,        // x86 AVX2 nibble lookup table
+        HAMMING_KERNEL_AVX512       // x86 AVX-512 VPOPCNTDQ
+    }; // HammingKernel
+    
+    /**
+     * @return True if KERNEL was compiled in and is supported by the CPU.
+     */
+    bool HammingKernelSupported(HammingKernel kernel);
+    
+    /**
+     * @return Fastest kernel supported by the CPU.
+     */
+    HammingKernel HammingKernelBest();
+    
+    /**
+     * Select the kernel used by HammingDistance768() and the batched variants. The
+     * fastest supported kernel is selected when the library is loaded, so this is
+     * only needed for testing and benchmarking. Must not be called while matching
+     * is in progress on another thread.
+     * @return False if KERNEL is not supported, in which case nothing changes
+     */
+    bool SetHammingKernel(HammingKernel kernel);
+    
+    /**
+     * @return Kernel currently in use.
+     */
+    HammingKernel GetHammingKernel();
+    
+    /**
+     * @return Human readable name of KERNEL.
+     */
+    const char* HammingKernelName(HammingKernel kernel);
+    
+    namespace detail {
+        
+        typedef unsigned int (*hamming_distance_768_t)(const unsigned char* a,
+                                                       const unsigned char* b);
+        typedef void (*hamming_distance_768_batch_t)(unsigned int* distances,
+                                                     const unsigned char* query,
+                                                     const unsigned char* features,
+                                                     size_t count);
+        typedef void (*hamming_distance_768_indexed_t)(unsigned int* distances,
+                                                       const unsigned char* query,
+                                                       const unsigned char* features,
+                                                       const int* indices,
+                                                       size_t count);
+        
+        /**
+         * Entry points of the selected kernel.
+         */
+        struct HammingKernelTable {
+            HammingKernel kernel;
+            hamming_distance_768_t distance768;
+            hamming_distance_768_batch_t distance768Batch;
+            hamming_distance_768_indexed_t distance768Indexed;
+        }; // HammingKernelTable
+        
+        extern HammingKernelTable gHammingKernelTable;
+        
+    } // detail
+    
+    /**
+     * Hamming distance for 768 bits (96 bytes)
+     */
+    inline unsigned int HammingDistance768(const unsigned int a[24], const unsigned int b[24]) {
+        return detail::gHammingKernelTable.distance768((const unsigned char*)a, (const unsigned char*)b);
+    }
+    
+    /**
+     * Hamming distance between one 768 bit QUERY and COUNT descriptors stored
+     * contiguously in FEATURES. DISTANCES must have room for COUNT entries.
+     */
+    inline void HammingDistance768Batch(unsigned int* distances,
+                                        const unsigned char* query,
+                                        const unsigned char* features,
+                                        size_t count) {
+        detail::gHammingKernelTable.distance768Batch(distances, query, features, count);
+    }
+    
+    /**
+     * Hamming distance between one 768 bit QUERY and the COUNT descriptors of
+     * FEATURES selected by INDICES, such as the reverse index of a tree leaf.
+     * DISTANCES must have room for COUNT entries.
+     */
+    inline void HammingDistance768Indexed(unsigned int* distances,
+                                          const unsigned char* query,
+                                          const unsigned char* features,
+                                          const int* indices,
+                                          size_t count) {
+        detail::gHammingKernelTable.distance768Indexed(distances, query, features, indices, count);
+    }
+    
     template<int NUM_BYTES>
     inline unsigned int HammingDistance(const unsigned char a[NUM_BYTES], const unsigned char b[NUM_BYTES]) {
         switch(NUM_BYTES) {
@@ -47,7 +47,7 @@ namespace vision {
      * http://software.intel.com/en-us/articles/fast-random-number-generator-on-the-intel-pentiumr-4-processor/
      */
     inline int FastRandom(int& seed) {
-        seed = (214013*seed+2531011);
+        seed = (int)(214013u*(unsigned int)seed+2531011u);
         return (seed>>16)&0x7FFF;
     }
     
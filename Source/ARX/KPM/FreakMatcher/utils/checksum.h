@@ -0,0 +1,68 @@
+//
+//  checksum.h
+//  artoolkitX
+//
+//  This file is part of artoolkitX.
+//
+//  artoolkitX is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  artoolkitX is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with artoolkitX.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders of this library give you
+//  permission to link this library with independent modules to produce an
+//  executable, regardless of the license terms of these independent modules, and to
+//  copy and distribute the resulting executable under terms of your choice,
+//  provided that you also meet, for each linked independent module, the terms and
+//  conditions of the license of that module. An independent module is a module
+//  which is neither derived from nor based on this library. If you modify this
+//  library, you may extend this exception to your version of the library, but you
+//  are not obligated to do so. If you do not wish to do so, delete this exception
+//  statement from your version.
+//
+//  Copyright 2024 artoolkitX Contributors.
+//
+
+#pragma once
+
+#include <cstring>
+#include <cstddef>
+#include <stdint.h>
+
+namespace vision {
+    
+    /**
+     * 64-bit FNV-1a style checksum, taken over 8-byte words and then the
+     * remaining bytes. This detects corrupt or mismatched data; it is not a
+     * cryptographic hash.
+     *
+     * @param[in] data Bytes to checksum
+     * @param[in] size Number of bytes
+     * @param[in] seed Checksum of the preceding data, to checksum data in pieces
+     */
+    inline uint64_t Checksum64(const void* data, size_t size, uint64_t seed = 14695981039346656037ull) {
+        const uint64_t prime = 1099511628211ull;
+        const unsigned char* p = (const unsigned char*)data;
+        uint64_t h = seed;
+        
+        size_t i = 0;
+        for(; i+8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, p+i, 8);
+            h = (h^word)*prime;
+        }
+        for(; i < size; i++) {
+            h = (h^p[i])*prime;
+        }
+        return h;
+    }
+    
+} // vision
@@ -89,11 +89,25 @@ typedef enum {
 
 #define   KpmChangePageNoAllPages (-1)
 
+#define   KpmIndexFileExt        "fset3i"
+
 typedef struct {
     float             x;
     float             y;
 } KpmCoord2D;
 
+/*!
+    @typedef    KpmSkipRect
+    @brief   A convex quadrilateral of an input image in which key points are not matched.
+    @details
+        Typically the area covered by a page that is already being tracked.
+	@field		vertex Corners of the quadrilateral, in order around its edge, in observed
+        (i.e. distorted) pixel coordinates of the input image.
+  */
+typedef struct {
+    KpmCoord2D        vertex[4];
+} KpmSkipRect;
+
 typedef struct {
     int               width;
     int               height;
@@ -135,6 +149,21 @@ typedef struct {
     int               pageNum;
 } KpmRefDataSet;
 
+/*!
+    @typedef    KPM_REF_DATA_SET_FORMAT
+    @brief   On-disk layouts of a reference data set (.fset3) file.
+    @details
+        KpmRefDataSetFormatLegacy is the original field-by-field layout.
+        KpmRefDataSetFormatMappable is a versioned layout with an aligned header and
+        aligned tables of reference points, pages and images, which kpmLoadRefDataSet maps
+        into memory and uses in place. Both layouts are in the byte order of the machine
+        that wrote them.
+ */
+typedef enum {
+    KpmRefDataSetFormatLegacy   = 0,
+    KpmRefDataSetFormatMappable = 1
+} KPM_REF_DATA_SET_FORMAT;
+
 /*!
     @typedef    KpmInputDataSet
     @brief   Data describing the number and location of keypoints in an input image to be matched against a loaded data set.
@@ -208,6 +237,20 @@ KPM_EXTERN KpmHandle  *kpmCreateHandle2(int xsize, int ysize);
 KPM_EXTERN KpmHandle  *kpmCreateHandleHomography(int xsize, int ysize);
 #define     kpmCreatHandleHomography kpmCreateHandleHomography
 
+/*!
+    @brief Allocate a KPM handle with the same settings and reference data as an existing handle.
+    @details
+        Use this to run kpmMatching on several frames at once, one handle per thread. The new handle
+        has the same camera parameters, frame size, processing mode and maximum number of features
+        as kpmHandle, and uses its reference data as if by kpmShareRefDataSet.
+    @param kpmHandle Handle whose settings and reference data are used. It must not be deleted
+        before the new handle.
+    @result Pointer to a newly-allocated KpmHandle structure, which must be deallocated via a call
+        to kpmDeleteHandle() when no longer needed, or NULL in case of error.
+    @see kpmShareRefDataSet kpmShareRefDataSet
+ */
+KPM_EXTERN KpmHandle  *kpmCreateHandleSharingRefDataSet(KpmHandle *kpmHandle);
+
 /*!
     @brief Finalise and dispose of structures for KPM tracking.
     @details
@@ -230,6 +273,57 @@ KPM_EXTERN int         kpmSetDetectedFeatureMax( KpmHandle *kpmHandle, int  dete
 KPM_EXTERN int         kpmGetDetectedFeatureMax( KpmHandle *kpmHandle, int *detectedMaxFeature );
 KPM_EXTERN int         kpmSetSurfThreadNum( KpmHandle *kpmHandle, int surfThreadNum );
 
+/*!
+    @brief Limit the number of reference images geometrically verified per call to kpmMatching().
+    @details
+        By default, every reference image (keyframe) in the loaded data set is matched and
+        verified against each input frame, so matching time grows linearly with the number of
+        pages loaded. When a non-zero maximum is set, a single index over the features of all
+        reference images is used to vote for candidates, and only the candidates with the
+        most votes go through geometric verification.
+    @param kpmHandle Handle to the current KPM tracker instance.
+    @param candidateKeyframeMax Maximum number of reference images to verify per frame,
+        or 0 to verify all reference images (the default).
+    @result 0 if successful, or value &lt;0 in case of error.
+ */
+KPM_EXTERN int         kpmSetCandidateKeyframeMax( KpmHandle *kpmHandle, int  candidateKeyframeMax );
+KPM_EXTERN int         kpmGetCandidateKeyframeMax( KpmHandle *kpmHandle, int *candidateKeyframeMax );
+
+/*!
+    @brief Set the number of worker threads used by kpmMatching().
+    @details
+        Stages of KPM matching that are independent (for example, the verification of
+        each candidate reference image) are spread over a pool of worker threads, with
+        the thread calling kpmMatching() also taking part.
+    @param kpmHandle Handle to the current KPM tracker instance.
+    @param threadNum Number of worker threads in addition to the calling thread. 0 (the
+        default) runs all matching on the calling thread. -1 uses one worker per
+        additional CPU core.
+    @result 0 if successful, or value &lt;0 in case of error.
+ */
+KPM_EXTERN int         kpmSetThreadNum( KpmHandle *kpmHandle, int  threadNum );
+KPM_EXTERN int         kpmGetThreadNum( KpmHandle *kpmHandle, int *threadNum );
+
+/*!
+    @brief Stop kpmMatching() at the first reference image found with enough inliers.
+    @details
+        By default, kpmMatching() verifies every candidate reference image (keyframe) and
+        reports the one with the most inliers. With early exit, the candidates are verified
+        in order of how likely they are to be in the frame: first those of the pages set
+        with kpmSetMatchingPriorPage(), then the rest by the votes they get from an index
+        over the features of all reference images. Matching stops at the first reference
+        image verified with at least earlyExitMargin inliers more than the minimum. When a
+        page that was lost recently comes back into view, typically only its own
+        reference images are verified.
+    @param kpmHandle Handle to the current KPM tracker instance.
+    @param earlyExitMargin Number of inliers above the minimum needed to stop, or -1
+        to verify every candidate (the default).
+    @result 0 if successful, or value &lt;0 in case of error.
+    @see kpmSetMatchingPriorPage kpmSetMatchingPriorPage
+ */
+KPM_EXTERN int         kpmSetEarlyExitMargin( KpmHandle *kpmHandle, int  earlyExitMargin );
+KPM_EXTERN int         kpmGetEarlyExitMargin( KpmHandle *kpmHandle, int *earlyExitMargin );
+
 /*!
     @brief Load a reference data set into the key point matcher for tracking.
     @details
@@ -247,6 +341,63 @@ KPM_EXTERN int         kpmSetSurfThreadNum( KpmHandle *kpmHandle, int surfThread
  */
 KPM_EXTERN int         kpmSetRefDataSet( KpmHandle *kpmHandle, KpmRefDataSet *refDataSet );
 
+/*!
+    @brief Add the pages of a reference data set to those already loaded into the key point matcher.
+    @details
+        Unlike kpmSetRefDataSet, the pages already loaded are kept, and only the features of
+        the new pages are indexed. This allows pages to be added while tracking others.
+        Must not be called while kpmMatching is running on the same handle.
+    @param kpmHandle Handle to the current KPM tracker instance.
+    @param refDataSet The reference data set to add. Its page numbers must differ from those
+        of the pages already loaded (see kpmChangePageNoOfRefDataSet). The operation takes
+        a copy of the data required from this dataset.
+    @result 0 if successful, or value &lt;0 in case of error.
+    @see kpmRemoveRefDataSetPage kpmRemoveRefDataSetPage
+ */
+KPM_EXTERN int         kpmAddRefDataSetPages( KpmHandle *kpmHandle, KpmRefDataSet *refDataSet );
+
+/*!
+    @brief Move the pages loaded into one KPM handle to those already loaded into another.
+    @details
+        With binary features, the features of the pages are indexed when they are loaded into
+        srcHandle (by kpmSetRefDataSet), so they can be prepared on another thread, and this
+        only moves them, without indexing anything. Must not be called while kpmMatching is
+        running on either handle.
+    @param kpmHandle Handle to the current KPM tracker instance.
+    @param srcHandle Handle holding the pages to add. Their page numbers must differ from those
+        of the pages already loaded into kpmHandle. It is left with no pages loaded.
+    @result 0 if successful, or value &lt;0 in case of error.
+    @see kpmAddRefDataSetPages kpmAddRefDataSetPages
+ */
+KPM_EXTERN int         kpmMoveRefDataSetPages( KpmHandle *kpmHandle, KpmHandle *srcHandle );
+
+/*!
+    @brief Remove one page from the reference data loaded into the key point matcher.
+    @details
+        The other pages are left as they are. Must not be called while kpmMatching is running
+        on the same handle.
+    @param kpmHandle Handle to the current KPM tracker instance.
+    @param pageNo Page number of the page to remove.
+    @result 0 if successful, or value &lt;0 in case of error.
+    @see kpmAddRefDataSetPages kpmAddRefDataSetPages
+ */
+KPM_EXTERN int         kpmRemoveRefDataSetPage( KpmHandle *kpmHandle, int pageNo );
+
+/*!
+    @brief Make a KPM handle use the reference data loaded into another handle.
+    @details
+        With binary features, the reference images and their feature indices are shared rather
+        than copied, so this is fast, and the two handles may run kpmMatching concurrently.
+        Changes made to the reference data of either handle afterwards do not affect the other,
+        so call this again after changing the reference data of srcHandle. Must not be called
+        while kpmMatching is running on either handle.
+    @param kpmHandle Handle which will use the reference data.
+    @param srcHandle Handle holding the reference data.
+    @result 0 if successful, or value &lt;0 in case of error.
+    @see kpmCreateHandleSharingRefDataSet kpmCreateHandleSharingRefDataSet
+ */
+KPM_EXTERN int         kpmShareRefDataSet( KpmHandle *kpmHandle, KpmHandle *srcHandle );
+
 /*!
     @brief
         Loads a reference data set from a file into the KPM tracker.
@@ -254,6 +405,8 @@ KPM_EXTERN int         kpmSetRefDataSet( KpmHandle *kpmHandle, KpmRefDataSet *re
         This is a convenience method which performs a sequence of kpmLoadRefDataSet, followed
         by kpmSetRefDataSet and finally kpmDeleteRefDataSet. When tracking from a single
         reference dataset file, this is the simplest means to start.
+        The feature indices are read from the index file 'filename'.fset3i when it exists and
+        matches the dataset. Otherwise they are built, and the index file is (re)written.
     @param kpmHandle Handle to the current KPM tracker instance, as generated by kpmCreateHandle or kpmCreateHandleHomography.
     @param filename Path to the dataset. Either full path, or a relative path if supported by
         the operating system.
@@ -268,6 +421,39 @@ KPM_EXTERN int         kpmSetRefDataSetFile( KpmHandle *kpmHandle, const char *f
 
 KPM_EXTERN int         kpmSetRefDataSetFileOld( KpmHandle *kpmHandle, const char *filename, const char *ext );
 
+/*!
+    @brief Read prebuilt feature indices from an index file.
+    @details
+        kpmSetRefDataSet builds a search index over the features of every reference image,
+        which is slow for large datasets. An index file holds these indices, each keyed by a
+        checksum of the descriptors it was built over. After this call, kpmSetRefDataSet
+        uses a stored index for every reference image whose descriptors match one, and builds
+        the rest. Several index files may be read, e.g. one per page. The indices read are
+        released by the next kpmSetRefDataSet.
+    @param kpmHandle Handle to the current KPM tracker instance.
+    @param filename Path to the index file, typically the dataset path.
+    @param ext If non-NULL, a '.' charater and this string will be appended to 'filename'.
+        Typically KpmIndexFileExt.
+    @result Number of indices read, or value &lt;0 if the file is missing, corrupt, or was
+        written for a different feature type.
+    @see kpmSaveIndexFile kpmSaveIndexFile
+ */
+KPM_EXTERN int         kpmLoadIndexFile( KpmHandle *kpmHandle, const char *filename, const char *ext );
+
+/*!
+    @brief Write the feature indices built by kpmSetRefDataSet to an index file.
+    @param kpmHandle Handle to the current KPM tracker instance.
+    @param filename Path to the index file, typically the dataset path.
+    @param ext If non-NULL, a '.' charater and this string will be appended to 'filename'.
+        Typically KpmIndexFileExt.
+    @param pageNo Page whose indices are written, or KpmChangePageNoAllPages for all pages.
+    @param onlyIfBuilt If non-zero, the file is only written when at least one of the indices
+        was built by kpmSetRefDataSet rather than read by kpmLoadIndexFile.
+    @result 1 if the file was written, 0 if there was nothing to write, or value &lt;0 in case of error.
+    @see kpmLoadIndexFile kpmLoadIndexFile
+ */
+KPM_EXTERN int         kpmSaveIndexFile( KpmHandle *kpmHandle, const char *filename, const char *ext, int pageNo, int onlyIfBuilt );
+
 /*!
     @brief Perform key-point matching on an image.
     @param kpmHandle
@@ -280,10 +466,47 @@ KPM_EXTERN int         kpmSetRefDataSetFileOld( KpmHandle *kpmHandle, const char
  */
 KPM_EXTERN int         kpmMatching(KpmHandle *kpmHandle, ARUint8 *inImageLuma);
 
+/*!
+    @brief Exclude pages from the next call to kpmMatching.
+    @details
+        Typically used for pages that are already being tracked, so that the matching only
+        looks for the other pages. On the binary feature path, the keyframes of the pages
+        are left out of the candidates that are verified. Applies to the next call to
+        kpmMatching only, and may be called more than once before it.
+    @param kpmHandle Handle to the current KPM tracker instance.
+    @param skipPages Page numbers of the pages to exclude.
+    @param num Number of entries in skipPages.
+    @result 0 if successful, or value &lt;0 in case of error.
+    @see kpmSetMatchingSkipRegion kpmSetMatchingSkipRegion
+ */
 KPM_EXTERN int         kpmSetMatchingSkipPage( KpmHandle *kpmHandle, int *skipPages, int num );
-#if !BINARY_FEATURE
-KPM_EXTERN int         kpmSetMatchingSkipRegion( KpmHandle *kpmHandle, SurfSubRect *skipRegion, int regionNum);
-#endif
+
+/*!
+    @brief Set regions of the input image in which no key points are detected by the next call to kpmMatching.
+    @details
+        Typically the areas covered by pages that are already being tracked, so that the
+        features detected are all on content that is not yet tracked. Replaces any regions
+        set before, and applies to the next call to kpmMatching only.
+    @param kpmHandle Handle to the current KPM tracker instance.
+    @param skipRegion Array of regions.
+    @param regionNum Number of entries in skipRegion.
+    @result 0 if successful, or value &lt;0 in case of error.
+    @see kpmSetMatchingSkipPage kpmSetMatchingSkipPage
+ */
+KPM_EXTERN int         kpmSetMatchingSkipRegion( KpmHandle *kpmHandle, KpmSkipRect *skipRegion, int regionNum );
+
+/*!
+    @brief Set the pages the next call to kpmMatching verifies first, when early exit is on.
+    @details
+        Typically the pages most recently lost by the tracker, most recent first. Replaces
+        any pages set before, and applies to the next call to kpmMatching only.
+    @param kpmHandle Handle to the current KPM tracker instance.
+    @param priorPages Page numbers of the pages, most likely first.
+    @param num Number of entries in priorPages.
+    @result 0 if successful, or value &lt;0 in case of error.
+    @see kpmSetEarlyExitMargin kpmSetEarlyExitMargin
+ */
+KPM_EXTERN int         kpmSetMatchingPriorPage( KpmHandle *kpmHandle, int *priorPages, int num );
 
 KPM_EXTERN int         kpmGetRefDataSet( KpmHandle *kpmHandle, KpmRefDataSet **refDataSet );
 KPM_EXTERN int         kpmGetInDataSet( KpmHandle *kpmHandle, KpmInputDataSet **inDataSet );
@@ -336,6 +559,33 @@ KPM_EXTERN int         kpmDeleteRefDataSet ( KpmRefDataSet **refDataSetPtr );
  */
 KPM_EXTERN int         kpmSaveRefDataSet   ( const char *filename, const char *ext, KpmRefDataSet  *refDataSet );
 
+/*!
+    @brief Save a reference data set to the filesystem in a chosen layout.
+    @details
+        kpmSaveRefDataSet is equivalent to this function with format KpmRefDataSetFormatLegacy.
+    @param filename Path to the dataset.
+    @param ext If non-NULL, a '.' charater and this string will be appended to 'filename'.
+    @param refDataSet The reference data set to save. It must have at least one point and
+        one page, as kpmLoadRefDataSet can't load an empty data set.
+    @param format The layout to write.
+    @result 0 if the save succeeded, or a value &lt; 0 in case of error.
+    @see kpmConvertRefDataSetFile kpmConvertRefDataSetFile
+ */
+KPM_EXTERN int         kpmSaveRefDataSetFormat( const char *filename, const char *ext, KpmRefDataSet *refDataSet, KPM_REF_DATA_SET_FORMAT format );
+
+/*!
+    @brief Rewrite a reference data set file in a chosen layout.
+    @details
+        The input file may be in either layout. The input and output paths may be the same.
+    @param inFilename Path to the input dataset.
+    @param inExt If non-NULL, a '.' charater and this string will be appended to 'inFilename'.
+    @param outFilename Path to the output dataset.
+    @param outExt If non-NULL, a '.' charater and this string will be appended to 'outFilename'.
+    @param format The layout to write.
+    @result 0 if the conversion succeeded, or a value &lt; 0 in case of error.
+ */
+KPM_EXTERN int         kpmConvertRefDataSetFile( const char *inFilename, const char *inExt, const char *outFilename, const char *outExt, KPM_REF_DATA_SET_FORMAT format );
+
 /*!
     @brief Load a reference data set from the filesystem into memory.
     @details
@@ -343,6 +593,8 @@ KPM_EXTERN int         kpmSaveRefDataSet   ( const char *filename, const char *e
         kpmSetRefDataSet after this load completes. Alternately, the loaded set can be
         merged with another loaded set by calling kpmMergeRefDataSet. To dispose of the
         loaded dataset, call kpmDeleteRefDataSet.
+        Files in the mappable layout are mapped copy-on-write and the reference points are
+        used in place, without parsing or copying them. Legacy files are parsed as before.
     @param filename Path to the dataset. Either full path, or a relative path if supported by
         the operating system.
     @param ext If non-NULL, a '.' charater and this string will be appended to 'filename'.
@@ -379,6 +631,26 @@ KPM_EXTERN int         kpmChangePageNoOfRefDataSet ( KpmRefDataSet *refDataSet,
  */
 KPM_EXTERN ARUint8    *kpmUtilResizeImage( ARUint8 *imageLuma, int xsize, int ysize, int procMode, int *newXsize, int *newYsize );
 
+/*!
+    @brief Get the size of the image that kpmUtilResizeImage produces.
+    @param xsize Width of the source image.
+    @param ysize Height of the source image.
+    @param procMode
+    @param newXsize On return, the width of the resized image.
+    @param newYsize On return, the height of the resized image.
+ */
+KPM_EXTERN void        kpmUtilGetResizedImageSize( int xsize, int ysize, int procMode, int *newXsize, int *newYsize );
+
+/*!
+    @brief As kpmUtilResizeImage, but writing into a buffer supplied by the caller.
+    @param imageLuma Source luminance image, as an unpadded pixel buffer beginning with the leftmost pixel of the top row.
+    @param xsize Width of pixel data in 'imageLuma'.
+    @param ysize height of pixel data in 'imageLuma'.
+    @param procMode
+    @param newImageLuma Buffer for the resized image, of the size given by kpmUtilGetResizedImageSize.
+ */
+KPM_EXTERN void        kpmUtilResizeImageInto( ARUint8 *imageLuma, int xsize, int ysize, int procMode, ARUint8 *newImageLuma );
+
 #if !BINARY_FEATURE
 KPM_EXTERN int         kpmUtilGetPose ( ARParamLT *cparamLT, KpmMatchResult *matchData, KpmRefDataSet *refDataSet, KpmInputDataSet *inputDataSet, float  camPose[3][4], float  *err );
     
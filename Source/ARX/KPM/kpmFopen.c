@@ -40,22 +40,43 @@
 #include <ARX/KPM/kpm.h>
 #include "kpmFopen.h"
 #ifdef _WIN32
+#  include <windows.h>
 #  define MAXPATHLEN MAX_PATH
 #else
 #  include <sys/param.h> // MAXPATHLEN
 #endif
+#if !defined(_WIN32) && (defined(__unix__) || defined(__APPLE__))
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  define KPM_HAVE_MMAP 1
+#endif
 
-FILE *kpmFopen( const char *filename, const char *ext, const char *mode )
+static char *kpmFilePath( const char *filename, const char *ext )
 {
-    FILE   *fp;
     char   *buf;
     size_t  len;
     
-    if (!filename) return (NULL);
     if (ext) {
         len = strlen(filename) + strlen(ext) + 2; // space for '.' and '\0'.
         arMalloc(buf, char, len)
         sprintf(buf, "%s.%s", filename, ext);
+    } else {
+        arMalloc(buf, char, strlen(filename) + 1)
+        strcpy(buf, filename);
+    }
+    return buf;
+}
+
+FILE *kpmFopen( const char *filename, const char *ext, const char *mode )
+{
+    FILE   *fp;
+    char   *buf;
+    
+    if (!filename) return (NULL);
+    if (ext) {
+        buf = kpmFilePath(filename, ext);
         fp = fopen(buf, mode);
         free(buf);
     } else {
@@ -64,3 +85,106 @@ FILE *kpmFopen( const char *filename, const char *ext, const char *mode )
 
     return fp;
 }
+
+KpmFileMapping *kpmFileMap( const char *filename, const char *ext )
+{
+    KpmFileMapping *mapping;
+    char           *path;
+    FILE           *fp;
+    long            len;
+    
+    if (!filename) return (NULL);
+    path = kpmFilePath(filename, ext);
+    arMallocClear(mapping, KpmFileMapping, 1);
+    
+#if defined(_WIN32)
+    {
+        HANDLE          file;
+        LARGE_INTEGER   fileSize;
+        
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file != INVALID_HANDLE_VALUE) {
+            if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 && (unsigned long long)fileSize.QuadPart <= (size_t)-1) {
+                mapping->handle = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+                if (mapping->handle) {
+                    mapping->data = MapViewOfFile(mapping->handle, FILE_MAP_COPY, 0, 0, 0);
+                    if (mapping->data) {
+                        mapping->size = (size_t)fileSize.QuadPart;
+                        mapping->mapped = 1;
+                    } else {
+                        CloseHandle(mapping->handle);
+                        mapping->handle = NULL;
+                    }
+                }
+            }
+            CloseHandle(file);
+        }
+    }
+#elif KPM_HAVE_MMAP
+    {
+        int             fd;
+        struct stat     st;
+        void           *data;
+        
+        fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            if (fstat(fd, &st) == 0 && st.st_size > 0 && (unsigned long long)st.st_size <= (size_t)-1) {
+                data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                    mapping->data = data;
+                    mapping->size = (size_t)st.st_size;
+                    mapping->mapped = 1;
+                }
+            }
+            close(fd);
+        }
+    }
+#endif
+    
+    // No mapping available, so read the whole file in one go.
+    if (!mapping->mapped) {
+        fp = fopen(path, "rb");
+        if (fp) {
+            if (fseek(fp, 0, SEEK_END) == 0 && (len = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0) {
+                mapping->data = malloc((size_t)len);
+                if (mapping->data) {
+                    if (fread(mapping->data, 1, (size_t)len, fp) == (size_t)len) {
+                        mapping->size = (size_t)len;
+                    } else {
+                        free(mapping->data);
+                        mapping->data = NULL;
+                    }
+                }
+            }
+            fclose(fp);
+        }
+    }
+    
+    free(path);
+    if (!mapping->data) {
+        free(mapping);
+        return (NULL);
+    }
+    return mapping;
+}
+
+void kpmFileUnmap( KpmFileMapping **mappingPtr )
+{
+    KpmFileMapping *mapping;
+    
+    if (!mappingPtr || !*mappingPtr) return;
+    mapping = *mappingPtr;
+    
+    if (mapping->mapped) {
+#if defined(_WIN32)
+        UnmapViewOfFile(mapping->data);
+        CloseHandle(mapping->handle);
+#elif KPM_HAVE_MMAP
+        munmap(mapping->data, mapping->size);
+#endif
+    } else {
+        free(mapping->data);
+    }
+    free(mapping);
+    *mappingPtr = NULL;
+}
@@ -45,6 +45,18 @@ extern "C" {
 
 FILE *kpmFopen( const char *filename, const char *ext, const char *mode );
 
+// A whole file mapped copy-on-write, so writes are private to the process.
+// Where the platform has no file mapping, data is a heap copy of the file.
+typedef struct {
+    void     *data;
+    size_t    size;
+    void     *handle;
+    int       mapped;
+} KpmFileMapping;
+
+KpmFileMapping *kpmFileMap( const char *filename, const char *ext );
+void            kpmFileUnmap( KpmFileMapping **mappingPtr );
+
 #ifdef __cplusplus
 }
 #endif
@@ -37,6 +37,7 @@
 #include <stdio.h>
 #include <ARX/AR/ar.h>
 #include <ARX/KPM/kpm.h>
+#include <ARX/ARUtil/thread_sub.h>
 #include "kpmPrivate.h"
 #if !BINARY_FEATURE
 #include "AnnMatch.h"
@@ -55,6 +56,25 @@ KpmHandle *kpmCreateHandleHomography(int xsize, int ysize)
     return kpmCreateHandleCore(NULL, xsize, ysize, KpmPoseHomography);
 }
 
+KpmHandle *kpmCreateHandleSharingRefDataSet(KpmHandle *kpmHandle)
+{
+    KpmHandle *newHandle;
+    
+    if (!kpmHandle) {
+        ARLOGe("kpmCreateHandleSharingRefDataSet(): NULL kpmHandle.\n");
+        return NULL;
+    }
+    newHandle = kpmCreateHandleCore(kpmHandle->cparamLT, kpmHandle->xsize, kpmHandle->ysize, kpmHandle->poseMode);
+    if (!newHandle) return NULL;
+    kpmSetProcMode(newHandle, kpmHandle->procMode);
+    if (kpmHandle->detectedMaxFeature >= 0) kpmSetDetectedFeatureMax(newHandle, kpmHandle->detectedMaxFeature);
+    if (kpmShareRefDataSet(newHandle, kpmHandle) < 0) {
+        kpmDeleteHandle(&newHandle);
+        return NULL;
+    }
+    return newHandle;
+}
+
 KpmHandle *kpmCreateHandle2(int xsize, int ysize)
 {
     return kpmCreateHandleCore(NULL, xsize, ysize, KpmPoseHomography);
@@ -98,14 +118,36 @@ static KpmHandle *kpmCreateHandleCore( ARParamLT *cparamLT, int xsize, int ysize
     kpmHandle->preRANSAC.match         = NULL;
     kpmHandle->aftRANSAC.num           = 0;
     kpmHandle->aftRANSAC.match         = NULL;
+#endif
 
     kpmHandle->skipRegion.regionMax    = 0;
     kpmHandle->skipRegion.regionNum    = 0;
     kpmHandle->skipRegion.region       = NULL;
-#endif
 
     kpmHandle->result                  = NULL;
     kpmHandle->resultNum               = 0;
+    kpmHandle->pageIDs                 = NULL;
+    kpmHandle->pageIDNum               = 0;
+
+    kpmHandle->inDataSetMax            = 0;
+#if !BINARY_FEATURE
+    kpmHandle->procImage               = NULL;
+    kpmHandle->procImageSize           = 0;
+    kpmHandle->inFeature               = NULL;
+    kpmHandle->matchPoint              = NULL;
+    kpmHandle->inlierIndex             = NULL;
+    kpmHandle->annMatch                = NULL;
+#else
+    kpmHandle->skipIDs                 = NULL;
+    kpmHandle->skipIDMax               = 0;
+    kpmHandle->priorIDs                = NULL;
+    kpmHandle->priorIDNum              = 0;
+    kpmHandle->priorIDMax              = 0;
+    kpmHandle->icpHandle               = NULL;
+    kpmHandle->icpScreenCoord          = NULL;
+    kpmHandle->icpWorldCoord           = NULL;
+    kpmHandle->icpCoordMax             = 0;
+#endif
 
 #if !BINARY_FEATURE
     switch (kpmHandle->procMode) {
@@ -223,6 +265,74 @@ int kpmSetSurfThreadNum( KpmHandle *kpmHandle, int surfThreadNum )
     return 0;
 }
 
+int kpmSetCandidateKeyframeMax( KpmHandle *kpmHandle, int  candidateKeyframeMax )
+{
+    if( kpmHandle == NULL || candidateKeyframeMax < 0 ) return -1;
+#if BINARY_FEATURE
+    kpmHandle->freakMatcher->setMaxNumCandidateKeyframes(candidateKeyframeMax);
+    if( candidateKeyframeMax > 0 && kpmHandle->refDataSet.num != 0 ) {
+        kpmHandle->freakMatcher->buildGlobalIndex();
+    }
+#endif
+    return 0;
+}
+
+int kpmGetCandidateKeyframeMax( KpmHandle *kpmHandle, int *candidateKeyframeMax )
+{
+    if( kpmHandle == NULL || candidateKeyframeMax == NULL ) return -1;
+#if BINARY_FEATURE
+    *candidateKeyframeMax = (int)kpmHandle->freakMatcher->maxNumCandidateKeyframes();
+#else
+    *candidateKeyframeMax = 0;
+#endif
+    return 0;
+}
+
+int kpmSetThreadNum( KpmHandle *kpmHandle, int  threadNum )
+{
+    if( kpmHandle == NULL ) return -1;
+    if( threadNum < 0 ) {
+        threadNum = threadGetCPU() - 1;
+        if( threadNum < 0 ) threadNum = 0;
+    }
+#if BINARY_FEATURE
+    kpmHandle->freakMatcher->setNumThreads(threadNum);
+#endif
+    return 0;
+}
+
+int kpmGetThreadNum( KpmHandle *kpmHandle, int *threadNum )
+{
+    if( kpmHandle == NULL || threadNum == NULL ) return -1;
+#if BINARY_FEATURE
+    *threadNum = kpmHandle->freakMatcher->numThreads();
+#else
+    *threadNum = 0;
+#endif
+    return 0;
+}
+
+int kpmSetEarlyExitMargin( KpmHandle *kpmHandle, int  earlyExitMargin )
+{
+    if( kpmHandle == NULL ) return -1;
+#if BINARY_FEATURE
+    kpmHandle->freakMatcher->setEarlyExit(earlyExitMargin >= 0);
+    kpmHandle->freakMatcher->setEarlyExitMargin(earlyExitMargin >= 0 ? earlyExitMargin : 0);
+#endif
+    return 0;
+}
+
+int kpmGetEarlyExitMargin( KpmHandle *kpmHandle, int *earlyExitMargin )
+{
+    if( kpmHandle == NULL || earlyExitMargin == NULL ) return -1;
+#if BINARY_FEATURE
+    *earlyExitMargin = (kpmHandle->freakMatcher->earlyExit() ? (int)kpmHandle->freakMatcher->earlyExitMargin() : -1);
+#else
+    *earlyExitMargin = -1;
+#endif
+    return 0;
+}
+
 
 
 int kpmDeleteHandle( KpmHandle **kpmHandle )
@@ -243,6 +353,9 @@ int kpmDeleteHandle( KpmHandle **kpmHandle )
         free( (*kpmHandle)->refDataSet.refPoint );
     }
     if( (*kpmHandle)->refDataSet.pageInfo != NULL ) {
+        for( int i = 0; i < (*kpmHandle)->refDataSet.pageNum; i++ ) {
+            free( (*kpmHandle)->refDataSet.pageInfo[i].imageInfo );
+        }
         free( (*kpmHandle)->refDataSet.pageInfo );
     }
 #if !BINARY_FEATURE
@@ -252,17 +365,32 @@ int kpmDeleteHandle( KpmHandle **kpmHandle )
     if( (*kpmHandle)->aftRANSAC.match != NULL ) {
         free( (*kpmHandle)->aftRANSAC.match );
     }
+#endif
 
     if( (*kpmHandle)->skipRegion.region != NULL ) {
         free( (*kpmHandle)->skipRegion.region );
     }
-#endif
     if( (*kpmHandle)->result != NULL ) {
         free( (*kpmHandle)->result );
     }
     if( (*kpmHandle)->inDataSet.coord != NULL ) {
         free( (*kpmHandle)->inDataSet.coord );
     }
+    free( (*kpmHandle)->pageIDs );
+    
+#if !BINARY_FEATURE
+    free( (*kpmHandle)->procImage );
+    free( (*kpmHandle)->inFeature );
+    free( (*kpmHandle)->matchPoint );
+    free( (*kpmHandle)->inlierIndex );
+    free( (*kpmHandle)->annMatch );
+#else
+    free( (*kpmHandle)->skipIDs );
+    free( (*kpmHandle)->priorIDs );
+    if( (*kpmHandle)->icpHandle != NULL ) icpDeleteHandle( &((*kpmHandle)->icpHandle) );
+    free( (*kpmHandle)->icpScreenCoord );
+    free( (*kpmHandle)->icpWorldCoord );
+#endif
 
     free( *kpmHandle );
     *kpmHandle = NULL;
@@ -39,6 +39,7 @@
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <unordered_map>
 
 #include <ARX/KPM/kpm.h>
 #include "kpmPrivate.h"
@@ -52,7 +53,7 @@ extern "C" {
 #  include "AnnMatch2.h"
 #endif
 
-int kpmUtilGetPose_binary( ARParamLT *cparamLT, const vision::matches_t &matchData, const std::vector<vision::Point3d<float> > &refDataSet, const std::vector<vision::FeaturePoint> &inputDataSet, float  camPose[3][4], float  *error );
+static int kpmUtilGetPose_binary( KpmHandle *kpmHandle, const vision::matches_t &matchData, const std::vector<vision::Point3d<float> > &refDataSet, const std::vector<vision::FeaturePoint> &inputDataSet, float  camPose[3][4], float  *error );
 
 template<typename T>
 std::string arrayToString(T *v, size_t size){
@@ -174,41 +175,11 @@ int kpmLoadImageDb(KpmHandle *kpmHandle, const char *filename)
     return 1;
 }
         
-int kpmSetRefDataSet( KpmHandle *kpmHandle, KpmRefDataSet *refDataSet )
+// Copy the pageInfo of a data set into the kpmHandle's dataset, with one result per page.
+static void kpmSetPageInfo( KpmHandle *kpmHandle, const KpmRefDataSet *refDataSet )
 {
-#if !BINARY_FEATURE
-    CAnnMatch2         *ann2;
-#endif
-    
-    FeatureVector       featureVector;
     int                 i, j;
     
-    if (!kpmHandle || !refDataSet) {
-        ARLOGe("kpmSetRefDataSet(): NULL kpmHandle/refDataSet.\n");
-        return -1;
-    }
-    if (!refDataSet->num) {
-        ARLOGe("kpmSetRefDataSet(): refDataSet.\n");
-        return -1;
-    }
-    
-    // Copy the refPoints into the kpmHandle's dataset.
-    if( kpmHandle->refDataSet.refPoint != NULL ) {
-        // Discard any old points first.
-        free( kpmHandle->refDataSet.refPoint );
-    }
-    if( refDataSet->num != 0 ) {
-        arMalloc( kpmHandle->refDataSet.refPoint, KpmRefData, refDataSet->num );
-        for( i = 0; i < refDataSet->num; i++ ) {
-            kpmHandle->refDataSet.refPoint[i] = refDataSet->refPoint[i];
-        }
-    }
-    else {
-        kpmHandle->refDataSet.refPoint = NULL;
-    }
-    kpmHandle->refDataSet.num = refDataSet->num;
-
-    // Copy the pageInfo into the kpmHandle's dataset.
     if( kpmHandle->refDataSet.pageInfo != NULL ) {
         // Discard any old pageInfo (and imageInfo) first.
         for( i = 0; i < kpmHandle->refDataSet.pageNum; i++ ) {
@@ -230,7 +201,7 @@ int kpmSetRefDataSet( KpmHandle *kpmHandle, KpmRefDataSet *refDataSet )
                 }
             }
             else {
-                refDataSet->pageInfo[i].imageInfo = NULL;
+                kpmHandle->refDataSet.pageInfo[i].imageInfo = NULL;
             }
         }
     }
@@ -239,7 +210,6 @@ int kpmSetRefDataSet( KpmHandle *kpmHandle, KpmRefDataSet *refDataSet )
     }
     kpmHandle->refDataSet.pageNum = refDataSet->pageNum;
 
-    
     if( kpmHandle->result != NULL ) {
         free( kpmHandle->result );
         kpmHandle->result = NULL;
@@ -248,13 +218,19 @@ int kpmSetRefDataSet( KpmHandle *kpmHandle, KpmRefDataSet *refDataSet )
     if( refDataSet->pageNum > 0 ) {
         kpmHandle->resultNum = refDataSet->pageNum;
         arMalloc( kpmHandle->result, KpmResult, refDataSet->pageNum );
-		for (int i = 0; i < refDataSet->pageNum;i++){
-			kpmHandle->result[i].skipF = 0;
-		}        
+        for( i = 0; i < refDataSet->pageNum; i++ ) {
+            kpmHandle->result[i].skipF = 0;
+        }
     }
+}
 
-    // Create feature vectors.
 #if !BINARY_FEATURE
+// (Re)build the ANN index over all the reference points in the handle.
+static void kpmBuildAnnIndex( KpmHandle *kpmHandle )
+{
+    CAnnMatch2         *ann2;
+    FeatureVector       featureVector;
+
     if (kpmHandle->ann2) {
         delete (CAnnMatch2 *)(kpmHandle->ann2);
         kpmHandle->ann2 = NULL;
@@ -270,41 +246,362 @@ int kpmSetRefDataSet( KpmHandle *kpmHandle, KpmRefDataSet *refDataSet )
         ann2->Construct(&featureVector);
         free(featureVector.sf);
     }
+}
+#else
+// Make sure at least num keyframe slots are not used by any page, growing the table if needed.
+static void kpmReserveKeyframes( KpmHandle *kpmHandle, int num )
+{
+    int     *pageIDs;
+    int      freeNum = 0;
+    int      pageIDNum;
+    int      i;
+    
+    for (i = 0; i < kpmHandle->pageIDNum; i++) {
+        if (kpmHandle->pageIDs[i] < 0) freeNum++;
+    }
+    if (freeNum >= num) return;
+    
+    pageIDNum = kpmHandle->pageIDNum + (num - freeNum);
+    arMalloc( pageIDs, int, pageIDNum );
+    for (i = 0; i < kpmHandle->pageIDNum; i++) pageIDs[i] = kpmHandle->pageIDs[i];
+    for (; i < pageIDNum; i++) pageIDs[i] = -1;
+    free( kpmHandle->pageIDs );
+    kpmHandle->pageIDs = pageIDs;
+    kpmHandle->pageIDNum = pageIDNum;
+}
+
+// Remove the keyframes of one page, or of all pages, from the matcher.
+static void kpmEraseKeyframes( KpmHandle *kpmHandle, int pageNo )
+{
+    for (int db_id = 0; db_id < kpmHandle->pageIDNum; db_id++) {
+        if (kpmHandle->pageIDs[db_id] < 0) continue;
+        if (pageNo != KpmChangePageNoAllPages && kpmHandle->pageIDs[db_id] != pageNo) continue;
+        kpmHandle->freakMatcher->erase(db_id);
+        kpmHandle->pageIDs[db_id] = -1;
+    }
+}
+
+// Add one keyframe to the matcher per (page, image) pair of a data set, using the lowest
+// free keyframe slots.
+static void kpmAddKeyframes( KpmHandle *kpmHandle, const KpmRefDataSet *ds )
+{
+    // One keyframe per (page, image) pair, in page then image order. Points are
+    // bucketed into their keyframe in a single pass over the reference data.
+    std::unordered_map<long long, int> slotOfImage;
+    std::vector<int> slotSource;
+    for (int k = 0; k < ds->pageNum; k++) {
+        for (int m = 0; m < ds->pageInfo[k].imageNum; m++) {
+            long long key = ((long long)ds->pageInfo[k].pageNo << 32) | (unsigned int)ds->pageInfo[k].imageInfo[m].imageNo;
+            int slot = (int)slotSource.size();
+            // A repeated (page, image) pair gets a copy of the first one's points.
+            slotSource.push_back(slotOfImage.insert(std::make_pair(key, slot)).first->second);
+        }
+    }
+    
+    std::vector<int> pointSlot(ds->num, -1);
+    std::vector<int> slotCount(slotSource.size(), 0);
+    for (int i = 0; i < ds->num; i++) {
+        long long key = ((long long)ds->refPoint[i].pageNo << 32) | (unsigned int)ds->refPoint[i].refImageNo;
+        std::unordered_map<long long, int>::const_iterator it = slotOfImage.find(key);
+        if (it != slotOfImage.end()) {
+            pointSlot[i] = it->second;
+            slotCount[it->second]++;
+        }
+    }
+    
+    std::vector<vision::FreakKeyframeData> keyframes(slotSource.size());
+    for (size_t s = 0; s < keyframes.size(); s++) {
+        if (slotSource[s] != (int)s) continue;
+        keyframes[s].featurePoints.reserve(slotCount[s]);
+        keyframes[s].points3D.reserve(slotCount[s]);
+        keyframes[s].descriptors.reserve(slotCount[s]*FREAK_SUB_DIMENSION);
+    }
+    for (int i = 0; i < ds->num; i++) {
+        if (pointSlot[i] < 0) continue;
+        const KpmRefData& ref = ds->refPoint[i];
+        vision::FreakKeyframeData& keyframe = keyframes[pointSlot[i]];
+        keyframe.featurePoints.push_back(vision::FeaturePoint(ref.coord2D.x, ref.coord2D.y, ref.featureVec.angle, ref.featureVec.scale, ref.featureVec.maxima));
+        keyframe.points3D.push_back(vision::Point3d<float>(ref.coord3D.x, ref.coord3D.y, 0));
+        keyframe.descriptors.insert(keyframe.descriptors.end(), ref.featureVec.v, ref.featureVec.v + FREAK_SUB_DIMENSION);
+    }
+    
+    kpmReserveKeyframes(kpmHandle, (int)keyframes.size());
+    int s = 0;
+    int db_id = 0;
+    for (int k = 0; k < ds->pageNum; k++) {
+        for (int m = 0; m < ds->pageInfo[k].imageNum; m++, s++) {
+            vision::FreakKeyframeData& keyframe = keyframes[s];
+            if (slotSource[s] != s) {
+                const vision::FreakKeyframeData& first = keyframes[slotSource[s]];
+                keyframe.featurePoints = first.featurePoints;
+                keyframe.points3D = first.points3D;
+                keyframe.descriptors = first.descriptors;
+            }
+            while (kpmHandle->pageIDs[db_id] >= 0) db_id++;
+            keyframe.width = ds->pageInfo[k].imageInfo[m].width;
+            keyframe.height = ds->pageInfo[k].imageInfo[m].height;
+            keyframe.image_id = db_id;
+            ARLOGi("points-%d\n", (int)keyframe.featurePoints.size());
+            kpmHandle->pageIDs[db_id] = ds->pageInfo[k].pageNo;
+        }
+    }
+    kpmHandle->freakMatcher->addFreakKeyframes(keyframes);
+}
+#endif
+
+int kpmSetRefDataSet( KpmHandle *kpmHandle, KpmRefDataSet *refDataSet )
+{
+    int                 i;
+    
+    if (!kpmHandle || !refDataSet) {
+        ARLOGe("kpmSetRefDataSet(): NULL kpmHandle/refDataSet.\n");
+        return -1;
+    }
+    if (!refDataSet->num) {
+        ARLOGe("kpmSetRefDataSet(): refDataSet.\n");
+        return -1;
+    }
+    
+    // Copy the refPoints into the kpmHandle's dataset.
+    if( kpmHandle->refDataSet.refPoint != NULL ) {
+        // Discard any old points first.
+        free( kpmHandle->refDataSet.refPoint );
+    }
+    if( refDataSet->num != 0 ) {
+        arMalloc( kpmHandle->refDataSet.refPoint, KpmRefData, refDataSet->num );
+        for( i = 0; i < refDataSet->num; i++ ) {
+            kpmHandle->refDataSet.refPoint[i] = refDataSet->refPoint[i];
+        }
+    }
+    else {
+        kpmHandle->refDataSet.refPoint = NULL;
+    }
+    kpmHandle->refDataSet.num = refDataSet->num;
+
+    kpmSetPageInfo(kpmHandle, refDataSet);
+
+    // Create feature vectors.
+#if !BINARY_FEATURE
+    kpmBuildAnnIndex(kpmHandle);
 #else
+    // Discard the keyframes of any previous data set.
+    kpmEraseKeyframes(kpmHandle, KpmChangePageNoAllPages);
     if (kpmHandle->refDataSet.num != 0) {
-        featureVector.num = kpmHandle->refDataSet.num;
-        
-        int db_id = 0;
-        for (int k = 0; k < kpmHandle->refDataSet.pageNum; k++) {
-            for (int m = 0; m < kpmHandle->refDataSet.pageInfo[k].imageNum; m++) {
-                std::vector<vision::FeaturePoint> points;
-                std::vector<vision::Point3d<float> > points_3d;
-                std::vector<unsigned char> descriptors;
-            
-                for (int i = 0; i < featureVector.num; i++) {
-                    if (kpmHandle->refDataSet.refPoint[i].refImageNo == kpmHandle->refDataSet.pageInfo[k].imageInfo[m].imageNo
-                    && kpmHandle->refDataSet.refPoint[i].pageNo == kpmHandle->refDataSet.pageInfo[k].pageNo) {
-                        points.push_back(vision::FeaturePoint(kpmHandle->refDataSet.refPoint[i].coord2D.x,
-                                                          kpmHandle->refDataSet.refPoint[i].coord2D.y,
-                                                          kpmHandle->refDataSet.refPoint[i].featureVec.angle,
-                                                          kpmHandle->refDataSet.refPoint[i].featureVec.scale,
-                                                          kpmHandle->refDataSet.refPoint[i].featureVec.maxima));
-                        points_3d.push_back(vision::Point3d<float>(kpmHandle->refDataSet.refPoint[i].coord3D.x,
-                                                                   kpmHandle->refDataSet.refPoint[i].coord3D.y,                                                                  0));
-                        for (int j = 0; j < FREAK_SUB_DIMENSION; j++)
-                            descriptors.push_back(kpmHandle->refDataSet.refPoint[i].featureVec.v[j]);
-                    }
-                }
-                ARLOGi("points-%d\n", points.size());
-               kpmHandle->pageIDs[db_id] = kpmHandle->refDataSet.pageInfo[k].pageNo; kpmHandle->freakMatcher->addFreakFeaturesAndDescriptors(points,descriptors,points_3d,kpmHandle->refDataSet.pageInfo[k].imageInfo[m].width,kpmHandle->refDataSet.pageInfo[k].imageInfo[m].height,db_id++);
+        kpmAddKeyframes(kpmHandle, &kpmHandle->refDataSet);
+        // Build the cross-page index up front so the first query doesn't pay for it.
+        if (kpmHandle->freakMatcher->maxNumCandidateKeyframes() > 0) {
+            kpmHandle->freakMatcher->buildGlobalIndex();
+        }
+    }
+#endif
+    
+    return 0;
+}
+
+// Append the refPoints and pages of a data set to the kpmHandle's dataset, without adding
+// any keyframes.
+static int kpmAppendRefDataSetPages( KpmHandle *kpmHandle, const KpmRefDataSet *refDataSet, const char *caller )
+{
+    KpmRefData         *refPoint;
+    KpmPageInfo        *pageInfo;
+    KpmResult          *result;
+    int                 pageNum;
+    int                 i, j, k;
+    
+    if (!refDataSet->num || !refDataSet->pageNum) {
+        ARLOGe("%s(): empty refDataSet.\n", caller);
+        return -1;
+    }
+    for (i = 0; i < refDataSet->pageNum; i++) {
+        for (j = 0; j < kpmHandle->refDataSet.pageNum; j++) {
+            if (refDataSet->pageInfo[i].pageNo == kpmHandle->refDataSet.pageInfo[j].pageNo) {
+                ARLOGe("%s(): page %d is already loaded.\n", caller, refDataSet->pageInfo[i].pageNo);
+                return -1;
             }
         }
     }
+    
+    // Append the refPoints to the kpmHandle's dataset.
+    arMalloc( refPoint, KpmRefData, kpmHandle->refDataSet.num + refDataSet->num );
+    for( i = 0; i < kpmHandle->refDataSet.num; i++ ) {
+        refPoint[i] = kpmHandle->refDataSet.refPoint[i];
+    }
+    for( i = 0; i < refDataSet->num; i++ ) {
+        refPoint[kpmHandle->refDataSet.num + i] = refDataSet->refPoint[i];
+    }
+    free( kpmHandle->refDataSet.refPoint );
+    kpmHandle->refDataSet.refPoint = refPoint;
+    kpmHandle->refDataSet.num += refDataSet->num;
+    
+    // Append the pageInfo, and a result for each new page.
+    pageNum = kpmHandle->refDataSet.pageNum + refDataSet->pageNum;
+    arMalloc( pageInfo, KpmPageInfo, pageNum );
+    arMalloc( result, KpmResult, pageNum );
+    for( i = 0; i < kpmHandle->refDataSet.pageNum; i++ ) {
+        pageInfo[i] = kpmHandle->refDataSet.pageInfo[i];
+        result[i] = kpmHandle->result[i];
+    }
+    for( j = 0; j < refDataSet->pageNum; j++, i++ ) {
+        pageInfo[i].pageNo = refDataSet->pageInfo[j].pageNo;
+        pageInfo[i].imageNum = refDataSet->pageInfo[j].imageNum;
+        if( refDataSet->pageInfo[j].imageNum != 0 ) {
+            arMalloc( pageInfo[i].imageInfo, KpmImageInfo, refDataSet->pageInfo[j].imageNum );
+            for( k = 0; k < refDataSet->pageInfo[j].imageNum; k++ ) {
+                pageInfo[i].imageInfo[k] = refDataSet->pageInfo[j].imageInfo[k];
+            }
+        }
+        else {
+            pageInfo[i].imageInfo = NULL;
+        }
+        result[i].skipF = 0;
+    }
+    free( kpmHandle->refDataSet.pageInfo );
+    free( kpmHandle->result );
+    kpmHandle->refDataSet.pageInfo = pageInfo;
+    kpmHandle->refDataSet.pageNum = pageNum;
+    kpmHandle->result = result;
+    kpmHandle->resultNum = pageNum;
+    
+    return 0;
+}
+
+int kpmAddRefDataSetPages( KpmHandle *kpmHandle, KpmRefDataSet *refDataSet )
+{
+    if (!kpmHandle || !refDataSet) {
+        ARLOGe("kpmAddRefDataSetPages(): NULL kpmHandle/refDataSet.\n");
+        return -1;
+    }
+    if (kpmAppendRefDataSetPages(kpmHandle, refDataSet, "kpmAddRefDataSetPages") < 0) return -1;
+    
+#if !BINARY_FEATURE
+    kpmBuildAnnIndex(kpmHandle);
+#else
+    // Only the new pages' keyframes are built. The others are left as they are. The
+    // global index is left to the next query that needs it.
+    kpmAddKeyframes(kpmHandle, refDataSet);
+#endif
+    
+    return 0;
+}
+
+int kpmMoveRefDataSetPages( KpmHandle *kpmHandle, KpmHandle *srcHandle )
+{
+    if (!kpmHandle || !srcHandle || kpmHandle == srcHandle) {
+        ARLOGe("kpmMoveRefDataSetPages(): NULL or identical kpmHandle/srcHandle.\n");
+        return -1;
+    }
+#if !BINARY_FEATURE
+    if (kpmAddRefDataSetPages(kpmHandle, &srcHandle->refDataSet) < 0) return -1;
+#else
+    if (kpmAppendRefDataSetPages(kpmHandle, &srcHandle->refDataSet, "kpmMoveRefDataSetPages") < 0) return -1;
+    
+    // The keyframes and their indices were built in srcHandle, so they only change slots.
+    int num = 0;
+    for (int i = 0; i < srcHandle->pageIDNum; i++) {
+        if (srcHandle->pageIDs[i] >= 0) num++;
+    }
+    kpmReserveKeyframes(kpmHandle, num);
+    int db_id = 0;
+    for (int i = 0; i < srcHandle->pageIDNum; i++) {
+        if (srcHandle->pageIDs[i] < 0) continue;
+        while (kpmHandle->pageIDs[db_id] >= 0) db_id++;
+        kpmHandle->freakMatcher->moveKeyframe(*srcHandle->freakMatcher, i, db_id);
+        kpmHandle->pageIDs[db_id] = srcHandle->pageIDs[i];
+        srcHandle->pageIDs[i] = -1;
+    }
+#endif
+    
+    // Leave srcHandle empty.
+    while (srcHandle->refDataSet.pageNum > 0) {
+        kpmRemoveRefDataSetPage(srcHandle, srcHandle->refDataSet.pageInfo[0].pageNo);
+    }
+    
+    return 0;
+}
+
+int kpmRemoveRefDataSetPage( KpmHandle *kpmHandle, int pageNo )
+{
+    int                 page;
+    int                 i, j;
+    
+    if (!kpmHandle) {
+        ARLOGe("kpmRemoveRefDataSetPage(): NULL kpmHandle.\n");
+        return -1;
+    }
+    for (page = 0; page < kpmHandle->refDataSet.pageNum; page++) {
+        if (kpmHandle->refDataSet.pageInfo[page].pageNo == pageNo) break;
+    }
+    if (page == kpmHandle->refDataSet.pageNum) {
+        ARLOGe("kpmRemoveRefDataSetPage(): page %d is not loaded.\n", pageNo);
+        return -1;
+    }
+    
+    // Remove the page's refPoints, keeping the others in order.
+    for( i = j = 0; i < kpmHandle->refDataSet.num; i++ ) {
+        if( kpmHandle->refDataSet.refPoint[i].pageNo == pageNo ) continue;
+        kpmHandle->refDataSet.refPoint[j++] = kpmHandle->refDataSet.refPoint[i];
+    }
+    kpmHandle->refDataSet.num = j;
+    if( j == 0 ) {
+        free( kpmHandle->refDataSet.refPoint );
+        kpmHandle->refDataSet.refPoint = NULL;
+    }
+    
+    // Remove the page's pageInfo and result.
+    free( kpmHandle->refDataSet.pageInfo[page].imageInfo );
+    for( i = page + 1; i < kpmHandle->refDataSet.pageNum; i++ ) {
+        kpmHandle->refDataSet.pageInfo[i-1] = kpmHandle->refDataSet.pageInfo[i];
+        kpmHandle->result[i-1] = kpmHandle->result[i];
+    }
+    kpmHandle->refDataSet.pageNum--;
+    kpmHandle->resultNum--;
+    if( kpmHandle->refDataSet.pageNum == 0 ) {
+        free( kpmHandle->refDataSet.pageInfo );
+        kpmHandle->refDataSet.pageInfo = NULL;
+        free( kpmHandle->result );
+        kpmHandle->result = NULL;
+    }
+    
+#if !BINARY_FEATURE
+    kpmBuildAnnIndex(kpmHandle);
+#else
+    // The global index is left to the next query that needs it.
+    kpmEraseKeyframes(kpmHandle, pageNo);
 #endif
     
     return 0;
 }
 
+int kpmShareRefDataSet( KpmHandle *kpmHandle, KpmHandle *srcHandle )
+{
+    if (!kpmHandle || !srcHandle) {
+        ARLOGe("kpmShareRefDataSet(): NULL kpmHandle/srcHandle.\n");
+        return -1;
+    }
+    if (kpmHandle == srcHandle) return 0;
+#if !BINARY_FEATURE
+    // The ANN index can't be shared, so the reference data is copied.
+    return kpmSetRefDataSet(kpmHandle, &srcHandle->refDataSet);
+#else
+    // Matching only needs the pages and the keyframes, so the refPoints aren't copied.
+    free( kpmHandle->refDataSet.refPoint );
+    kpmHandle->refDataSet.refPoint = NULL;
+    kpmHandle->refDataSet.num = 0;
+    kpmSetPageInfo(kpmHandle, &srcHandle->refDataSet);
+    
+    free( kpmHandle->pageIDs );
+    kpmHandle->pageIDs = NULL;
+    kpmHandle->pageIDNum = srcHandle->pageIDNum;
+    if (srcHandle->pageIDNum > 0) {
+        arMalloc( kpmHandle->pageIDs, int, srcHandle->pageIDNum );
+        for (int i = 0; i < srcHandle->pageIDNum; i++) kpmHandle->pageIDs[i] = srcHandle->pageIDs[i];
+    }
+    
+    kpmHandle->freakMatcher->shareKeyframes(*srcHandle->freakMatcher);
+    return 0;
+#endif
+}
+
 int kpmSetRefDataSetFile( KpmHandle *kpmHandle, const char *filename, const char *ext )
 {
     KpmRefDataSet   *refDataSet;
@@ -315,11 +612,20 @@ int kpmSetRefDataSetFile( KpmHandle *kpmHandle, const char *filename, const char
     }
     
     if( kpmLoadRefDataSet(filename, ext, &refDataSet) < 0 ) return -1;
+#if BINARY_FEATURE
+    kpmLoadIndexFile(kpmHandle, filename, KpmIndexFileExt);
+#endif
     if( kpmSetRefDataSet(kpmHandle, refDataSet) < 0 ) {
         kpmDeleteRefDataSet(&refDataSet);
         return -1;
     }
     kpmDeleteRefDataSet(&refDataSet);
+#if BINARY_FEATURE
+    // Failing to cache the indices (e.g. in a read-only bundle) only costs time on the next load.
+    if( kpmSaveIndexFile(kpmHandle, filename, KpmIndexFileExt, KpmChangePageNoAllPages, 1) < 0 ) {
+        ARLOGw("Unable to write KPM index file '%s.%s'.\n", filename, KpmIndexFileExt);
+    }
+#endif
     
     return 0;
 }
@@ -340,6 +646,64 @@ int kpmSetRefDataSetFileOld( KpmHandle *kpmHandle, const char *filename, const c
     return 0;
 }
 
+#if BINARY_FEATURE
+static std::string kpmIndexFilePath( const char *filename, const char *ext )
+{
+    std::string path(filename);
+    if (ext) {
+        path += ".";
+        path += ext;
+    }
+    return path;
+}
+#endif
+
+int kpmLoadIndexFile( KpmHandle *kpmHandle, const char *filename, const char *ext )
+{
+    if (!kpmHandle || !filename) {
+        ARLOGe("kpmLoadIndexFile(): NULL kpmHandle/filename.\n");
+        return -1;
+    }
+#if BINARY_FEATURE
+    int num = kpmHandle->freakMatcher->loadIndexFile(kpmIndexFilePath(filename, ext));
+    if (num < 0) {
+        ARLOGd("No valid KPM index file '%s%s%s'.\n", filename, (ext ? "." : ""), (ext ? ext : ""));
+        return -1;
+    }
+    ARLOGi("Read %d feature indices from '%s%s%s'.\n", num, filename, (ext ? "." : ""), (ext ? ext : ""));
+    return num;
+#else
+    return -1;
+#endif
+}
+
+int kpmSaveIndexFile( KpmHandle *kpmHandle, const char *filename, const char *ext, int pageNo, int onlyIfBuilt )
+{
+    if (!kpmHandle || !filename) {
+        ARLOGe("kpmSaveIndexFile(): NULL kpmHandle/filename.\n");
+        return -1;
+    }
+#if BINARY_FEATURE
+    std::vector<int> ids;
+    bool built = false;
+    for (int db_id = 0; db_id < kpmHandle->pageIDNum; db_id++) {
+        if (kpmHandle->pageIDs[db_id] < 0) continue;
+        if (pageNo != KpmChangePageNoAllPages && kpmHandle->pageIDs[db_id] != pageNo) continue;
+        ids.push_back(db_id);
+        if (kpmHandle->freakMatcher->indexWasBuilt(db_id)) built = true;
+    }
+    if (ids.empty() || (onlyIfBuilt && !built)) return 0;
+    
+    if (!kpmHandle->freakMatcher->saveIndexFile(kpmIndexFilePath(filename, ext), ids)) {
+        ARLOGe("Error saving KPM index file '%s%s%s'.\n", filename, (ext ? "." : ""), (ext ? ext : ""));
+        return -1;
+    }
+    return 1;
+#else
+    return -1;
+#endif
+}
+
 int kpmSetMatchingSkipPage( KpmHandle *kpmHandle, int skipPages[], int num )
 {
     int    i, j;
@@ -362,37 +726,133 @@ int kpmSetMatchingSkipPage( KpmHandle *kpmHandle, int skipPages[], int num )
     return 0;
 }
 
-#if !BINARY_FEATURE
-int kpmSetMatchingSkipRegion( KpmHandle *kpmHandle, SurfSubRect *skipRegion, int regionNum)
+int kpmSetMatchingSkipRegion( KpmHandle *kpmHandle, KpmSkipRect *skipRegion, int regionNum )
 {
+    float  scale;
+    float  x[4], y[4];
+    
+    if( kpmHandle == NULL || (skipRegion == NULL && regionNum > 0) ) return -1;
+    
     if( kpmHandle->skipRegion.regionMax < regionNum ) {
         if( kpmHandle->skipRegion.region != NULL ) free(kpmHandle->skipRegion.region);
         kpmHandle->skipRegion.regionMax = ((regionNum-1)/10+1) * 10;
+#if !BINARY_FEATURE
         arMalloc(kpmHandle->skipRegion.region, SurfSubSkipRegion, kpmHandle->skipRegion.regionMax);
+#else
+        arMalloc(kpmHandle->skipRegion.region, vision::SkipRegion, kpmHandle->skipRegion.regionMax);
+#endif
     }
-    kpmHandle->skipRegion.regionNum = regionNum;
+    kpmHandle->skipRegion.regionNum = (regionNum > 0 ? regionNum : 0);
+    
+    // Features are detected in the image resized for procMode.
+    scale = kpmUtilGetProcModeScale( kpmHandle->procMode );
     for(int i = 0; i < regionNum; i++ ) {
-        kpmHandle->skipRegion.region[i].rect = skipRegion[i];
         for(int j = 0; j < 4; j++) {
-            kpmHandle->skipRegion.region[i].param[j][0] = skipRegion[i].vertex[(j+1)%4].y - skipRegion[i].vertex[j].y;
-            kpmHandle->skipRegion.region[i].param[j][1] = skipRegion[i].vertex[j].x - skipRegion[i].vertex[(j+1)%4].x;
-            kpmHandle->skipRegion.region[i].param[j][2] = skipRegion[i].vertex[(j+1)%4].x * skipRegion[i].vertex[j].y
-                                                        - skipRegion[i].vertex[j].x * skipRegion[i].vertex[(j+1)%4].y;
+            x[j] = skipRegion[i].vertex[j].x / scale;
+            y[j] = skipRegion[i].vertex[j].y / scale;
+        }
+#if !BINARY_FEATURE
+        for(int j = 0; j < 4; j++) {
+            kpmHandle->skipRegion.region[i].rect.vertex[j].x = x[j];
+            kpmHandle->skipRegion.region[i].rect.vertex[j].y = y[j];
+        }
+        for(int j = 0; j < 4; j++) {
+            kpmHandle->skipRegion.region[i].param[j][0] = y[(j+1)%4] - y[j];
+            kpmHandle->skipRegion.region[i].param[j][1] = x[j] - x[(j+1)%4];
+            kpmHandle->skipRegion.region[i].param[j][2] = x[(j+1)%4] * y[j] - x[j] * y[(j+1)%4];
         }
+#else
+        for(int j = 0; j < 4; j++) {
+            kpmHandle->skipRegion.region[i].vertex[j][0] = x[j];
+            kpmHandle->skipRegion.region[i].vertex[j][1] = y[j];
+        }
+#endif
     }
     return 0;
 }
+
+int kpmSetMatchingPriorPage( KpmHandle *kpmHandle, int *priorPages, int num )
+{
+    if( kpmHandle == NULL || (priorPages == NULL && num > 0) ) return -1;
+#if BINARY_FEATURE
+    kpmHandle->priorIDNum = 0;
+    if( num <= 0 ) return 0;
+    if( kpmHandle->priorIDMax < kpmHandle->pageIDNum ) {
+        free( kpmHandle->priorIDs );
+        arMalloc( kpmHandle->priorIDs, int, kpmHandle->pageIDNum );
+        kpmHandle->priorIDMax = kpmHandle->pageIDNum;
+    }
+    // Keyframe slots in the order of their pages.
+    for( int i = 0; i < num; i++ ) {
+        for( int j = 0; j < kpmHandle->pageIDNum; j++ ) {
+            if( kpmHandle->pageIDs[j] == priorPages[i] && kpmHandle->priorIDNum < kpmHandle->priorIDMax ) kpmHandle->priorIDs[kpmHandle->priorIDNum++] = j;
+        }
+    }
+#endif
+    return 0;
+}
+
+#if BINARY_FEATURE
+// Pass the pages and regions to skip, and the pages to try first, to the matcher. The
+// keyframes of the skipped pages are left out of the candidates, so that a match is
+// only looked for among the pages that are not already tracked.
+static void kpmPrepareQuery( KpmHandle *kpmHandle )
+{
+    int    skipIDNum = 0;
+    int    i, j;
+    
+    for( i = 0; i < kpmHandle->resultNum; i++ ) {
+        if( !kpmHandle->result[i].skipF ) continue;
+        if( kpmHandle->skipIDMax < kpmHandle->pageIDNum ) {
+            free( kpmHandle->skipIDs );
+            arMalloc( kpmHandle->skipIDs, int, kpmHandle->pageIDNum );
+            kpmHandle->skipIDMax = kpmHandle->pageIDNum;
+        }
+        for( j = 0; j < kpmHandle->pageIDNum; j++ ) {
+            if( kpmHandle->pageIDs[j] == kpmHandle->refDataSet.pageInfo[i].pageNo ) kpmHandle->skipIDs[skipIDNum++] = j;
+        }
+    }
+    kpmHandle->freakMatcher->setQuerySkipIds( kpmHandle->skipIDs, skipIDNum );
+    kpmHandle->freakMatcher->setQuerySkipRegions( kpmHandle->skipRegion.region, kpmHandle->skipRegion.regionNum );
+    kpmHandle->freakMatcher->setQueryPriorIds( kpmHandle->priorIDs, kpmHandle->priorIDNum );
+}
 #endif
 
+// Make sure the per-feature buffers used by kpmMatching can hold num input features.
+// They are kept between frames and only ever grow, so that once the number of features
+// has settled, kpmMatching doesn't allocate them again.
+static void kpmReserveInDataSet( KpmHandle *kpmHandle, int num )
+{
+    if( num <= kpmHandle->inDataSetMax ) return;
+    
+    free( kpmHandle->inDataSet.coord );
+    arMalloc( kpmHandle->inDataSet.coord, KpmCoord2D,     num );
+#if !BINARY_FEATURE
+    free( kpmHandle->preRANSAC.match );
+    free( kpmHandle->aftRANSAC.match );
+    free( kpmHandle->inFeature );
+    free( kpmHandle->matchPoint );
+    free( kpmHandle->inlierIndex );
+    free( kpmHandle->annMatch );
+    arMalloc( kpmHandle->preRANSAC.match, KpmMatchData,   num );
+    arMalloc( kpmHandle->aftRANSAC.match, KpmMatchData,   num );
+    arMalloc( kpmHandle->inFeature,       SurfFeature,    num );
+    arMalloc( kpmHandle->matchPoint,      MatchPoint,     num );
+    arMalloc( kpmHandle->inlierIndex,     int,            num );
+    arMalloc( kpmHandle->annMatch,        int,            num ); // knn = 1.
+#endif
+    kpmHandle->inDataSetMax = num;
+}
+
 int kpmMatching(KpmHandle *kpmHandle, ARUint8 *inImageLuma)
 {
     int               xsize, ysize;
-    int               xsize2, ysize2;
     int               procMode;
-    ARUint8          *imageLuma;
-    int               imageLumaWasAllocated;
+    float             scale;
     int               i;
 #if !BINARY_FEATURE
+    int               xsize2, ysize2;
+    ARUint8          *imageLuma;
     FeatureVector     featureVector;
     int              *inlierIndex;
     CorspMap          preRANSAC;
@@ -414,160 +874,68 @@ int kpmMatching(KpmHandle *kpmHandle, ARUint8 *inImageLuma)
     ysize           = kpmHandle->ysize;
     procMode        = kpmHandle->procMode;
     
+#if BINARY_FEATURE
+    kpmPrepareQuery( kpmHandle );
+    // The resize for procMode is done as part of building the first pyramid octave.
+    kpmHandle->freakMatcher->query(inImageLuma, xsize, ysize, kpmUtilGetDownscaleMode(procMode));
+    kpmHandle->skipRegion.regionNum = 0;
+    kpmHandle->priorIDNum = 0;
+    kpmHandle->inDataSet.num = (int)kpmHandle->freakMatcher->getQueryFeaturePoints().size();
+#else
     if (procMode == KpmProcFullSize) {
         imageLuma = inImageLuma;
-        xsize2 = xsize;
-        ysize2 = ysize;
-        imageLumaWasAllocated = 0;
     } else {
-        imageLuma = kpmUtilResizeImage(inImageLuma, xsize, ysize, procMode, &xsize2, &ysize2);
-        if (!imageLuma) return -1;
-        imageLumaWasAllocated = 1;
+        kpmUtilGetResizedImageSize(xsize, ysize, procMode, &xsize2, &ysize2);
+        if (xsize2*ysize2 > kpmHandle->procImageSize) {
+            free(kpmHandle->procImage);
+            arMalloc(kpmHandle->procImage, ARUint8, xsize2*ysize2);
+            kpmHandle->procImageSize = xsize2*ysize2;
+        }
+        imageLuma = kpmHandle->procImage;
+        kpmUtilResizeImageInto(inImageLuma, xsize, ysize, procMode, imageLuma);
     }
-
-#if BINARY_FEATURE
-    kpmHandle->freakMatcher->query(imageLuma, xsize2, ysize2);
-    kpmHandle->inDataSet.num = (int)kpmHandle->freakMatcher->getQueryFeaturePoints().size();
-#else
     surfSubExtractFeaturePoint( kpmHandle->surfHandle, imageLuma, kpmHandle->skipRegion.region, kpmHandle->skipRegion.regionNum );
     kpmHandle->skipRegion.regionNum = 0;
     kpmHandle->inDataSet.num = featureVector.num = surfSubGetFeaturePointNum( kpmHandle->surfHandle );
 #endif
     
     if( kpmHandle->inDataSet.num != 0 ) {
-        if( kpmHandle->inDataSet.coord != NULL ) free(kpmHandle->inDataSet.coord);
-#if !BINARY_FEATURE
-        if( kpmHandle->preRANSAC.match != NULL ) free(kpmHandle->preRANSAC.match);
-        if( kpmHandle->aftRANSAC.match != NULL ) free(kpmHandle->aftRANSAC.match);
-#endif
-        arMalloc( kpmHandle->inDataSet.coord, KpmCoord2D,     kpmHandle->inDataSet.num );
+        kpmReserveInDataSet( kpmHandle, kpmHandle->inDataSet.num );
 #if !BINARY_FEATURE
-        arMalloc( kpmHandle->preRANSAC.match, KpmMatchData,   kpmHandle->inDataSet.num );
-        arMalloc( kpmHandle->aftRANSAC.match, KpmMatchData,   kpmHandle->inDataSet.num );
-#endif
-#if BINARY_FEATURE
-#else
-        arMalloc( featureVector.sf,           SurfFeature,    kpmHandle->inDataSet.num );
-        arMalloc( preRANSAC.mp,               MatchPoint,     kpmHandle->inDataSet.num );
-        arMalloc( inlierIndex,                int,            kpmHandle->inDataSet.num );
-
+        featureVector.sf = kpmHandle->inFeature;
+        preRANSAC.mp     = kpmHandle->matchPoint;
+        inlierIndex      = kpmHandle->inlierIndex;
         knn = 1;
-        arMalloc( annMatch2,                  int,            kpmHandle->inDataSet.num*knn);
+        annMatch2        = kpmHandle->annMatch;
 #endif
         
 #if BINARY_FEATURE
         const std::vector<vision::FeaturePoint>& points = kpmHandle->freakMatcher->getQueryFeaturePoints();
         //const std::vector<unsigned char>& descriptors = kpmHandle->freakMatcher->getQueryDescriptors();
 #endif
-        if( procMode == KpmProcFullSize ) {
-            for( i = 0 ; i < kpmHandle->inDataSet.num; i++ ) {
-
+        // Feature coordinates are in the procMode-resized image, so scale them back
+        // to the input image.
+        scale = kpmUtilGetProcModeScale( procMode );
+        for( i = 0 ; i < kpmHandle->inDataSet.num; i++ ) {
 #if BINARY_FEATURE
-                float  x = points[i].x, y = points[i].y;
+            float  x = points[i].x*scale, y = points[i].y*scale;
 #else
-                float  x, y, *desc;
-                surfSubGetFeaturePosition( kpmHandle->surfHandle, i, &x, &y );
-                desc = surfSubGetFeatureDescPtr( kpmHandle->surfHandle, i );
-                for( j = 0; j < SURF_SUB_DIMENSION; j++ ) {
-                    featureVector.sf[i].v[j] = desc[j];
-                }
-                featureVector.sf[i].l = surfSubGetFeatureSign( kpmHandle->surfHandle, i );
-#endif
-                if( kpmHandle->cparamLT != NULL ) {
-                    arParamObserv2IdealLTf( &(kpmHandle->cparamLT->paramLTf), x, y, &(kpmHandle->inDataSet.coord[i].x), &(kpmHandle->inDataSet.coord[i].y) );
-                }
-                else {
-                    kpmHandle->inDataSet.coord[i].x = x;
-                    kpmHandle->inDataSet.coord[i].y = y;
-                }
+            float  x, y, *desc;
+            surfSubGetFeaturePosition( kpmHandle->surfHandle, i, &x, &y );
+            x *= scale;
+            y *= scale;
+            desc = surfSubGetFeatureDescPtr( kpmHandle->surfHandle, i );
+            for( j = 0; j < SURF_SUB_DIMENSION; j++ ) {
+                featureVector.sf[i].v[j] = desc[j];
             }
-        }
-        else if( procMode == KpmProcTwoThirdSize ) {
-            for( i = 0 ; i < kpmHandle->inDataSet.num; i++ ) {
-#if BINARY_FEATURE
-                float  x = points[i].x, y = points[i].y;
-#else
-                float  x, y, *desc;
-                surfSubGetFeaturePosition( kpmHandle->surfHandle, i, &x, &y );
-                desc = surfSubGetFeatureDescPtr( kpmHandle->surfHandle, i );
-                for( j = 0; j < SURF_SUB_DIMENSION; j++ ) {
-                    featureVector.sf[i].v[j] = desc[j];
-                }
-                featureVector.sf[i].l = surfSubGetFeatureSign( kpmHandle->surfHandle, i );
+            featureVector.sf[i].l = surfSubGetFeatureSign( kpmHandle->surfHandle, i );
 #endif
-                if( kpmHandle->cparamLT != NULL ) {
-                    arParamObserv2IdealLTf( &(kpmHandle->cparamLT->paramLTf), x*1.5f, y*1.5f, &(kpmHandle->inDataSet.coord[i].x), &(kpmHandle->inDataSet.coord[i].y) );
-                }
-                else {
-                    kpmHandle->inDataSet.coord[i].x = x*1.5f;
-                    kpmHandle->inDataSet.coord[i].y = y*1.5f;
-                }
+            if( kpmHandle->cparamLT != NULL ) {
+                arParamObserv2IdealLTf( &(kpmHandle->cparamLT->paramLTf), x, y, &(kpmHandle->inDataSet.coord[i].x), &(kpmHandle->inDataSet.coord[i].y) );
             }
-        }
-        else if( procMode == KpmProcHalfSize ) {
-            for( i = 0 ; i < kpmHandle->inDataSet.num; i++ ) {
-#if BINARY_FEATURE
-                float  x = points[i].x, y = points[i].y;
-#else
-                float  x, y, *desc;
-                surfSubGetFeaturePosition( kpmHandle->surfHandle, i, &x, &y );
-                desc = surfSubGetFeatureDescPtr( kpmHandle->surfHandle, i );
-                for( j = 0; j < SURF_SUB_DIMENSION; j++ ) {
-                    featureVector.sf[i].v[j] = desc[j];
-                }
-                featureVector.sf[i].l = surfSubGetFeatureSign( kpmHandle->surfHandle, i );
-#endif
-                if( kpmHandle->cparamLT != NULL ) {
-                    arParamObserv2IdealLTf( &(kpmHandle->cparamLT->paramLTf), x*2.0f, y*2.0f, &(kpmHandle->inDataSet.coord[i].x), &(kpmHandle->inDataSet.coord[i].y) );
-                }
-                else {
-                    kpmHandle->inDataSet.coord[i].x = x*2.0f;
-                    kpmHandle->inDataSet.coord[i].y = y*2.0f;
-                }
-            }
-        }
-        else if( procMode == KpmProcOneThirdSize ) {
-            for( i = 0 ; i < kpmHandle->inDataSet.num; i++ ) {
-#if BINARY_FEATURE
-                float  x = points[i].x, y = points[i].y;
-#else
-                float  x, y, *desc;
-                surfSubGetFeaturePosition( kpmHandle->surfHandle, i, &x, &y );
-                desc = surfSubGetFeatureDescPtr( kpmHandle->surfHandle, i );
-                for( j = 0; j < SURF_SUB_DIMENSION; j++ ) {
-                    featureVector.sf[i].v[j] = desc[j];
-                }
-                featureVector.sf[i].l = surfSubGetFeatureSign( kpmHandle->surfHandle, i );
-#endif
-                if( kpmHandle->cparamLT != NULL ) {
-                    arParamObserv2IdealLTf( &(kpmHandle->cparamLT->paramLTf), x*3.0f, y*3.0f, &(kpmHandle->inDataSet.coord[i].x), &(kpmHandle->inDataSet.coord[i].y) );
-                }
-                else {
-                    kpmHandle->inDataSet.coord[i].x = x*3.0f;
-                    kpmHandle->inDataSet.coord[i].y = y*3.0f;
-                }
-            }
-        }
-        else { // procMode == KpmProcQuatSize
-            for( i = 0 ; i < kpmHandle->inDataSet.num; i++ ) {
-#if BINARY_FEATURE
-                float  x = points[i].x, y = points[i].y;
-#else
-                float  x, y, *desc;
-                surfSubGetFeaturePosition( kpmHandle->surfHandle, i, &x, &y );
-                desc = surfSubGetFeatureDescPtr( kpmHandle->surfHandle, i );
-                for( j = 0; j < SURF_SUB_DIMENSION; j++ ) {
-                    featureVector.sf[i].v[j] = desc[j];
-                }
-                featureVector.sf[i].l = surfSubGetFeatureSign( kpmHandle->surfHandle, i );
-#endif
-                if( kpmHandle->cparamLT != NULL ) {
-                    arParamObserv2IdealLTf( &(kpmHandle->cparamLT->paramLTf), x*4.0f, y*4.0f, &(kpmHandle->inDataSet.coord[i].x), &(kpmHandle->inDataSet.coord[i].y) );
-                }
-                else {
-                    kpmHandle->inDataSet.coord[i].x = x*4.0f;
-                    kpmHandle->inDataSet.coord[i].y = y*4.0f;
-                }
+            else {
+                kpmHandle->inDataSet.coord[i].x = x;
+                kpmHandle->inDataSet.coord[i].y = y;
             }
         }
 
@@ -635,38 +1003,35 @@ int kpmMatching(KpmHandle *kpmHandle, ARUint8 *inImageLuma)
                 ARLOGi("Page[%d]  pre:%3d, aft:%3d, error = %f\n", pageLoop, preRANSAC.num, inlierNum, kpmHandle->result[pageLoop].error);
             }
         }
-        free(annMatch2);
 #else
         for (int pageLoop = 0; pageLoop < kpmHandle->resultNum; pageLoop++) {
-            
             kpmHandle->result[pageLoop].pageNo = kpmHandle->refDataSet.pageInfo[pageLoop].pageNo;
             kpmHandle->result[pageLoop].camPoseF = -1;
-            if( kpmHandle->result[pageLoop].skipF ) continue;
-            
-            
-            const vision::matches_t& matches = kpmHandle->freakMatcher->inliers();
-            int matched_image_id = kpmHandle->freakMatcher->matchedId();
-            if (matched_image_id < 0) continue;
-
-            ret = kpmUtilGetPose_binary(kpmHandle->cparamLT,
-                                        matches ,
-                                        kpmHandle->freakMatcher->get3DFeaturePoints(matched_image_id),
-                                        kpmHandle->freakMatcher->getQueryFeaturePoints(),
-                                        kpmHandle->result[pageLoop].camPose,
-                                        &(kpmHandle->result[pageLoop].error) );
-            //ARLOGi("Pose (freak) - %s\n",arrayToString2(kpmHandle->result[pageLoop].camPose).c_str());
-            if( ret == 0 ) {
-                kpmHandle->result[pageLoop].camPoseF = 0;
-                kpmHandle->result[pageLoop].inlierNum = (int)matches.size();
-                kpmHandle->result[pageLoop].pageNo = kpmHandle->pageIDs[matched_image_id];
-                ARLOGi("Page[%d]  pre:%3d, aft:%3d, error = %f\n", pageLoop, (int)matches.size(), (int)matches.size(), kpmHandle->result[pageLoop].error);
+        }
+        
+        // The matcher finds at most one keyframe, so only the result of its page gets a pose.
+        const vision::matches_t& matches = kpmHandle->freakMatcher->inliers();
+        int matched_image_id = kpmHandle->freakMatcher->matchedId();
+        if (matched_image_id >= 0 && matched_image_id < kpmHandle->pageIDNum) {
+            int pageLoop;
+            for (pageLoop = 0; pageLoop < kpmHandle->resultNum; pageLoop++) {
+                if (kpmHandle->result[pageLoop].pageNo == kpmHandle->pageIDs[matched_image_id]) break;
+            }
+            if (pageLoop < kpmHandle->resultNum && !kpmHandle->result[pageLoop].skipF) {
+                ret = kpmUtilGetPose_binary(kpmHandle,
+                                            matches ,
+                                            kpmHandle->freakMatcher->get3DFeaturePoints(matched_image_id),
+                                            kpmHandle->freakMatcher->getQueryFeaturePoints(),
+                                            kpmHandle->result[pageLoop].camPose,
+                                            &(kpmHandle->result[pageLoop].error) );
+                //ARLOGi("Pose (freak) - %s\n",arrayToString2(kpmHandle->result[pageLoop].camPose).c_str());
+                if( ret == 0 ) {
+                    kpmHandle->result[pageLoop].camPoseF = 0;
+                    kpmHandle->result[pageLoop].inlierNum = (int)matches.size();
+                    ARLOGi("Page[%d]  pre:%3d, aft:%3d, error = %f\n", pageLoop, (int)matches.size(), (int)matches.size(), kpmHandle->result[pageLoop].error);
+                }
             }
         }
-#endif
-#if !BINARY_FEATURE
-        free(featureVector.sf);
-        free(preRANSAC.mp);
-        free(inlierIndex);
 #endif
     }
     else {
@@ -680,16 +1045,14 @@ int kpmMatching(KpmHandle *kpmHandle, ARUint8 *inImageLuma)
     }
     
     for( i = 0; i < kpmHandle->resultNum; i++ ) kpmHandle->result[i].skipF = 0;
-
-    if (imageLumaWasAllocated) free(imageLuma);
     
     return 0;
 }
 
 
-int kpmUtilGetPose_binary(ARParamLT *cparamLT, const vision::matches_t &matchData, const std::vector<vision::Point3d<float> > &refDataSet, const std::vector<vision::FeaturePoint> &inputDataSet, float camPose[3][4], float *error)
+static int kpmUtilGetPose_binary(KpmHandle *kpmHandle, const vision::matches_t &matchData, const std::vector<vision::Point3d<float> > &refDataSet, const std::vector<vision::FeaturePoint> &inputDataSet, float camPose[3][4], float *error)
 {
-    ICPHandleT    *icpHandle;
+    ARParamLT     *cparamLT = kpmHandle->cparamLT;
     ICPDataT       icpData;
     ICP2DCoordT   *sCoord;
     ICP3DCoordT   *wCoord;
@@ -700,8 +1063,16 @@ int kpmUtilGetPose_binary(ARParamLT *cparamLT, const vision::matches_t &matchDat
     
     if( matchData.size() < 4 ) return -1;
     
-    arMalloc( sCoord, ICP2DCoordT, matchData.size() );
-    arMalloc( wCoord, ICP3DCoordT, matchData.size() );
+    // The coordinate buffers and the ICP handle are kept in the KPM handle between frames.
+    if( (int)matchData.size() > kpmHandle->icpCoordMax ) {
+        free( kpmHandle->icpScreenCoord );
+        free( kpmHandle->icpWorldCoord );
+        arMalloc( kpmHandle->icpScreenCoord, ICP2DCoordT, matchData.size() );
+        arMalloc( kpmHandle->icpWorldCoord, ICP3DCoordT, matchData.size() );
+        kpmHandle->icpCoordMax = (int)matchData.size();
+    }
+    sCoord = kpmHandle->icpScreenCoord;
+    wCoord = kpmHandle->icpWorldCoord;
     for( i = 0; i < matchData.size(); i++ ) {
         sCoord[i].x = inputDataSet[matchData[i].ins].x;
         sCoord[i].y = inputDataSet[matchData[i].ins].y;
@@ -717,8 +1088,6 @@ int kpmUtilGetPose_binary(ARParamLT *cparamLT, const vision::matches_t &matchDat
     
     if( icpGetInitXw2Xc_from_PlanarData( cparamLT->param.mat, sCoord, wCoord, (int)matchData.size(), initMatXw2Xc ) < 0 ) {
         //printf("Error!! at icpGetInitXw2Xc_from_PlanarData.\n");
-        free( sCoord );
-        free( wCoord );
         return -1;
     }
     /*
@@ -728,53 +1097,40 @@ int kpmUtilGetPose_binary(ARParamLT *cparamLT, const vision::matches_t &matchDat
         printf("\n");
     }
     */
-    if( (icpHandle = icpCreateHandle( cparamLT->param.mat )) == NULL ) {
-        free( sCoord );
-        free( wCoord );
-        return -1;
+    if( kpmHandle->icpHandle == NULL ) {
+        if( (kpmHandle->icpHandle = icpCreateHandle( cparamLT->param.mat )) == NULL ) {
+            return -1;
+        }
     }
 #if 0
     if( icpData.num > 10 ) {
-        icpSetInlierProbability( icpHandle, 0.7 );
-        if( icpPointRobust( icpHandle, &icpData, initMatXw2Xc, camPose, &err ) < 0 ) {
+        icpSetInlierProbability( kpmHandle->icpHandle, 0.7 );
+        if( icpPointRobust( kpmHandle->icpHandle, &icpData, initMatXw2Xc, camPose, &err ) < 0 ) {
             ARLOGe("Error!! at icpPoint.\n");
-            free( sCoord );
-            free( wCoord );
-            icpDeleteHandle( &icpHandle );
             return -1;
         }
     }
     else {
-        if( icpPoint( icpHandle, &icpData, initMatXw2Xc, camPose, &err ) < 0 ) {
+        if( icpPoint( kpmHandle->icpHandle, &icpData, initMatXw2Xc, camPose, &err ) < 0 ) {
             ARLOGe("Error!! at icpPoint.\n");
-            free( sCoord );
-            free( wCoord );
-            icpDeleteHandle( &icpHandle );
             return -1;
         }
     }
 #else
 #  ifdef ARDOUBLE_IS_FLOAT
-    if( icpPoint( icpHandle, &icpData, initMatXw2Xc, camPose, &err ) < 0 ) {
+    if( icpPoint( kpmHandle->icpHandle, &icpData, initMatXw2Xc, camPose, &err ) < 0 ) {
         //ARLOGe("Error!! at icpPoint.\n");
-        free( sCoord );
-        free( wCoord );
-        icpDeleteHandle( &icpHandle );
         return -1;
     }
 #  else
     ARdouble camPosed[3][4];
-    if( icpPoint( icpHandle, &icpData, initMatXw2Xc, camPosed, &err ) < 0 ) {
+    if( icpPoint( kpmHandle->icpHandle, &icpData, initMatXw2Xc, camPosed, &err ) < 0 ) {
         //ARLOGe("Error!! at icpPoint.\n");
-        free( sCoord );
-        free( wCoord );
-        icpDeleteHandle( &icpHandle );
         return -1;
     }
     for (int r = 0; r < 3; r++) for (int c = 0; c < 4; c++) camPose[r][c] = (float)camPosed[r][c];
 #  endif
 #endif
-    icpDeleteHandle( &icpHandle );
     
     /*
     printf("error = %f\n", err);
@@ -789,10 +1145,6 @@ int kpmUtilGetPose_binary(ARParamLT *cparamLT, const vision::matches_t &matchDat
     }
     */
     
-    
-    free( sCoord );
-    free( wCoord );
-    
     *error = (float)err;
     if( *error > 10.0f ) return -1;
     
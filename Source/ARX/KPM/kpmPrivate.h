@@ -38,17 +38,24 @@
 
 #if BINARY_FEATURE
 #include <facade/visual_database_facade.h>
+#include <ARX/AR/icp.h>
 #else
 #include <ARX/KPM/surfSub.h>
 #endif
-#define DB_IMAGE_MAX 1024
-#if !BINARY_FEATURE
+#include <detectors/gaussian_scale_space_pyramid.h>
+
+// Regions set by kpmSetMatchingSkipRegion, in the coordinates of the image resized for procMode.
 typedef struct {
+#if !BINARY_FEATURE
     SurfSubSkipRegion    *region;
+#else
+    vision::SkipRegion   *region;
+#endif
     int                   regionNum;
     int                   regionMax;
 } KpmSkipRegionSet;
 
+#if !BINARY_FEATURE
 typedef struct {
     void                     *ann;
     int                      *annCoordIndex;
@@ -81,13 +88,40 @@ struct _KpmHandle {
     KpmMatchResult            aftRANSAC;
 #endif
     
-#if !BINARY_FEATURE
     KpmSkipRegionSet          skipRegion;
-#endif
     
     KpmResult                *result;
     int                       resultNum;
-    int                       pageIDs[DB_IMAGE_MAX];
+    int                      *pageIDs;        // Page of each keyframe slot, or -1 if unused.
+    int                       pageIDNum;      // Number of keyframe slots.
+    
+    // Buffers used by kpmMatching, kept between frames. They only ever grow.
+    int                       inDataSetMax;   // Number of features the per-feature buffers can hold.
+#if !BINARY_FEATURE
+    ARUint8                  *procImage;      // Input image resized for procMode.
+    int                       procImageSize;  // Bytes allocated for procImage.
+    SurfFeature              *inFeature;      // Descriptors of the input features.
+    MatchPoint               *matchPoint;     // Coordinates of the matches of a page.
+    int                      *inlierIndex;    // Inliers of the matches of a page.
+    int                      *annMatch;       // Nearest reference point of each input feature.
+#else
+    int                      *skipIDs;        // Keyframe slots of the pages skipped by the next query.
+    int                       skipIDMax;      // Number of slots skipIDs can hold.
+    int                      *priorIDs;       // Keyframe slots of the pages verified first by the next query.
+    int                       priorIDNum;
+    int                       priorIDMax;     // Number of slots priorIDs can hold.
+    ICPHandleT               *icpHandle;
+    ICP2DCoordT              *icpScreenCoord;
+    ICP3DCoordT              *icpWorldCoord;
+    int                       icpCoordMax;    // Number of points icpScreenCoord and icpWorldCoord can hold.
+#endif
 };
 
+// Factor from coordinates in an image resized for procMode to coordinates in the
+// source image, i.e. 1, 1.5, 2, 3 or 4.
+float kpmUtilGetProcModeScale( int procMode );
+
+// The downscale that resizes an image for procMode.
+vision::DownscaleMode kpmUtilGetDownscaleMode( int procMode );
+
 #endif // !__kpmPrivate_h__
@@ -37,19 +37,117 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <ARX/AR/ar.h>
 #include <ARX/KPM/kpm.h>
 #include <ARX/KPM/kpmType.h>
 #include "kpmPrivate.h"
 #include "kpmFopen.h"
 
+#include <map>
+#include <mutex>
+
 #if BINARY_FEATURE
 #include <facade/visual_database_facade.h>
 #else
 #include <ARX/KPM/surfSub.h>
 #endif
 
+#if BINARY_FEATURE
+#  define KPM_FEATURE_DIMENSION FREAK_SUB_DIMENSION
+#else
+#  define KPM_FEATURE_DIMENSION SURF_SUB_DIMENSION
+#endif
+
+// Mappable .fset3 layout. The header is followed by three tables, each starting
+// on a KPM_REF_DATA_SET_FILE_ALIGN boundary: num KpmRefData records exactly as
+// laid out in memory (descriptors inline), pageNum page records, and the
+// KpmImageInfo records of all pages, page by page.
+#define KPM_REF_DATA_SET_FILE_MAGIC      "ARXFSET3"
+#define KPM_REF_DATA_SET_FILE_VERSION    1
+#define KPM_REF_DATA_SET_FILE_BYTE_ORDER 0x01020304u
+#define KPM_REF_DATA_SET_FILE_ALIGN      64
+
+typedef struct {
+    char              magic[8];
+    uint32_t          version;
+    uint32_t          byteOrder;
+    uint32_t          headerSize;
+    uint32_t          refDataSize;
+    uint32_t          featureDimension;
+    int32_t           num;
+    int32_t           pageNum;
+    int32_t           imageNum;
+    uint64_t          refPointOffset;
+    uint64_t          pageTableOffset;
+    uint64_t          imageTableOffset;
+} KpmRefDataSetFileHeader;
+
+typedef struct {
+    int32_t           pageNo;
+    int32_t           imageNum;
+    int32_t           imageIndex;   // First entry in the image table.
+    int32_t           reserved;
+} KpmRefDataSetFilePage;
+
+static_assert(sizeof(KpmRefDataSetFileHeader) == KPM_REF_DATA_SET_FILE_ALIGN, "Unexpected padding in KpmRefDataSetFileHeader");
+static_assert(sizeof(KpmRefDataSetFilePage) == 16, "Unexpected padding in KpmRefDataSetFilePage");
+
+static uint64_t kpmFileAlign( uint64_t offset )
+{
+    return (offset + KPM_REF_DATA_SET_FILE_ALIGN - 1) & ~(uint64_t)(KPM_REF_DATA_SET_FILE_ALIGN - 1);
+}
+
+// The file mappings that sets loaded from the mappable layout point into, keyed by set. These are
+// kept here rather than in KpmRefDataSet, which callers may allocate and fill in themselves.
+static std::mutex                                        refDataSetMappingsLock;
+static std::map<const KpmRefDataSet *, KpmFileMapping *> refDataSetMappings;
+
+static void kpmSetRefDataSetMapping( const KpmRefDataSet *refDataSet, KpmFileMapping *mapping )
+{
+    std::lock_guard<std::mutex> lock(refDataSetMappingsLock);
+    refDataSetMappings[refDataSet] = mapping;
+}
+
+static KpmFileMapping *kpmGetRefDataSetMapping( const KpmRefDataSet *refDataSet )
+{
+    std::lock_guard<std::mutex> lock(refDataSetMappingsLock);
+    std::map<const KpmRefDataSet *, KpmFileMapping *>::const_iterator it = refDataSetMappings.find(refDataSet);
+    return (it != refDataSetMappings.end() ? it->second : NULL);
+}
+
+// Removes the set's mapping from the table and returns it, or NULL if the set has none.
+static KpmFileMapping *kpmTakeRefDataSetMapping( const KpmRefDataSet *refDataSet )
+{
+    std::lock_guard<std::mutex> lock(refDataSetMappingsLock);
+    std::map<const KpmRefDataSet *, KpmFileMapping *>::iterator it = refDataSetMappings.find(refDataSet);
+    if (it == refDataSetMappings.end()) return NULL;
+    KpmFileMapping *mapping = it->second;
+    refDataSetMappings.erase(it);
+    return mapping;
+}
 
+// Frees the points and page tables of a set, or releases the file mapping they point into.
+static void kpmFreeRefDataSetData( KpmRefDataSet *refDataSet )
+{
+    KpmFileMapping *mapping = kpmTakeRefDataSetMapping(refDataSet);
+    if (mapping) {
+        free(refDataSet->pageInfo);
+        kpmFileUnmap(&mapping);
+    } else {
+        if (refDataSet->refPoint) free(refDataSet->refPoint);
+        if (refDataSet->pageInfo) {
+            for (int i = 0; i < refDataSet->pageNum; i++) {
+                free(refDataSet->pageInfo[i].imageInfo);
+            }
+            free(refDataSet->pageInfo);
+        }
+    }
+    refDataSet->refPoint = NULL;
+    refDataSet->num      = 0;
+    refDataSet->pageInfo = NULL;
+    refDataSet->pageNum  = 0;
+}
 
 int kpmGenRefDataSet ( ARUint8 *refImage, int xsize, int ysize, float dpi, int procMode, int compMode, int maxFeatureNum,
                        int pageNo, int imageNo, KpmRefDataSet **refDataSetPtr )
@@ -57,6 +155,7 @@ int kpmGenRefDataSet ( ARUint8 *refImage, int xsize, int ysize, float dpi, int p
     ARUint8         *refImageBW;
     KpmRefDataSet   *refDataSet;
     int              xsize2, ysize2;
+    float            scale;
     int              i, j;
 
     if (!refDataSetPtr || !refImage) {
@@ -121,154 +220,36 @@ int kpmGenRefDataSet ( ARUint8 *refImage, int xsize, int ysize, float dpi, int p
     
     if( refDataSet->num != 0 ) {
         arMalloc( refDataSet->refPoint, KpmRefData, refDataSet->num );
-        if( procMode == KpmProcFullSize ) {
-            for( i = 0 ; i < refDataSet->num ; i++ ) {
-#if BINARY_FEATURE
-                float  x = points[i].x, y = points[i].y;
-                if( compMode == KpmCompY ) y *= 2.0f;
-                for( j = 0; j < FREAK_SUB_DIMENSION; j++ ) {
-                    refDataSet->refPoint[i].featureVec.v[j] = descriptors[i*FREAK_SUB_DIMENSION+j];
-                }
-                refDataSet->refPoint[i].featureVec.angle = points[i].angle;
-                refDataSet->refPoint[i].featureVec.scale = points[i].scale;
-                refDataSet->refPoint[i].featureVec.maxima = (int)points[i].maxima;
-#else
-                float  x, y, *desc;
-                desc = surfSubGetFeatureDescPtr( surfHandle, i );
-                surfSubGetFeaturePosition( surfHandle, i, &x, &y );
-                if( compMode == KpmCompY ) y *= 2.0f;
-                for( j = 0; j < SURF_SUB_DIMENSION; j++ ) {
-                    refDataSet->refPoint[i].featureVec.v[j] = desc[j];
-                }
-                refDataSet->refPoint[i].featureVec.l = surfSubGetFeatureSign( surfHandle, i );
-#endif
-                
-                refDataSet->refPoint[i].coord2D.x = x;
-                refDataSet->refPoint[i].coord2D.y = y;
-                refDataSet->refPoint[i].coord3D.x = (x + 0.5f) / dpi * 25.4f;               // millimetres.
-                refDataSet->refPoint[i].coord3D.y = ((ysize-0.5f) - y) / dpi * 25.4f;       // millimetres.
-                refDataSet->refPoint[i].pageNo = pageNo;
-                refDataSet->refPoint[i].refImageNo = imageNo;
-            }
-        }
-        else if( procMode == KpmProcTwoThirdSize ) {
-            for( i = 0 ; i < refDataSet->num ; i++ ) {
-#if BINARY_FEATURE
-                float  x = points[i].x, y = points[i].y;
-                if( compMode == KpmCompY ) y *= 2.0f;
-                for( j = 0; j < FREAK_SUB_DIMENSION; j++ ) {
-                    refDataSet->refPoint[i].featureVec.v[j] = descriptors[i*FREAK_SUB_DIMENSION+j];
-                }
-                refDataSet->refPoint[i].featureVec.angle = points[i].angle;
-                refDataSet->refPoint[i].featureVec.scale = points[i].scale;
-                refDataSet->refPoint[i].featureVec.maxima = (int)points[i].maxima;
-#else
-                float  x, y, *desc;
-                desc = surfSubGetFeatureDescPtr( surfHandle, i );
-                surfSubGetFeaturePosition( surfHandle, i, &x, &y );
-                if( compMode == KpmCompY ) y *= 2.0f;
-                for( j = 0; j < SURF_SUB_DIMENSION; j++ ) {
-                    refDataSet->refPoint[i].featureVec.v[j] = desc[j];
-                }
-                refDataSet->refPoint[i].featureVec.l = surfSubGetFeatureSign( surfHandle, i );
-#endif
-                
-                refDataSet->refPoint[i].coord2D.x = x;
-                refDataSet->refPoint[i].coord2D.y = y;
-                refDataSet->refPoint[i].coord3D.x = (x*1.5f + 0.75f) / dpi * 25.4f;         // millimetres.
-                refDataSet->refPoint[i].coord3D.y = ((ysize-0.75f) - y*1.5f) / dpi * 25.4f; // millimetres.
-                refDataSet->refPoint[i].pageNo = pageNo;
-                refDataSet->refPoint[i].refImageNo = imageNo;
-            }
-        }
-        else if( procMode == KpmProcHalfSize ) {
-            for( i = 0 ; i < refDataSet->num ; i++ ) {
+        // Feature coordinates are in the procMode-resized image. The 3D coordinates
+        // are those of the centre of the resized pixel in the source image.
+        scale = kpmUtilGetProcModeScale( procMode );
+        for( i = 0 ; i < refDataSet->num ; i++ ) {
 #if BINARY_FEATURE
-                float  x = points[i].x, y = points[i].y;
-                if( compMode == KpmCompY ) y *= 2.0f;
-                for( j = 0; j < FREAK_SUB_DIMENSION; j++ ) {
-                    refDataSet->refPoint[i].featureVec.v[j] = descriptors[i*FREAK_SUB_DIMENSION+j];
-                }
-                refDataSet->refPoint[i].featureVec.angle = points[i].angle;
-                refDataSet->refPoint[i].featureVec.scale = points[i].scale;
-                refDataSet->refPoint[i].featureVec.maxima = (int)points[i].maxima;
-#else
-                float  x, y, *desc;
-                desc = surfSubGetFeatureDescPtr( surfHandle, i );
-                surfSubGetFeaturePosition( surfHandle, i, &x, &y );
-                if( compMode == KpmCompY ) y *= 2.0f;
-                for( j = 0; j < SURF_SUB_DIMENSION; j++ ) {
-                    refDataSet->refPoint[i].featureVec.v[j] = desc[j];
-                }
-                refDataSet->refPoint[i].featureVec.l = surfSubGetFeatureSign( surfHandle, i );
-#endif
-                
-                refDataSet->refPoint[i].coord2D.x = x;
-                refDataSet->refPoint[i].coord2D.y = y;
-                refDataSet->refPoint[i].coord3D.x = (x*2.0f + 1.0f) / dpi * 25.4f;          // millimetres.
-                refDataSet->refPoint[i].coord3D.y = ((ysize-1.0f) - y*2.0f) / dpi * 25.4f;  // millimetres.
-                refDataSet->refPoint[i].pageNo = pageNo;
-                refDataSet->refPoint[i].refImageNo = imageNo;
+            float  x = points[i].x, y = points[i].y;
+            if( compMode == KpmCompY ) y *= 2.0f;
+            for( j = 0; j < FREAK_SUB_DIMENSION; j++ ) {
+                refDataSet->refPoint[i].featureVec.v[j] = descriptors[i*FREAK_SUB_DIMENSION+j];
             }
-        }
-        else if( procMode == KpmProcOneThirdSize ) {
-            for( i = 0 ; i < refDataSet->num ; i++ ) {
-#if BINARY_FEATURE
-                float  x = points[i].x, y = points[i].y;
-                if( compMode == KpmCompY ) y *= 2.0f;
-                for( j = 0; j < FREAK_SUB_DIMENSION; j++ ) {
-                    refDataSet->refPoint[i].featureVec.v[j] = descriptors[i*FREAK_SUB_DIMENSION+j];
-                }
-                refDataSet->refPoint[i].featureVec.angle = points[i].angle;
-                refDataSet->refPoint[i].featureVec.scale = points[i].scale;
-                refDataSet->refPoint[i].featureVec.maxima = (int)points[i].maxima;
+            refDataSet->refPoint[i].featureVec.angle = points[i].angle;
+            refDataSet->refPoint[i].featureVec.scale = points[i].scale;
+            refDataSet->refPoint[i].featureVec.maxima = (int)points[i].maxima;
 #else
-                float  x, y, *desc;
-                desc = surfSubGetFeatureDescPtr( surfHandle, i );
-                surfSubGetFeaturePosition( surfHandle, i, &x, &y );
-                if( compMode == KpmCompY ) y *= 2.0f;
-                for( j = 0; j < SURF_SUB_DIMENSION; j++ ) {
-                    refDataSet->refPoint[i].featureVec.v[j] = desc[j];
-                }
-                refDataSet->refPoint[i].featureVec.l = surfSubGetFeatureSign( surfHandle, i );
-#endif
-                refDataSet->refPoint[i].coord2D.x = x;
-                refDataSet->refPoint[i].coord2D.y = y;
-                refDataSet->refPoint[i].coord3D.x = (x*3.0f + 1.5f) / dpi * 25.4f;          // millimetres.
-                refDataSet->refPoint[i].coord3D.y = ((ysize-1.5f) - y*3.0f) / dpi * 25.4f;  // millimetres.
-                refDataSet->refPoint[i].pageNo = pageNo;
-                refDataSet->refPoint[i].refImageNo = imageNo;
+            float  x, y, *desc;
+            desc = surfSubGetFeatureDescPtr( surfHandle, i );
+            surfSubGetFeaturePosition( surfHandle, i, &x, &y );
+            if( compMode == KpmCompY ) y *= 2.0f;
+            for( j = 0; j < SURF_SUB_DIMENSION; j++ ) {
+                refDataSet->refPoint[i].featureVec.v[j] = desc[j];
             }
-        }
-        else {
-            for( i = 0 ; i < refDataSet->num ; i++ ) {
-#if BINARY_FEATURE
-                float  x = points[i].x, y = points[i].y;
-                if( compMode == KpmCompY ) y *= 2.0f;
-                for( j = 0; j < FREAK_SUB_DIMENSION; j++ ) {
-                    refDataSet->refPoint[i].featureVec.v[j] = descriptors[i*FREAK_SUB_DIMENSION+j];
-                }
-                refDataSet->refPoint[i].featureVec.angle = points[i].angle;
-                refDataSet->refPoint[i].featureVec.scale = points[i].scale;
-                refDataSet->refPoint[i].featureVec.maxima = (int)points[i].maxima;
-#else
-                float  x, y, *desc;
-                desc = surfSubGetFeatureDescPtr( surfHandle, i );
-                surfSubGetFeaturePosition( surfHandle, i, &x, &y );
-                if( compMode == KpmCompY ) y *= 2.0f;
-                for( j = 0; j < SURF_SUB_DIMENSION; j++ ) {
-                    refDataSet->refPoint[i].featureVec.v[j] = desc[j];
-                }
-                refDataSet->refPoint[i].featureVec.l = surfSubGetFeatureSign( surfHandle, i );
+            refDataSet->refPoint[i].featureVec.l = surfSubGetFeatureSign( surfHandle, i );
 #endif
-                
-                refDataSet->refPoint[i].coord2D.x = x;
-                refDataSet->refPoint[i].coord2D.y = y;
-                refDataSet->refPoint[i].coord3D.x = (x*4.0f + 2.0f) / dpi * 25.4f;          // millimetres.
-                refDataSet->refPoint[i].coord3D.y = ((ysize-2.0f) - y*4.0f) / dpi * 25.4f;  // millimetres.
-                refDataSet->refPoint[i].pageNo = pageNo;
-                refDataSet->refPoint[i].refImageNo = imageNo;
-            }
+            
+            refDataSet->refPoint[i].coord2D.x = x;
+            refDataSet->refPoint[i].coord2D.y = y;
+            refDataSet->refPoint[i].coord3D.x = (x*scale + scale*0.5f) / dpi * 25.4f;               // millimetres.
+            refDataSet->refPoint[i].coord3D.y = ((ysize - scale*0.5f) - y*scale) / dpi * 25.4f;     // millimetres.
+            refDataSet->refPoint[i].pageNo = pageNo;
+            refDataSet->refPoint[i].refImageNo = imageNo;
         }
     }
     else {
@@ -338,23 +319,21 @@ int kpmMergeRefDataSet ( KpmRefDataSet **refDataSetPtr1, KpmRefDataSet **refData
     for( i = 0; i < num2; i++ ) {
         refPoint[num1+i] = (*refDataSetPtr2)->refPoint[i];
     }
-    if( (*refDataSetPtr1)->refPoint != NULL ) free((*refDataSetPtr1)->refPoint);
-    (*refDataSetPtr1)->refPoint = refPoint;
-    (*refDataSetPtr1)->num      = num1 + num2;
+    num3 = num1 + num2;
     
     // Allocate pageInfo for the combined sets.
     num1 = (*refDataSetPtr1)->pageNum;
     num2 = (*refDataSetPtr2)->pageNum;
-    num3 = 0;
+    k = 0;
     for( i = 0; i < num2; i++ ) {
         for( j = 0; j < num1; j++ ) {
             if( (*refDataSetPtr2)->pageInfo[i].pageNo == (*refDataSetPtr1)->pageInfo[j].pageNo ) {
-                num3++; // count a duplicate.
+                k++; // count a duplicate.
                 break;
             }
         }
     }
-    pageNum = num1+num2-num3;
+    pageNum = num1+num2-k;
     arMalloc(pageInfo, KpmPageInfo, pageNum);
     
     for( i = 0; i < num1; i++ ) {
@@ -406,12 +385,10 @@ int kpmMergeRefDataSet ( KpmRefDataSet **refDataSetPtr1, KpmRefDataSet **refData
         pageInfo[num1+i-k].imageNum = imageNum;
     }
 
-    if ((*refDataSetPtr1)->pageInfo) {
-        for( i = 0; i < (*refDataSetPtr1)->pageNum; i++ ) {
-            free( (*refDataSetPtr1)->pageInfo[i].imageInfo );
-        }
-        free((*refDataSetPtr1)->pageInfo);
-    }
+    // Replace the first set's data (which may be a file mapping) with the merged data.
+    kpmFreeRefDataSetData(*refDataSetPtr1);
+    (*refDataSetPtr1)->refPoint = refPoint;
+    (*refDataSetPtr1)->num      = num3;
     (*refDataSetPtr1)->pageInfo = pageInfo;
     (*refDataSetPtr1)->pageNum  = pageNum;
 
@@ -428,12 +405,7 @@ int kpmDeleteRefDataSet( KpmRefDataSet **refDataSetPtr )
     }
     if (!*refDataSetPtr) return 0; // OK to call on already deleted handle.
 
-    if ((*refDataSetPtr)->refPoint) free((*refDataSetPtr)->refPoint);
-    
-    for(int i = 0; i < (*refDataSetPtr)->pageNum; i++ ) {
-        free( (*refDataSetPtr)->pageInfo[i].imageInfo );
-    }
-    free( (*refDataSetPtr)->pageInfo );
+    kpmFreeRefDataSetData(*refDataSetPtr);
     free( *refDataSetPtr );
     *refDataSetPtr = NULL;
 
@@ -441,7 +413,71 @@ int kpmDeleteRefDataSet( KpmRefDataSet **refDataSetPtr )
 }
 
 
+static int kpmWritePadding( FILE *fp, uint64_t from, uint64_t to )
+{
+    static const unsigned char zeros[KPM_REF_DATA_SET_FILE_ALIGN] = {0};
+    
+    if( to > from && fwrite(zeros, 1, (size_t)(to - from), fp) != (size_t)(to - from) ) return -1;
+    return 0;
+}
+
+static int kpmWriteRefDataSetMappable( FILE *fp, KpmRefDataSet *refDataSet )
+{
+    KpmRefDataSetFileHeader  header;
+    KpmRefDataSetFilePage    page;
+    uint64_t                 refPointEnd, pageTableEnd;
+    int                      imageNum;
+    int                      i, j;
+    
+    imageNum = 0;
+    for( i = 0; i < refDataSet->pageNum; i++ ) imageNum += refDataSet->pageInfo[i].imageNum;
+    
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KPM_REF_DATA_SET_FILE_MAGIC, sizeof(header.magic));
+    header.version          = KPM_REF_DATA_SET_FILE_VERSION;
+    header.byteOrder        = KPM_REF_DATA_SET_FILE_BYTE_ORDER;
+    header.headerSize       = sizeof(KpmRefDataSetFileHeader);
+    header.refDataSize      = sizeof(KpmRefData);
+    header.featureDimension = KPM_FEATURE_DIMENSION;
+    header.num              = refDataSet->num;
+    header.pageNum          = refDataSet->pageNum;
+    header.imageNum         = imageNum;
+    header.refPointOffset   = kpmFileAlign(sizeof(KpmRefDataSetFileHeader));
+    refPointEnd             = header.refPointOffset + (uint64_t)refDataSet->num * sizeof(KpmRefData);
+    header.pageTableOffset  = kpmFileAlign(refPointEnd);
+    pageTableEnd            = header.pageTableOffset + (uint64_t)refDataSet->pageNum * sizeof(KpmRefDataSetFilePage);
+    header.imageTableOffset = kpmFileAlign(pageTableEnd);
+    
+    if( fwrite(&header, sizeof(header), 1, fp) != 1 ) return -1;
+    if( kpmWritePadding(fp, sizeof(header), header.refPointOffset) < 0 ) return -1;
+    if( fwrite(refDataSet->refPoint, sizeof(KpmRefData), refDataSet->num, fp) != (size_t)refDataSet->num ) return -1;
+    if( kpmWritePadding(fp, refPointEnd, header.pageTableOffset) < 0 ) return -1;
+    
+    j = 0;
+    for( i = 0; i < refDataSet->pageNum; i++ ) {
+        page.pageNo     = refDataSet->pageInfo[i].pageNo;
+        page.imageNum   = refDataSet->pageInfo[i].imageNum;
+        page.imageIndex = j;
+        page.reserved   = 0;
+        if( fwrite(&page, sizeof(page), 1, fp) != 1 ) return -1;
+        j += page.imageNum;
+    }
+    if( kpmWritePadding(fp, pageTableEnd, header.imageTableOffset) < 0 ) return -1;
+    
+    for( i = 0; i < refDataSet->pageNum; i++ ) {
+        j = refDataSet->pageInfo[i].imageNum;
+        if( fwrite(refDataSet->pageInfo[i].imageInfo, sizeof(KpmImageInfo), j, fp) != (size_t)j ) return -1;
+    }
+    
+    return 0;
+}
+
 int kpmSaveRefDataSet( const char *filename, const char *ext, KpmRefDataSet  *refDataSet )
+{
+    return kpmSaveRefDataSetFormat(filename, ext, refDataSet, KpmRefDataSetFormatLegacy);
+}
+
+int kpmSaveRefDataSetFormat( const char *filename, const char *ext, KpmRefDataSet *refDataSet, KPM_REF_DATA_SET_FORMAT format )
 {
     FILE   *fp;
     char    fmode[] = "wb";
@@ -451,6 +487,11 @@ int kpmSaveRefDataSet( const char *filename, const char *ext, KpmRefDataSet  *re
         ARLOGe("kpmSaveRefDataSet(): NULL filename/refDataSet.\n");
         return (-1);
     }
+    // The loaders reject data sets without points or pages, so don't write one.
+    if (refDataSet->num <= 0 || refDataSet->pageNum <= 0) {
+        ARLOGe("kpmSaveRefDataSet(): empty refDataSet.\n");
+        return (-1);
+    }
 
     fp = kpmFopen(filename, ext, fmode);
     if( fp == NULL ) {
@@ -458,6 +499,12 @@ int kpmSaveRefDataSet( const char *filename, const char *ext, KpmRefDataSet  *re
         return -1;
     }
 
+    if( format == KpmRefDataSetFormatMappable ) {
+        if( kpmWriteRefDataSetMappable(fp, refDataSet) < 0 ) goto bailBadWrite;
+        fclose(fp);
+        return 0;
+    }
+
     if( fwrite(&(refDataSet->num), sizeof(int), 1, fp) != 1 ) goto bailBadWrite;
     
     for(i = 0; i < refDataSet->num; i++ ) {
@@ -490,11 +537,75 @@ bailBadWrite:
     return -1;
 }
 
+// Sets up a reference data set over a file in the mappable layout, taking
+// ownership of the mapping on success.
+static int kpmLoadRefDataSetMapped( KpmFileMapping *mapping, KpmRefDataSet **refDataSetPtr )
+{
+    const KpmRefDataSetFileHeader *header;
+    const KpmRefDataSetFilePage   *pages;
+    KpmImageInfo                  *images;
+    KpmRefDataSet                 *refDataSet;
+    unsigned char                 *base;
+    uint64_t                       size;
+    int                            i;
+    
+    base = (unsigned char *)mapping->data;
+    size = mapping->size;
+    header = (const KpmRefDataSetFileHeader *)base;
+    
+    if( size < sizeof(KpmRefDataSetFileHeader) || header->version != KPM_REF_DATA_SET_FILE_VERSION ) {
+        ARLOGe("Error loading KPM data: unsupported file version.\n");
+        return (-1);
+    }
+    if( header->byteOrder != KPM_REF_DATA_SET_FILE_BYTE_ORDER ) {
+        ARLOGe("Error loading KPM data: file was written on a machine with a different byte order.\n");
+        return (-1);
+    }
+    if( header->headerSize < sizeof(KpmRefDataSetFileHeader) || header->refDataSize != sizeof(KpmRefData) || header->featureDimension != KPM_FEATURE_DIMENSION ) {
+        ARLOGe("Error loading KPM data: file was written with a different feature type.\n");
+        return (-1);
+    }
+    if( header->num <= 0 || header->pageNum <= 0 || header->imageNum < 0
+       || header->refPointOffset % KPM_REF_DATA_SET_FILE_ALIGN || header->pageTableOffset % KPM_REF_DATA_SET_FILE_ALIGN || header->imageTableOffset % KPM_REF_DATA_SET_FILE_ALIGN
+       || header->refPointOffset > size || (size - header->refPointOffset) / sizeof(KpmRefData) < (uint64_t)header->num
+       || header->pageTableOffset > size || (size - header->pageTableOffset) / sizeof(KpmRefDataSetFilePage) < (uint64_t)header->pageNum
+       || header->imageTableOffset > size || (size - header->imageTableOffset) / sizeof(KpmImageInfo) < (uint64_t)header->imageNum ) {
+        ARLOGe("Error loading KPM data: file is truncated or corrupt.\n");
+        return (-1);
+    }
+    
+    pages  = (const KpmRefDataSetFilePage *)(base + header->pageTableOffset);
+    images = (KpmImageInfo *)(base + header->imageTableOffset);
+    for( i = 0; i < header->pageNum; i++ ) {
+        if( pages[i].imageNum < 0 || pages[i].imageIndex < 0 || pages[i].imageIndex > header->imageNum - pages[i].imageNum ) {
+            ARLOGe("Error loading KPM data: file is truncated or corrupt.\n");
+            return (-1);
+        }
+    }
+    
+    arMallocClear(refDataSet, KpmRefDataSet, 1);
+    refDataSet->refPoint = (KpmRefData *)(base + header->refPointOffset);
+    refDataSet->num      = header->num;
+    refDataSet->pageNum  = header->pageNum;
+    arMalloc(refDataSet->pageInfo, KpmPageInfo, refDataSet->pageNum);
+    for( i = 0; i < refDataSet->pageNum; i++ ) {
+        refDataSet->pageInfo[i].pageNo    = pages[i].pageNo;
+        refDataSet->pageInfo[i].imageNum  = pages[i].imageNum;
+        refDataSet->pageInfo[i].imageInfo = (pages[i].imageNum > 0 ? images + pages[i].imageIndex : NULL);
+    }
+    kpmSetRefDataSetMapping(refDataSet, mapping);
+    
+    *refDataSetPtr = refDataSet;
+    return 0;
+}
+
 int kpmLoadRefDataSet( const char *filename, const char *ext, KpmRefDataSet **refDataSetPtr )
 {
     KpmRefDataSet  *refDataSet;
+    KpmFileMapping *mapping;
     FILE           *fp;
     char            fmode[] = "rb";
+    char            magic[8];
     int             i, j;
 
     if (!filename || !refDataSetPtr) {
@@ -508,6 +619,25 @@ int kpmLoadRefDataSet( const char *filename, const char *ext, KpmRefDataSet **re
         return (-1);
     }
 
+    // Files in the mappable layout are used in place.
+    if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, KPM_REF_DATA_SET_FILE_MAGIC, sizeof(magic)) == 0) {
+        fclose(fp);
+        mapping = kpmFileMap(filename, ext);
+        if (!mapping) {
+            ARLOGe("Error loading KPM data: unable to map file '%s%s%s'.\n", filename, (ext ? "." : ""), (ext ? ext : ""));
+            return (-1);
+        }
+        if (kpmLoadRefDataSetMapped(mapping, refDataSetPtr) < 0) {
+            kpmFileUnmap(&mapping);
+            return (-1);
+        }
+        return 0;
+    }
+    if (fseek(fp, 0, SEEK_SET) != 0) {
+        fclose(fp);
+        return (-1);
+    }
+
     arMallocClear(refDataSet, KpmRefDataSet, 1);
     
     if( fread(&(refDataSet->num), sizeof(int), 1, fp) != 1 ) goto bailBadRead;
@@ -557,6 +687,34 @@ bailBadRead:
     return (-1);
 }
 
+int kpmConvertRefDataSetFile( const char *inFilename, const char *inExt, const char *outFilename, const char *outExt, KPM_REF_DATA_SET_FORMAT format )
+{
+    KpmRefDataSet  *refDataSet;
+    int             ret;
+    
+    if (!inFilename || !outFilename) {
+        ARLOGe("kpmConvertRefDataSetFile(): NULL inFilename/outFilename.\n");
+        return (-1);
+    }
+    
+    if (kpmLoadRefDataSet(inFilename, inExt, &refDataSet) < 0) return (-1);
+    
+    // Writing over the input would truncate the file under its own mapping.
+    if (kpmGetRefDataSetMapping(refDataSet)) {
+        KpmRefDataSet *copy = NULL;
+        ret = kpmMergeRefDataSet(&copy, &refDataSet);
+        if (ret < 0) {
+            kpmDeleteRefDataSet(&refDataSet);
+            return (-1);
+        }
+        refDataSet = copy;
+    }
+    
+    ret = kpmSaveRefDataSetFormat(outFilename, outExt, refDataSet, format);
+    kpmDeleteRefDataSet(&refDataSet);
+    return ret;
+}
+
 int kpmLoadRefDataSetOld( const char *filename, const char *ext, KpmRefDataSet **refDataSetPtr )
 {
 #if !BINARY_FEATURE
@@ -0,0 +1,171 @@
+//
+//  hamming_parity.cpp
+//  artoolkitX
+//
+//  Checks that every Hamming distance kernel supported by the CPU returns exactly
+//  the distances of HammingDistance768Scalar, through the single, batched and
+//  indexed entry points.
+//
+//  This file is part of artoolkitX.
+//
+//  artoolkitX is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  artoolkitX is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  along with artoolkitX.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders of this library give you
+//  permission to link this library with independent modules to produce an
+//  executable, regardless of the license terms of these independent modules, and to
+//  copy and distribute the resulting executable under terms of your choice,
+//  provided that you also meet, for each linked independent module, the terms and
+//  conditions of the license of that module. An independent module is a module
+//  which is neither derived from nor based on this library. If you modify this
+//  library, you may extend this exception to your version of the library, but you
+//  are not obligated to do so. If you do not wish to do so, delete this exception
+//  statement from your version.
+//
+//  Copyright 2024 artoolkitX Contributors.
+//
+
+#include <math/hamming.h>
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+using namespace vision;
+
+namespace {
+
+    const int kBytes = 96;
+
+    // Small fixed generator, so that a failure can be reproduced
+    unsigned int NextRandom(unsigned int& state) {
+        state = state*1664525u+1013904223u;
+        return state >> 8;
+    }
+
+    // Descriptors with the edge cases first (all zeros, all ones, and every single bit
+    // set on its own), then random ones. They are stored one byte past an aligned
+    // address, as the kernels must not depend on alignment.
+    void MakeDescriptors(std::vector<unsigned char>& buffer, unsigned char*& features, int& count) {
+        const int num_random = 61; // Odd, so batches have a remainder for every block size
+        count = 2+kBytes*8+num_random;
+        buffer.assign((size_t)count*kBytes+64, 0);
+        features = &buffer[1];
+
+        unsigned char* f = features;
+        memset(f, 0x00, kBytes); f += kBytes;
+        memset(f, 0xFF, kBytes); f += kBytes;
+        for(int bit = 0; bit < kBytes*8; bit++, f += kBytes) {
+            f[bit/8] = (unsigned char)(1 << (bit%8));
+        }
+        unsigned int state = 12345;
+        for(int i = 0; i < num_random*kBytes; i++) {
+            *f++ = (unsigned char)NextRandom(state);
+        }
+    }
+
+    unsigned int ScalarDistance(const unsigned char* a, const unsigned char* b) {
+        unsigned int ua[24], ub[24];
+        memcpy(ua, a, kBytes);
+        memcpy(ub, b, kBytes);
+        return HammingDistance768Scalar(ua, ub);
+    }
+
+    // @return Number of mismatches of the selected kernel against the scalar code
+    int CheckKernel(const unsigned char* features, int count) {
+        int errors = 0;
+        std::vector<unsigned int> batch(count);
+        std::vector<unsigned int> indexed(count);
+        std::vector<int> indices(count);
+
+        // Every length up to 17 and the whole set, so that each block size of a kernel
+        // is followed by every possible remainder
+        std::vector<int> lengths;
+        for(int n = 0; n <= 17 && n < count; n++) lengths.push_back(n);
+        lengths.push_back(count);
+
+        // Every descriptor as a query, against every other
+        for(int q = 0; q < count; q++) {
+            const unsigned char* query = features+(size_t)q*kBytes;
+
+            // Single
+            for(int i = 0; i < count; i++) {
+                unsigned int a[24];
+                unsigned int b[24];
+                memcpy(a, query, kBytes);
+                memcpy(b, features+(size_t)i*kBytes, kBytes);
+                if(HammingDistance768(a, b) != ScalarDistance(query, features+(size_t)i*kBytes)) {
+                    if(errors++ < 10) printf("  single: query %d, feature %d\n", q, i);
+                }
+            }
+
+            // Batch
+            for(size_t l = 0; l < lengths.size(); l++) {
+                const int n = lengths[l];
+                HammingDistance768Batch(batch.data(), query, features, n);
+                for(int i = 0; i < n; i++) {
+                    if(batch[i] != ScalarDistance(query, features+(size_t)i*kBytes)) {
+                        if(errors++ < 10) printf("  batch: query %d, length %d, feature %d\n", q, n, i);
+                    }
+                }
+            }
+
+            // Indexed, in a scrambled order with repeats
+            for(int i = 0; i < count; i++) {
+                indices[i] = (int)(((unsigned int)i*7919u+(unsigned int)q) % (unsigned int)count);
+            }
+            for(size_t l = 0; l < lengths.size(); l++) {
+                const int n = lengths[l];
+                HammingDistance768Indexed(indexed.data(), query, features, indices.data(), n);
+                for(int i = 0; i < n; i++) {
+                    if(indexed[i] != ScalarDistance(query, features+(size_t)indices[i]*kBytes)) {
+                        if(errors++ < 10) printf("  indexed: query %d, length %d, position %d\n", q, n, i);
+                    }
+                }
+            }
+        }
+        return errors;
+    }
+
+} // anonymous namespace
+
+int main() {
+    const HammingKernel kernels[] = {
+        HAMMING_KERNEL_SCALAR,
+        HAMMING_KERNEL_POPCNT,
+        HAMMING_KERNEL_NEON,
+        HAMMING_KERNEL_AVX2,
+        HAMMING_KERNEL_AVX512
+    };
+
+    std::vector<unsigned char> buffer;
+    unsigned char* features;
+    int count;
+    MakeDescriptors(buffer, features, count);
+
+    const HammingKernel selected = GetHammingKernel();
+    int failed = 0;
+    for(size_t k = 0; k < sizeof(kernels)/sizeof(kernels[0]); k++) {
+        if(!HammingKernelSupported(kernels[k])) {
+            printf("%-8s skipped, not supported\n", HammingKernelName(kernels[k]));
+            continue;
+        }
+        SetHammingKernel(kernels[k]);
+        int errors = CheckKernel(features, count);
+        printf("%-8s %s (%d mismatches)\n", HammingKernelName(kernels[k]), (errors ? "FAILED" : "ok"), errors);
+        if(errors) failed++;
+    }
+    SetHammingKernel(selected);
+
+    return (failed ? 1 : 0);
+}
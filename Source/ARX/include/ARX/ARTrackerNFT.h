@@ -50,7 +50,7 @@
 #include <ARX/AR2/tracking.h>
 #include <ARX/KPM/kpm.h>
 
-#define PAGES_MAX 64
+typedef struct _TRACKING_INIT_HANDLE_T TRACKING_INIT_HANDLE_T;
 
 class ARTrackerNFT : public ARTrackerVideo {
 public:
@@ -72,6 +72,21 @@ public:
     void setNFTMultiMode(bool on);
     bool NFTMultiMode() const;
     
+    /// Set the number of threads which detect NFT pages, each working on a different frame.
+    /// More threads find a lost page sooner, at the cost of more CPU time and memory.
+    /// Takes effect the next time NFT data is loaded. Defaults to 1.
+    void setNFTDetectionWorkerCount(int count);
+    int NFTDetectionWorkerCount() const;
+    
+    /// Set the number of inliers above the minimum at which NFT page detection stops at the first page
+    /// found, trying the pages lost most recently first, or -1 to look at all pages and take the best.
+    /// Early exit finds a page sooner when many are loaded, but the first detection after pages are
+    /// loaded, added or removed then also builds an index over the features of all pages. 12 is a
+    /// reasonable margin.
+    /// Takes effect the next time NFT data is loaded. Defaults to -1.
+    void setNFTDetectionEarlyExitMargin(int margin);
+    int NFTDetectionEarlyExitMargin() const;
+    
     bool start(ARParamLT *paramLT, AR_PIXEL_FORMAT pixelFormat) override;
     bool start(ARParamLT *paramLT0, AR_PIXEL_FORMAT pixelFormat0, ARParamLT *paramLT1, AR_PIXEL_FORMAT pixelFormat1, const ARdouble transL2R[3][4]) override;
     bool isRunning() override;
@@ -93,17 +108,31 @@ private:
     bool m_videoSourceIsStereo;
     bool m_nftMultiMode;
     bool m_kpmRequired;
-    bool m_kpmBusy;
+    int m_kpmWorkerCount;
+    int m_kpmEarlyExitMargin;
     // NFT data.
-    THREAD_HANDLE_T     *trackingThreadHandle;
+    TRACKING_INIT_HANDLE_T *trackingThreadHandle;
     AR2HandleT          *m_ar2Handle;
     KpmHandle           *m_kpmHandle;
-    AR2SurfaceSetT      *m_surfaceSet[PAGES_MAX]; // Weak-reference. Strong reference is now in ARTrackableNFT class.
+    std::vector<AR2SurfaceSetT *> m_surfaceSet; // Indexed by page number. Weak-reference. Strong reference is now in ARTrackableNFT class.
     ARdouble m_transL2R[3][4];          ///< For stereo tracking, transformation matrix from left camera to right camera.
 
     bool unloadNFTData();
     bool loadNFTData();
-    int m_pageCount; ///< Number of loaded pages, in range [0 - PAGES_MAX].
+    bool updateNFTData();
+    int freePageNo() const;
+    void updateKPMSkipPages();
+    int m_pageCount; ///< Number of loaded pages.
+    struct PageToAdd {
+        std::shared_ptr<ARTrackableNFT> trackable;
+        int pageNo;
+        KpmHandle *kpmHandle; ///< The page's KPM data, with its features already indexed.
+    };
+    std::vector<PageToAdd> m_pagesToAdd; ///< Trackables added since NFT data was loaded, with their KPM data.
+    std::vector<int> m_pagesToRemove; ///< Pages of trackables deleted since NFT data was loaded.
+    std::vector<int> m_kpmSkipPages; ///< Pages being tracked, which KPM does not look for.
+    std::vector<KpmSkipRect> m_kpmSkipRegions; ///< Areas of the frame covered by the pages being tracked.
+    std::vector<int> m_lostPages; ///< Pages lost by tracking and not yet detected again, most recent first.
 };
 
 #endif // HAVE_NFT
@@ -52,93 +52,306 @@ typedef struct {
     float                   trans[3][4];    // Transform containing pose of tracked image.
     int                     page;           // Assigned page number of tracked image.
     int                     flag;           // Tracked successfully.
+    int                    *skipPages;      // Pages to skip in this frame.
+    int                     skipPageNum;
+    int                     skipPageMax;
+    KpmSkipRect            *skipRegions;    // Regions of this frame to skip.
+    int                     skipRegionNum;
+    int                     skipRegionMax;
+    int                    *priorPages;     // Pages to look for first in this frame.
+    int                     priorPageNum;
+    int                     priorPageMax;
 } TrackingInitHandle;
 
+typedef struct {
+    THREAD_HANDLE_T        *threadHandle;
+    int                     busy;           // Started, and result not yet collected.
+    unsigned long           frameNo;        // Sequence number of the frame being processed.
+    AR2VideoTimestampT      time;           // Time of the frame being processed.
+} TrackingInitWorker;
+
+struct _TRACKING_INIT_HANDLE_T {
+    KpmHandle              *kpmHandle;      // Holds the reference data. Used by the first worker.
+    TrackingInitWorker     *workers;
+    int                     workerNum;
+    int                     nextWorker;     // Next worker to try in trackingInitStart.
+    unsigned long           frameNo;        // Sequence number of the last frame started.
+    unsigned long           resultFrameNo;  // Sequence number of the frame of the last detection returned.
+    int                    *skipPages;      // Set by trackingInitSetSkipPages, passed to each frame started.
+    int                     skipPageNum;
+    int                     skipPageMax;
+    KpmSkipRect            *skipRegions;
+    int                     skipRegionNum;
+    int                     skipRegionMax;
+    int                    *priorPages;     // Set by trackingInitSetPriorPages, passed to each frame started.
+    int                     priorPageNum;
+    int                     priorPageMax;
+};
+
 static void *trackingInitMain( THREAD_HANDLE_T *threadHandle );
 
+// Copy num elements of size size from src to *dst, growing *dst (which holds *max elements) if need be.
+static int trackingInitCopyArray( void **dst, int *max, const void *src, int num, size_t size )
+{
+    void                *p;
+
+    if (num > *max) {
+        p = realloc( *dst, num * size );
+        if (!p) return -1;
+        *dst = p;
+        *max = num;
+    }
+    if (num > 0) memcpy( *dst, src, num * size );
+    return 0;
+}
+
 
-int trackingInitQuit( THREAD_HANDLE_T **threadHandle_p )
+static void trackingInitWorkerQuit( TrackingInitWorker *worker, KpmHandle *kpmHandle )
 {
     TrackingInitHandle  *trackingInitHandle;
 
-    if (!threadHandle_p)  {
-        ARLOGe("trackingInitQuit(): Error: NULL threadHandle_p.\n");
-        return (-1);
-    }
-    if (!*threadHandle_p) return 0;
-    
-    threadWaitQuit( *threadHandle_p );
-    trackingInitHandle = (TrackingInitHandle *)threadGetArg(*threadHandle_p);
+    if (!worker->threadHandle) return;
+    threadWaitQuit( worker->threadHandle );
+    trackingInitHandle = (TrackingInitHandle *)threadGetArg(worker->threadHandle);
     if (trackingInitHandle) {
+        // Only the handles created for the other workers are owned by the worker.
+        if (trackingInitHandle->kpmHandle != kpmHandle) kpmDeleteHandle( &trackingInitHandle->kpmHandle );
         free( trackingInitHandle->imageLumaPtr );
+        free( trackingInitHandle->skipPages );
+        free( trackingInitHandle->skipRegions );
+        free( trackingInitHandle->priorPages );
         free( trackingInitHandle );
     }
-    threadFree( threadHandle_p );
+    threadFree( &worker->threadHandle );
+}
+
+int trackingInitQuit( TRACKING_INIT_HANDLE_T **trackingInitHandle_p )
+{
+    int                  i;
+
+    if (!trackingInitHandle_p)  {
+        ARLOGe("trackingInitQuit(): Error: NULL trackingInitHandle_p.\n");
+        return (-1);
+    }
+    if (!*trackingInitHandle_p) return 0;
+    
+    for (i = 0; i < (*trackingInitHandle_p)->workerNum; i++) {
+        trackingInitWorkerQuit( &(*trackingInitHandle_p)->workers[i], (*trackingInitHandle_p)->kpmHandle );
+    }
+    free( (*trackingInitHandle_p)->workers );
+    free( (*trackingInitHandle_p)->skipPages );
+    free( (*trackingInitHandle_p)->skipRegions );
+    free( (*trackingInitHandle_p)->priorPages );
+    free( *trackingInitHandle_p );
+    *trackingInitHandle_p = NULL;
     return 0;
 }
 
-THREAD_HANDLE_T *trackingInitInit( KpmHandle *kpmHandle )
+TRACKING_INIT_HANDLE_T *trackingInitInit( KpmHandle *kpmHandle, int workerNum )
 {
-    TrackingInitHandle  *trackingInitHandle;
-    THREAD_HANDLE_T     *threadHandle;
+    TRACKING_INIT_HANDLE_T *handle;
+    TrackingInitHandle     *trackingInitHandle;
+    int                     i;
 
     if (!kpmHandle) {
         ARLOGe("trackingInitInit(): Error: NULL KpmHandle.\n");
         return (NULL);
     }
+    if (workerNum < 1) workerNum = 1;
+    
+    handle = (TRACKING_INIT_HANDLE_T *)calloc(1, sizeof(TRACKING_INIT_HANDLE_T));
+    if (!handle) return NULL;
+    handle->kpmHandle = kpmHandle;
+    handle->workers = (TrackingInitWorker *)calloc(workerNum, sizeof(TrackingInitWorker));
+    if (!handle->workers) {
+        free(handle);
+        return NULL;
+    }
+    
+    for (i = 0; i < workerNum; i++) {
+        trackingInitHandle = (TrackingInitHandle *)calloc(1, sizeof(TrackingInitHandle));
+        if( trackingInitHandle == NULL ) goto bail;
+        trackingInitHandle->kpmHandle = (i == 0 ? kpmHandle : kpmCreateHandleSharingRefDataSet(kpmHandle));
+        trackingInitHandle->imageSize = kpmHandleGetXSize(kpmHandle) * kpmHandleGetYSize(kpmHandle);
+        trackingInitHandle->imageLumaPtr  = (ARUint8 *)malloc(trackingInitHandle->imageSize);
+        trackingInitHandle->flag      = 0;
+        if (!trackingInitHandle->kpmHandle || !trackingInitHandle->imageLumaPtr ||
+            !(handle->workers[i].threadHandle = threadInit(i, trackingInitHandle, trackingInitMain))) {
+            if (i > 0) kpmDeleteHandle( &trackingInitHandle->kpmHandle );
+            free( trackingInitHandle->imageLumaPtr );
+            free( trackingInitHandle );
+            goto bail;
+        }
+        handle->workerNum++;
+    }
+    ARLOGi("Started %d KPM worker%s.\n", workerNum, (workerNum == 1 ? "" : "s"));
     
-    trackingInitHandle = (TrackingInitHandle *)malloc(sizeof(TrackingInitHandle));
-    if( trackingInitHandle == NULL ) return NULL;
-    trackingInitHandle->kpmHandle = kpmHandle;
-    trackingInitHandle->imageSize = kpmHandleGetXSize(kpmHandle) * kpmHandleGetYSize(kpmHandle);
-    trackingInitHandle->imageLumaPtr  = (ARUint8 *)malloc(trackingInitHandle->imageSize);
-    trackingInitHandle->flag      = 0;
-
-    threadHandle = threadInit(0, trackingInitHandle, trackingInitMain);
-    return threadHandle;
+    return handle;
+    
+bail:
+    ARLOGe("trackingInitInit(): Error: unable to start KPM worker %d.\n", handle->workerNum);
+    trackingInitQuit( &handle );
+    return NULL;
 }
 
-int trackingInitStart( THREAD_HANDLE_T *threadHandle, ARUint8 *imageLumaPtr )
+int trackingInitStart( TRACKING_INIT_HANDLE_T *handle, ARUint8 *imageLumaPtr, const AR2VideoTimestampT *time )
 {
     TrackingInitHandle     *trackingInitHandle;
+    TrackingInitWorker     *worker;
+    int                     i;
 
-    if (!threadHandle || !imageLumaPtr) {
-        ARLOGe("trackingInitStart(): Error: NULL threadHandle or imagePtr.\n");
+    if (!handle || !imageLumaPtr) {
+        ARLOGe("trackingInitStart(): Error: NULL trackingInitHandle or imagePtr.\n");
         return (-1);
     }
     
-    trackingInitHandle = (TrackingInitHandle *)threadGetArg(threadHandle);
+    // Take the next idle worker, so that successive frames are spread over all the workers.
+    worker = NULL;
+    for (i = 0; i < handle->workerNum; i++) {
+        if (!handle->workers[(handle->nextWorker + i) % handle->workerNum].busy) {
+            worker = &handle->workers[(handle->nextWorker + i) % handle->workerNum];
+            break;
+        }
+    }
+    if (!worker) return 0;
+    handle->nextWorker = (handle->nextWorker + i + 1) % handle->workerNum;
+    
+    trackingInitHandle = (TrackingInitHandle *)threadGetArg(worker->threadHandle);
     if (!trackingInitHandle) {
         ARLOGe("trackingInitStart(): Error: NULL trackingInitHandle.\n");
         return (-1);
     }
     memcpy( trackingInitHandle->imageLumaPtr, imageLumaPtr, trackingInitHandle->imageSize );
-    threadStartSignal( threadHandle );
+    if (trackingInitCopyArray( (void **)&trackingInitHandle->skipPages, &trackingInitHandle->skipPageMax, handle->skipPages, handle->skipPageNum, sizeof(int) ) < 0 ||
+        trackingInitCopyArray( (void **)&trackingInitHandle->skipRegions, &trackingInitHandle->skipRegionMax, handle->skipRegions, handle->skipRegionNum, sizeof(KpmSkipRect) ) < 0 ||
+        trackingInitCopyArray( (void **)&trackingInitHandle->priorPages, &trackingInitHandle->priorPageMax, handle->priorPages, handle->priorPageNum, sizeof(int) ) < 0) {
+        ARLOGe("trackingInitStart(): Error: out of memory.\n");
+        return (-1);
+    }
+    trackingInitHandle->skipPageNum = handle->skipPageNum;
+    trackingInitHandle->skipRegionNum = handle->skipRegionNum;
+    trackingInitHandle->priorPageNum = handle->priorPageNum;
+    worker->frameNo = ++handle->frameNo;
+    if (time) worker->time = *time;
+    else {
+        worker->time.sec = 0;
+        worker->time.usec = 0;
+    }
+    worker->busy = 1;
+    threadStartSignal( worker->threadHandle );
+
+    return 1;
+}
+
+int trackingInitSetSkipPages( TRACKING_INIT_HANDLE_T *handle, const int *pages, int pageNum, const KpmSkipRect *regions, int regionNum )
+{
+    if (!handle || (!pages && pageNum > 0) || (!regions && regionNum > 0)) {
+        ARLOGe("trackingInitSetSkipPages(): Error: NULL trackingInitHandle or pages or regions.\n");
+        return (-1);
+    }
+    if (pageNum < 0) pageNum = 0;
+    if (regionNum < 0) regionNum = 0;
+    
+    if (trackingInitCopyArray( (void **)&handle->skipPages, &handle->skipPageMax, pages, pageNum, sizeof(int) ) < 0 ||
+        trackingInitCopyArray( (void **)&handle->skipRegions, &handle->skipRegionMax, regions, regionNum, sizeof(KpmSkipRect) ) < 0) {
+        ARLOGe("trackingInitSetSkipPages(): Error: out of memory.\n");
+        handle->skipPageNum = handle->skipRegionNum = 0;
+        return (-1);
+    }
+    handle->skipPageNum = pageNum;
+    handle->skipRegionNum = regionNum;
+    return 0;
+}
 
+int trackingInitSetPriorPages( TRACKING_INIT_HANDLE_T *handle, const int *pages, int num )
+{
+    if (!handle || (!pages && num > 0)) {
+        ARLOGe("trackingInitSetPriorPages(): Error: NULL trackingInitHandle or pages.\n");
+        return (-1);
+    }
+    if (num < 0) num = 0;
+    
+    if (trackingInitCopyArray( (void **)&handle->priorPages, &handle->priorPageMax, pages, num, sizeof(int) ) < 0) {
+        ARLOGe("trackingInitSetPriorPages(): Error: out of memory.\n");
+        handle->priorPageNum = 0;
+        return (-1);
+    }
+    handle->priorPageNum = num;
     return 0;
 }
 
-int trackingInitGetResult( THREAD_HANDLE_T *threadHandle, float trans[3][4], int *page )
+int trackingInitGetResult( TRACKING_INIT_HANDLE_T *handle, float trans[3][4], int *page, AR2VideoTimestampT *time )
 {
     TrackingInitHandle     *trackingInitHandle;
-    int  i, j;
+    TrackingInitWorker     *worker;
+    TrackingInitHandle     *best = NULL;
+    TrackingInitWorker     *bestWorker = NULL;
+    int                     finished = 0;
+    int                     i, j, k;
 
-    if (!threadHandle || !trans || !page)  {
-        ARLOGe("trackingInitGetResult(): Error: NULL threadHandle or trans or page.\n");
+    if (!handle || !trans || !page)  {
+        ARLOGe("trackingInitGetResult(): Error: NULL trackingInitHandle or trans or page.\n");
         return (-1);
     }
     
-    if( threadGetStatus( threadHandle ) == 0 ) return 0;
-    threadEndWait( threadHandle );
-    trackingInitHandle = (TrackingInitHandle *)threadGetArg(threadHandle);
-    if (!trackingInitHandle) return (-1);
-    if( trackingInitHandle->flag ) {
-        for (j = 0; j < 3; j++) for (i = 0; i < 4; i++) trans[j][i] = trackingInitHandle->trans[j][i];
-        *page = trackingInitHandle->page;
-        return 1;
+    for (k = 0; k < handle->workerNum; k++) {
+        worker = &handle->workers[k];
+        if (!worker->busy || threadGetStatus( worker->threadHandle ) == 0) continue;
+        threadEndWait( worker->threadHandle );
+        worker->busy = 0;
+        finished = 1;
+        trackingInitHandle = (TrackingInitHandle *)threadGetArg(worker->threadHandle);
+        if (!trackingInitHandle || !trackingInitHandle->flag) continue;
+        // Frames are numbered in the order they were started, so the highest number is the newest frame.
+        if (worker->frameNo <= handle->resultFrameNo) continue;
+        if (bestWorker && worker->frameNo <= bestWorker->frameNo) continue;
+        best = trackingInitHandle;
+        bestWorker = worker;
+    }
+    if (!finished) return 0;
+    if (!best) return -1;
+    
+    for (j = 0; j < 3; j++) for (i = 0; i < 4; i++) trans[j][i] = best->trans[j][i];
+    *page = best->page;
+    if (time) *time = bestWorker->time;
+    handle->resultFrameNo = bestWorker->frameNo;
+    return 1;
+}
+
+int trackingInitIsBusy( TRACKING_INIT_HANDLE_T *handle )
+{
+    int                     i;
+
+    if (!handle) return 0;
+    for (i = 0; i < handle->workerNum; i++) {
+        if (handle->workers[i].busy) return 1;
     }
+    return 0;
+}
+
+int trackingInitUpdateRefDataSet( TRACKING_INIT_HANDLE_T *handle )
+{
+    TrackingInitHandle     *trackingInitHandle;
+    int                     i;
+    int                     ret = 0;
 
-    return -1;
+    if (!handle) {
+        ARLOGe("trackingInitUpdateRefDataSet(): Error: NULL trackingInitHandle.\n");
+        return (-1);
+    }
+    if (trackingInitIsBusy(handle)) {
+        ARLOGe("trackingInitUpdateRefDataSet(): Error: KPM workers busy.\n");
+        return (-1);
+    }
+    
+    for (i = 1; i < handle->workerNum; i++) {
+        trackingInitHandle = (TrackingInitHandle *)threadGetArg(handle->workers[i].threadHandle);
+        if (kpmShareRefDataSet( trackingInitHandle->kpmHandle, handle->kpmHandle ) < 0) {
+            ARLOGe("trackingInitUpdateRefDataSet(): Error: kpmShareRefDataSet.\n");
+            ret = -1;
+        }
+    }
+    return ret;
 }
 
 static void *trackingInitMain( THREAD_HANDLE_T *threadHandle )
@@ -168,12 +381,17 @@ static void *trackingInitMain( THREAD_HANDLE_T *threadHandle )
     }
     ARLOGi("Start tracking thread.\n");
     
-    kpmGetResult( kpmHandle, &kpmResult, &kpmResultNum );
-
     for(;;) {
         if( threadStartWait(threadHandle) < 0 ) break;
 
+        // Pages already being tracked are left out, along with the part of the frame they cover.
+        if (trackingInitHandle->skipPageNum > 0) kpmSetMatchingSkipPage( kpmHandle, trackingInitHandle->skipPages, trackingInitHandle->skipPageNum );
+        kpmSetMatchingSkipRegion( kpmHandle, trackingInitHandle->skipRegions, trackingInitHandle->skipRegionNum );
+        // Pages lost most recently are looked for first.
+        kpmSetMatchingPriorPage( kpmHandle, trackingInitHandle->priorPages, trackingInitHandle->priorPageNum );
         kpmMatching(kpmHandle, imageLumaPtr);
+        // Pages may have been added or removed since the last run, so fetch the results afresh.
+        kpmGetResult( kpmHandle, &kpmResult, &kpmResultNum );
         trackingInitHandle->flag = 0;
         for( i = 0; i < kpmResultNum; i++ ) {
             if( kpmResult[i].camPoseF != 0 ) continue;
@@ -49,10 +49,41 @@
 extern "C" {
 #endif
 
-THREAD_HANDLE_T *trackingInitInit( KpmHandle *kpmHandle );
-int trackingInitStart( THREAD_HANDLE_T *threadHandle, ARUint8 *imagePtrLuma );
-int trackingInitGetResult( THREAD_HANDLE_T *threadHandle, float trans[3][4], int *page );
-int trackingInitQuit( THREAD_HANDLE_T **threadHandle_p );
+// A pool of KPM detection workers, each running on its own thread with its own KpmHandle.
+// The workers share the reference data of the KpmHandle passed to trackingInitInit.
+typedef struct _TRACKING_INIT_HANDLE_T TRACKING_INIT_HANDLE_T;
+
+// Start workerNum workers (at least 1). The first worker uses kpmHandle itself.
+TRACKING_INIT_HANDLE_T *trackingInitInit( KpmHandle *kpmHandle, int workerNum );
+
+// Pass a copy of a frame to the next idle worker, in round-robin order. time may be NULL.
+// Returns 1 if the frame was passed to a worker, 0 if all workers are busy, or -1 in case of error.
+int trackingInitStart( TRACKING_INIT_HANDLE_T *trackingInitHandle, ARUint8 *imagePtrLuma, const AR2VideoTimestampT *time );
+
+// Set the pages that the frames started from now on are not matched against, typically those
+// already being tracked, and the regions of the frames they cover, in which no features are
+// detected. Replaces any set before. pageNum and regionNum may be 0.
+int trackingInitSetSkipPages( TRACKING_INIT_HANDLE_T *trackingInitHandle, const int *pages, int pageNum, const KpmSkipRect *regions, int regionNum );
+
+// Set the pages that the frames started from now on look for first, typically those lost most
+// recently, most recent first. Only used when early exit is set on the KpmHandle (see
+// kpmSetEarlyExitMargin). Replaces any set before. num may be 0.
+int trackingInitSetPriorPages( TRACKING_INIT_HANDLE_T *trackingInitHandle, const int *pages, int num );
+
+// Collect the results of the workers that have finished. If any detected a page, the detection
+// from the most recently started frame is returned, along with that frame's time (if time is
+// non-NULL). Detections from frames started before one already returned are discarded.
+// Returns 1 if a page was detected, 0 if no worker has finished, or -1 if none detected a page.
+int trackingInitGetResult( TRACKING_INIT_HANDLE_T *trackingInitHandle, float trans[3][4], int *page, AR2VideoTimestampT *time );
+
+// Returns 1 if any worker has been started and its result not yet collected, 0 otherwise.
+int trackingInitIsBusy( TRACKING_INIT_HANDLE_T *trackingInitHandle );
+
+// After the reference data of the KpmHandle passed to trackingInitInit has been changed, pass
+// the changes on to the other workers. Must only be called when trackingInitIsBusy returns 0.
+int trackingInitUpdateRefDataSet( TRACKING_INIT_HANDLE_T *trackingInitHandle );
+
+int trackingInitQuit( TRACKING_INIT_HANDLE_T **trackingInitHandle_p );
 
 #ifdef __cplusplus
 }
@@ -456,7 +456,9 @@ public class ARX_jni {
 							ARW_TRACKER_OPTION_2D_MAXIMUM_MARKERS_TO_TRACK = 12,           ///< Maximum number of markers able to be tracked simultaneously. Defaults to 1. Should not be set higher than the number of 2D markers loaded.
 							ARW_TRACKER_OPTION_SQUARE_MATRIX_MODE_AUTOCREATE_NEW_TRACKABLES = 13, ///< If true, when the square tracker is detecting matrix (barcode) markers, new trackables will be created for unmatched markers. Defaults to false. bool.
 							ARW_TRACKER_OPTION_SQUARE_MATRIX_MODE_AUTOCREATE_NEW_TRACKABLES_DEFAULT_WIDTH = 14, ///< If ARW_TRACKER_OPTION_SQUARE_MATRIX_MODE_AUTOCREATE_NEW_TRACKABLES is true, this value will be used for the initial width of new trackables for unmatched markers. Defaults to 80.0f. float.
-							ARW_TRACKER_OPTION_2D_THREADED = 15;                           ///< bool, If false, 2D tracking updates synchronously, and arwUpdateAR will not return until 2D tracking is complete. If true, 2D tracking updates asychronously on a secondary thread, and arwUpdateAR will not block if the track is busy. Defaults to true.
+							ARW_TRACKER_OPTION_2D_THREADED = 15,                           ///< bool, If false, 2D tracking updates synchronously, and arwUpdateAR will not return until 2D tracking is complete. If true, 2D tracking updates asychronously on a secondary thread, and arwUpdateAR will not block if the track is busy. Defaults to true.
+							ARW_TRACKER_OPTION_NFT_DETECTION_WORKER_COUNT = 16,            ///< Number of threads detecting NFT pages, each working on a different frame. More threads find a lost page sooner, at the cost of more CPU time. Takes effect the next time NFT data is loaded. Defaults to 1. int.
+							ARW_TRACKER_OPTION_NFT_DETECTION_EARLY_EXIT_MARGIN = 17;       ///< Number of inliers above the minimum at which NFT page detection stops at the first page found, trying the pages lost most recently first. Speeds up detection when many pages are loaded, at the cost of building an index over all pages' features in the first detection after pages are loaded, added or removed. -1 disables early exit, and the page with the most inliers is taken. Takes effect the next time NFT data is loaded. Defaults to -1. int.
 
     // ARW_TRACKER_OPTION_SQUARE_THRESHOLD_MODE
     public static final int AR_LABELING_THRESH_MODE_MANUAL = 0,
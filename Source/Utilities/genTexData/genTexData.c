@@ -132,6 +132,7 @@ int main( int argc, char *argv[] )
     AR2FeatureMapT      *featureMap = NULL;
     AR2FeatureSetT      *featureSet = NULL;
     KpmRefDataSet       *refDataSet = NULL;
+    KpmHandle           *kpmHandle = NULL;
     float                scale1, scale2;
     int                  procMode;
     char                 buf[1024];
@@ -481,6 +482,17 @@ int main( int argc, char *argv[] )
             EXIT(E_DATA_PROCESSING_ERROR);
         }
         ARPRINT("  Done.\n");
+        
+        // Prebuild the feature indices, so trackers loading the dataset needn't build them.
+        ARPRINT("Saving FeatureSet3 index...\n");
+        kpmHandle = kpmCreateHandleHomography(xsize, ysize);
+        if( !kpmHandle || kpmSetRefDataSet(kpmHandle, refDataSet) < 0 ||
+            kpmSaveIndexFile(kpmHandle, filename, KpmIndexFileExt, KpmChangePageNoAllPages, 0) < 0 ) {
+            ARPRINTE("Save error: %s.%s. Trackers will build the index on first load.\n", filename, KpmIndexFileExt );
+        } else {
+            ARPRINT("  Done.\n");
+        }
+        kpmDeleteHandle( &kpmHandle );
         kpmDeleteRefDataSet( &refDataSet );
     }
     